@@ -1,27 +1,133 @@
 #ifndef __TINY_DB_CONFIG
 #define __TINY_DB_CONFIG
 
-// port that TCP connection will be open
+// port that TCP connection will be open (--port)
 #define PORT 8079
 
-// host that TCP connection will be open
-#define HOST (u_int32_t)0x00000000
+// addresses the port is bound to, separated by spaces (--bind <addr> ...).
+// names and IPv6 addresses work too, "0.0.0.0 ::" is every interface
+#define HOST "0.0.0.0"
+
+// TCP_NODELAY on client connections (--tcp-nodelay yes|no), replies are sent
+// right away instead of waiting for the ack of the previous ones
+#define DEFAULT_TCP_NODELAY 1
+
+// seconds a client connection is idle before the kernel checks the peer is
+// still there (--tcp-keepalive), 0 never checks
+#define DEFAULT_TCP_KEEPALIVE 300
+
+// SO_REUSEPORT on the listening sockets (--reuseport yes|no), servers started
+// with it share the port and the kernel spreads the connections over them
+#define DEFAULT_REUSEPORT 0
+
+// SO_RCVBUF/SO_SNDBUF of client connections in bytes (--rcvbuf, --sndbuf), 0
+// lets the kernel size them
+#define DEFAULT_SOCKET_RCVBUF 0
+#define DEFAULT_SOCKET_SNDBUF 0
+
+// unix socket served next to the TCP port (--unix-socket <path>), NULL
+// serves TCP only. clients on the same host skip the TCP stack
+#define UNIX_SOCKET_PATH NULL
+
+// permissions of the unix socket (--unix-socket-perm <octal>), whoever can
+// write to it can connect
+#define UNIX_SOCKET_PERM 0700
 
 // total command message length in bytes
 #define COMMAND_BUFFER_SIZE 1000000
 
-// total connections that server can queue
+// what a connection starts with for the commands it receives, doubled while
+// a longer one arrives
+#define CONNECTION_BUFFER_SIZE 16384
+
+// clients connected at once (--maxclients), the ones past it are told so and
+// disconnected right after accept, 0 is unlimited. without --io-uring each
+// client keeps a worker busy, the ones past the workers wait for a free one
+#define MAX_CLIENTS 10000
+
+// clients connected at once from one IP address (--maxclients-per-ip), 0 is
+// unlimited
+#define MAX_CLIENTS_PER_IP 0
+
+// total connections that server can queue (--tcp-backlog)
 #define CONN_QUEUE_SIZE 128
 
+// replies of a connection are queued in chunks of this many bytes, a reply
+// that fills one goes out while it is still being produced
+#define OUTPUT_CHUNK_SIZE 16384
+
+// bytes of output a client may leave unread before it is disconnected, 0
+// never disconnects
+#define CLIENT_OUTPUT_LIMIT (256 * 1024 * 1024)
+
+// the same for connections that subscribed to a channel, they fall behind as
+// soon as the publishers outpace them
+#define SUBSCRIBER_OUTPUT_LIMIT (32 * 1024 * 1024)
+
+// --io-uring: submission queue entries of the ring, and the buffers (a power
+// of 2) the kernel receives into for all connections
+#define URING_ENTRIES 256
+#define URING_RECV_BUFFERS 256
+#define URING_RECV_BUFFER_SIZE 16384
+
+// worker threads of the pool (--threads), every client connection keeps one
+// busy while it is open (unless --io-uring)
+#define DEFAULT_THREAD_POOL_SIZE 10
+
+// threads that own the shards and execute the commands on their keys
+// (--shard-executors), 0 executes commands on the connection's worker
+#define DEFAULT_SHARD_EXECUTORS 0
+
 // snapshot name that db will look for on startup
 #define DEFAULT_SNAPSHOT_NAME "snapshot.bin"
 
 // snapshot that will be created every time program will terminate
 #define DEFAULT_EXIT_SNAPSHOT_NAME "on_exit_snapshot.bin"
 
+// default of --snapshot-zero-copy: keep string values loaded from the snapshot
+// inside the read only mapping instead of copying them to the heap, the
+// mapping stays alive until the data is replaced. makes restarts of read
+// mostly datasets almost free and lets the page cache share the values between
+// processes that loaded the same file.
+#define SNAPSHOT_ZERO_COPY 0
+
+// compress the snapshot in blocks, only values of uncompressed blocks can be
+// kept in the mapping by --snapshot-zero-copy
+#define SNAPSHOT_COMPRESSION 1
+
+// with --snapshot-zero-copy a block is only compressed when that saves at
+// least this percentage of it, the others are written raw so their values can
+// be used in place
+#define SNAPSHOT_ZERO_COPY_MIN_SAVING 50
+
+// background save rules { seconds, changes }, the snapshot is saved in the
+// background when at least <changes> writes happened within <seconds>
+#define SAVE_RULES { { 900, 1 }, { 300, 10 }, { 60, 10000 } }
+
+// append only file that db will replay on startup and log writes to, NULL
+// disables it
+#define DEFAULT_AOF_NAME "appendonly.aof"
+
+// when the append only file is synced to disk: AOF_FSYNC_ALWAYS,
+// AOF_FSYNC_EVERYSEC or AOF_FSYNC_NO
+#define DEFAULT_AOF_FSYNC AOF_FSYNC_EVERYSEC
+
+// bytes of recent writes kept for replicas, a replica that was disconnected
+// for less than that continues where it left off (partial resync), otherwise
+// it has to load a new snapshot
+#define REPL_BACKLOG_SIZE (1024 * 1024)
+
+// a replica refuses reads once it has not been in sync with its primary for
+// longer than this many milliseconds, 0 serves reads regardless of the lag
+#define REPL_MAX_LAG_MS 0
+
 // number of initial databases to be initalized by default on startup
 #define NUM_INITAL_DATABASES 1
 
+// databases a connection can SELECT (0 .. NUM_DATABASES - 1), the ones past
+// NUM_INITAL_DATABASES get their shards the first time they are selected
+#define NUM_DATABASES 16
+
 // this must be a power of 2 (e.g., 2, 4, 8, 16, 32 ...)
 #define NUM_SHARDS 16
 
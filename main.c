@@ -1,39 +1,60 @@
 /**
  * TinyDB by David Kviloria <david@skystargames.com>
  */
+#include <pthread.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "tinydb_config_file.h"
 #include "tinydb_context.h"
 #include "tinydb_hash.h"
 #include "tinydb_log.h"
+#include "tinydb_shard_executor.h"
 #include "tinydb_snapshot.h"
 #include "tinydb_tcp_client_handler.h"
 #include "tinydb_tcp_server.h"
 #include "tinydb_thread_pool.h"
+#include "tinydb_uring.h"
 #include "tinydb_webhook.h"
 
 RuntimeContext* context = NULL;
 
+static TCP_Server tcp_server = { 0 };
+
 void
 After_Exit_Hook()
 {
   DB_Log(DB_LOG_INFO, "BYE");
+  if (context && context->aof) {
+    AOF_Flush(context->aof);
+  }
 #if 0
   Export_Snapshot(context, DEFAULT_EXIT_SNAPSHOT_NAME);
 #endif
 }
 
-void
-Signal_Handler(int signum)
+// SIGINT/SIGTERM are blocked in every thread and taken here, the first one
+// stops accepting and main shuts down, a second one exits right away
+void*
+Signal_Thread_Function(void* arg)
 {
+  sigset_t* signals = (sigset_t*)arg;
+  int signum;
+
+  sigwait(signals, &signum);
   DB_Log(DB_LOG_INFO,
          "Interrupt signal (%d) received. Exiting gracefully...",
          signum);
-  exit(EXIT_SUCCESS);
+  TCP_Server_Stop(&tcp_server);
+
+  sigwait(signals, &signum);
+  DB_Log(DB_LOG_WARNING, "Interrupt signal (%d) received again.", signum);
+  exit(EXIT_FAILURE);
+  return NULL;
 }
 
 void
@@ -66,31 +87,101 @@ log_tinydb_ascii_art()
   printf("\n%s\n", tinydb_ascii_art);
 }
 
+// yes/no (or 1/0) of an option
+static int
+Parse_Yes_No(const char* value)
+{
+  return strcasecmp(value, "yes") == 0 || strcmp(value, "1") == 0;
+}
+
 int
 main(int argc, char const* argv[])
 {
   atexit(After_Exit_Hook);
-  signal(SIGINT, Signal_Handler);
+
+  // before any thread is created so they all inherit the mask
+  static sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  pthread_t signal_thread;
+  pthread_create(&signal_thread, NULL, Signal_Thread_Function, &signals);
 
   log_tinydb_ascii_art();
   DB_Log(DB_LOG_INFO, "> %s Version %s Dev.", TINYDB_SIGNATURE, TINYDB_VERSION);
 
-  Thread_Pool_Init();
-  DB_Log(DB_LOG_INFO, "Thread Pool has been created.");
+  // --config <file>, its options go in front of the command line
+  if (Config_File_Expand_Args(&argc, &argv) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  // the pool comes first, it decides where the memory of the databases goes
+  Thread_Pool_Config pool_config = { DEFAULT_THREAD_POOL_SIZE, NULL, 0, -1 };
+  for (int32_t i = 1; i + 1 < argc; i++) {
+    if (strcmp(argv[i], "--threads") == 0) {
+      pool_config.num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--cpus") == 0) {
+      free(pool_config.cpus);
+      pool_config.num_cpus =
+        Thread_Pool_Parse_Cpus(argv[++i], &pool_config.cpus);
+      if (pool_config.num_cpus <= 0) {
+        DB_Log(DB_LOG_ERROR, "Invalid cpu list %s", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--numa-node") == 0) {
+      pool_config.numa_node = atoi(argv[++i]);
+    }
+  }
 
-  context = Initialize_Context(NUM_INITAL_DATABASES, DEFAULT_SNAPSHOT_NAME);
+  if (Thread_Pool_Init(&pool_config) != 0) {
+    DB_Log(DB_LOG_ERROR, "Unable to start the Thread Pool.");
+    return EXIT_FAILURE;
+  }
+  free(pool_config.cpus);
+  DB_Log(DB_LOG_INFO,
+         "Thread Pool has been created with %d workers.",
+         pool_config.num_threads);
+
+  // the snapshot is loaded with the context, the shard executors own the
+  // shards from the moment they are created
+  bool snapshot_zero_copy = SNAPSHOT_ZERO_COPY;
+  int32_t num_shard_executors = DEFAULT_SHARD_EXECUTORS;
+  for (int32_t i = 1; i + 1 < argc; i++) {
+    if (strcmp(argv[i], "--snapshot-zero-copy") == 0) {
+      snapshot_zero_copy = Parse_Yes_No(argv[++i]);
+    } else if (strcmp(argv[i], "--shard-executors") == 0) {
+      num_shard_executors = atoi(argv[++i]);
+    }
+  }
+
+  if (Shard_Executors_Init(num_shard_executors) != 0) {
+    DB_Log(DB_LOG_ERROR, "Unable to start the shard executors.");
+    return EXIT_FAILURE;
+  }
+
+  context = Initialize_Context(NUM_INITAL_DATABASES,
+                               DEFAULT_SNAPSHOT_NAME,
+                               snapshot_zero_copy,
+                               DEFAULT_AOF_NAME,
+                               DEFAULT_AOF_FSYNC);
   DB_Log(DB_LOG_INFO, "RuntimeContext has been allocated and initialized.");
 
 #if 1
-  context->user_manager.users = (DB_User*)malloc(sizeof(DB_User));
-  context->user_manager.users[0].ID = 0;
-  context->user_manager.users[0].name = "default";
-  context->user_manager.users[0].access = (DB_Access*)malloc(sizeof(DB_Access));
-  context->user_manager.users[0].access[0].database = 0;
-  context->user_manager.users[0].access[0].acl = DB_READ | DB_WRITE | DB_DELETE;
-
-  SHA256(context->user_manager.users[0].password, "123", 3);
-  context->user_manager.num_users++;
+  // the snapshot brings its own users
+  if (context->user_manager.num_users == 0) {
+    context->user_manager.users = (DB_User*)malloc(sizeof(DB_User));
+    DB_User* user = &context->user_manager.users[0];
+    user->ID = 0;
+    user->name = "default";
+    user->access = (DB_Access*)malloc(sizeof(DB_Access));
+    user->access->database = 0;
+    user->access->acl = DB_READ | DB_WRITE | DB_DELETE;
+
+    SHA256(user->password, "123", 3);
+    context->user_manager.num_users++;
+  }
 #endif
 
   context->Active.user = &context->user_manager.users[0];
@@ -102,20 +193,155 @@ main(int argc, char const* argv[])
          "Default Database (%s) has been assigned.",
          context->Active.db->name);
 
-  TCP_Server tcp_server = { 0 };
   TCP_Client tcp_client = { 0 };
 
   Add_Webhook("@hook_test", "http://localhost/webhook");
 
   List_Webhooks("@hook_test");
 
-  TCP_Server_Create(&tcp_server);
+  // --port <port> and --replicaof <host> <port>, so several servers can run
+  // on one machine
+  int32_t port = PORT;
+  bool use_io_uring = false;
+  const char* binds[MAX_LISTENERS];
+  int32_t num_binds = 0;
+  TCP_Server_Options* options = &tcp_server.options;
+  options->backlog = CONN_QUEUE_SIZE;
+  options->nodelay = DEFAULT_TCP_NODELAY;
+  options->reuseport = DEFAULT_REUSEPORT;
+  options->keepalive = DEFAULT_TCP_KEEPALIVE;
+  options->rcvbuf = DEFAULT_SOCKET_RCVBUF;
+  options->sndbuf = DEFAULT_SOCKET_SNDBUF;
+  int32_t max_clients = MAX_CLIENTS;
+  int32_t max_clients_per_ip = MAX_CLIENTS_PER_IP;
+  const char* unix_socket_path = UNIX_SOCKET_PATH;
+  mode_t unix_socket_perm = UNIX_SOCKET_PERM;
+  for (int32_t i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      port = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--bind") == 0) {
+      // the addresses up to the next option, the last --bind wins
+      num_binds = 0;
+      while (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+        if (num_binds < MAX_LISTENERS) {
+          binds[num_binds++] = argv[i + 1];
+        }
+        i++;
+      }
+    } else if (strcmp(argv[i], "--tcp-backlog") == 0 && i + 1 < argc) {
+      options->backlog = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--tcp-nodelay") == 0 && i + 1 < argc) {
+      options->nodelay = Parse_Yes_No(argv[++i]);
+    } else if (strcmp(argv[i], "--reuseport") == 0 && i + 1 < argc) {
+      options->reuseport = Parse_Yes_No(argv[++i]);
+    } else if (strcmp(argv[i], "--tcp-keepalive") == 0 && i + 1 < argc) {
+      options->keepalive = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--rcvbuf") == 0 && i + 1 < argc) {
+      options->rcvbuf = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--sndbuf") == 0 && i + 1 < argc) {
+      options->sndbuf = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--maxclients") == 0 && i + 1 < argc) {
+      max_clients = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--maxclients-per-ip") == 0 && i + 1 < argc) {
+      max_clients_per_ip = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+      i++; // expanded above
+    } else if (strcmp(argv[i], "--unix-socket") == 0 && i + 1 < argc) {
+      unix_socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--unix-socket-perm") == 0 && i + 1 < argc) {
+      unix_socket_perm = (mode_t)strtol(argv[++i], NULL, 8);
+    } else if (strcmp(argv[i], "--io-uring") == 0) {
+      use_io_uring = true;
+    } else if ((strcmp(argv[i], "--threads") == 0 ||
+                strcmp(argv[i], "--cpus") == 0 ||
+                strcmp(argv[i], "--numa-node") == 0 ||
+                strcmp(argv[i], "--snapshot-zero-copy") == 0 ||
+                strcmp(argv[i], "--shard-executors") == 0) &&
+               i + 1 < argc) {
+      i++; // taken before the context was created
+    } else if (strcmp(argv[i], "--replicaof") == 0 && i + 2 < argc) {
+      Replication_Set_Primary(
+        context->replication, argv[i + 1], atoi(argv[i + 2]));
+      i += 2;
+    } else {
+      DB_Log(DB_LOG_WARNING, "Ignoring unknown argument %s", argv[i]);
+    }
+  }
+
+  context->output_system = Create_Output_System();
+  if (!context->output_system) {
+    DB_Log(DB_LOG_ERROR, "Unable to start the output thread.");
+    return EXIT_FAILURE;
+  }
+
   DB_Log(
     DB_LOG_INFO, "TCP Server has been initialized.", context->Active.db->name);
-  DB_Log(DB_LOG_INFO, " - Host: %s", "127.0.0.1");
-  DB_Log(DB_LOG_INFO, " - Port: %d", PORT);
+  char default_binds[] = HOST;
+  if (num_binds == 0) {
+    for (char* host = strtok(default_binds, " ");
+         host && num_binds < MAX_LISTENERS;
+         host = strtok(NULL, " ")) {
+      binds[num_binds++] = host;
+    }
+  }
+  for (int32_t i = 0; i < num_binds; i++) {
+    if (TCP_Server_Listen(&tcp_server, binds[i], port) != 0) {
+      return EXIT_FAILURE;
+    }
+  }
+  if (unix_socket_path) {
+    if (TCP_Server_Listen_Unix(
+          &tcp_server, unix_socket_path, unix_socket_perm) != 0) {
+      return EXIT_FAILURE;
+    }
+    DB_Log(DB_LOG_INFO, " - Unix socket: %s", unix_socket_path);
+  }
+
+  URingServer* uring_server = NULL;
+  if (use_io_uring) {
+    uring_server = Create_URing_Server(
+      tcp_server.listeners, tcp_server.num_listeners, tcp_server.stop_fd);
+    if (!uring_server) {
+      DB_Log(DB_LOG_WARNING,
+             "io_uring is unavailable, every client keeps a worker busy");
+    }
+  }
 
-  TCP_Server_Process_Connections(&tcp_server, &tcp_client, TCP_Client_Handler);
+  // without the ring a client keeps a worker busy while it is open, the ones
+  // past the workers are queued until a worker is free
+  int32_t num_workers = Thread_Pool_Size();
+  if (!uring_server && (max_clients <= 0 || max_clients > num_workers)) {
+    DB_Log(DB_LOG_INFO,
+           "Clients past the %d workers of the pool (--threads) wait for a "
+           "free worker",
+           num_workers);
+  }
+  context->admission_system =
+    Create_Admission_System(max_clients, max_clients_per_ip);
+  if (!context->admission_system) {
+    return EXIT_FAILURE;
+  }
+
+  if (uring_server) {
+    URing_Server_Run(uring_server);
+  } else {
+    TCP_Server_Process_Connections(
+      &tcp_server, &tcp_client, TCP_Client_Handler);
+  }
+
+  // stopped by a signal, let the running commands finish and drain the pool
+  TCP_Server_Close(&tcp_server);
+  TCP_Client_Shutdown_All();
+  Thread_Pool_Destroy();
+  DB_Log(DB_LOG_INFO, "Thread Pool has been drained.");
+  if (uring_server) {
+    Destroy_URing_Server(uring_server);
+  }
+  Shard_Executors_Destroy();
+  Destroy_Output_System(context->output_system);
+  context->output_system = NULL;
+  Destroy_Admission_System(context->admission_system);
+  context->admission_system = NULL;
 
   return 0;
 }
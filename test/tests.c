@@ -1,8 +1,18 @@
 #include <assert.h>
 #include <stdio.h>
 
+#include "../tinydb_aof.h"
+#include "../tinydb_compress.h"
+#include "../tinydb_context.h"
+#include "../tinydb_database.h"
 #include "../tinydb_database_entry_destructor.h"
 #include "../tinydb_hashmap.h"
+#include "../tinydb_list.h"
+#include "../tinydb_object.h"
+#include "../tinydb_query_parser.h"
+
+// the modules that reach for the server's context see none
+RuntimeContext* context = NULL;
 
 void
 Test_Create_Destroy()
@@ -19,7 +29,8 @@ Test_Create_Destroy()
 void
 Test_Insert()
 {
-  HashMap* map = HM_Create(Database_Entry_Destructor);
+  // the values are literals, the map must not release them
+  HashMap* map = HM_Create(NULL);
   char* key = "test_key";
   char* value = "test_value";
 
@@ -38,7 +49,7 @@ Test_Insert()
 void
 Test_Modify()
 {
-  HashMap* map = HM_Create(Database_Entry_Destructor);
+  HashMap* map = HM_Create(NULL);
   char* key = "test_key";
   char* value = "test_value";
   char* new_value = "new_value";
@@ -58,7 +69,7 @@ Test_Modify()
 void
 Test_Remove()
 {
-  HashMap* map = HM_Create(Database_Entry_Destructor);
+  HashMap* map = HM_Create(NULL);
   char* key = "test_key";
   char* value = "test_value";
 
@@ -77,7 +88,7 @@ Test_Remove()
 void
 Test_Resize()
 {
-  HashMap* map = HM_Create(Database_Entry_Destructor);
+  HashMap* map = HM_Create(free);
 
   char key[10];
   char value[20];
@@ -100,6 +111,307 @@ Test_Resize()
   printf("Test_Resize passed.\n");
 }
 
+void
+Test_Get_While_Resizing()
+{
+  HashMap* map = HM_Create(NULL);
+  char key[16];
+
+  // every key stays visible while the resizes migrate it
+  for (intptr_t i = 0; i < 2000; i++) {
+    sprintf(key, "key_%d", (int)i);
+    HM_Put(map, key, (void*)(i + 1));
+    for (intptr_t j = 0; j <= i; j += 7) {
+      sprintf(key, "key_%d", (int)j);
+      assert(HM_Get(map, key) == (void*)(j + 1));
+    }
+  }
+
+  // overwrites of keys that were not migrated yet win over the old copy
+  for (intptr_t i = 0; i < 2000; i++) {
+    sprintf(key, "key_%d", (int)i);
+    HM_Put(map, key, (void*)(i + 2));
+  }
+  for (intptr_t i = 0; i < 2000; i++) {
+    sprintf(key, "key_%d", (int)i);
+    assert(HM_Get(map, key) == (void*)(i + 2));
+  }
+
+  HM_Destroy(map);
+  printf("Test_Get_While_Resizing passed.\n");
+}
+
+void
+Test_List_Push_Pop()
+{
+  HPLinkedList* list = HPList_Create();
+  assert(list != NULL);
+
+  for (int i = 0; i < 1000; i++) {
+    HPList_RPush_Int(list, i);
+  }
+  HPList_LPush_String(list, "head");
+  assert(list->count == 1001);
+  assert(list->num_chunks > 1);
+
+  ListNode node;
+  assert(HPList_LPop(list, &node) == 1);
+  assert(node.type == TYPE_STRING);
+  assert(strcmp(node.value.string_value, "head") == 0);
+  HPList_Release_Node(&node);
+
+  for (int i = 999; i >= 0; i--) {
+    assert(HPList_RPop(list, &node) == 1);
+    assert(node.type == TYPE_INT);
+    assert(node.value.int_value == i);
+  }
+
+  assert(HPList_RPop(list, &node) == 0);
+  assert(list->count == 0);
+  assert(list->head == NULL && list->tail == NULL);
+
+  HPList_Destroy(list);
+  printf("Test_List_Push_Pop passed.\n");
+}
+
+void
+Test_List_Index_Range()
+{
+  HPLinkedList* list = HPList_Create();
+  char value[20];
+
+  for (int i = 0; i < 500; i++) {
+    sprintf(value, "value_%d", i);
+    HPList_RPush_String(list, value);
+  }
+
+  ListNode node;
+  for (int i = 0; i < 500; i++) {
+    sprintf(value, "value_%d", i);
+    assert(HPList_Index(list, i, &node) == 1);
+    assert(strcmp(node.value.string_value, value) == 0);
+    HPList_Release_Node(&node);
+  }
+
+  assert(HPList_Index(list, -1, &node) == 1);
+  assert(strcmp(node.value.string_value, "value_499") == 0);
+  HPList_Release_Node(&node);
+  assert(HPList_Index(list, 500, &node) == 0);
+
+  char* range = HPList_RangeToString(list, -2, -1);
+  assert(strcmp(range, "[\"value_498\", \"value_499\"]") == 0);
+  free(range);
+
+  range = HPList_RangeToString(list, 10, 5);
+  assert(strcmp(range, "[]") == 0);
+  free(range);
+
+  HPList_Destroy(list);
+  printf("Test_List_Index_Range passed.\n");
+}
+
+void
+Test_Object_Fields()
+{
+  DB_Object* obj = CreateDBObject();
+  assert(obj != NULL);
+  assert(obj->encoding == DB_OBJECT_ENCODING_COMPACT);
+
+  char name[20];
+  for (int i = 0; i < DB_OBJECT_COMPACT_MAX_FIELDS * 2; i++) {
+    DB_Value value;
+    value.number.value = i;
+    sprintf(name, "field_%d", i);
+    assert(DBObject_AddField(obj, name, value, DB_ENTRY_NUMBER) ==
+           HM_ACTION_ADDED);
+  }
+  assert(obj->encoding == DB_OBJECT_ENCODING_HASHMAP);
+  assert(DBObject_Count(obj) == DB_OBJECT_COMPACT_MAX_FIELDS * 2);
+
+  int64_t result = 0;
+  assert(DBObject_IncrField(obj, "field_7", 3, &result) == DB_OBJECT_INCR_OK);
+  assert(result == 10);
+
+  DB_Value str;
+  str.string.value = strdup("text");
+  DBObject_AddField(obj, "field_7", str, DB_ENTRY_STRING);
+  assert(DBObject_IncrField(obj, "field_7", 1, &result) ==
+         DB_OBJECT_INCR_NOT_NUMBER);
+
+  assert(DBObject_RemoveField(obj, "field_0") == 1);
+  assert(DBObject_RemoveField(obj, "field_0") == 0);
+  assert(DBObject_GetField(obj, "field_0") == NULL);
+  assert(DBObject_GetField(obj, "field_1")->value.number.value == 1);
+
+  Destroy_DB_Object(obj);
+  printf("Test_Object_Fields passed.\n");
+}
+
+void
+Test_LZ_Round_Trip()
+{
+  static const char text[] = "{\"name\": \"tinydb\", \"id\": 42}";
+  size_t len = 100000;
+  uint8_t* src = malloc(len);
+  for (size_t i = 0; i < len; i++) {
+    // repetitive json-like text followed by noise
+    src[i] = i < len / 2 ? text[i % (sizeof(text) - 1)]
+                         : (uint8_t)(i * 2654435761u >> 13);
+  }
+
+  size_t capacity = LZ_Compress_Bound(len);
+  uint8_t* packed = malloc(capacity);
+  size_t packed_len = LZ_Compress(src, len, packed, capacity);
+  assert(packed_len > 0 && packed_len < len);
+
+  uint8_t* out = malloc(len);
+  assert(LZ_Decompress(packed, packed_len, out, len) == 0);
+  assert(memcmp(src, out, len) == 0);
+
+  // truncated input and a wrong size are rejected
+  assert(LZ_Decompress(packed, packed_len - 1, out, len) != 0);
+  assert(LZ_Decompress(packed, packed_len, out, len - 1) != 0);
+
+  // too small to look for matches
+  assert(LZ_Compress(src, 3, packed, capacity) == 4);
+  assert(LZ_Decompress(packed, 4, out, 3) == 0);
+  assert(memcmp(src, out, 3) == 0);
+
+  free(src);
+  free(packed);
+  free(out);
+  printf("Test_LZ_Round_Trip passed.\n");
+}
+
+void
+Test_Select_Database()
+{
+  DatabaseManager manager = { 0 };
+  manager.num_databases = 4;
+  manager.databases = calloc(manager.num_databases, sizeof(Database));
+  pthread_mutex_init(&manager.init_lock, NULL);
+  for (int32_t i = 0; i < manager.num_databases; i++) {
+    manager.databases[i].ID = i;
+  }
+
+  // created on first use only
+  assert(!atomic_load(&manager.databases[2].ready));
+  Database* db = Select_Database(&manager, 2);
+  assert(db == &manager.databases[2]);
+  assert(atomic_load(&db->ready));
+  assert(db->shards[NUM_SHARDS - 1].entries != NULL);
+  assert(Select_Database(&manager, 2) == db);
+  assert(!atomic_load(&manager.databases[1].ready));
+
+  assert(Select_Database(&manager, -1) == NULL);
+  assert(Select_Database(&manager, 4) == NULL);
+
+  DatabaseStats stats;
+  Database_Stats(&manager.databases[1], &stats);
+  assert(stats.num_keys == 0 && stats.num_commands == 0);
+
+  for (int32_t j = 0; j < NUM_SHARDS; j++) {
+    HM_Destroy(db->shards[j].entries);
+    pthread_rwlock_destroy(&db->shards[j].rwlock);
+  }
+  pthread_mutex_destroy(&manager.init_lock);
+  free(manager.databases);
+  printf("Test_Select_Database passed.\n");
+}
+
+void
+Test_Parse_Blocking_Timeout()
+{
+  // decimals reach the handler as they were typed
+  char line[] = "blpop queue 0.3";
+  size_t total_read = sizeof(line);
+  ParsedCommand* cmd = Parse_Command(line, sizeof(line), &total_read);
+  assert(cmd != NULL && strcmp(cmd->command, "blpop") == 0);
+  assert(cmd->argc == 2);
+  assert(strcmp(cmd->argv[1], "0.3") == 0);
+  Free_Parsed_Command(cmd);
+
+  int64_t timeout_ms = -1;
+  assert(Parse_Timeout("0.3", &timeout_ms) && timeout_ms == 300);
+  assert(Parse_Timeout("2", &timeout_ms) && timeout_ms == 2000);
+  assert(Parse_Timeout("0", &timeout_ms) && timeout_ms == 0);
+  assert(Parse_Timeout("0.0001", &timeout_ms) && timeout_ms == 1);
+
+  // negative and non-numeric timeouts are rejected
+  assert(!Parse_Timeout("-1", &timeout_ms));
+  assert(!Parse_Timeout("-0.5", &timeout_ms));
+  assert(!Parse_Timeout("soon", &timeout_ms));
+  assert(!Parse_Timeout("1s", &timeout_ms));
+  assert(!Parse_Timeout("", &timeout_ms));
+  assert(!Parse_Timeout("nan", &timeout_ms));
+  printf("Test_Parse_Blocking_Timeout passed.\n");
+}
+
+static void
+Test_AOF_Escaped_Values()
+{
+  // quotes and backslashes in a value survive the AOF and replication line
+  char* argv[] = { "quote\"key", "say \"hi\" C:\\dir\\", "42" };
+  TOKEN types[] = { TOKEN_STRING, TOKEN_STRING, TOKEN_NUMBER };
+  char line[256];
+  size_t len = AOF_Format_Command(line, "set", argv, types, 3);
+  assert(len <= AOF_Command_Length("set", argv, 3));
+  assert(line[len - 1] == '\n');
+  line[len - 1] = '\0';
+
+  size_t total_read = len;
+  ParsedCommand* cmd = Parse_Command(line, len, &total_read);
+  assert(cmd != NULL && strcmp(cmd->command, "set") == 0);
+  assert(cmd->argc == 3);
+  for (int32_t i = 0; i < 3; i++) {
+    assert(strcmp(cmd->argv[i], argv[i]) == 0);
+    assert(cmd->types[i] == types[i]);
+  }
+  Free_Parsed_Command(cmd);
+
+  // a lone backslash is kept as it was typed
+  char typed[] = "set k \"a\\b\"";
+  total_read = sizeof(typed);
+  cmd = Parse_Command(typed, sizeof(typed), &total_read);
+  assert(cmd != NULL && strcmp(cmd->argv[1], "a\\b") == 0);
+  Free_Parsed_Command(cmd);
+  printf("Test_AOF_Escaped_Values passed.\n");
+}
+
+static void
+Test_Float_Text()
+{
+  // fractions and exponents are lexed as floats, anything else stays whole
+  char line[] = "rpush l 1.5 -2e-3 1e+20 007 1. 1.5x";
+  size_t total_read = sizeof(line);
+  ParsedCommand* cmd = Parse_Command(line, sizeof(line), &total_read);
+  assert(cmd != NULL && cmd->argc == 7);
+  TOKEN types[] = { TOKEN_STRING, TOKEN_FLOAT,  TOKEN_FLOAT, TOKEN_FLOAT,
+                    TOKEN_NUMBER, TOKEN_STRING, TOKEN_STRING };
+  for (int32_t i = 0; i < 7; i++) {
+    assert(cmd->types[i] == types[i]);
+  }
+  assert(strcmp(cmd->argv[3], "1e+20") == 0);
+  Free_Parsed_Command(cmd);
+
+  // a float is only stored as one when its text comes back the same
+  double value;
+  assert(HPList_Parse_Float("1.5", &value) && value == 1.5);
+  assert(HPList_Parse_Float("0.1", &value) && value == 0.1);
+  assert(HPList_Parse_Float("1e+20", &value) && value == 1e20);
+  assert(!HPList_Parse_Float("1.50", &value));
+  assert(!HPList_Parse_Float("1e3", &value));
+  assert(!HPList_Parse_Float("7", &value));
+
+  char text[HPLIST_FLOAT_LENGTH];
+  double values[] = { 1000.0, 0.1, -2.5e-300, 1.0 / 3.0, 4.9e-324 };
+  for (int32_t i = 0; i < 5; i++) {
+    HPList_Format_Float(text, sizeof(text), values[i]);
+    assert(HPList_Parse_Float(text, &value) && value == values[i]);
+  }
+  printf("Test_Float_Text passed.\n");
+}
+
 int
 main()
 {
@@ -110,6 +422,35 @@ main()
   Test_Modify();
   Test_Remove();
   Test_Resize();
+  Test_Get_While_Resizing();
+  printf("-------------------------------------\n");
+
+  printf("List\n");
+  printf("-------------------------------------\n");
+  Test_List_Push_Pop();
+  Test_List_Index_Range();
+  printf("-------------------------------------\n");
+
+  printf("Object\n");
+  printf("-------------------------------------\n");
+  Test_Object_Fields();
+  printf("-------------------------------------\n");
+
+  printf("Compression\n");
+  printf("-------------------------------------\n");
+  Test_LZ_Round_Trip();
+  printf("-------------------------------------\n");
+
+  printf("Database\n");
+  printf("-------------------------------------\n");
+  Test_Select_Database();
+  printf("-------------------------------------\n");
+
+  printf("Parser\n");
+  printf("-------------------------------------\n");
+  Test_Parse_Blocking_Timeout();
+  Test_AOF_Escaped_Values();
+  Test_Float_Text();
   printf("-------------------------------------\n");
 
   printf("All tests passed.\n");
@@ -0,0 +1,219 @@
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tinydb_admission.h"
+#include "tinydb_log.h"
+
+// what unix sockets count against
+static AdmissionAddress no_address;
+
+// a storm is logged once per this many refused connections
+#define ADMISSION_LOG_EVERY 1000
+
+AdmissionSystem*
+Create_Admission_System(int32_t max_clients, int32_t max_per_address)
+{
+  AdmissionSystem* system =
+    (AdmissionSystem*)calloc(1, sizeof(AdmissionSystem));
+  if (!system) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for AdmissionSystem");
+    return NULL;
+  }
+  system->max_clients = max_clients;
+  system->max_per_address = max_per_address;
+  pthread_mutex_init(&system->lock, NULL);
+  return system;
+}
+
+// the address as 16 bytes, false for peers without one (unix sockets)
+static bool
+address_key(const struct sockaddr* addr, uint8_t key[16])
+{
+  if (addr->sa_family == AF_INET6) {
+    memcpy(key, &((const struct sockaddr_in6*)addr)->sin6_addr, 16);
+    return true;
+  }
+  if (addr->sa_family == AF_INET) {
+    memset(key, 0, 10);
+    key[10] = key[11] = 0xff;
+    memcpy(key + 12, &((const struct sockaddr_in*)addr)->sin_addr, 4);
+    return true;
+  }
+  return false;
+}
+
+static uint32_t
+address_bucket(const uint8_t key[16])
+{
+  uint32_t hash = 2166136261u;
+  for (int32_t i = 0; i < 16; i++) {
+    hash = (hash ^ key[i]) * 16777619u;
+  }
+  return hash & (ADMISSION_BUCKETS - 1);
+}
+
+// caller holds system->lock, the address is created with a count of 0
+static AdmissionAddress*
+find_address(AdmissionSystem* system, const uint8_t key[16])
+{
+  AdmissionAddress** bucket = &system->buckets[address_bucket(key)];
+  AdmissionAddress* address;
+  for (address = *bucket; address; address = address->next) {
+    if (memcmp(address->addr, key, 16) == 0) {
+      return address;
+    }
+  }
+
+  address =
+    (AdmissionAddress*)calloc(1, sizeof(AdmissionAddress));
+  if (!address) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for AdmissionAddress");
+    return NULL;
+  }
+  memcpy(address->addr, key, 16);
+  address->next = *bucket;
+  *bucket = address;
+  return address;
+}
+
+// caller holds system->lock
+static void
+drop_address(AdmissionSystem* system, AdmissionAddress* address)
+{
+  AdmissionAddress** link = &system->buckets[address_bucket(address->addr)];
+  while (*link != address) {
+    link = &(*link)->next;
+  }
+  *link = address->next;
+  free(address);
+}
+
+// caller holds system->lock
+static bool
+reserve_socket(AdmissionSystem* system, int32_t sock)
+{
+  if (sock < system->capacity) {
+    return true;
+  }
+  int32_t capacity = system->capacity > 0 ? system->capacity : 1024;
+  while (capacity <= sock) {
+    capacity *= 2;
+  }
+  AdmissionAddress** by_socket = (AdmissionAddress**)realloc(
+    system->by_socket, capacity * sizeof(AdmissionAddress*));
+  if (!by_socket) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for admitted sockets");
+    return false;
+  }
+  memset(by_socket + system->capacity,
+         0,
+         (capacity - system->capacity) * sizeof(AdmissionAddress*));
+  system->by_socket = by_socket;
+  system->capacity = capacity;
+  return true;
+}
+
+static void
+refuse(AdmissionSystem* system, int32_t sock, const char* reason)
+{
+  // the socket buffer of a fresh connection is empty, this never blocks
+  send(sock, reason, strlen(reason), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+  if (system->num_refused++ % ADMISSION_LOG_EVERY == 0) {
+    DB_Log(DB_LOG_WARNING,
+           "TCP_SERVER Refusing connections (%d so far), %d clients are "
+           "connected",
+           system->num_refused,
+           system->num_clients);
+  }
+}
+
+bool
+Admission_Admit(AdmissionSystem* system,
+                int32_t sock,
+                const struct sockaddr* addr)
+{
+  if (!system) {
+    return true;
+  }
+
+  struct sockaddr_storage peer;
+  if (!addr) {
+    socklen_t len = sizeof(peer);
+    peer.ss_family = AF_UNSPEC;
+    getpeername(sock, (struct sockaddr*)&peer, &len);
+    addr = (const struct sockaddr*)&peer;
+  }
+  uint8_t key[16];
+  bool has_address = address_key(addr, key);
+
+  pthread_mutex_lock(&system->lock);
+  if (!reserve_socket(system, sock)) {
+    pthread_mutex_unlock(&system->lock);
+    return false;
+  }
+  if (system->max_clients > 0 && system->num_clients >= system->max_clients) {
+    refuse(system, sock, "Max number of clients reached\n");
+    pthread_mutex_unlock(&system->lock);
+    return false;
+  }
+
+  AdmissionAddress* address = &no_address;
+  if (has_address) {
+    address = find_address(system, key);
+    if (!address) {
+      pthread_mutex_unlock(&system->lock);
+      return false;
+    }
+    if (system->max_per_address > 0 &&
+        address->count >= system->max_per_address) {
+      refuse(
+        system, sock, "Max number of clients from your address reached\n");
+      pthread_mutex_unlock(&system->lock);
+      return false;
+    }
+    address->count++;
+  }
+
+  system->num_clients++;
+  system->by_socket[sock] = address;
+  pthread_mutex_unlock(&system->lock);
+  return true;
+}
+
+void
+Admission_Release(AdmissionSystem* system, int32_t sock)
+{
+  if (!system) {
+    return;
+  }
+
+  pthread_mutex_lock(&system->lock);
+  AdmissionAddress* address =
+    sock < system->capacity ? system->by_socket[sock] : NULL;
+  if (address) {
+    system->by_socket[sock] = NULL;
+    system->num_clients--;
+    if (address != &no_address && --address->count == 0) {
+      drop_address(system, address);
+    }
+  }
+  pthread_mutex_unlock(&system->lock);
+}
+
+void
+Destroy_Admission_System(AdmissionSystem* system)
+{
+  for (int32_t i = 0; i < ADMISSION_BUCKETS; i++) {
+    AdmissionAddress* address = system->buckets[i];
+    while (address) {
+      AdmissionAddress* next = address->next;
+      free(address);
+      address = next;
+    }
+  }
+  pthread_mutex_destroy(&system->lock);
+  free(system->by_socket);
+  free(system);
+}
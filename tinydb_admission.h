@@ -0,0 +1,69 @@
+/**
+ * note (David)
+ * /ADMISSION/
+ * connections are counted as soon as they are accepted, on the accepting
+ * thread, and released when they close. a connection past MAX_CLIENTS, or
+ * past MAX_CLIENTS_PER_IP from the same address, is answered with a one line
+ * error and closed right there, it never waits for a worker nor gets a
+ * Connection. a storm of new connections (a deploy reconnecting every
+ * client at once) therefore cannot crowd out the clients that are served.
+ *
+ * connections on the unix socket count against MAX_CLIENTS only.
+ */
+#ifndef __TINY_DB_ADMISSION
+#define __TINY_DB_ADMISSION
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// buckets of the per address counts, a power of 2
+#define ADMISSION_BUCKETS 1024
+
+typedef struct AdmissionAddress
+{
+  uint8_t addr[16]; // IPv4 as ::ffff:a.b.c.d
+  int32_t count;
+  struct AdmissionAddress* next;
+} AdmissionAddress;
+
+typedef struct AdmissionSystem
+{
+  int32_t max_clients;     // 0: unlimited
+  int32_t max_per_address; // 0: unlimited
+
+  pthread_mutex_t lock;
+  int32_t num_clients;
+  int32_t num_refused;
+  AdmissionAddress* buckets[ADMISSION_BUCKETS];
+
+  // address each admitted socket counts against (a placeholder for unix
+  // sockets), NULL when it was not admitted
+  AdmissionAddress** by_socket;
+  int32_t capacity;
+} AdmissionSystem;
+
+AdmissionSystem*
+Create_Admission_System(int32_t max_clients, int32_t max_per_address);
+
+/**
+ * counts the connection on sock, addr is the peer address accept returned
+ * (NULL looks it up).
+ * @returns false when it is over a limit, it was told so and has to be closed
+ */
+bool
+Admission_Admit(AdmissionSystem* system,
+                int32_t sock,
+                const struct sockaddr* addr);
+
+/**
+ * releases what Admission_Admit counted for sock, before the socket closes.
+ */
+void
+Admission_Release(AdmissionSystem* system, int32_t sock);
+
+void
+Destroy_Admission_System(AdmissionSystem* system);
+
+#endif // __TINY_DB_ADMISSION
@@ -0,0 +1,960 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tinydb_aof.h"
+#include "tinydb_clock.h"
+#include "tinydb_command_executor.h"
+#include "tinydb_context.h"
+#include "tinydb_hash.h"
+#include "tinydb_log.h"
+#include "tinydb_object.h"
+#include "tinydb_shard_executor.h"
+
+// executor handlers reach the blocking and pubsub systems through the global
+extern RuntimeContext* context;
+
+static int32_t
+write_all(int32_t fd, const char* data, size_t len)
+{
+  size_t written = 0;
+  while (written < len) {
+    ssize_t n = write(fd, data + written, len - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    written += n;
+  }
+  return 0;
+}
+
+static int32_t
+stripe_of(const char* key)
+{
+  return DJB2_Hash_String(key) & (AOF_KEY_LOCKS - 1);
+}
+
+static int32_t
+reserve(char** buffer, size_t* capacity, size_t len, size_t extra)
+{
+  if (len + extra <= *capacity) {
+    return 0;
+  }
+
+  size_t new_capacity = *capacity ? *capacity : AOF_BUFFER_SIZE;
+  while (new_capacity < len + extra) {
+    new_capacity *= 2;
+  }
+
+  char* temp = realloc(*buffer, new_capacity);
+  if (!temp) {
+    DB_Log(DB_LOG_ERROR, "AOF Failed to grow the append buffer");
+    return -1;
+  }
+  *buffer = temp;
+  *capacity = new_capacity;
+  return 0;
+}
+
+static void
+rewrite_start_locked(AOF* aof, DatabaseManager* dbs);
+
+static void*
+AOF_Writer_Function(void* arg)
+{
+  AOF* aof = (AOF*)arg;
+
+  pthread_mutex_lock(&aof->lock);
+  while (1) {
+    while (aof->len == 0 && !aof->stop && !aof->sync_requested) {
+      bool retry = atomic_load(&aof->failed) && !aof->rewriting;
+      if (retry || (aof->policy == AOF_FSYNC_EVERYSEC &&
+                    aof->written_seq != aof->synced_seq)) {
+        int64_t deadline = retry
+                             ? aof->last_retry_ms + AOF_RETRY_INTERVAL_MS
+                             : aof->last_fsync_ms + AOF_FSYNC_INTERVAL_MS;
+        if (Now_Ms() >= deadline) {
+          break;
+        }
+        struct timespec ts;
+        ts.tv_sec = deadline / 1000;
+        ts.tv_nsec = (deadline % 1000) * 1000000;
+        pthread_cond_timedwait(&aof->has_data, &aof->lock, &ts);
+      } else {
+        pthread_cond_wait(&aof->has_data, &aof->lock);
+      }
+    }
+
+    // take the whole batch, workers keep appending into the spare buffer
+    char* batch = aof->buffer;
+    size_t batch_len = aof->len;
+    size_t batch_capacity = aof->capacity;
+    uint64_t batch_seq = aof->appended_seq;
+    uint64_t generation = aof->generation;
+    bool failed = atomic_load(&aof->failed);
+    bool sync_requested = aof->sync_requested;
+    bool stop = aof->stop;
+
+    aof->buffer = aof->spare;
+    aof->capacity = aof->spare_capacity;
+    aof->len = 0;
+    aof->sync_requested = false;
+    pthread_mutex_unlock(&aof->lock);
+
+    int64_t now = Now_Ms();
+    bool sync = aof->policy == AOF_FSYNC_ALWAYS || sync_requested || stop ||
+                (aof->policy == AOF_FSYNC_EVERYSEC &&
+                 now - aof->last_fsync_ms >= AOF_FSYNC_INTERVAL_MS);
+
+    pthread_mutex_lock(&aof->io_lock);
+    // a finished rewrite already put this batch into the new log, a failed
+    // log drops it, the rewrite that recovers it dumps the dataset instead
+    bool current = generation == aof->generation && !failed;
+    bool written = true;
+    bool synced = sync;
+    if (current) {
+      if (batch_len > 0 && write_all(aof->fd, batch, batch_len) != 0) {
+        DB_Log(DB_LOG_ERROR, "AOF write failed: %s", strerror(errno));
+        // no torn line in the middle of the log
+        if (ftruncate(aof->fd, aof->size) != 0) {
+          DB_Log(DB_LOG_ERROR, "AOF truncate failed: %s", strerror(errno));
+        }
+        written = synced = false;
+      }
+      if (written && sync && fdatasync(aof->fd) != 0) {
+        // the kernel may have dropped the pages already, only a rewrite
+        // knows what is on disk
+        DB_Log(DB_LOG_ERROR, "AOF fdatasync failed: %s", strerror(errno));
+        synced = false;
+      }
+    }
+    pthread_mutex_unlock(&aof->io_lock);
+
+    pthread_mutex_lock(&aof->lock);
+    aof->spare = batch;
+    aof->spare_capacity = batch_capacity;
+    if (current && written) {
+      aof->size += batch_len;
+      if (batch_seq > aof->written_seq) {
+        aof->written_seq = batch_seq;
+      }
+    }
+    if (current && synced) {
+      if (batch_seq > aof->synced_seq) {
+        aof->synced_seq = batch_seq;
+      }
+      aof->last_fsync_ms = now;
+    }
+    if (current && (!written || synced != sync) &&
+        generation == aof->generation) {
+      DB_Log(DB_LOG_ERROR, "AOF failed, writes are refused until it recovers");
+      atomic_store(&aof->failed, true);
+      aof->last_retry_ms = now - AOF_RETRY_INTERVAL_MS;
+    }
+    pthread_cond_broadcast(&aof->synced);
+
+    if (!stop && !aof->rewriting && atomic_load(&aof->failed) &&
+        Now_Ms() - aof->last_retry_ms >= AOF_RETRY_INTERVAL_MS &&
+        context != NULL) {
+      DB_Log(DB_LOG_INFO, "AOF rewriting the log to recover it");
+      aof->last_retry_ms = Now_Ms();
+      rewrite_start_locked(aof, &context->db_manager);
+    }
+
+    if (!stop && !aof->rewriting && aof->size >= AOF_REWRITE_MIN_SIZE &&
+        aof->size >= aof->base_size * 2 && context != NULL) {
+      DB_Log(DB_LOG_INFO,
+             "AOF grew to %lld bytes, starting a rewrite",
+             (long long)aof->size);
+      rewrite_start_locked(aof, &context->db_manager);
+    }
+
+    if (stop && aof->len == 0) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&aof->lock);
+
+  return NULL;
+}
+
+AOF*
+Create_AOF(const char* filename, AOF_FSYNC_POLICY policy)
+{
+  AOF* aof = (AOF*)calloc(1, sizeof(AOF));
+  if (!aof) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for AOF");
+    return NULL;
+  }
+
+  aof->fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (aof->fd < 0) {
+    DB_Log(
+      DB_LOG_ERROR, "Unable to open AOF %s: %s", filename, strerror(errno));
+    free(aof);
+    return NULL;
+  }
+
+  aof->filename = strdup(filename);
+  aof->policy = policy;
+  aof->feed_db = -1; // whatever the log selected last, name it again
+  aof->capacity = aof->spare_capacity = AOF_BUFFER_SIZE;
+  aof->buffer = malloc(aof->capacity);
+  aof->spare = malloc(aof->spare_capacity);
+  if (!aof->filename || !aof->buffer || !aof->spare) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for AOF buffers");
+    close(aof->fd);
+    free(aof->filename);
+    free(aof->buffer);
+    free(aof->spare);
+    free(aof);
+    return NULL;
+  }
+  aof->last_fsync_ms = Now_Ms();
+
+  struct stat st;
+  if (fstat(aof->fd, &st) == 0) {
+    aof->size = aof->base_size = st.st_size;
+  }
+
+  pthread_mutex_init(&aof->lock, NULL);
+  pthread_mutex_init(&aof->io_lock, NULL);
+  pthread_cond_init(&aof->rewrite_done, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&aof->has_data, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&aof->synced, NULL);
+
+  for (int32_t i = 0; i < AOF_KEY_LOCKS; i++) {
+    pthread_mutex_init(&aof->key_locks[i], NULL);
+  }
+
+  pthread_create(&aof->writer_thread, NULL, AOF_Writer_Function, (void*)aof);
+  return aof;
+}
+
+// quoted values escape '"' and '\\', the lexer takes them back out
+static bool
+needs_escape(char c)
+{
+  return c == '"' || c == '\\';
+}
+
+size_t
+AOF_Command_Length(const char* command, char* const* argv, int32_t argc)
+{
+  size_t len = strlen(command) + 1;
+  for (int32_t i = 0; i < argc; i++) {
+    for (const char* c = argv[i]; *c; c++) {
+      len += needs_escape(*c) ? 2 : 1;
+    }
+    len += 3;
+  }
+  return len;
+}
+
+size_t
+AOF_Format_Command(char* out,
+                   const char* command,
+                   char* const* argv,
+                   const TOKEN* types,
+                   int32_t argc)
+{
+  char* start = out;
+  size_t len = strlen(command);
+  memcpy(out, command, len);
+  out += len;
+
+  for (int32_t i = 0; i < argc; i++) {
+    bool quote = types == NULL || types[i] == TOKEN_STRING;
+
+    *out++ = ' ';
+    if (quote) {
+      *out++ = '"';
+      for (const char* c = argv[i]; *c; c++) {
+        if (needs_escape(*c)) {
+          *out++ = '\\';
+        }
+        *out++ = *c;
+      }
+      *out++ = '"';
+    } else {
+      len = strlen(argv[i]);
+      memcpy(out, argv[i], len);
+      out += len;
+    }
+  }
+  *out++ = '\n';
+
+  return out - start;
+}
+
+size_t
+AOF_Format_Select(char* out, int32_t db)
+{
+  return snprintf(out, AOF_SELECT_LENGTH, "select %d\n", db);
+}
+
+uint64_t
+AOF_Feed(AOF* aof,
+         int32_t db,
+         const char* command,
+         char* const* argv,
+         const TOKEN* types,
+         int32_t argc)
+{
+  size_t line_len = AOF_Command_Length(command, argv, argc);
+
+  pthread_mutex_lock(&aof->lock);
+  if (reserve(&aof->buffer,
+              &aof->capacity,
+              aof->len,
+              AOF_SELECT_LENGTH + line_len) != 0) {
+    // the line is lost, the rewrite puts the key back
+    atomic_store(&aof->failed, true);
+    pthread_cond_signal(&aof->has_data);
+    pthread_mutex_unlock(&aof->lock);
+    return 0;
+  }
+
+  if (aof->feed_db != db) {
+    aof->len += AOF_Format_Select(aof->buffer + aof->len, db);
+    aof->feed_db = db;
+  }
+  char* line = aof->buffer + aof->len;
+  line_len = AOF_Format_Command(line, command, argv, types, argc);
+  aof->len += line_len;
+
+  // keys of stripes that are not dumped yet end up in the rewrite as they are
+  // once the dump gets to them
+  if (aof->rewriting && argc > 0 && aof->rewrite_dumped[stripe_of(argv[0])] &&
+      reserve(&aof->rewrite_buffer,
+              &aof->rewrite_capacity,
+              aof->rewrite_len,
+              AOF_SELECT_LENGTH + line_len) == 0) {
+    if (aof->rewrite_feed_db != db) {
+      aof->rewrite_len +=
+        AOF_Format_Select(aof->rewrite_buffer + aof->rewrite_len, db);
+      aof->rewrite_feed_db = db;
+    }
+    memcpy(aof->rewrite_buffer + aof->rewrite_len, line, line_len);
+    aof->rewrite_len += line_len;
+  }
+
+  uint64_t seq = ++aof->appended_seq;
+  pthread_cond_signal(&aof->has_data);
+  pthread_mutex_unlock(&aof->lock);
+
+  return seq;
+}
+
+bool
+AOF_Commit(AOF* aof, uint64_t seq)
+{
+  if (seq == 0) {
+    return false;
+  }
+  if (aof->policy != AOF_FSYNC_ALWAYS) {
+    return true;
+  }
+
+  pthread_mutex_lock(&aof->lock);
+  while (aof->synced_seq < seq && !atomic_load(&aof->failed)) {
+    pthread_cond_wait(&aof->synced, &aof->lock);
+  }
+  bool synced = aof->synced_seq >= seq;
+  pthread_mutex_unlock(&aof->lock);
+  return synced;
+}
+
+bool
+AOF_Healthy(AOF* aof)
+{
+  return !atomic_load(&aof->failed);
+}
+
+void
+AOF_Flush(AOF* aof)
+{
+  pthread_mutex_lock(&aof->lock);
+  uint64_t seq = aof->appended_seq;
+  if (aof->synced_seq < seq || aof->len > 0) {
+    aof->sync_requested = true;
+    pthread_cond_signal(&aof->has_data);
+    while (aof->synced_seq < seq && !atomic_load(&aof->failed)) {
+      pthread_cond_wait(&aof->synced, &aof->lock);
+    }
+  }
+  pthread_mutex_unlock(&aof->lock);
+}
+
+void
+AOF_Lock_Key(AOF* aof, const char* key)
+{
+  pthread_mutex_lock(&aof->key_locks[stripe_of(key)]);
+}
+
+void
+AOF_Unlock_Key(AOF* aof, const char* key)
+{
+  pthread_mutex_unlock(&aof->key_locks[stripe_of(key)]);
+}
+
+static void
+dump_token(FILE* file, const char* value, bool quote)
+{
+  fputc(' ', file);
+  if (!quote) {
+    fputs(value, file);
+    return;
+  }
+  fputc('"', file);
+  for (const char* c = value; *c; c++) {
+    if (needs_escape(*c)) {
+      fputc('\\', file);
+    }
+    fputc(*c, file);
+  }
+  fputc('"', file);
+}
+
+// @returns false when the list holds a float the protocol can not express
+static bool
+dump_list(FILE* file, DatabaseEntry* entry)
+{
+  HPLinkedList* list = entry->value.list;
+  char number[HPLIST_FLOAT_LENGTH];
+  size_t in_command = 0;
+  bool ok = true;
+
+  pthread_rwlock_rdlock(&list->rwlock);
+  ListNode node;
+  HPList_Iterator it = HPList_Iter(list);
+  while (ok && HPList_Iter_Next(&it, &node)) {
+    if (node.type == TYPE_FLOAT && !isfinite(node.value.float_value)) {
+      DB_Log(DB_LOG_ERROR,
+             "AOF rewrite can not express the float %f in %s",
+             node.value.float_value,
+             entry->key);
+      ok = false;
+      break;
+    }
+
+    if (in_command == 0) {
+      fputs("rpush", file);
+      dump_token(file, entry->key, true);
+    }
+
+    switch (node.type) {
+      case TYPE_INT:
+        snprintf(number, sizeof(number), "%" PRId64, node.value.int_value);
+        dump_token(file, number, false);
+        break;
+      case TYPE_FLOAT:
+        HPList_Format_Float(number, sizeof(number), node.value.float_value);
+        dump_token(file, number, false);
+        break;
+      case TYPE_STRING:
+        dump_token(file, node.value.string_value, true);
+        break;
+    }
+
+    if (++in_command == AOF_REWRITE_ITEMS_PER_CMD) {
+      fputc('\n', file);
+      in_command = 0;
+    }
+  }
+  pthread_rwlock_unlock(&list->rwlock);
+
+  if (in_command != 0) {
+    fputc('\n', file);
+  }
+  return ok;
+}
+
+// @returns false when the object has a nested list or object, HSET only sets
+// strings and numbers
+static bool
+dump_object(FILE* file, DatabaseEntry* entry)
+{
+  DB_Object* obj = entry->value.object;
+  char number[32];
+  size_t in_command = 0;
+  bool ok = true;
+
+  pthread_rwlock_rdlock(&obj->rwlock);
+  DBObject_Iterator it = DBObject_Iter(obj);
+  DatabaseEntry* field;
+  while ((field = DBObject_Iter_Next(&it)) != NULL) {
+    if (field->type != DB_ENTRY_STRING && field->type != DB_ENTRY_NUMBER) {
+      DB_Log(DB_LOG_ERROR,
+             "AOF rewrite can not express the nested field %s of %s",
+             field->key,
+             entry->key);
+      ok = false;
+      break;
+    }
+
+    if (in_command == 0) {
+      fputs("hset", file);
+      dump_token(file, entry->key, true);
+    }
+
+    dump_token(file, field->key, true);
+    if (field->type == DB_ENTRY_STRING) {
+      dump_token(file, field->value.string.value, true);
+    } else {
+      snprintf(number,
+               sizeof(number),
+               "%" PRId64,
+               atomic_load(&field->value.number.value));
+      dump_token(file, number, false);
+    }
+
+    if (++in_command == AOF_REWRITE_ITEMS_PER_CMD) {
+      fputc('\n', file);
+      in_command = 0;
+    }
+  }
+  pthread_rwlock_unlock(&obj->rwlock);
+
+  if (in_command != 0) {
+    fputc('\n', file);
+  }
+  return ok;
+}
+
+// @returns false when the entry can not be written as commands, the rewrite
+// is given up then instead of losing it
+static bool
+dump_entry(FILE* file, DatabaseEntry* entry)
+{
+  char number[32];
+
+  switch (entry->type) {
+    case DB_ENTRY_STRING:
+      fputs("set", file);
+      dump_token(file, entry->key, true);
+      dump_token(file, entry->value.string.value, true);
+      fputc('\n', file);
+      break;
+    case DB_ENTRY_NUMBER:
+      // SET stores strings, INCRBY on the missing key brings the counter back
+      snprintf(number,
+               sizeof(number),
+               "%" PRId64,
+               atomic_load(&entry->value.number.value));
+      fputs("incrby", file);
+      dump_token(file, entry->key, true);
+      dump_token(file, number, false);
+      fputc('\n', file);
+      break;
+    case DB_ENTRY_LIST:
+      return dump_list(file, entry);
+    case DB_ENTRY_OBJECT:
+      return dump_object(file, entry);
+  }
+  return true;
+}
+
+static void
+dump_select(FILE* file, Database* db, int32_t* file_db)
+{
+  if (*file_db != (int32_t)db->ID) {
+    *file_db = (int32_t)db->ID;
+    fprintf(file, "select %d\n", *file_db);
+  }
+}
+
+// caller holds the key lock of the stripe. file_db is the database the file
+// selected last, a select is only written when the stripe has keys.
+// @returns false when an entry could not be dumped
+static bool
+dump_stripe(FILE* file, Database* db, int32_t stripe, int32_t* file_db)
+{
+  DatabaseShard* shard = &db->shards[stripe & (NUM_SHARDS - 1)];
+  HashMap* map = shard->entries;
+  bool ok = true;
+
+  // on the owner of the shard nothing else touches the map
+  bool owned = HM_Is_Owner(map);
+  Shard_Read_Lock(shard);
+  if (!owned) {
+    pthread_mutex_lock(&map->resize_lock);
+  }
+
+  for (size_t i = 0; ok && i < map->capacity; i++) {
+    HashEntry* hash_entry = &map->entries[i];
+    if (hash_entry->is_occupied && !hash_entry->is_deleted &&
+        stripe_of(hash_entry->key) == stripe) {
+      dump_select(file, db, file_db);
+      ok = dump_entry(file, (DatabaseEntry*)hash_entry->value);
+    }
+  }
+
+  // entries of an incremental resize that were not migrated yet
+  if (ok && map->old_entries != NULL) {
+    for (size_t i = atomic_load(&map->resize_progress);
+         ok && i < map->old_capacity;
+         i++) {
+      HashEntry* hash_entry = &map->old_entries[i];
+      if (hash_entry->is_occupied && !hash_entry->is_deleted &&
+          stripe_of(hash_entry->key) == stripe) {
+        dump_select(file, db, file_db);
+        ok = dump_entry(file, (DatabaseEntry*)hash_entry->value);
+      }
+    }
+  }
+
+  if (!owned) {
+    pthread_mutex_unlock(&map->resize_lock);
+  }
+  Shard_Unlock(shard);
+  return ok;
+}
+
+static int32_t
+sync_parent_directory(const char* filename)
+{
+  char* path = strdup(filename);
+  if (!path) {
+    return -1;
+  }
+
+  char* slash = strrchr(path, '/');
+  const char* dir = ".";
+  if (slash) {
+    *slash = '\0';
+    dir = slash == path ? "/" : path;
+  }
+
+  int32_t fd = open(dir, O_RDONLY);
+  int32_t res = fd >= 0 ? fsync(fd) : -1;
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(path);
+  return res;
+}
+
+static void
+rewrite_finish(AOF* aof, int32_t fd, const char* temp_name, bool ok)
+{
+  pthread_mutex_lock(&aof->io_lock);
+  pthread_mutex_lock(&aof->lock);
+
+  if (ok && write_all(fd, aof->rewrite_buffer, aof->rewrite_len) != 0) {
+    DB_Log(DB_LOG_ERROR, "AOF rewrite failed to append the tail");
+    ok = false;
+  }
+  if (ok && fdatasync(fd) != 0) {
+    ok = false;
+  }
+  if (ok && rename(temp_name, aof->filename) != 0) {
+    DB_Log(DB_LOG_ERROR, "AOF rewrite rename failed: %s", strerror(errno));
+    ok = false;
+  }
+
+  if (ok) {
+    sync_parent_directory(aof->filename);
+    close(aof->fd);
+    aof->fd = fd;
+
+    // everything appended so far is in the new log, including the lines the
+    // writer thread has not written yet
+    aof->generation++;
+    aof->len = 0;
+    aof->feed_db = aof->rewrite_feed_db;
+    aof->written_seq = aof->synced_seq = aof->appended_seq;
+    aof->last_fsync_ms = Now_Ms();
+    if (atomic_load(&aof->failed)) {
+      DB_Log(DB_LOG_INFO, "AOF recovered, accepting writes again");
+      atomic_store(&aof->failed, false);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+      aof->size = aof->base_size = st.st_size;
+    }
+    pthread_cond_broadcast(&aof->synced);
+
+    DB_Log(DB_LOG_INFO,
+           "AOF rewrite finished, %s is %lld bytes",
+           aof->filename,
+           (long long)aof->size);
+  } else {
+    DB_Log(DB_LOG_ERROR, "AOF rewrite failed, %s is kept", aof->filename);
+    close(fd);
+    unlink(temp_name);
+  }
+  aof->rewrite_failed = !ok;
+
+  free(aof->rewrite_buffer);
+  aof->rewrite_buffer = NULL;
+  aof->rewrite_len = aof->rewrite_capacity = 0;
+  aof->rewriting = false;
+  pthread_cond_broadcast(&aof->rewrite_done);
+  pthread_cond_signal(&aof->has_data); // a failed log retries
+
+  pthread_mutex_unlock(&aof->lock);
+  pthread_mutex_unlock(&aof->io_lock);
+}
+
+typedef struct RewriteStripe
+{
+  AOF* aof;
+  FILE* file;
+  int32_t stripe;
+  int32_t file_db; // database the file selected last
+  bool ok;
+} RewriteStripe;
+
+static void
+rewrite_stripe(void* arg)
+{
+  RewriteStripe* dump = (RewriteStripe*)arg;
+  AOF* aof = dump->aof;
+  DatabaseManager* dbs = aof->rewrite_dbs;
+
+  pthread_mutex_lock(&aof->key_locks[dump->stripe]);
+  for (int32_t i = 0; dump->ok && i < dbs->num_databases; i++) {
+    if (atomic_load(&dbs->databases[i].ready)) {
+      dump->ok = dump_stripe(
+        dump->file, &dbs->databases[i], dump->stripe, &dump->file_db);
+    }
+  }
+
+  pthread_mutex_lock(&aof->lock);
+  aof->rewrite_dumped[dump->stripe] = true;
+  pthread_mutex_unlock(&aof->lock);
+  pthread_mutex_unlock(&aof->key_locks[dump->stripe]);
+}
+
+static void*
+AOF_Rewrite_Function(void* arg)
+{
+  AOF* aof = (AOF*)arg;
+
+  size_t temp_len = strlen(aof->filename) + sizeof(".rewrite");
+  char* temp_name = malloc(temp_len);
+  snprintf(temp_name, temp_len, "%s.rewrite", aof->filename);
+
+  int32_t fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  FILE* file = fd >= 0 ? fdopen(dup(fd), "w") : NULL;
+  if (!file) {
+    DB_Log(DB_LOG_ERROR, "AOF rewrite unable to open %s", temp_name);
+    if (fd >= 0) {
+      close(fd);
+    }
+    pthread_mutex_lock(&aof->lock);
+    aof->rewriting = false;
+    aof->rewrite_failed = true;
+    pthread_cond_broadcast(&aof->rewrite_done);
+    pthread_cond_signal(&aof->has_data);
+    pthread_mutex_unlock(&aof->lock);
+    free(temp_name);
+    return NULL;
+  }
+  setvbuf(file, NULL, _IOFBF, AOF_BUFFER_SIZE);
+
+  // a database created while the dump runs has no keys in the stripes that
+  // were dumped already, its writes to them go to the rewrite buffer. a
+  // stripe is dumped by the owner of its shard
+  RewriteStripe dump = { .aof = aof, .file = file, .file_db = -1, .ok = true };
+  for (dump.stripe = 0; dump.ok && dump.stripe < AOF_KEY_LOCKS; dump.stripe++) {
+    Shard_Executors_Run(dump.stripe & (NUM_SHARDS - 1), rewrite_stripe, &dump);
+  }
+  bool dumped = dump.ok;
+
+  bool ok = fflush(file) == 0 && dumped;
+  fclose(file);
+
+  rewrite_finish(aof, fd, temp_name, ok);
+  free(temp_name);
+  return NULL;
+}
+
+// caller holds aof->lock
+static void
+rewrite_start_locked(AOF* aof, DatabaseManager* dbs)
+{
+  aof->rewriting = true;
+  aof->rewrite_dbs = dbs;
+  aof->rewrite_len = 0;
+  aof->rewrite_feed_db = -1;
+  memset(aof->rewrite_dumped, 0, sizeof(aof->rewrite_dumped));
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, AOF_Rewrite_Function, (void*)aof) != 0) {
+    DB_Log(DB_LOG_ERROR, "AOF Failed to start the rewrite thread");
+    aof->rewriting = false;
+    aof->rewrite_failed = true;
+    return;
+  }
+  pthread_detach(thread);
+}
+
+int32_t
+AOF_Rewrite_Start(AOF* aof, DatabaseManager* dbs)
+{
+  pthread_mutex_lock(&aof->lock);
+  if (aof->rewriting) {
+    pthread_mutex_unlock(&aof->lock);
+    return -1;
+  }
+  rewrite_start_locked(aof, dbs);
+  int32_t res = aof->rewriting ? 0 : -1;
+  pthread_mutex_unlock(&aof->lock);
+  return res;
+}
+
+int32_t
+AOF_Rewrite_Wait(AOF* aof)
+{
+  pthread_mutex_lock(&aof->lock);
+  while (aof->rewriting) {
+    pthread_cond_wait(&aof->rewrite_done, &aof->lock);
+  }
+  bool failed = aof->rewrite_failed;
+  pthread_mutex_unlock(&aof->lock);
+  return failed ? -1 : 0;
+}
+
+void
+AOF_Mark_Failed(AOF* aof)
+{
+  pthread_mutex_lock(&aof->lock);
+  atomic_store(&aof->failed, true);
+  pthread_cond_signal(&aof->has_data);
+  pthread_mutex_unlock(&aof->lock);
+}
+
+int32_t
+AOF_Replay(RuntimeContext* ctx, const char* filename)
+{
+  int32_t fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    DB_Log(DB_LOG_ERROR, "Unable to open AOF %s for reading", filename);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    DB_Log(DB_LOG_ERROR, "Failed to get file size for %s", filename);
+    close(fd);
+    return -1;
+  }
+
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    DB_Log(DB_LOG_ERROR, "Failed to mmap AOF %s", filename);
+    close(fd);
+    return -1;
+  }
+
+  RuntimeContext* previous = context;
+  context = ctx;
+
+  // nothing else runs yet, the commands are executed right here instead of
+  // being handed to the shard executors one by one
+  Shard_Executors_Pause();
+
+  // replies go nowhere
+  Connection replay = { .sock = -1, .db = &ctx->db_manager.databases[0] };
+  const char* ptr = data;
+  const char* end = data + st.st_size;
+  size_t line_capacity = 0;
+  char* line = NULL;
+  uint64_t num_commands = 0;
+
+  while (ptr < end) {
+    const char* eol = memchr(ptr, '\n', end - ptr);
+    if (!eol) {
+      DB_Log(DB_LOG_WARNING,
+             "AOF %s ends with a truncated command, ignoring %zu bytes",
+             filename,
+             (size_t)(end - ptr));
+      break;
+    }
+
+    size_t len = eol - ptr;
+    if (len + 1 > line_capacity) {
+      line_capacity = len + 1;
+      char* temp = realloc(line, line_capacity);
+      if (!temp) {
+        DB_Log(DB_LOG_ERROR, "Failed to allocate memory for AOF line");
+        break;
+      }
+      line = temp;
+    }
+    memcpy(line, ptr, len);
+    line[len] = '\0';
+    ptr = eol + 1;
+
+    size_t total_read = len;
+    ParsedCommand* cmd = Parse_Command(line, len + 1, &total_read);
+    if (cmd != NULL) {
+      Execute_Command(&replay, cmd);
+      Free_Parsed_Command(cmd);
+      num_commands++;
+    }
+  }
+
+  Shard_Executors_Resume();
+  context = previous;
+  free(line);
+  munmap(data, st.st_size);
+  close(fd);
+
+  DB_Log(DB_LOG_INFO,
+         "Replayed %" PRIu64 " commands from AOF %s",
+         num_commands,
+         filename);
+  return 0;
+}
+
+void
+Destroy_AOF(AOF* aof)
+{
+  pthread_mutex_lock(&aof->lock);
+  while (aof->rewriting) {
+    pthread_cond_wait(&aof->rewrite_done, &aof->lock);
+  }
+  aof->stop = true;
+  pthread_cond_signal(&aof->has_data);
+  pthread_mutex_unlock(&aof->lock);
+  pthread_join(aof->writer_thread, NULL);
+
+  for (int32_t i = 0; i < AOF_KEY_LOCKS; i++) {
+    pthread_mutex_destroy(&aof->key_locks[i]);
+  }
+  pthread_cond_destroy(&aof->rewrite_done);
+  pthread_cond_destroy(&aof->synced);
+  pthread_cond_destroy(&aof->has_data);
+  pthread_mutex_destroy(&aof->io_lock);
+  pthread_mutex_destroy(&aof->lock);
+
+  close(aof->fd);
+  free(aof->filename);
+  free(aof->buffer);
+  free(aof->spare);
+  free(aof);
+}
@@ -0,0 +1,244 @@
+/**
+ * note (David)
+ * /APPEND ONLY FILE/
+ * every write command is appended to the log as a protocol line before it is
+ * executed. workers only copy the line into a shared buffer, a dedicated
+ * writer thread drains the buffer with a single write() and syncs it
+ * according to the fsync policy:
+ *
+ *   AOF_FSYNC_ALWAYS   fdatasync after every batch, writers wait for it
+ *   AOF_FSYNC_EVERYSEC fdatasync at most once per second
+ *   AOF_FSYNC_NO       leave it to the kernel
+ *
+ * with ALWAYS all the workers that appended while the previous batch was being
+ * synced share the next fdatasync (group commit).
+ *
+ * /FAILURES/
+ * a write() or fdatasync that fails leaves the log behind the dataset. the
+ * waiting commits fail, clients are refused writes and the writer drops its
+ * batches until a rewrite, retried every AOF_RETRY_INTERVAL_MS, has put the
+ * whole dataset on disk again.
+ *
+ * /REWRITE/
+ * the log is compacted in the background by dumping the dataset as one
+ * command per key (lists and objects in batches) into a temp file. the dump
+ * walks the key lock stripes one by one, holding the stripe while its keys
+ * are written. writes to a stripe that was already dumped are appended to the
+ * rewrite buffer as well, at the end the buffer is appended to the temp file
+ * which is then renamed over the log. a value no command can create (lists or
+ * objects nested in an object, floats that are not finite, both only come
+ * from snapshots) gives the rewrite up and the old log is kept.
+ *
+ * /DATABASES/
+ * a write to another database than the one of the line before it is preceded
+ * by "select <db>", replay starts in database 0. the log and the rewrite
+ * buffer keep track of the database of their last line separately.
+ */
+#ifndef __TINY_DB_AOF
+#define __TINY_DB_AOF
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "tinydb_database.h"
+#include "tinydb_query_parser.h"
+
+// initial size of the append buffer, it grows on demand
+#define AOF_BUFFER_SIZE 65536
+
+// number of key lock stripes, must be a power of 2
+#define AOF_KEY_LOCKS 64
+
+// interval of AOF_FSYNC_EVERYSEC in milliseconds
+#define AOF_FSYNC_INTERVAL_MS 1000
+
+// a failing log is rewritten at most this often, in milliseconds
+#define AOF_RETRY_INTERVAL_MS 1000
+
+// the log is rewritten automatically once it is bigger than this and twice
+// the size it had after the last rewrite (or on startup)
+#define AOF_REWRITE_MIN_SIZE (64 * 1024 * 1024)
+
+// max elements/fields per RPUSH/HSET emitted by the rewrite
+#define AOF_REWRITE_ITEMS_PER_CMD 64
+
+// stripe i only holds keys of shard (i & (NUM_SHARDS - 1)), the rewrite
+// relies on that to dump a stripe from a single shard
+#if AOF_KEY_LOCKS < NUM_SHARDS
+#error "AOF_KEY_LOCKS must be >= NUM_SHARDS"
+#endif
+
+struct RuntimeContext;
+
+typedef enum AOF_FSYNC_POLICY
+{
+  AOF_FSYNC_ALWAYS,
+  AOF_FSYNC_EVERYSEC,
+  AOF_FSYNC_NO
+} AOF_FSYNC_POLICY;
+
+typedef struct AOF
+{
+  int32_t fd;
+  char* filename;
+  AOF_FSYNC_POLICY policy;
+
+  // lines appended by the workers, swapped with spare by the writer
+  char* buffer;
+  size_t len;
+  size_t capacity;
+  char* spare;
+  size_t spare_capacity;
+
+  int32_t feed_db;       // database of the last line appended, -1 unknown
+  uint64_t appended_seq; // last line copied into buffer
+  uint64_t written_seq;  // last line handed to the kernel
+  uint64_t synced_seq;   // last line on disk
+  int64_t last_fsync_ms;
+  bool sync_requested;
+  bool stop;
+
+  // a write or sync failed, cleared by the rewrite that recovers the log
+  atomic_bool failed;
+  int64_t last_retry_ms;
+
+  pthread_mutex_t lock;
+  pthread_cond_t has_data;
+  pthread_cond_t synced;
+  pthread_t writer_thread;
+
+  // serializes log + execute of commands touching the same key so the order
+  // of the file matches the order the key saw
+  pthread_mutex_t key_locks[AOF_KEY_LOCKS];
+
+  // held by the writer thread while it uses fd, bumping generation tells it
+  // that the batch it holds was already written to the rewritten log
+  pthread_mutex_t io_lock;
+  uint64_t generation;
+  off_t size;
+  off_t base_size;
+
+  bool rewriting;
+  bool rewrite_failed; // outcome of the last rewrite
+  bool rewrite_dumped[AOF_KEY_LOCKS];
+  char* rewrite_buffer;
+  size_t rewrite_len;
+  size_t rewrite_capacity;
+  int32_t rewrite_feed_db;
+  DatabaseManager* rewrite_dbs;
+  pthread_cond_t rewrite_done;
+} AOF;
+
+AOF*
+Create_AOF(const char* filename, AOF_FSYNC_POLICY policy);
+
+/**
+ * appends "command argv..." (a write to database db) to the log, string
+ * arguments are quoted so they are lexed back with the same type. types can
+ * be NULL when all the arguments are strings.
+ * @returns sequence number of the line to pass to AOF_Commit
+ */
+uint64_t
+AOF_Feed(AOF* aof,
+         int32_t db,
+         const char* command,
+         char* const* argv,
+         const TOKEN* types,
+         int32_t argc);
+
+/**
+ * @returns upper bound of the line AOF_Format_Command writes: the command,
+ * separators, quotes, escapes and the newline
+ */
+size_t
+AOF_Command_Length(const char* command, char* const* argv, int32_t argc);
+
+/**
+ * writes the protocol line AOF_Feed appends, the replication backlog carries
+ * the same lines. '"' and '\\' in quoted arguments are escaped with a '\\'.
+ * @returns length of the line
+ */
+size_t
+AOF_Format_Command(char* out,
+                   const char* command,
+                   char* const* argv,
+                   const TOKEN* types,
+                   int32_t argc);
+
+// upper bound of the line AOF_Format_Select writes
+#define AOF_SELECT_LENGTH 32
+
+/**
+ * writes "select <db>", out has room for AOF_SELECT_LENGTH bytes.
+ * @returns length of the line
+ */
+size_t
+AOF_Format_Select(char* out, int32_t db);
+
+/**
+ * waits until the line is on disk when the policy is AOF_FSYNC_ALWAYS,
+ * returns immediately otherwise.
+ * @returns false when the line was not appended or the log failed before it
+ * was synced
+ */
+bool
+AOF_Commit(AOF* aof, uint64_t seq);
+
+/**
+ * @returns false from a failed write or sync until the log was rewritten
+ */
+bool
+AOF_Healthy(AOF* aof);
+
+/**
+ * writes and syncs everything appended so far regardless of the policy.
+ */
+void
+AOF_Flush(AOF* aof);
+
+void
+AOF_Lock_Key(AOF* aof, const char* key);
+
+void
+AOF_Unlock_Key(AOF* aof, const char* key);
+
+/**
+ * starts compacting the log in the background, every database that exists
+ * is dumped.
+ * @returns 0 when the rewrite was started, -1 when one is already running
+ */
+int32_t
+AOF_Rewrite_Start(AOF* aof, DatabaseManager* dbs);
+
+/**
+ * returns once no rewrite is running.
+ * @returns 0 when the last rewrite replaced the log, -1 when it failed or was
+ * given up because a value has no command form (floats that are not finite,
+ * lists or objects nested in an object)
+ */
+int32_t
+AOF_Rewrite_Wait(AOF* aof);
+
+/**
+ * the log misses writes the dataset has, it is treated like a failed write:
+ * writes are refused until a rewrite succeeds.
+ */
+void
+AOF_Mark_Failed(AOF* aof);
+
+/**
+ * executes every complete line of the file, starting in the first database.
+ * a torn line at the end (crash during write) is ignored.
+ * @returns 0 on success, -1 when the file can not be read
+ */
+int32_t
+AOF_Replay(struct RuntimeContext* ctx, const char* filename);
+
+void
+Destroy_AOF(AOF* aof);
+
+#endif // __TINY_DB_AOF
@@ -14,6 +14,7 @@ DB_Atomic_Store(Database* db,
   new_entry->key = strdup(key);
   new_entry->value = value;
   new_entry->type = type;
+  new_entry->borrowed = false;
   int8_t state = HM_Put(shard->entries, new_entry->key, new_entry);
 
   if (state == HM_ACTION_FAILED) {
@@ -39,30 +40,41 @@ DB_Atomic_Get(Database* db, const char* key)
 
 int64_t
 DB_Atomic_Incr(Database* db, const char* key)
+{
+  int64_t result;
+  if (!DB_Atomic_Incr_By(db, key, 1, &result)) {
+    return -1;
+  }
+  return result;
+}
+
+bool
+DB_Atomic_Incr_By(Database* db, const char* key, int64_t by, int64_t* result)
 {
   int32_t shard_id = Pick_Shard(key);
   DatabaseShard* shard = &db->shards[shard_id];
 
-  pthread_rwlock_wrlock(&shard->rwlock);
+  Shard_Write_Lock(shard);
   DatabaseEntry* entry = HM_Get(shard->entries, key);
 
   if (entry == NULL) {
-    DB_Value value = { .number = { .value = 1 } };
+    DB_Value value = { .number = { .value = by } };
     DB_Atomic_Store(db, key, value, DB_ENTRY_NUMBER);
 
-    pthread_rwlock_unlock(&shard->rwlock);
-    return 1;
+    Shard_Unlock(shard);
+    *result = by;
+    return true;
   }
 
   if (entry->type != DB_ENTRY_NUMBER) {
-    pthread_rwlock_unlock(&shard->rwlock);
+    Shard_Unlock(shard);
     DB_Log(DB_LOG_WARNING, "INCR Attempt to increment a non-integer value");
-    return -1;
+    return false;
   }
 
-  int64_t new_value = atomic_fetch_add(&(entry->value.number.value), 1) + 1;
+  *result = atomic_fetch_add(&(entry->value.number.value), by) + by;
 
-  pthread_rwlock_unlock(&shard->rwlock);
+  Shard_Unlock(shard);
 
-  return new_value;
+  return true;
 }
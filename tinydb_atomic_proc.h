@@ -1,6 +1,8 @@
 #ifndef __TINY_DB_ATOMIC_PROC
 #define __TINY_DB_ATOMIC_PROC
 
+#include <stdbool.h>
+
 #include "tinydb_database.h"
 
 void
@@ -15,4 +17,11 @@ DB_Atomic_Get(Database* db, const char* key);
 int64_t
 DB_Atomic_Incr(Database* db, const char* key);
 
+/**
+ * adds by to the number at key, a missing key starts at 0.
+ * @returns false when the value is not a number, it is left as it is
+ */
+bool
+DB_Atomic_Incr_By(Database* db, const char* key, int64_t by, int64_t* result);
+
 #endif // __TINY_DB_ATOMIC_PROC
\ No newline at end of file
@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tinydb_bgsave.h"
+#include "tinydb_clock.h"
+#include "tinydb_context.h"
+#include "tinydb_log.h"
+#include "tinydb_shard_executor.h"
+#include "tinydb_snapshot.h"
+
+// runs in the child, only this thread exists there
+static void
+save_child(SaveSystem* system, const char* filename)
+{
+  _exit(Export_Snapshot(system->ctx, filename) == 0 ? 0 : 1);
+}
+
+// no write is in flight while we hold fork_lock and the shard executors are
+// parked between two commands, the resize locks make sure no reader is in the
+// middle of migrating hashmap entries either. init_lock keeps databases from
+// being created in the meantime
+static pid_t
+fork_snapshot(SaveSystem* system,
+              const char* filename,
+              uint64_t* dirty,
+              uint64_t* repl_offset)
+{
+  RuntimeContext* ctx = system->ctx;
+
+  pthread_rwlock_wrlock(&system->fork_lock);
+  Shard_Executors_Pause();
+  pthread_mutex_lock(&ctx->db_manager.init_lock);
+  for (int32_t i = 0; i < ctx->db_manager.num_databases; i++) {
+    if (!atomic_load(&ctx->db_manager.databases[i].ready)) {
+      continue;
+    }
+    for (int32_t j = 0; j < NUM_SHARDS; j++) {
+      HashMap* map = ctx->db_manager.databases[i].shards[j].entries;
+      pthread_mutex_lock(&map->resize_lock);
+    }
+  }
+
+  if (dirty) {
+    *dirty = atomic_load(&system->dirty);
+  }
+  if (repl_offset && ctx->replication) {
+    *repl_offset = Replication_Sync_Offset(ctx->replication);
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    save_child(system, filename);
+  }
+
+  for (int32_t i = 0; i < ctx->db_manager.num_databases; i++) {
+    if (!atomic_load(&ctx->db_manager.databases[i].ready)) {
+      continue;
+    }
+    for (int32_t j = 0; j < NUM_SHARDS; j++) {
+      HashMap* map = ctx->db_manager.databases[i].shards[j].entries;
+      pthread_mutex_unlock(&map->resize_lock);
+    }
+  }
+  pthread_mutex_unlock(&ctx->db_manager.init_lock);
+  Shard_Executors_Resume();
+  pthread_rwlock_unlock(&system->fork_lock);
+
+  if (pid < 0) {
+    DB_Log(DB_LOG_ERROR, "Snapshot fork failed: %s", strerror(errno));
+  }
+  return pid;
+}
+
+// caller holds system->lock
+static int32_t
+save_start_locked(SaveSystem* system)
+{
+  if (system->child_pid > 0) {
+    return -1;
+  }
+
+  system->last_try_ms = Now_Ms();
+  pid_t pid =
+    fork_snapshot(system, system->filename, &system->dirty_at_fork, NULL);
+  if (pid < 0) {
+    system->last_save_failed = true;
+    return -1;
+  }
+
+  DB_Log(DB_LOG_INFO, "BGSAVE started by pid %d", (int32_t)pid);
+  system->child_pid = pid;
+  return 0;
+}
+
+// caller holds system->lock
+static void
+reap_child_locked(SaveSystem* system, bool wait)
+{
+  int32_t status = 0;
+  pid_t pid = waitpid(system->child_pid, &status, wait ? 0 : WNOHANG);
+  if (pid == 0 || (pid < 0 && errno == EINTR)) {
+    return;
+  }
+
+  if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    atomic_fetch_sub(&system->dirty, system->dirty_at_fork);
+    system->last_save_ms = Now_Ms();
+    system->last_save_failed = false;
+    DB_Log(DB_LOG_INFO, "BGSAVE saved %s", system->filename);
+  } else {
+    system->last_save_failed = true;
+    DB_Log(DB_LOG_ERROR, "BGSAVE failed to save %s", system->filename);
+  }
+  system->child_pid = 0;
+}
+
+static void*
+Save_Cron_Function(void* arg)
+{
+  SaveSystem* system = (SaveSystem*)arg;
+
+  pthread_mutex_lock(&system->lock);
+  while (!system->stop) {
+    if (system->child_pid > 0) {
+      reap_child_locked(system, false);
+    }
+
+    int64_t now = Now_Ms();
+    uint64_t dirty = atomic_load(&system->dirty);
+    bool retry_ok =
+      !system->last_save_failed || now - system->last_try_ms >= SAVE_RETRY_MS;
+
+    for (int32_t i = 0; i < system->num_rules; i++) {
+      if (system->child_pid > 0 || !retry_ok) {
+        break;
+      }
+
+      SaveRule* rule = &system->rules[i];
+      if (dirty >= rule->changes &&
+          now - system->last_save_ms >= rule->seconds * 1000) {
+        DB_Log(DB_LOG_INFO,
+               "%" PRIu64 " changes in %" PRId64 " seconds, saving",
+               rule->changes,
+               rule->seconds);
+        save_start_locked(system);
+        break;
+      }
+    }
+
+    int64_t deadline = now + SAVE_CRON_INTERVAL_MS;
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000;
+    ts.tv_nsec = (deadline % 1000) * 1000000;
+    pthread_cond_timedwait(&system->wakeup, &system->lock, &ts);
+  }
+  pthread_mutex_unlock(&system->lock);
+
+  return NULL;
+}
+
+SaveSystem*
+Create_Save_System(RuntimeContext* ctx,
+                   const char* filename,
+                   const SaveRule* rules,
+                   int32_t num_rules)
+{
+  SaveSystem* system = (SaveSystem*)calloc(1, sizeof(SaveSystem));
+  if (!system) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for SaveSystem");
+    return NULL;
+  }
+
+  system->ctx = ctx;
+  system->filename = strdup(filename);
+  system->rules = (SaveRule*)malloc(sizeof(SaveRule) * num_rules);
+  if (!system->filename || (num_rules > 0 && !system->rules)) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for SaveSystem");
+    free(system->filename);
+    free(system->rules);
+    free(system);
+    return NULL;
+  }
+  memcpy(system->rules, rules, sizeof(SaveRule) * num_rules);
+  system->num_rules = num_rules;
+
+  atomic_init(&system->dirty, 0);
+  system->last_save_ms = Now_Ms();
+
+  // writer preferring, a steady stream of writes must not starve the fork
+  pthread_rwlockattr_t rwlock_attr;
+  pthread_rwlockattr_init(&rwlock_attr);
+  pthread_rwlockattr_setkind_np(&rwlock_attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&system->fork_lock, &rwlock_attr);
+  pthread_rwlockattr_destroy(&rwlock_attr);
+
+  pthread_mutex_init(&system->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&system->wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_create(
+    &system->cron_thread, NULL, Save_Cron_Function, (void*)system);
+  return system;
+}
+
+void
+Save_Begin_Write(SaveSystem* system)
+{
+  pthread_rwlock_rdlock(&system->fork_lock);
+}
+
+void
+Save_End_Write(SaveSystem* system, bool changed)
+{
+  if (changed) {
+    Save_Count_Write(system);
+  }
+  pthread_rwlock_unlock(&system->fork_lock);
+}
+
+void
+Save_Count_Write(SaveSystem* system)
+{
+  atomic_fetch_add(&system->dirty, 1);
+}
+
+int32_t
+Save_Background(SaveSystem* system)
+{
+  pthread_mutex_lock(&system->lock);
+  int32_t res = save_start_locked(system);
+  pthread_mutex_unlock(&system->lock);
+  return res;
+}
+
+pid_t
+Save_Fork(SaveSystem* system, const char* filename, uint64_t* repl_offset)
+{
+  pid_t pid = fork_snapshot(system, filename, NULL, repl_offset);
+  if (pid > 0) {
+    DB_Log(DB_LOG_INFO, "Writing %s from pid %d", filename, (int32_t)pid);
+  }
+  return pid;
+}
+
+void
+Destroy_Save_System(SaveSystem* system)
+{
+  pthread_mutex_lock(&system->lock);
+  system->stop = true;
+  pthread_cond_signal(&system->wakeup);
+  pthread_mutex_unlock(&system->lock);
+  pthread_join(system->cron_thread, NULL);
+
+  if (system->child_pid > 0) {
+    reap_child_locked(system, true);
+  }
+
+  pthread_cond_destroy(&system->wakeup);
+  pthread_mutex_destroy(&system->lock);
+  pthread_rwlock_destroy(&system->fork_lock);
+  free(system->rules);
+  free(system->filename);
+  free(system);
+}
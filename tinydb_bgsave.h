@@ -0,0 +1,102 @@
+/**
+ * note (David)
+ * /BACKGROUND SAVE/
+ * BGSAVE forks and lets the child write the snapshot, the child sees the
+ * memory as it was at the fork (copy on write) so it needs no locks and the
+ * parent keeps serving. writes take fork_lock shared, the fork takes it
+ * exclusively for the few milliseconds fork() needs, so no write is half done
+ * in the child's copy. the shard executors are paused for that time instead.
+ *
+ * a cron thread reaps the child and starts a save whenever one of the save
+ * rules (at least <changes> writes within <seconds>) matches.
+ */
+#ifndef __TINY_DB_BGSAVE
+#define __TINY_DB_BGSAVE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// how often the cron thread checks the rules and the child
+#define SAVE_CRON_INTERVAL_MS 100
+
+// wait before retrying after a failed save
+#define SAVE_RETRY_MS 5000
+
+struct RuntimeContext;
+
+typedef struct SaveRule
+{
+  int64_t seconds;
+  uint64_t changes;
+} SaveRule;
+
+typedef struct SaveSystem
+{
+  struct RuntimeContext* ctx;
+  char* filename;
+  SaveRule* rules;
+  int32_t num_rules;
+
+  atomic_uint_fast64_t dirty; // writes since the last successful save
+  uint64_t dirty_at_fork;
+  int64_t last_save_ms;
+  int64_t last_try_ms;
+  bool last_save_failed;
+  pid_t child_pid;
+
+  pthread_rwlock_t fork_lock;
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  pthread_t cron_thread;
+  bool stop;
+} SaveSystem;
+
+SaveSystem*
+Create_Save_System(struct RuntimeContext* ctx,
+                   const char* filename,
+                   const SaveRule* rules,
+                   int32_t num_rules);
+
+/**
+ * brackets every command that modifies data, changed counts it towards the
+ * save rules.
+ */
+void
+Save_Begin_Write(SaveSystem* system);
+
+void
+Save_End_Write(SaveSystem* system, bool changed);
+
+/**
+ * counts a write that was not bracketed, the shard executors are paused for
+ * a fork instead.
+ */
+void
+Save_Count_Write(SaveSystem* system);
+
+/**
+ * @returns 0 when the child was started, -1 when a save is already running or
+ * fork failed
+ */
+int32_t
+Save_Background(SaveSystem* system);
+
+/**
+ * forks a child that writes the snapshot to filename, independent of the
+ * save rules and of a running BGSAVE. repl_offset receives the replication
+ * offset the snapshot corresponds to.
+ * @returns pid of the child the caller has to wait for, -1 when fork failed
+ */
+pid_t
+Save_Fork(SaveSystem* system, const char* filename, uint64_t* repl_offset);
+
+/**
+ * waits for a running child before releasing the system.
+ */
+void
+Destroy_Save_System(SaveSystem* system);
+
+#endif // __TINY_DB_BGSAVE
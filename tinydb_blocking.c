@@ -0,0 +1,492 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tinydb_atomic_proc.h"
+#include "tinydb_blocking.h"
+#include "tinydb_clock.h"
+#include "tinydb_context.h"
+#include "tinydb_hash.h"
+#include "tinydb_list.h"
+#include "tinydb_log.h"
+#include "tinydb_output.h"
+
+#define BLOCKING_REPLY_NULL "null\n"
+
+extern RuntimeContext* context;
+
+// queued, a slow waiter never stalls the pushing thread
+static void
+send_reply(Connection* conn, const char* data, size_t len)
+{
+  Output_Write(conn, data, len);
+  Output_Flush(conn);
+}
+
+static void
+send_node(Connection* conn, ListNode* node)
+{
+  char buffer[64];
+  switch (node->type) {
+    case TYPE_STRING: {
+      size_t len = strlen(node->value.string_value);
+      char* reply = (char*)malloc(len + 1);
+      if (!reply) {
+        return;
+      }
+      memcpy(reply, node->value.string_value, len);
+      reply[len] = '\n';
+      send_reply(conn, reply, len + 1);
+      free(reply);
+    } break;
+    case TYPE_INT: {
+      int32_t len =
+        snprintf(buffer, sizeof(buffer), "%" PRId64 "\n", node->value.int_value);
+      send_reply(conn, buffer, len);
+    } break;
+    case TYPE_FLOAT: {
+      int32_t len =
+        HPList_Format_Float(buffer, sizeof(buffer) - 1, node->value.float_value);
+      buffer[len++] = '\n';
+      send_reply(conn, buffer, len);
+    } break;
+  }
+}
+
+static BlockedKey*
+find_key(BlockingSystem* system, Database* db, const char* key, uint64_t hash)
+{
+  BlockedKey* current = system->buckets[hash & (system->num_buckets - 1)];
+  while (current != NULL) {
+    if (current->hash == hash && current->db == db &&
+        strcmp(current->name, key) == 0) {
+      return current;
+    }
+    current = current->next;
+  }
+  return NULL;
+}
+
+// doubles the table, a failed allocation keeps the chains longer
+static void
+grow_buckets(BlockingSystem* system)
+{
+  size_t num_buckets = system->num_buckets * 2;
+  BlockedKey** buckets = calloc(num_buckets, sizeof(BlockedKey*));
+  if (!buckets) {
+    return;
+  }
+
+  for (size_t i = 0; i < system->num_buckets; i++) {
+    BlockedKey* key = system->buckets[i];
+    while (key != NULL) {
+      BlockedKey* next = key->next;
+      BlockedKey** bucket = &buckets[key->hash & (num_buckets - 1)];
+      key->next = *bucket;
+      *bucket = key;
+      key = next;
+    }
+  }
+  free(system->buckets);
+  system->buckets = buckets;
+  system->num_buckets = num_buckets;
+}
+
+static BlockedKey*
+add_key(BlockingSystem* system, Database* db, const char* key, uint64_t hash)
+{
+  BlockedKey* blocked_key = (BlockedKey*)malloc(sizeof(BlockedKey));
+  if (!blocked_key) {
+    return NULL;
+  }
+  blocked_key->name = strdup(key);
+  if (!blocked_key->name) {
+    free(blocked_key);
+    return NULL;
+  }
+  blocked_key->db = db;
+  blocked_key->hash = hash;
+  blocked_key->head = blocked_key->tail = NULL;
+
+  if (system->num_keys >= system->num_buckets) {
+    grow_buckets(system);
+  }
+  BlockedKey** bucket = &system->buckets[hash & (system->num_buckets - 1)];
+  blocked_key->next = *bucket;
+  *bucket = blocked_key;
+  system->num_keys++;
+  return blocked_key;
+}
+
+static void
+remove_key(BlockingSystem* system, BlockedKey* key)
+{
+  BlockedKey** current = &system->buckets[key->hash & (system->num_buckets - 1)];
+  while (*current != NULL) {
+    if (*current == key) {
+      *current = key->next;
+      system->num_keys--;
+      free(key->name);
+      free(key);
+      return;
+    }
+    current = &(*current)->next;
+  }
+}
+
+static void
+heap_swap(BlockingSystem* system, size_t a, size_t b)
+{
+  BlockedClient* tmp = system->deadlines[a];
+  system->deadlines[a] = system->deadlines[b];
+  system->deadlines[b] = tmp;
+  system->deadlines[a]->heap_index = a;
+  system->deadlines[b]->heap_index = b;
+}
+
+static void
+heap_sift_up(BlockingSystem* system, size_t i)
+{
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (system->deadlines[parent]->deadline_ms <=
+        system->deadlines[i]->deadline_ms) {
+      return;
+    }
+    heap_swap(system, i, parent);
+    i = parent;
+  }
+}
+
+static void
+heap_sift_down(BlockingSystem* system, size_t i)
+{
+  for (;;) {
+    size_t smallest = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+    if (left < system->num_deadlines &&
+        system->deadlines[left]->deadline_ms <
+          system->deadlines[smallest]->deadline_ms) {
+      smallest = left;
+    }
+    if (right < system->num_deadlines &&
+        system->deadlines[right]->deadline_ms <
+          system->deadlines[smallest]->deadline_ms) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    heap_swap(system, i, smallest);
+    i = smallest;
+  }
+}
+
+static bool
+heap_reserve(BlockingSystem* system)
+{
+  if (system->num_deadlines < system->deadlines_capacity) {
+    return true;
+  }
+  size_t capacity =
+    system->deadlines_capacity ? system->deadlines_capacity * 2 : 64;
+  BlockedClient** deadlines =
+    realloc(system->deadlines, capacity * sizeof(BlockedClient*));
+  if (!deadlines) {
+    return false;
+  }
+  system->deadlines = deadlines;
+  system->deadlines_capacity = capacity;
+  return true;
+}
+
+static void
+heap_push(BlockingSystem* system, BlockedClient* client)
+{
+  client->heap_index = system->num_deadlines++;
+  system->deadlines[client->heap_index] = client;
+  heap_sift_up(system, client->heap_index);
+}
+
+static void
+heap_remove(BlockingSystem* system, BlockedClient* client)
+{
+  size_t i = client->heap_index;
+  size_t last = --system->num_deadlines;
+  if (i != last) {
+    heap_swap(system, i, last);
+    heap_sift_down(system, i);
+    heap_sift_up(system, i);
+  }
+}
+
+// takes client off its key and the heap and frees it, the key goes with its
+// last waiter. caller holds system->lock
+static void
+unlink_client(BlockingSystem* system, BlockedClient* client)
+{
+  BlockedKey* key = client->key;
+  if (client->prev) {
+    client->prev->next = client->next;
+  } else {
+    key->head = client->next;
+  }
+  if (client->next) {
+    client->next->prev = client->prev;
+  } else {
+    key->tail = client->prev;
+  }
+  if (client->deadline_ms != 0) {
+    heap_remove(system, client);
+  }
+
+  client->conn->waiting = NULL;
+  free(client);
+  atomic_fetch_sub(&system->num_blocked, 1);
+
+  if (!key->head) {
+    remove_key(system, key);
+  }
+}
+
+// caller holds system->lock
+static void
+serve_key(BlockingSystem* system, BlockedKey* key)
+{
+  DatabaseEntry res = DB_Atomic_Get(key->db, key->name);
+  if (res.type != DB_ENTRY_LIST) {
+    return;
+  }
+
+  for (;;) {
+    BlockedClient* client = key->head;
+    ListNode node;
+
+    int32_t popped = client->side == BLOCK_POP_LEFT
+                       ? HPList_LPop(res.value.list, &node)
+                       : HPList_RPop(res.value.list, &node);
+    if (!popped) {
+      return;
+    }
+
+    // the pusher holds the key lock, the pop lands right after its push.
+    // not waiting for the sync here, the push that fed us already did.
+    const char* pop = client->side == BLOCK_POP_LEFT ? "lpop" : "rpop";
+    int32_t db = (int32_t)key->db->ID;
+    if (context && context->replication) {
+      Replication_Feed(context->replication, db, pop, &key->name, NULL, 1);
+    }
+    if (context && context->aof) {
+      AOF_Feed(context->aof, db, pop, &key->name, NULL, 1);
+    }
+
+    Connection* conn = client->conn;
+    bool last = client->next == NULL;
+    unlink_client(system, client);
+
+    send_node(conn, &node);
+    HPList_Release_Node(&node);
+    Connection_Unblock(conn);
+    if (last) {
+      return;
+    }
+  }
+}
+
+static void*
+Blocking_Timer_Function(void* arg)
+{
+  BlockingSystem* system = (BlockingSystem*)arg;
+
+  pthread_mutex_lock(&system->lock);
+  while (!system->stop) {
+    int64_t now = Now_Ms();
+    while (system->num_deadlines > 0 &&
+           system->deadlines[0]->deadline_ms <= now) {
+      Connection* conn = system->deadlines[0]->conn;
+      unlink_client(system, system->deadlines[0]);
+      send_reply(conn, BLOCKING_REPLY_NULL, strlen(BLOCKING_REPLY_NULL));
+      Connection_Unblock(conn);
+    }
+
+    if (system->num_deadlines == 0) {
+      pthread_cond_wait(&system->wakeup, &system->lock);
+    } else {
+      int64_t next_deadline = system->deadlines[0]->deadline_ms;
+      struct timespec ts;
+      ts.tv_sec = next_deadline / 1000;
+      ts.tv_nsec = (next_deadline % 1000) * 1000000;
+      pthread_cond_timedwait(&system->wakeup, &system->lock, &ts);
+    }
+  }
+  pthread_mutex_unlock(&system->lock);
+
+  return NULL;
+}
+
+BlockingSystem*
+Create_Blocking_System()
+{
+  BlockingSystem* system = (BlockingSystem*)calloc(1, sizeof(BlockingSystem));
+  if (!system) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for BlockingSystem");
+    return NULL;
+  }
+
+  system->num_buckets = BLOCKING_INITIAL_BUCKETS;
+  system->buckets = calloc(system->num_buckets, sizeof(BlockedKey*));
+  if (!system->buckets) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for BlockingSystem");
+    free(system);
+    return NULL;
+  }
+
+  system->stop = false;
+  atomic_init(&system->num_blocked, 0);
+  pthread_mutex_init(&system->lock, NULL);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&system->wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_create(
+    &system->timer_thread, NULL, Blocking_Timer_Function, (void*)system);
+  return system;
+}
+
+void
+Blocking_Wait(BlockingSystem* system,
+              Database* db,
+              const char* key,
+              Connection* conn,
+              BLOCK_POP_SIDE side,
+              int64_t timeout_ms)
+{
+  BlockedClient* client = (BlockedClient*)malloc(sizeof(BlockedClient));
+  if (!client) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for BlockedClient");
+    return;
+  }
+
+  client->conn = conn;
+  client->side = side;
+  client->deadline_ms = timeout_ms > 0 ? Now_Ms() + timeout_ms : 0;
+  client->next = NULL;
+  uint64_t hash = DJB2_Hash_String(key);
+
+  // before it can be served, that unblocks it
+  Connection_Block(conn);
+  pthread_mutex_lock(&system->lock);
+  BlockedKey* blocked_key = find_key(system, db, key, hash);
+  if (!blocked_key) {
+    blocked_key = add_key(system, db, key, hash);
+  }
+  if (!blocked_key || (client->deadline_ms != 0 && !heap_reserve(system))) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for BlockedClient");
+    if (blocked_key && !blocked_key->head) {
+      remove_key(system, blocked_key);
+    }
+    pthread_mutex_unlock(&system->lock);
+    free(client);
+    send_reply(conn, BLOCKING_REPLY_NULL, strlen(BLOCKING_REPLY_NULL));
+    Connection_Unblock(conn);
+    return;
+  }
+
+  client->key = blocked_key;
+  client->prev = blocked_key->tail;
+  if (blocked_key->tail) {
+    blocked_key->tail->next = client;
+  } else {
+    blocked_key->head = client;
+  }
+  blocked_key->tail = client;
+  conn->waiting = client;
+  atomic_fetch_add(&system->num_blocked, 1);
+
+  // the timer only needs waking when this is its new earliest deadline
+  bool earliest = false;
+  if (client->deadline_ms != 0) {
+    heap_push(system, client);
+    earliest = client->heap_index == 0;
+  }
+
+  // an element could have been pushed between the caller's pop attempt and
+  // the registration above
+  serve_key(system, blocked_key);
+
+  if (earliest) {
+    pthread_cond_signal(&system->wakeup);
+  }
+  pthread_mutex_unlock(&system->lock);
+}
+
+void
+Blocking_Signal_Key(BlockingSystem* system, Database* db, const char* key)
+{
+  // fast path, pushes do not touch the lock when nobody is waiting
+  if (atomic_load(&system->num_blocked) == 0) {
+    return;
+  }
+
+  uint64_t hash = DJB2_Hash_String(key);
+  pthread_mutex_lock(&system->lock);
+  BlockedKey* blocked_key = find_key(system, db, key, hash);
+  if (blocked_key) {
+    serve_key(system, blocked_key);
+  }
+  pthread_mutex_unlock(&system->lock);
+}
+
+void
+Blocking_Remove_Client(BlockingSystem* system, Connection* conn)
+{
+  if (atomic_load(&system->num_blocked) == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&system->lock);
+  if (conn->waiting) {
+    unlink_client(system, conn->waiting);
+    Connection_Unblock(conn);
+  }
+  pthread_mutex_unlock(&system->lock);
+}
+
+void
+Destroy_Blocking_System(BlockingSystem* system)
+{
+  pthread_mutex_lock(&system->lock);
+  system->stop = true;
+  pthread_cond_signal(&system->wakeup);
+  pthread_mutex_unlock(&system->lock);
+  pthread_join(system->timer_thread, NULL);
+
+  for (size_t i = 0; i < system->num_buckets; i++) {
+    BlockedKey* key = system->buckets[i];
+    while (key != NULL) {
+      BlockedClient* client = key->head;
+      while (client != NULL) {
+        BlockedClient* next_client = client->next;
+        free(client);
+        client = next_client;
+      }
+      BlockedKey* next_key = key->next;
+      free(key->name);
+      free(key);
+      key = next_key;
+    }
+  }
+
+  free(system->buckets);
+  free(system->deadlines);
+  pthread_cond_destroy(&system->wakeup);
+  pthread_mutex_destroy(&system->lock);
+  free(system);
+}
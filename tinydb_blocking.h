@@ -0,0 +1,111 @@
+/**
+ * note (David)
+ * /BLOCKING POPS/
+ * BLPOP/BRPOP do not execute anything while they wait. the client is only
+ * registered on the key and the command returns, pushes to the key hand the
+ * popped element straight to the oldest waiter and a single timer thread
+ * replies null to waiters whose timeout expired. until then the connection
+ * is blocked, the commands it pipelined after the pop wait so their replies
+ * can not overtake the one of the pop.
+ *
+ * waiters are found by their key through a hash table and expire through a
+ * heap ordered by deadline, so neither pushes nor the timer walk all of them.
+ *
+ * with --io-uring a waiting connection holds no worker at all. with a worker
+ * per connection its worker stays with it while it waits, as it does while
+ * the connection is idle, so only --io-uring serves more blocked clients
+ * than there are workers.
+ */
+#ifndef __TINY_DB_BLOCKING
+#define __TINY_DB_BLOCKING
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tinydb_connection.h"
+#include "tinydb_database.h"
+
+typedef enum BLOCK_POP_SIDE
+{
+  BLOCK_POP_LEFT,
+  BLOCK_POP_RIGHT
+} BLOCK_POP_SIDE;
+
+// buckets of the key table to start with, a power of 2
+#define BLOCKING_INITIAL_BUCKETS 64
+
+typedef struct BlockedClient
+{
+  Connection* conn;
+  BLOCK_POP_SIDE side;
+  int64_t deadline_ms; // monotonic, 0 blocks forever
+  size_t heap_index;   // position in the deadline heap when it has one
+  struct BlockedKey* key;
+  struct BlockedClient* prev;
+  struct BlockedClient* next;
+} BlockedClient;
+
+typedef struct BlockedKey
+{
+  char* name;
+  Database* db;
+  uint64_t hash;
+  BlockedClient* head;
+  BlockedClient* tail;
+  struct BlockedKey* next; // in the same bucket
+} BlockedKey;
+
+typedef struct BlockingSystem
+{
+  // keys with waiters, the table doubles once there are more keys than
+  // buckets
+  BlockedKey** buckets;
+  size_t num_buckets;
+  size_t num_keys;
+
+  // waiters with a timeout, min heap on deadline_ms
+  BlockedClient** deadlines;
+  size_t num_deadlines;
+  size_t deadlines_capacity;
+
+  atomic_size_t num_blocked;
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  pthread_t timer_thread;
+  bool stop;
+} BlockingSystem;
+
+BlockingSystem*
+Create_Blocking_System();
+
+/**
+ * registers conn as a waiter on key, the reply is sent once an element is
+ * pushed or when timeout_ms (0 = forever) expires. conn is blocked until
+ * then, its handler does not execute the commands that follow.
+ */
+void
+Blocking_Wait(BlockingSystem* system,
+              Database* db,
+              const char* key,
+              Connection* conn,
+              BLOCK_POP_SIDE side,
+              int64_t timeout_ms);
+
+/**
+ * serves waiters of key from its list, called after every push.
+ */
+void
+Blocking_Signal_Key(BlockingSystem* system, Database* db, const char* key);
+
+/**
+ * drops the waits of conn without a reply and unblocks it.
+ */
+void
+Blocking_Remove_Client(BlockingSystem* system, Connection* conn);
+
+void
+Destroy_Blocking_System(BlockingSystem* system);
+
+#endif // __TINY_DB_BLOCKING
@@ -0,0 +1,16 @@
+#ifndef __TINY_DB_CLOCK
+#define __TINY_DB_CLOCK
+
+#include <stdint.h>
+#include <time.h>
+
+// milliseconds on the monotonic clock, only meaningful as a difference
+static inline int64_t
+Now_Ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#endif // __TINY_DB_CLOCK
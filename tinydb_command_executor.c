@@ -1,14 +1,20 @@
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "tinydb_atomic_proc.h"
+#include "tinydb_blocking.h"
 #include "tinydb_command_executor.h"
 #include "tinydb_database.h"
 #include "tinydb_list.h"
 #include "tinydb_log.h"
+#include "tinydb_object.h"
+#include "tinydb_output.h"
+#include "tinydb_shard_executor.h"
 #include "tinydb_snapshot.h"
 
 #define RESPONSE_OK "Ok\n"
@@ -17,18 +23,41 @@
 #define RESPONSE_USAGE_SET "Usage: set <key> <value>\n"
 #define RESPONSE_USAGE_GET "Usage: get <key>\n"
 #define RESPONSE_USAGE_INCR "Usage: incr <key>\n"
+#define RESPONSE_USAGE_INCRBY "Usage: incrby <key> <increment>\n"
 #define RESPONSE_USAGE_APPEND "Usage: append <key> <value>\n"
 #define RESPONSE_USAGE_STRLEN "Usage: strlen <key>\n"
 #define RESPONSE_USAGE_EXPORT "Usage: export snapshot.bin\n"
-#define RESPONSE_USAGE_RPUSH "Usage: rpush <key> <value>\n"
-#define RESPONSE_USAGE_LPUSH "Usage: lpush <key> <value>\n"
+#define RESPONSE_USAGE_RPUSH "Usage: rpush <key> <value> [value ...]\n"
+#define RESPONSE_USAGE_LPUSH "Usage: lpush <key> <value> [value ...]\n"
 #define RESPONSE_USAGE_RPOP "Usage: rpop <key>\n"
 #define RESPONSE_USAGE_LPOP "Usage: lpop <key>\n"
+#define RESPONSE_USAGE_BLPOP "Usage: blpop <key> <timeout>\n"
+#define RESPONSE_USAGE_BRPOP "Usage: brpop <key> <timeout>\n"
+#define RESPONSE_INVALID_TIMEOUT "Timeout is not a number or is negative\n"
 #define RESPONSE_USAGE_LLEN "Usage: llen <key>\n"
 #define RESPONSE_USAGE_LRANGE "Usage: lrange <key> <min> <max>\n"
+#define RESPONSE_USAGE_LINDEX "Usage: lindex <key> <index>\n"
+#define RESPONSE_USAGE_HSET "Usage: hset <key> <field> <value> [field value ...]\n"
+#define RESPONSE_USAGE_HGET "Usage: hget <key> <field>\n"
+#define RESPONSE_USAGE_HDEL "Usage: hdel <key> <field> [field ...]\n"
+#define RESPONSE_USAGE_HGETALL "Usage: hgetall <key>\n"
+#define RESPONSE_USAGE_HINCRBY "Usage: hincrby <key> <field> <increment>\n"
+#define RESPONSE_USAGE_REPLICAOF "Usage: replicaof <host> <port> | no one\n"
+#define RESPONSE_USAGE_SELECT "Usage: select <db>\n"
+#define RESPONSE_INVALID_DB "Invalid database\n"
+#define RESPONSE_WRONG_TYPE "Wrong type\n"
+#define RESPONSE_REWRITE_STARTED "Background AOF rewrite started\n"
+#define RESPONSE_BGSAVE_STARTED "Background saving started\n"
+#define RESPONSE_READ_ONLY "Read only replica\n"
+#define RESPONSE_STALE "Replica is out of sync\n"
+#define RESPONSE_AOF_FAILED "Append only file is failing, writes are refused\n"
+#define RESPONSE_NOT_LOGGED "Write was applied but the append only file failed\n"
 #define RESPONSE_UNKNOWN_COMMAND "Unknown command\n"
 #define MSG(key) Get_Message(key)
 
+// size of the stack buffer large replies are built in before they are queued
+#define RESPONSE_CHUNK_SIZE 16384
+
 extern RuntimeContext* context;
 
 typedef struct
@@ -43,6 +72,7 @@ MessageLUT message_lut[] = { { "OK", RESPONSE_OK },
                              { "USAGE_SET", RESPONSE_USAGE_SET },
                              { "USAGE_GET", RESPONSE_USAGE_GET },
                              { "USAGE_INC", RESPONSE_USAGE_INCR },
+                             { "USAGE_INCRBY", RESPONSE_USAGE_INCRBY },
                              { "USAGE_APPEND", RESPONSE_USAGE_APPEND },
                              { "USAGE_STRLEN", RESPONSE_USAGE_STRLEN },
                              { "USAGE_EXPORT", RESPONSE_USAGE_EXPORT },
@@ -50,8 +80,27 @@ MessageLUT message_lut[] = { { "OK", RESPONSE_OK },
                              { "USAGE_LPUSH", RESPONSE_USAGE_LPUSH },
                              { "USAGE_LPOP", RESPONSE_USAGE_LPOP },
                              { "USAGE_RPOP", RESPONSE_USAGE_RPOP },
+                             { "USAGE_BLPOP", RESPONSE_USAGE_BLPOP },
+                             { "USAGE_BRPOP", RESPONSE_USAGE_BRPOP },
+                             { "INVALID_TIMEOUT", RESPONSE_INVALID_TIMEOUT },
                              { "USAGE_LLEN", RESPONSE_USAGE_LLEN },
                              { "USAGE_LRANGE", RESPONSE_USAGE_LRANGE },
+                             { "USAGE_LINDEX", RESPONSE_USAGE_LINDEX },
+                             { "USAGE_HSET", RESPONSE_USAGE_HSET },
+                             { "USAGE_HGET", RESPONSE_USAGE_HGET },
+                             { "USAGE_HDEL", RESPONSE_USAGE_HDEL },
+                             { "USAGE_HGETALL", RESPONSE_USAGE_HGETALL },
+                             { "USAGE_HINCRBY", RESPONSE_USAGE_HINCRBY },
+                             { "USAGE_REPLICAOF", RESPONSE_USAGE_REPLICAOF },
+                             { "USAGE_SELECT", RESPONSE_USAGE_SELECT },
+                             { "INVALID_DB", RESPONSE_INVALID_DB },
+                             { "WRONG_TYPE", RESPONSE_WRONG_TYPE },
+                             { "REWRITE_STARTED", RESPONSE_REWRITE_STARTED },
+                             { "BGSAVE_STARTED", RESPONSE_BGSAVE_STARTED },
+                             { "READ_ONLY", RESPONSE_READ_ONLY },
+                             { "STALE", RESPONSE_STALE },
+                             { "AOF_FAILED", RESPONSE_AOF_FAILED },
+                             { "NOT_LOGGED", RESPONSE_NOT_LOGGED },
                              { "UNKNOWN_COMMAND", RESPONSE_UNKNOWN_COMMAND } };
 
 static inline const char*
@@ -66,35 +115,486 @@ Get_Message(const char* key)
   return RESPONSE_UNKNOWN_COMMAND;
 }
 
+// reply of a write that is held back until the write is logged
+typedef struct
+{
+  Connection* conn;
+  char* data;
+  size_t len;
+  size_t capacity;
+} Held_Reply;
+
+static _Thread_local Held_Reply* held_reply;
+
+static void
+Reply_Write(Connection* conn, const char* data, size_t len)
+{
+  Held_Reply* held = held_reply;
+  if (held == NULL || held->conn != conn) {
+    Output_Write(conn, data, len);
+    return;
+  }
+
+  if (held->len + len > held->capacity) {
+    size_t new_capacity = held->capacity ? held->capacity : 256;
+    while (new_capacity < held->len + len) {
+      new_capacity *= 2;
+    }
+    char* temp = realloc(held->data, new_capacity);
+    if (!temp) {
+      // out of memory, the reply goes out before the write is logged
+      Output_Write(conn, held->data, held->len);
+      Output_Write(conn, data, len);
+      held->len = 0;
+      return;
+    }
+    held->data = temp;
+    held->capacity = new_capacity;
+  }
+  memcpy(held->data + held->len, data, len);
+  held->len += len;
+}
+
+// queued on the connection, the client handler flushes after the command
 static inline void
-TCP_Write(int32_t sock, const char* message, uint8_t new_line)
+TCP_Write(Connection* conn, const char* message, uint8_t new_line)
 {
-  write(sock, message, strlen(message));
+  Reply_Write(conn, message, strlen(message));
   if (new_line) {
-    write(sock, "\n", 1);
+    Reply_Write(conn, "\n", 1);
+  }
+}
+
+typedef struct
+{
+  Connection* conn;
+  size_t len;
+  char data[RESPONSE_CHUNK_SIZE];
+} Response_Stream;
+
+static void
+Response_Flush(Response_Stream* stream)
+{
+  Reply_Write(stream->conn, stream->data, stream->len);
+  stream->len = 0;
+}
+
+static void
+Response_Stream_Write(void* ctx, const char* data, size_t len)
+{
+  Response_Stream* stream = (Response_Stream*)ctx;
+  while (len > 0) {
+    size_t space = RESPONSE_CHUNK_SIZE - stream->len;
+    size_t n = len < space ? len : space;
+    memcpy(stream->data + stream->len, data, n);
+    stream->len += n;
+    data += n;
+    len -= n;
+
+    if (stream->len == RESPONSE_CHUNK_SIZE) {
+      Response_Flush(stream);
+    }
+  }
+}
+
+static void
+Response_Stream_Write_Quoted(Response_Stream* stream, const char* str)
+{
+  Response_Stream_Write(stream, "\"", 1);
+  const char* start = str;
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      Response_Stream_Write(stream, start, str - start);
+      Response_Stream_Write(stream, "\\", 1);
+      start = str;
+    }
+  }
+  Response_Stream_Write(stream, start, str - start);
+  Response_Stream_Write(stream, "\"", 1);
+}
+
+static void
+Response_Stream_Write_Object(Response_Stream* stream, DB_Object* obj)
+{
+  char number[32];
+  int32_t first = 1;
+
+  Response_Stream_Write(stream, "{", 1);
+  pthread_rwlock_rdlock(&obj->rwlock);
+
+  DBObject_Iterator it = DBObject_Iter(obj);
+  DatabaseEntry* entry;
+  while ((entry = DBObject_Iter_Next(&it)) != NULL) {
+    if (!first) {
+      Response_Stream_Write(stream, ", ", 2);
+    }
+    first = 0;
+
+    Response_Stream_Write_Quoted(stream, entry->key);
+    Response_Stream_Write(stream, ": ", 2);
+
+    switch (entry->type) {
+      case DB_ENTRY_STRING:
+        Response_Stream_Write_Quoted(stream, entry->value.string.value);
+        break;
+      case DB_ENTRY_NUMBER: {
+        int32_t len = snprintf(number,
+                               sizeof(number),
+                               "%" PRId64,
+                               atomic_load(&entry->value.number.value));
+        Response_Stream_Write(stream, number, len);
+      } break;
+      case DB_ENTRY_LIST:
+        HPList_RangeWrite(
+          entry->value.list, 0, -1, Response_Stream_Write, stream);
+        break;
+      case DB_ENTRY_OBJECT:
+        Response_Stream_Write_Object(stream, entry->value.object);
+        break;
+    }
+  }
+
+  pthread_rwlock_unlock(&obj->rwlock);
+  Response_Stream_Write(stream, "}", 1);
+}
+
+// number tokens are only stored as numbers when that keeps their text, "007"
+// or values beyond int64 stay strings
+static bool
+Parse_Exact_Int(const char* text, int64_t* value)
+{
+  char* end;
+  errno = 0;
+  *value = strtoll(text, &end, 10);
+  if (errno == ERANGE || *end != '\0') {
+    return false;
+  }
+
+  char digits[24];
+  snprintf(digits, sizeof(digits), "%" PRId64, *value);
+  return strcmp(digits, text) == 0;
+}
+
+// returns the object stored under key, creating it when create is set.
+// sets *wrong_type when the key holds something else.
+static DB_Object*
+Get_Object(Database* db, const char* key, int32_t create, int32_t* wrong_type)
+{
+  *wrong_type = 0;
+
+  DatabaseEntry res = DB_Atomic_Get(db, key);
+  if (res.type == DB_ENTRY_OBJECT) {
+    return res.value.object;
+  }
+
+  // DB_Atomic_Get reports missing keys as an entry without a key, a stored
+  // "null" string is a string like any other
+  if (res.key != NULL) {
+    *wrong_type = 1;
+    return NULL;
+  }
+
+  if (!create) {
+    return NULL;
+  }
+
+  DB_Value obj_val;
+  obj_val.object = CreateDBObject();
+  if (!obj_val.object) {
+    return NULL;
+  }
+  DB_Atomic_Store(db, key, obj_val, DB_ENTRY_OBJECT);
+  return obj_val.object;
+}
+
+// commands that modify their key (argv[0]) and end up in the AOF, blocking
+// pops are logged as plain pops once they actually pop something
+static const char* write_commands[] = { "set",   "append", "incr", "incrby",
+                                        "rpush", "lpush",  "lpop", "rpop",
+                                        "hset",  "hdel",   "hincrby" };
+
+static int32_t
+Is_Write_Command(const char* command)
+{
+  int32_t num_commands = sizeof(write_commands) / sizeof(write_commands[0]);
+  for (int32_t i = 0; i < num_commands; i++) {
+    if (strcmp(command, write_commands[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// the log and the backlog see the writes to a key in the order the key saw
+// them, the AOF key locks take care of that and the backlog has stripes of
+// its own for when there is no AOF
+static void
+Lock_Write_Key(AOF* aof, Replication* repl, const char* key)
+{
+  if (aof) {
+    AOF_Lock_Key(aof, key);
+  } else if (repl) {
+    Replication_Lock_Key(repl, key);
+  }
+}
+
+static void
+Unlock_Write_Key(AOF* aof, Replication* repl, const char* key)
+{
+  if (aof) {
+    AOF_Unlock_Key(aof, key);
+  } else if (repl) {
+    Replication_Unlock_Key(repl, key);
+  }
+}
+
+static const char* read_commands[] = { "get",    "strlen", "llen",   "lrange",
+                                       "lindex", "hget",   "hgetall" };
+
+static int32_t
+Is_Read_Command(const char* command)
+{
+  int32_t num_commands = sizeof(read_commands) / sizeof(read_commands[0]);
+  for (int32_t i = 0; i < num_commands; i++) {
+    if (strcmp(command, read_commands[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// works on replicas as well, the stream selects databases like clients do
+static void
+Select_Command(Connection* conn, ParsedCommand* cmd)
+{
+  if (cmd->argc < 1 || cmd->types[0] != TOKEN_NUMBER) {
+    TCP_Write(conn, MSG("USAGE_SELECT"), 0);
+    return;
+  }
+
+  Database* selected =
+    Select_Database(&context->db_manager, strtoll(cmd->argv[0], NULL, 10));
+  if (!selected) {
+    if (conn->sock < 0) {
+      DB_Log(DB_LOG_ERROR, "Unable to select database %s", cmd->argv[0]);
+    }
+    TCP_Write(conn, MSG("INVALID_DB"), 0);
+    return;
+  }
+  conn->db = selected;
+  TCP_Write(conn, MSG("OK"), 0);
+}
+
+// replaces every key with the ones of a snapshot while clients are served.
+// no single line describes that, so the AOF is rewritten and the replicas
+// resync in full before the client gets its reply
+static void
+Load_Command(Connection* conn, ParsedCommand* cmd)
+{
+  Replication* repl = context->replication;
+  if (conn->sock >= 0 && repl && Replication_Is_Read_Only(repl)) {
+    TCP_Write(conn, MSG("READ_ONLY"), 0);
+    return;
   }
+
+  SaveSystem* save_system = context->save_system;
+  const char* filename = cmd->argc > 0 ? cmd->argv[0]
+                         : save_system  ? save_system->filename
+                                        : DEFAULT_SNAPSHOT_NAME;
+
+  // BGSAVE never forks in the middle of the swap
+  if (save_system) {
+    Save_Begin_Write(save_system);
+  }
+  int32_t res = Import_Snapshot_Live(context, filename);
+  if (save_system) {
+    Save_End_Write(save_system, res == 0);
+  }
+  if (res != 0) {
+    DB_Log(DB_LOG_ERROR, "Loading snapshot %s failed", filename);
+    TCP_Write(conn, MSG("FAILED"), 0);
+    return;
+  }
+
+  if (repl) {
+    Replication_New_History(repl);
+  }
+  AOF* aof = context->aof;
+  if (aof) {
+    if (AOF_Rewrite_Start(aof, &context->db_manager) != 0) {
+      // the running one may have dumped keys from before the load
+      AOF_Rewrite_Wait(aof);
+      AOF_Rewrite_Start(aof, &context->db_manager);
+    }
+    if (AOF_Rewrite_Wait(aof) != 0) {
+      // the log still holds the keys from before the load
+      DB_Log(DB_LOG_ERROR, "Snapshot %s was loaded but not logged", filename);
+      AOF_Mark_Failed(aof);
+      TCP_Write(conn, MSG("NOT_LOGGED"), 0);
+      return;
+    }
+  }
+
+  DB_Log(DB_LOG_INFO, "Snapshot %s was loaded successfully", filename);
+  TCP_Write(conn, MSG("OK"), 0);
+}
+
+static void
+Count_Command(Database* db, ParsedCommand* cmd, int32_t writes)
+{
+  DatabaseShard* shard = &db->shards[Pick_Shard(cmd->argv[0])];
+  atomic_fetch_add_explicit(&shard->num_commands, 1, memory_order_relaxed);
+  if (writes) {
+    atomic_fetch_add_explicit(&shard->num_writes, 1, memory_order_relaxed);
+  }
+}
+
+/**
+ * @returns false when cmd left the database as it was, only writes that
+ * return true are logged and replicated
+ */
+static bool
+Dispatch_Command(Connection* conn, ParsedCommand* cmd);
+
+static int32_t
+Is_Push_Command(const char* command)
+{
+  return strcmp(command, "rpush") == 0 || strcmp(command, "lpush") == 0;
 }
 
 void
-Execute_Command(int sock, ParsedCommand* cmd, Database* db)
+Execute_Command(Connection* conn, ParsedCommand* cmd)
 {
   if (!cmd->command) {
     return;
   }
+  // a command on one key runs on the executor that owns the key's shard
+  if (Shard_Executors_Execute(conn, cmd)) {
+    return;
+  }
+  if (strcmp(cmd->command, "select") == 0) {
+    Select_Command(conn, cmd);
+    return;
+  }
+  if (strcmp(cmd->command, "load") == 0) {
+    Load_Command(conn, cmd);
+    return;
+  }
+
+  Database* db = conn->db;
+
+  int32_t writes = Is_Write_Command(cmd->command);
+  int32_t blocking_pop = strcmp(cmd->command, "blpop") == 0 ||
+                         strcmp(cmd->command, "brpop") == 0;
+
+  // a replica only changes through its link (sock -1), clients can read
+  Replication* repl = context ? context->replication : NULL;
+  if (conn->sock >= 0 && repl && Replication_Is_Read_Only(repl)) {
+    if (writes || blocking_pop) {
+      TCP_Write(conn, MSG("READ_ONLY"), 0);
+      return;
+    }
+#if REPL_MAX_LAG_MS > 0
+    if (Is_Read_Command(cmd->command)) {
+      int64_t lag = Replication_Lag_Ms(repl);
+      if (lag < 0 || lag > REPL_MAX_LAG_MS) {
+        TCP_Write(conn, MSG("STALE"), 0);
+        return;
+      }
+    }
+#endif
+  }
+
+  if (cmd->argc > 0 &&
+      (writes || blocking_pop || Is_Read_Command(cmd->command))) {
+    Count_Command(db, cmd, writes);
+  }
+
+  if (!writes && !blocking_pop) {
+    Dispatch_Command(conn, cmd);
+    return;
+  }
+
+  // clients write again once the log was rewritten, the replication link
+  // keeps applying its stream, the rewrite catches up with it
+  AOF* aof = context ? context->aof : NULL;
+  if (conn->sock >= 0 && aof && !AOF_Healthy(aof)) {
+    TCP_Write(conn, MSG("AOF_FAILED"), 0);
+    return;
+  }
+
+  // BGSAVE never forks in the middle of a write, it pauses the executors
+  // instead of them taking the fork lock
+  SaveSystem* save_system = context ? context->save_system : NULL;
+  bool fork_locked = save_system && Shard_Executors_Current() < 0;
+  if (fork_locked) {
+    Save_Begin_Write(save_system);
+  }
+
+  if ((aof || repl) && writes && cmd->argc > 0) {
+    // only writes that succeeded are logged, and the reply is held until the
+    // command is on disk (AOF_FSYNC_ALWAYS). the key lock keeps the log in the
+    // order the key saw the writes
+    Lock_Write_Key(aof, repl, cmd->argv[0]);
+    Held_Reply reply = { .conn = conn };
+    held_reply = &reply;
+    bool applied = Dispatch_Command(conn, cmd);
+    held_reply = NULL;
+
+    bool logged = true;
+    int32_t id = (int32_t)db->ID;
+    if (applied && repl) {
+      Replication_Feed(
+        repl, id, cmd->command, cmd->argv, cmd->types, cmd->argc);
+    }
+    if (applied && aof) {
+      uint64_t seq =
+        AOF_Feed(aof, id, cmd->command, cmd->argv, cmd->types, cmd->argc);
+      logged = AOF_Commit(aof, seq);
+    }
+
+    if (logged) {
+      Output_Write(conn, reply.data, reply.len);
+    } else {
+      TCP_Write(conn, MSG("NOT_LOGGED"), 0);
+    }
+    free(reply.data);
+
+    // waiting pops are logged after the push that fed them
+    if (applied && Is_Push_Command(cmd->command)) {
+      Blocking_Signal_Key(context->blocking_system, db, cmd->argv[0]);
+    }
+    Unlock_Write_Key(aof, repl, cmd->argv[0]);
+  } else if (Dispatch_Command(conn, cmd) && writes &&
+             Is_Push_Command(cmd->command)) {
+    Blocking_Signal_Key(context->blocking_system, db, cmd->argv[0]);
+  }
+
+  if (fork_locked) {
+    Save_End_Write(save_system, writes);
+  } else if (save_system && writes) {
+    Save_Count_Write(save_system);
+  }
+}
+
+static bool
+Dispatch_Command(Connection* conn, ParsedCommand* cmd)
+{
+  Database* db = conn->db;
 
   if (strcmp(cmd->command, "set") == 0) {
     const char* key = cmd->argv[0];
     const char* value = cmd->argv[1];
 
     if (key == NULL || value == NULL) {
-      TCP_Write(sock, MSG("USAGE_SET"), 0);
-      return;
+      TCP_Write(conn, MSG("USAGE_SET"), 0);
+      return false;
     }
 
     DB_Value val_def = { .string = { strdup(value) } };
     DB_Atomic_Store(db, key, val_def, DB_ENTRY_STRING);
 
-    TCP_Write(sock, MSG("OK"), 0);
+    TCP_Write(conn, MSG("OK"), 0);
   }
 
   else if (strcmp(cmd->command, "get") == 0) {
@@ -103,73 +603,91 @@ Execute_Command(int sock, ParsedCommand* cmd, Database* db)
     const char* value = cmd->argv[1];
 
     if (key == NULL) {
-      TCP_Write(sock, MSG("USAGE_GET"), 0);
-      return;
+      TCP_Write(conn, MSG("USAGE_GET"), 0);
+      return false;
     }
 
     DatabaseEntry res = DB_Atomic_Get(db, key);
     if (res.type == DB_ENTRY_STRING) {
-      TCP_Write(sock, res.value.string.value, 1);
+      TCP_Write(conn, res.value.string.value, 1);
 
     } else if (res.type == DB_ENTRY_NUMBER) {
       char buffer[32];
       sprintf(buffer, "%" PRId64 "\n", res.value.number.value);
-      TCP_Write(sock, buffer, 0);
+      TCP_Write(conn, buffer, 0);
 
     } else if (res.type == DB_ENTRY_LIST) {
       HPLinkedList* list = res.value.list;
       char* buffer = HPList_ToString(list);
-      TCP_Write(sock, buffer, 1);
+      TCP_Write(conn, buffer, 1);
 
       free(buffer); // buffer was allocated on heap by ToString
     } else {
-      TCP_Write(sock, MSG("KEY_NOT_FOUND"), 0);
+      TCP_Write(conn, MSG("KEY_NOT_FOUND"), 0);
     }
   } else if (strcmp(cmd->command, "append") == 0) {
     const char* key = cmd->argv[0];
     const char* value = cmd->argv[1];
 
     if (key == NULL || value == NULL) {
-      TCP_Write(sock, MSG("USAGE_APPEND"), 0);
-      return;
+      TCP_Write(conn, MSG("USAGE_APPEND"), 0);
+      return false;
     }
 
+    // a number becomes the string of its digits
+    char number[32];
+    const char* current = NULL;
     DatabaseEntry res = DB_Atomic_Get(db, key);
     if (res.type == DB_ENTRY_STRING) {
-      if (res.value.string.value) {
-        char* new_value =
-          malloc(strlen(res.value.string.value) + strlen(value) + 1);
-        strcpy(new_value, res.value.string.value);
-        strcat(new_value, value);
-        DB_Value new_val = { .string = { new_value } };
-        DB_Atomic_Store(db, key, new_val, DB_ENTRY_STRING);
+      current = res.value.string.value;
+    } else if (res.type == DB_ENTRY_NUMBER) {
+      snprintf(number, sizeof(number), "%" PRId64, res.value.number.value);
+      current = number;
+    } else {
+      TCP_Write(conn, MSG("WRONG_TYPE"), 0);
+      return false;
+    }
 
-        TCP_Write(sock, MSG("OK"), 0);
+    if (current) {
+      char* new_value = malloc(strlen(current) + strlen(value) + 1);
+      strcpy(new_value, current);
+      strcat(new_value, value);
+      DB_Value new_val = { .string = { new_value } };
+      DB_Atomic_Store(db, key, new_val, DB_ENTRY_STRING);
+
+      TCP_Write(conn, MSG("OK"), 0);
 
-      } else {
-        TCP_Write(sock, MSG("KEY_NOT_FOUND"), 0);
-      }
     } else {
-      TCP_Write(sock, MSG("KEY_NOT_FOUND"), 0);
+      TCP_Write(conn, MSG("KEY_NOT_FOUND"), 0);
+      return false;
     }
   } else if (strcmp(cmd->command, "strlen") == 0) {
     const char* key = cmd->argv[0];
     const char* value = cmd->argv[1];
 
     if (key == NULL) {
-      TCP_Write(sock, MSG("USAGE_STRLEN"), 0);
-      return;
+      TCP_Write(conn, MSG("USAGE_STRLEN"), 0);
+      return false;
     }
 
     DatabaseEntry res = DB_Atomic_Get(db, key);
+    char length[32];
     if (res.type == DB_ENTRY_STRING) {
       if (res.value.string.value) {
-        char length[20];
         sprintf(length, "%lu\n", strlen(res.value.string.value));
-        TCP_Write(sock, length, 0);
+        TCP_Write(conn, length, 0);
       } else {
-        TCP_Write(sock, MSG("KEY_NOT_FOUND"), 0);
+        TCP_Write(conn, MSG("KEY_NOT_FOUND"), 0);
       }
+    } else if (res.type == DB_ENTRY_NUMBER) {
+      // the length of the digits GET replies with
+      char number[32];
+      int32_t len =
+        snprintf(number, sizeof(number), "%" PRId64, res.value.number.value);
+      sprintf(length, "%d\n", len);
+      TCP_Write(conn, length, 0);
+    } else {
+      TCP_Write(conn, MSG("WRONG_TYPE"), 0);
     }
 
     // todo (David) 'incr' when key exists and value is not a number (it returns
@@ -179,121 +697,117 @@ Execute_Command(int sock, ParsedCommand* cmd, Database* db)
     const char* value = cmd->argv[1];
 
     if (key == NULL) {
-      TCP_Write(sock, MSG("USAGE_INC"), 0);
-      return;
+      TCP_Write(conn, MSG("USAGE_INC"), 0);
+      return false;
     }
 
-    int64_t result = DB_Atomic_Incr(db, key);
+    // a value that is no number replies -1 and stays as it is
+    int64_t result = -1;
+    bool incremented = DB_Atomic_Incr_By(db, key, 1, &result);
 
-    char as_number[20];
+    char as_number[24];
     sprintf(as_number, "%" PRId64 "\n", result);
-    TCP_Write(sock, as_number, 0);
+    TCP_Write(conn, as_number, 0);
+    if (!incremented) {
+      return false;
+    }
+
+  } else if (strcmp(cmd->command, "incrby") == 0) {
+    const char* key = cmd->argv[0];
+
+    errno = 0;
+    int64_t by = cmd->argc < 2 ? 0 : strtoll(cmd->argv[1], NULL, 10);
+    if (key == NULL || cmd->argc < 2 || cmd->types[1] != TOKEN_NUMBER ||
+        errno == ERANGE) {
+      TCP_Write(conn, MSG("USAGE_INCRBY"), 0);
+      return false;
+    }
+
+    int64_t result;
+    if (!DB_Atomic_Incr_By(db, key, by, &result)) {
+      TCP_Write(conn, MSG("WRONG_TYPE"), 0);
+      return false;
+    }
+
+    char as_number[24];
+    sprintf(as_number, "%" PRId64 "\n", result);
+    TCP_Write(conn, as_number, 0);
 
   } else if (strcmp(cmd->command, "export") == 0) {
     const char* key = cmd->argv[0];
     const char* value = cmd->argv[1];
 
     if (key == NULL) {
-      TCP_Write(sock, MSG("USAGE_EXPORT"), 0);
-      return;
+      TCP_Write(conn, MSG("USAGE_EXPORT"), 0);
+      return false;
     }
     if (Export_Snapshot(context, key) == 0) {
       DB_Log(DB_LOG_INFO, "Exporting snapshot %s was successful", key);
-      TCP_Write(sock, MSG("OK"), 0);
+      TCP_Write(conn, MSG("OK"), 0);
     } else {
       DB_Log(DB_LOG_ERROR, "Exporting snapshot %s failed", key);
-      TCP_Write(sock, MSG("FAILED"), 0);
+      TCP_Write(conn, MSG("FAILED"), 0);
     }
   } else if (strcmp(cmd->command, "insp") == 0) {
     Print_Runtime_Context(context);
   }
 
-  else if (strcmp(cmd->command, "rpush") == 0) {
+  else if (strcmp(cmd->command, "rpush") == 0 ||
+           strcmp(cmd->command, "lpush") == 0) {
+    const int32_t is_rpush = cmd->command[0] == 'r';
     const char* key = cmd->argv[0];
-    const char* value = cmd->argv[1];
-    const TOKEN type = cmd->types[1];
 
-    if (key == NULL || value == NULL) {
-      TCP_Write(sock, MSG("USAGE_RPUSH"), 0);
-      return;
+    if (key == NULL || cmd->argc < 2) {
+      TCP_Write(conn, MSG(is_rpush ? "USAGE_RPUSH" : "USAGE_LPUSH"), 0);
+      return false;
     }
-    DatabaseEntry res = DB_Atomic_Get(db, key);
 
-    if (res.type == DB_ENTRY_LIST) { // append element to list
-      HPLinkedList* list = res.value.list;
-      switch (type) {
-        case TOKEN_STRING: {
-          HPList_RPush_String(list, value);
-        } break;
-
-        case TOKEN_NUMBER: {
-          HPList_RPush_Int(list, atoll(value));
-        } break;
-      };
-
-      TCP_Write(sock, MSG("OK"), 0);
-    }
-
-    else { // not entry, create new list
-      HPLinkedList* new_list = HPList_Create();
-      switch (type) {
-        case TOKEN_STRING: {
-          HPList_RPush_String(new_list, value);
-        } break;
-        case TOKEN_NUMBER: {
-          HPList_RPush_Int(new_list, atoll(value));
-        } break;
-      };
+    // values are borrowed from the parsed command, the list copies them
+    size_t num_values = cmd->argc - 1;
+    ListNode* nodes = (ListNode*)malloc(num_values * sizeof(ListNode));
+    if (!nodes) {
+      TCP_Write(conn, MSG("FAILED"), 0);
+      return false;
+    }
+
+    for (size_t i = 0; i < num_values; i++) {
+      if (cmd->types[i + 1] == TOKEN_NUMBER &&
+          Parse_Exact_Int(cmd->argv[i + 1], &nodes[i].value.int_value)) {
+        nodes[i].type = TYPE_INT;
+      } else if (cmd->types[i + 1] == TOKEN_FLOAT &&
+                 HPList_Parse_Float(cmd->argv[i + 1],
+                                    &nodes[i].value.float_value)) {
+        nodes[i].type = TYPE_FLOAT;
+      } else {
+        nodes[i].type = TYPE_STRING;
+        nodes[i].value.string_value = cmd->argv[i + 1];
+      }
+    }
 
+    HPLinkedList* list = NULL;
+    DatabaseEntry res = DB_Atomic_Get(db, key);
+    if (res.type == DB_ENTRY_LIST) {
+      list = res.value.list;
+    } else { // no entry, create new list
+      list = HPList_Create();
       DB_Value list_val;
-      list_val.list = new_list;
+      list_val.list = list;
       DB_Atomic_Store(db, key, list_val, DB_ENTRY_LIST);
-
-      TCP_Write(sock, MSG("OK"), 0);
     }
-  }
 
-  else if (strcmp(cmd->command, "lpush") == 0) {
-    const char* key = cmd->argv[0];
-    const char* value = cmd->argv[1];
-    const TOKEN type = cmd->types[1];
+    int32_t length = is_rpush ? HPList_RPush_Many(list, nodes, num_values)
+                              : HPList_LPush_Many(list, nodes, num_values);
+    free(nodes);
 
-    if (key == NULL || value == NULL) {
-      TCP_Write(sock, MSG("USAGE_LPUSH"), 0);
-      return;
+    if (length < 0) {
+      TCP_Write(conn, MSG("FAILED"), 0);
+      return false;
     }
-    DatabaseEntry res = DB_Atomic_Get(db, key);
-
-    if (res.type == DB_ENTRY_LIST) { // append
-      HPLinkedList* list = res.value.list;
-      switch (type) {
-        case TOKEN_STRING: {
-          HPList_LPush_String(list, value);
-        } break;
-
-        case TOKEN_NUMBER: {
-          HPList_LPush_Int(list, atoll(value));
-        } break;
-      };
-      TCP_Write(sock, MSG("OK"), 0);
-    }
-
-    else { // no, entry create new list
-      HPLinkedList* new_list = HPList_Create();
-      switch (type) {
-        case TOKEN_STRING: {
-          HPList_LPush_String(new_list, value);
-        } break;
-        case TOKEN_NUMBER: {
-          HPList_LPush_Int(new_list, atoll(value));
-        } break;
-      };
 
-      DB_Value list_val;
-      list_val.list = new_list;
-      DB_Atomic_Store(db, key, list_val, DB_ENTRY_LIST);
-      TCP_Write(sock, MSG("OK"), 0);
-    }
+    // waiting pops are served by Execute_Command once the push is logged
+    char buffer[32];
+    sprintf(buffer, "%d\n", length);
+    TCP_Write(conn, buffer, 0);
   }
 
   else if (strcmp(cmd->command, "lpop") == 0) {
@@ -301,36 +815,40 @@ Execute_Command(int sock, ParsedCommand* cmd, Database* db)
     const char* value = cmd->argv[1];
 
     if (key == NULL) {
-      TCP_Write(sock, MSG("USAGE_LPOP"), 0);
-      return;
+      TCP_Write(conn, MSG("USAGE_LPOP"), 0);
+      return false;
     }
 
     DatabaseEntry res = DB_Atomic_Get(db, key);
     if (res.type == DB_ENTRY_LIST) {
       HPLinkedList* list = res.value.list;
-      ListNode* node = HPList_LPop(list);
+      ListNode popped;
 
-      if (node) {
+      if (HPList_LPop(list, &popped)) {
+        ListNode* node = &popped;
         if (node->type == TYPE_STRING) {
-          TCP_Write(sock, node->value.string_value, 0);
+          TCP_Write(conn, node->value.string_value, 0);
         } else if (node->type == TYPE_INT) {
           char buffer[32];
           sprintf(buffer, "%" PRId64, node->value.int_value);
-          TCP_Write(sock, buffer, 0);
+          TCP_Write(conn, buffer, 0);
 
         } else if (node->type == TYPE_FLOAT) {
           char buffer[32];
-          sprintf(buffer, "%f", node->value.float_value);
-          TCP_Write(sock, buffer, 0);
+          HPList_Format_Float(buffer, sizeof(buffer), node->value.float_value);
+          TCP_Write(conn, buffer, 0);
         }
 
-        TCP_Write(sock, "\n", 0);
+        TCP_Write(conn, "\n", 0);
+        HPList_Release_Node(node);
 
       } else {
-        TCP_Write(sock, MSG("KEY_NOT_FOUND"), 0);
+        TCP_Write(conn, MSG("KEY_NOT_FOUND"), 0);
+        return false;
       }
     } else {
-      TCP_Write(sock, MSG("KEY_NOT_FOUND"), 0);
+      TCP_Write(conn, MSG("KEY_NOT_FOUND"), 0);
+      return false;
     }
   }
 
@@ -339,36 +857,104 @@ Execute_Command(int sock, ParsedCommand* cmd, Database* db)
     const char* value = cmd->argv[1];
 
     if (key == NULL) {
-      TCP_Write(sock, MSG("USAGE_RPOP"), 0);
-      return;
+      TCP_Write(conn, MSG("USAGE_RPOP"), 0);
+      return false;
     }
     DatabaseEntry res = DB_Atomic_Get(db, key);
 
     if (res.type == DB_ENTRY_LIST) {
       HPLinkedList* list = res.value.list;
-      ListNode* node = HPList_RPop(list);
+      ListNode popped;
 
-      if (node) {
+      if (HPList_RPop(list, &popped)) {
+        ListNode* node = &popped;
         if (node->type == TYPE_STRING) {
-          TCP_Write(sock, node->value.string_value, 0);
+          TCP_Write(conn, node->value.string_value, 0);
         } else if (node->type == TYPE_INT) {
           char buffer[32];
           sprintf(buffer, "%" PRId64, node->value.int_value);
-          TCP_Write(sock, buffer, 0);
+          TCP_Write(conn, buffer, 0);
         } else if (node->type == TYPE_FLOAT) {
           char buffer[32];
-          sprintf(buffer, "%f", node->value.float_value);
-          TCP_Write(sock, buffer, 0);
+          HPList_Format_Float(buffer, sizeof(buffer), node->value.float_value);
+          TCP_Write(conn, buffer, 0);
         }
 
-        TCP_Write(sock, "\n", 0);
+        TCP_Write(conn, "\n", 0);
+        HPList_Release_Node(node);
 
       } else {
-        TCP_Write(sock, MSG("KEY_NOT_FOUND"), 0);
+        TCP_Write(conn, MSG("KEY_NOT_FOUND"), 0);
+        return false;
+      }
+    } else {
+      TCP_Write(conn, MSG("KEY_NOT_FOUND"), 0);
+      return false;
+    }
+  }
+
+  else if (strcmp(cmd->command, "blpop") == 0 ||
+           strcmp(cmd->command, "brpop") == 0) {
+    const BLOCK_POP_SIDE side =
+      cmd->command[1] == 'l' ? BLOCK_POP_LEFT : BLOCK_POP_RIGHT;
+
+    if (cmd->argc < 2) {
+      TCP_Write(
+        conn, MSG(side == BLOCK_POP_LEFT ? "USAGE_BLPOP" : "USAGE_BRPOP"), 0);
+      return false;
+    }
+    const char* key = cmd->argv[0];
+    int64_t timeout_ms;
+    if (!Parse_Timeout(cmd->argv[1], &timeout_ms)) {
+      TCP_Write(conn, MSG("INVALID_TIMEOUT"), 0);
+      return false;
+    }
+
+    AOF* aof = context->aof;
+    Replication* repl = context->replication;
+    Lock_Write_Key(aof, repl, key);
+
+    DatabaseEntry res = DB_Atomic_Get(db, key);
+    ListNode popped;
+    int32_t has_value = 0;
+
+    if (res.type == DB_ENTRY_LIST) {
+      has_value = side == BLOCK_POP_LEFT ? HPList_LPop(res.value.list, &popped)
+                                         : HPList_RPop(res.value.list, &popped);
+    }
+
+    const char* pop = side == BLOCK_POP_LEFT ? "lpop" : "rpop";
+    if (has_value && repl) {
+      Replication_Feed(repl, (int32_t)db->ID, pop, cmd->argv, NULL, 1);
+    }
+    if (has_value && aof) {
+      uint64_t seq = AOF_Feed(aof, (int32_t)db->ID, pop, cmd->argv, NULL, 1);
+      if (!AOF_Commit(aof, seq)) {
+        TCP_Write(conn, MSG("NOT_LOGGED"), 0);
+        HPList_Release_Node(&popped);
+        Unlock_Write_Key(aof, repl, key);
+        return false;
+      }
+    }
+
+    if (has_value) {
+      char buffer[32];
+      if (popped.type == TYPE_STRING) {
+        TCP_Write(conn, popped.value.string_value, 1);
+      } else if (popped.type == TYPE_INT) {
+        sprintf(buffer, "%" PRId64, popped.value.int_value);
+        TCP_Write(conn, buffer, 1);
+      } else if (popped.type == TYPE_FLOAT) {
+        HPList_Format_Float(buffer, sizeof(buffer), popped.value.float_value);
+        TCP_Write(conn, buffer, 1);
       }
+      HPList_Release_Node(&popped);
     } else {
-      TCP_Write(sock, MSG("KEY_NOT_FOUND"), 0);
+      // reply is sent later by whoever pushes to the key or by the timer
+      Blocking_Wait(context->blocking_system, db, key, conn, side, timeout_ms);
     }
+
+    Unlock_Write_Key(aof, repl, key);
   }
 
   else if (strcmp(cmd->command, "llen") == 0) {
@@ -376,8 +962,8 @@ Execute_Command(int sock, ParsedCommand* cmd, Database* db)
     const char* value = cmd->argv[1];
 
     if (key == NULL) {
-      TCP_Write(sock, MSG("USAGE_LLEN"), 0);
-      return;
+      TCP_Write(conn, MSG("USAGE_LLEN"), 0);
+      return false;
     }
     DatabaseEntry res = DB_Atomic_Get(db, key);
 
@@ -385,40 +971,304 @@ Execute_Command(int sock, ParsedCommand* cmd, Database* db)
       HPLinkedList* list = res.value.list;
       char buffer[32];
       sprintf(buffer, "%zu\n", list->count);
-      TCP_Write(sock, buffer, 0);
+      TCP_Write(conn, buffer, 0);
     } else {
-      TCP_Write(sock, MSG("KEY_NOT_FOUND"), 0);
+      TCP_Write(conn, MSG("KEY_NOT_FOUND"), 0);
     }
   } else if (strcmp(cmd->command, "sub") == 0) {
-    Subscribe(context->pubsub_system, cmd->argv[0], sock);
+    // before it can be published to, the subscriber output limit applies
+    conn->subscribed = true;
+    Subscribe(context->pubsub_system, cmd->argv[0], conn);
   } else if (strcmp(cmd->command, "unsub") == 0) {
-    Unsubscribe(context->pubsub_system, cmd->argv[0], sock);
+    Unsubscribe(context->pubsub_system, cmd->argv[0], conn);
   } else if (strcmp(cmd->command, "pub") == 0) {
     Publish(context->pubsub_system, cmd->argv[0], cmd->argv[1]);
   } else if (strcmp(cmd->command, "lrange") == 0) {
     if (cmd->argc < 3) {
-      TCP_Write(sock, MSG("USAGE_LRANGE"), 0);
-      return;
+      TCP_Write(conn, MSG("USAGE_LRANGE"), 0);
+      return false;
     }
     const char* key = cmd->argv[0];
-    int start = atoi(cmd->argv[1]);
-    int stop = atoi(cmd->argv[2]);
+    int64_t start = strtoll(cmd->argv[1], NULL, 10);
+    int64_t stop = strtoll(cmd->argv[2], NULL, 10);
 
     DatabaseEntry res = DB_Atomic_Get(db, key);
     if (res.type == DB_ENTRY_LIST) {
-      HPLinkedList* list = res.value.list;
-      char* buffer = HPList_ToString(list);
-      TCP_Write(sock, buffer, 1);
+      Response_Stream stream;
+      stream.conn = conn;
+      stream.len = 0;
 
-      free(buffer); // buffer was allocated on heap by ToString
+      HPList_RangeWrite(
+        res.value.list, start, stop, Response_Stream_Write, &stream);
+      Response_Stream_Write(&stream, "\n", 1);
+      Response_Flush(&stream);
+    } else {
+      TCP_Write(conn, MSG("KEY_NOT_FOUND"), 1);
+    }
+  } else if (strcmp(cmd->command, "lindex") == 0) {
+    if (cmd->argc < 2) {
+      TCP_Write(conn, MSG("USAGE_LINDEX"), 0);
+      return false;
+    }
+    const char* key = cmd->argv[0];
+    int64_t index = strtoll(cmd->argv[1], NULL, 10);
+
+    DatabaseEntry res = DB_Atomic_Get(db, key);
+    ListNode node;
+    if (res.type == DB_ENTRY_LIST && HPList_Index(res.value.list, index, &node)) {
+      char buffer[32];
+      if (node.type == TYPE_STRING) {
+        TCP_Write(conn, node.value.string_value, 1);
+      } else if (node.type == TYPE_INT) {
+        sprintf(buffer, "%" PRId64, node.value.int_value);
+        TCP_Write(conn, buffer, 1);
+      } else if (node.type == TYPE_FLOAT) {
+        HPList_Format_Float(buffer, sizeof(buffer), node.value.float_value);
+        TCP_Write(conn, buffer, 1);
+      }
+      HPList_Release_Node(&node);
+    } else {
+      TCP_Write(conn, MSG("KEY_NOT_FOUND"), 0);
+    }
+  } else if (strcmp(cmd->command, "hset") == 0) {
+    const char* key = cmd->argv[0];
+
+    if (key == NULL || cmd->argc < 3 || (cmd->argc - 1) % 2 != 0) {
+      TCP_Write(conn, MSG("USAGE_HSET"), 0);
+      return false;
+    }
+
+    int32_t wrong_type = 0;
+    DB_Object* obj = Get_Object(db, key, 1, &wrong_type);
+    if (!obj) {
+      TCP_Write(conn, MSG(wrong_type ? "WRONG_TYPE" : "FAILED"), 0);
+      return false;
+    }
+
+    int32_t added = 0;
+    for (int32_t i = 1; i + 1 < cmd->argc; i += 2) {
+      DB_Value value;
+      DB_ENTRY_TYPE type;
+      int64_t number;
+      if (cmd->types[i + 1] == TOKEN_NUMBER &&
+          Parse_Exact_Int(cmd->argv[i + 1], &number)) {
+        value.number.value = number;
+        type = DB_ENTRY_NUMBER;
+      } else {
+        value.string.value = strdup(cmd->argv[i + 1]);
+        type = DB_ENTRY_STRING;
+      }
+
+      if (DBObject_AddField(obj, cmd->argv[i], value, type) ==
+          HM_ACTION_ADDED) {
+        added++;
+      }
+    }
+
+    char buffer[32];
+    sprintf(buffer, "%d\n", added);
+    TCP_Write(conn, buffer, 0);
+  } else if (strcmp(cmd->command, "hget") == 0) {
+    const char* key = cmd->argv[0];
+    const char* field = cmd->argv[1];
+
+    if (key == NULL || field == NULL) {
+      TCP_Write(conn, MSG("USAGE_HGET"), 0);
+      return false;
+    }
+
+    int32_t wrong_type = 0;
+    DB_Object* obj = Get_Object(db, key, 0, &wrong_type);
+    if (!obj) {
+      TCP_Write(conn, MSG(wrong_type ? "WRONG_TYPE" : "KEY_NOT_FOUND"), 0);
+      return false;
+    }
+
+    Response_Stream stream;
+    stream.conn = conn;
+    stream.len = 0;
+
+    pthread_rwlock_rdlock(&obj->rwlock);
+    DatabaseEntry* entry = DBObject_GetField(obj, field);
+    if (entry == NULL) {
+      Response_Stream_Write(&stream, "null", 4);
+    } else if (entry->type == DB_ENTRY_STRING) {
+      Response_Stream_Write(&stream,
+                            entry->value.string.value,
+                            strlen(entry->value.string.value));
+    } else if (entry->type == DB_ENTRY_NUMBER) {
+      char buffer[32];
+      int32_t len = sprintf(
+        buffer, "%" PRId64, atomic_load(&entry->value.number.value));
+      Response_Stream_Write(&stream, buffer, len);
+    } else if (entry->type == DB_ENTRY_LIST) {
+      HPList_RangeWrite(
+        entry->value.list, 0, -1, Response_Stream_Write, &stream);
+    } else if (entry->type == DB_ENTRY_OBJECT) {
+      Response_Stream_Write_Object(&stream, entry->value.object);
+    }
+    pthread_rwlock_unlock(&obj->rwlock);
+
+    Response_Stream_Write(&stream, "\n", 1);
+    Response_Flush(&stream);
+  } else if (strcmp(cmd->command, "hdel") == 0) {
+    const char* key = cmd->argv[0];
+
+    if (key == NULL || cmd->argc < 2) {
+      TCP_Write(conn, MSG("USAGE_HDEL"), 0);
+      return false;
+    }
+
+    int32_t wrong_type = 0;
+    int32_t removed = 0;
+    DB_Object* obj = Get_Object(db, key, 0, &wrong_type);
+    if (wrong_type) {
+      TCP_Write(conn, MSG("WRONG_TYPE"), 0);
+      return false;
+    }
+
+    for (int32_t i = 1; obj && i < cmd->argc; i++) {
+      removed += DBObject_RemoveField(obj, cmd->argv[i]) ? 1 : 0;
+    }
+
+    char buffer[32];
+    sprintf(buffer, "%d\n", removed);
+    TCP_Write(conn, buffer, 0);
+    if (removed == 0) {
+      return false;
+    }
+  } else if (strcmp(cmd->command, "hgetall") == 0) {
+    const char* key = cmd->argv[0];
+
+    if (key == NULL) {
+      TCP_Write(conn, MSG("USAGE_HGETALL"), 0);
+      return false;
+    }
+
+    int32_t wrong_type = 0;
+    DB_Object* obj = Get_Object(db, key, 0, &wrong_type);
+    if (!obj) {
+      TCP_Write(conn, MSG(wrong_type ? "WRONG_TYPE" : "KEY_NOT_FOUND"), 0);
+      return false;
+    }
+
+    Response_Stream stream;
+    stream.conn = conn;
+    stream.len = 0;
+
+    Response_Stream_Write_Object(&stream, obj);
+    Response_Stream_Write(&stream, "\n", 1);
+    Response_Flush(&stream);
+  } else if (strcmp(cmd->command, "hincrby") == 0) {
+    const char* key = cmd->argv[0];
+    const char* field = cmd->argv[1];
+
+    errno = 0;
+    int64_t by = cmd->argc < 3 ? 0 : strtoll(cmd->argv[2], NULL, 10);
+    if (key == NULL || field == NULL || cmd->argc < 3 ||
+        cmd->types[2] != TOKEN_NUMBER || errno == ERANGE) {
+      TCP_Write(conn, MSG("USAGE_HINCRBY"), 0);
+      return false;
+    }
+
+    int32_t wrong_type = 0;
+    DB_Object* obj = Get_Object(db, key, 1, &wrong_type);
+    if (!obj) {
+      TCP_Write(conn, MSG(wrong_type ? "WRONG_TYPE" : "FAILED"), 0);
+      return false;
+    }
+
+    int64_t result = 0;
+    if (DBObject_IncrField(obj, field, by, &result) !=
+        DB_OBJECT_INCR_OK) {
+      TCP_Write(conn, MSG("WRONG_TYPE"), 0);
+      return false;
+    }
+
+    char buffer[32];
+    sprintf(buffer, "%" PRId64 "\n", result);
+    TCP_Write(conn, buffer, 0);
+  } else if (strcmp(cmd->command, "bgsave") == 0) {
+    if (context->save_system == NULL ||
+        Save_Background(context->save_system) != 0) {
+      TCP_Write(conn, MSG("FAILED"), 0);
+      return false;
+    }
+    TCP_Write(conn, MSG("BGSAVE_STARTED"), 0);
+  } else if (strcmp(cmd->command, "bgrewriteaof") == 0) {
+    if (context->aof == NULL ||
+        AOF_Rewrite_Start(context->aof, &context->db_manager) != 0) {
+      TCP_Write(conn, MSG("FAILED"), 0);
+      return false;
+    }
+    TCP_Write(conn, MSG("REWRITE_STARTED"), 0);
+  } else if (strcmp(cmd->command, "psync") == 0) {
+    // the connection is the replication link from now on, this returns once
+    // the link broke. the stream is written straight to the socket, after
+    // whatever replies are still queued
+    int64_t offset = cmd->argc > 1 ? strtoll(cmd->argv[1], NULL, 10) : -1;
+    Output_Flush(conn);
+    if (conn->detach) {
+      conn->detach(conn);
+    }
+    Replication_Serve(context->replication, conn->sock, cmd->argv[0], offset);
+  } else if (strcmp(cmd->command, "replicaof") == 0) {
+    if (cmd->argc < 2) {
+      TCP_Write(conn, MSG("USAGE_REPLICAOF"), 0);
+      return false;
+    }
+
+    int32_t res;
+    if (strcasecmp(cmd->argv[0], "no") == 0 &&
+        strcasecmp(cmd->argv[1], "one") == 0) {
+      res = Replication_Set_Primary(context->replication, NULL, 0);
     } else {
-      TCP_Write(sock, MSG("KEY_NOT_FOUND"), 1);
+      int32_t port = atoi(cmd->argv[1]);
+      if (port <= 0 || port > 65535) {
+        TCP_Write(conn, MSG("USAGE_REPLICAOF"), 0);
+        return false;
+      }
+      res = Replication_Set_Primary(context->replication, cmd->argv[0], port);
     }
-  } else if (strcmp(cmd->command, "load") == 0) {
-    if (Import_Snapshot(context, "snapshot.bin") == 0) {
-      DB_Log(DB_LOG_INFO, "SNAPSHOT was loaded successfully");
+    TCP_Write(conn, MSG(res == 0 ? "OK" : "FAILED"), 0);
+  } else if (strcmp(cmd->command, "dbstats") == 0) {
+    Response_Stream stream;
+    stream.conn = conn;
+    stream.len = 0;
+
+    // databases that were never selected have nothing to report
+    char buffer[160];
+    int32_t first = 1;
+    Response_Stream_Write(&stream, "[", 1);
+    for (int32_t i = 0; i < context->db_manager.num_databases; i++) {
+      Database* stats_db = &context->db_manager.databases[i];
+      if (!atomic_load(&stats_db->ready)) {
+        continue;
+      }
+
+      DatabaseStats stats;
+      Database_Stats(stats_db, &stats);
+      int32_t len = snprintf(buffer,
+                             sizeof(buffer),
+                             "%s{\"db\": %d, \"keys\": %" PRIu64
+                             ", \"commands\": %" PRIu64
+                             ", \"writes\": %" PRIu64 "}",
+                             first ? "" : ", ",
+                             i,
+                             stats.num_keys,
+                             stats.num_commands,
+                             stats.num_writes);
+      Response_Stream_Write(&stream, buffer, len);
+      first = 0;
     }
+    Response_Stream_Write(&stream, "]\n", 2);
+    Response_Flush(&stream);
+  } else if (strcmp(cmd->command, "role") == 0) {
+    char* role = Replication_Role(context->replication);
+    TCP_Write(conn, role ? role : MSG("FAILED"), 0);
+    free(role);
   } else {
-    TCP_Write(sock, MSG("UNKNOWN_COMMAND"), 0);
+    TCP_Write(conn, MSG("UNKNOWN_COMMAND"), 0);
   }
+  return true;
 }
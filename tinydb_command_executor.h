@@ -1,10 +1,14 @@
 #ifndef __TINY_DB_COMMAND_EXECUTOR
 #define __TINY_DB_COMMAND_EXECUTOR
 
+#include "tinydb_connection.h"
 #include "tinydb_database.h"
 #include "tinydb_query_parser.h"
 
+/**
+ * executes cmd against the database of conn and replies on its socket.
+ */
 void
-Execute_Command(int sock, ParsedCommand* cmd, Database* db);
+Execute_Command(Connection* conn, ParsedCommand* cmd);
 
 #endif // __TINY_DB_COMMAND_EXECUTOR
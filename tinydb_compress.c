@@ -0,0 +1,196 @@
+#include <string.h>
+
+#include "tinydb_compress.h"
+
+static uint32_t
+read32(const uint8_t* p)
+{
+  uint32_t value;
+  memcpy(&value, p, sizeof(uint32_t));
+  return value;
+}
+
+static uint32_t
+hash32(uint32_t sequence)
+{
+  return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// writes the extra bytes of a length whose nibble was saturated
+static uint8_t*
+put_length(uint8_t* op, const uint8_t* oend, size_t len)
+{
+  while (len >= 255) {
+    if (op >= oend) {
+      return NULL;
+    }
+    *op++ = 255;
+    len -= 255;
+  }
+
+  if (op >= oend) {
+    return NULL;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+static uint8_t*
+put_sequence(uint8_t* op,
+             const uint8_t* oend,
+             const uint8_t* literals,
+             size_t num_literals,
+             size_t offset,
+             size_t match_len)
+{
+  if (op >= oend) {
+    return NULL;
+  }
+
+  uint8_t* token = op++;
+  *token = (num_literals >= 15 ? 15 : num_literals) << 4;
+  if (num_literals >= 15 && !(op = put_length(op, oend, num_literals - 15))) {
+    return NULL;
+  }
+
+  if ((size_t)(oend - op) < num_literals) {
+    return NULL;
+  }
+  memcpy(op, literals, num_literals);
+  op += num_literals;
+
+  // the last sequence has literals only
+  if (match_len == 0) {
+    return op;
+  }
+
+  if (oend - op < 2) {
+    return NULL;
+  }
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+
+  size_t len = match_len - LZ_MIN_MATCH;
+  *token |= len >= 15 ? 15 : len;
+  if (len >= 15) {
+    op = put_length(op, oend, len - 15);
+  }
+  return op;
+}
+
+size_t
+LZ_Compress_Bound(size_t len)
+{
+  return len + len / 255 + 16;
+}
+
+size_t
+LZ_Compress(const uint8_t* src, size_t len, uint8_t* dst, size_t capacity)
+{
+  uint32_t table[1 << LZ_HASH_BITS] = { 0 };
+  const uint8_t* oend = dst + capacity;
+  uint8_t* op = dst;
+  size_t anchor = 0;
+  size_t i = 0;
+
+  while (len >= LZ_MATCH_LIMIT && i + LZ_MATCH_LIMIT <= len) {
+    uint32_t sequence = read32(src + i);
+    uint32_t h = hash32(sequence);
+    size_t ref = table[h];
+    table[h] = (uint32_t)i;
+
+    if (ref >= i || i - ref > LZ_MAX_OFFSET || read32(src + ref) != sequence) {
+      // skip faster through data that does not compress
+      i += 1 + ((i - anchor) >> 6);
+      continue;
+    }
+
+    size_t match_len = LZ_MIN_MATCH;
+    size_t max_len = len - LZ_LAST_LITERALS - i;
+    while (match_len < max_len && src[ref + match_len] == src[i + match_len]) {
+      match_len++;
+    }
+
+    op = put_sequence(
+      op, oend, src + anchor, i - anchor, i - ref, match_len);
+    if (!op) {
+      return 0;
+    }
+    i += match_len;
+    anchor = i;
+  }
+
+  op = put_sequence(op, oend, src + anchor, len - anchor, 0, 0);
+  return op ? (size_t)(op - dst) : 0;
+}
+
+// reads the extra bytes of a saturated length nibble
+static int32_t
+get_length(const uint8_t** ip, const uint8_t* iend, size_t* len)
+{
+  uint8_t byte;
+  do {
+    if (*ip >= iend) {
+      return -1;
+    }
+    byte = *(*ip)++;
+    *len += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+int32_t
+LZ_Decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_len)
+{
+  const uint8_t* ip = src;
+  const uint8_t* iend = src + len;
+  uint8_t* op = dst;
+  uint8_t* oend = dst + dst_len;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+
+    size_t num_literals = token >> 4;
+    if (num_literals == 15 && get_length(&ip, iend, &num_literals) != 0) {
+      return -1;
+    }
+    if ((size_t)(iend - ip) < num_literals ||
+        (size_t)(oend - op) < num_literals) {
+      return -1;
+    }
+    memcpy(op, ip, num_literals);
+    ip += num_literals;
+    op += num_literals;
+
+    if (ip == iend) {
+      break; // last sequence
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    size_t offset = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst)) {
+      return -1;
+    }
+
+    size_t match_len = token & 15;
+    if (match_len == 15 && get_length(&ip, iend, &match_len) != 0) {
+      return -1;
+    }
+    match_len += LZ_MIN_MATCH;
+    if ((size_t)(oend - op) < match_len) {
+      return -1;
+    }
+
+    // the match may overlap the bytes it produces
+    const uint8_t* match = op - offset;
+    for (size_t k = 0; k < match_len; k++) {
+      op[k] = match[k];
+    }
+    op += match_len;
+  }
+
+  return op == oend ? 0 : -1;
+}
@@ -0,0 +1,47 @@
+/**
+ * note (David)
+ * /BLOCK COMPRESSION/
+ * small LZ77 compressor producing the LZ4 block format: a sequence is a token
+ * byte (literal length in the high nibble, match length - 4 in the low
+ * nibble), the literals, a 2 byte little endian offset and the extra length
+ * bytes. nibbles of 15 continue in the following bytes (255 means more).
+ * matches are found through a single hash table of 4 byte prefixes, which
+ * is fast enough to keep up with the disk and does well on repetitive values
+ * such as JSON documents.
+ */
+#ifndef __TINY_DB_COMPRESS
+#define __TINY_DB_COMPRESS
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// the last match has to start this many bytes before the end of the input
+// and the last LZ_LAST_LITERALS bytes are always literals
+#define LZ_MATCH_LIMIT 12
+#define LZ_LAST_LITERALS 5
+
+/**
+ * @returns size of dst that is always enough to compress len bytes
+ */
+size_t
+LZ_Compress_Bound(size_t len);
+
+/**
+ * @returns size of the compressed data, 0 when it does not fit into capacity
+ */
+size_t
+LZ_Compress(const uint8_t* src, size_t len, uint8_t* dst, size_t capacity);
+
+/**
+ * decompresses exactly dst_len bytes, every read and write is bounds checked
+ * so corrupted input can not overflow dst.
+ * @returns 0 on success, -1 when the input is malformed
+ */
+int32_t
+LZ_Decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_len);
+
+#endif // __TINY_DB_COMPRESS
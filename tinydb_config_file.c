@@ -0,0 +1,129 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tinydb_config_file.h"
+#include "tinydb_log.h"
+
+// the expanded arguments, they stay reachable until exit
+static const char** args = NULL;
+static int32_t num_args = 0;
+static int32_t args_capacity = 0;
+
+static int32_t
+push_arg(const char* arg)
+{
+  if (num_args == args_capacity) {
+    int32_t capacity = args_capacity > 0 ? args_capacity * 2 : 32;
+    const char** temp =
+      (const char**)realloc(args, capacity * sizeof(const char*));
+    if (!temp) {
+      DB_Log(DB_LOG_ERROR, "Failed to allocate memory for the arguments");
+      return -1;
+    }
+    args = temp;
+    args_capacity = capacity;
+  }
+  args[num_args++] = arg;
+  return 0;
+}
+
+// the option of a line becomes --option, its values follow as they are
+static int32_t
+push_word(const char* word, bool option)
+{
+  char* arg = (char*)malloc(strlen(word) + (option ? 3 : 1));
+  if (!arg) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for the arguments");
+    return -1;
+  }
+  strcpy(arg, option ? "--" : "");
+  strcat(arg, word);
+  return push_arg(arg);
+}
+
+static int32_t
+push_line(char* line, const char* path, int32_t line_no)
+{
+  char* p = line;
+  bool option = true;
+  while (1) {
+    while (isspace((unsigned char)*p)) {
+      p++;
+    }
+    if (*p == '\0' || (option && *p == '#')) {
+      return 0;
+    }
+
+    // quotes are dropped, the spaces between them kept
+    char* word = p;
+    char* out = p;
+    bool quoted = false;
+    while (*p && (quoted || !isspace((unsigned char)*p))) {
+      if (*p == '"') {
+        quoted = !quoted;
+        p++;
+      } else {
+        *out++ = *p++;
+      }
+    }
+    if (quoted) {
+      DB_Log(DB_LOG_ERROR, "CONFIG %s:%d Missing closing quote", path, line_no);
+      return -1;
+    }
+
+    char* next = *p ? p + 1 : p;
+    *out = '\0';
+    if (push_word(word, option) != 0) {
+      return -1;
+    }
+    option = false;
+    p = next;
+  }
+}
+
+int32_t
+Config_File_Expand_Args(int* argc, const char*** argv)
+{
+  const char* path = NULL;
+  for (int i = 1; i + 1 < *argc; i++) {
+    if (strcmp((*argv)[i], "--config") == 0) {
+      path = (*argv)[i + 1];
+    }
+  }
+  if (!path) {
+    return 0;
+  }
+
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    DB_Log(
+      DB_LOG_ERROR, "CONFIG Unable to open %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  int32_t res = push_arg((*argv)[0]);
+  char* line = NULL;
+  size_t line_size = 0;
+  int32_t line_no = 0;
+  while (res == 0 && getline(&line, &line_size, file) != -1) {
+    res = push_line(line, path, ++line_no);
+  }
+  free(line);
+  fclose(file);
+
+  for (int i = 1; res == 0 && i < *argc; i++) {
+    res = push_arg((*argv)[i]);
+  }
+  if (res != 0 || push_arg(NULL) != 0) {
+    return -1;
+  }
+
+  DB_Log(DB_LOG_INFO, "CONFIG Loaded %s", path);
+  *argc = num_args - 1;
+  *argv = args;
+  return 0;
+}
@@ -0,0 +1,31 @@
+/**
+ * note (David)
+ * /CONFIG FILE/
+ * --config <file> reads command line options from a file, one option per
+ * line and without the leading dashes:
+ *
+ *   # every interface, IPv4 and IPv6
+ *   bind 0.0.0.0 ::
+ *   port 8079
+ *   tcp-nodelay yes
+ *   tcp-keepalive 300
+ *
+ * blank lines and the ones starting with # are skipped, a value with spaces
+ * goes in double quotes. the options of the file are put in front of the
+ * ones on the command line, so the command line overrides the file.
+ */
+#ifndef __TINY_DB_CONFIG_FILE
+#define __TINY_DB_CONFIG_FILE
+
+#include <stdint.h>
+
+/**
+ * replaces argc/argv with the options of the --config file followed by the
+ * command line, they stay allocated until the process exits. without
+ * --config they are left alone.
+ * @returns -1 when the file cannot be read
+ */
+int32_t
+Config_File_Expand_Args(int* argc, const char*** argv);
+
+#endif // __TINY_DB_CONFIG_FILE
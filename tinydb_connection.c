@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "config.h"
+#include "tinydb_clock.h"
+#include "tinydb_connection.h"
+#include "tinydb_log.h"
+#include "tinydb_output.h"
+
+Connection*
+Create_Connection(int32_t sock, Database* db, DB_User* user)
+{
+  Connection* conn = (Connection*)calloc(1, sizeof(Connection));
+  if (!conn) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for Connection");
+    return NULL;
+  }
+
+  conn->buffer_size = CONNECTION_BUFFER_SIZE;
+  conn->buffer = (char*)malloc(conn->buffer_size);
+  if (!conn->buffer) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for Connection buffer");
+    free(conn);
+    return NULL;
+  }
+
+  pthread_mutex_init(&conn->output_lock, NULL);
+  pthread_mutex_init(&conn->block_lock, NULL);
+  pthread_cond_init(&conn->unblocked, NULL);
+  conn->sock = sock;
+  conn->db = db;
+  conn->user = user;
+  conn->connected_ms = Now_Ms();
+  return conn;
+}
+
+bool
+Connection_Reserve(Connection* conn, size_t len)
+{
+  size_t size = conn->buffer_size;
+  while (size - conn->total_read - 1 < len) {
+    size *= 2;
+  }
+  if (size == conn->buffer_size) {
+    return true;
+  }
+
+  char* buffer = (char*)realloc(conn->buffer, size);
+  if (!buffer) {
+    DB_Log(DB_LOG_ERROR, "Failed to reallocate memory for Connection buffer");
+    return false;
+  }
+  conn->buffer = buffer;
+  conn->buffer_size = size;
+  return true;
+}
+
+void
+Connection_Block(Connection* conn)
+{
+  atomic_store(&conn->blocked, true);
+}
+
+void
+Connection_Unblock(Connection* conn)
+{
+  pthread_mutex_lock(&conn->block_lock);
+  bool was_blocked = atomic_exchange(&conn->blocked, false);
+  pthread_cond_broadcast(&conn->unblocked);
+  pthread_mutex_unlock(&conn->block_lock);
+
+  if (was_blocked && conn->resume) {
+    conn->resume(conn);
+  }
+}
+
+bool
+Connection_Is_Blocked(Connection* conn)
+{
+  return atomic_load(&conn->blocked);
+}
+
+bool
+Connection_Wait_Unblocked(Connection* conn, int64_t timeout_ms)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += timeout_ms / 1000;
+  ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&conn->block_lock);
+  int rc = 0;
+  while (atomic_load(&conn->blocked) && rc == 0) {
+    rc = pthread_cond_timedwait(&conn->unblocked, &conn->block_lock, &ts);
+  }
+  pthread_mutex_unlock(&conn->block_lock);
+  return !atomic_load(&conn->blocked);
+}
+
+void
+Destroy_Connection(Connection* conn)
+{
+  if (!conn) {
+    return;
+  }
+  OutputChunk* chunk = conn->output_head;
+  while (chunk) {
+    OutputChunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  pthread_mutex_destroy(&conn->output_lock);
+  pthread_mutex_destroy(&conn->block_lock);
+  pthread_cond_destroy(&conn->unblocked);
+  free(conn->buffer);
+  free(conn);
+}
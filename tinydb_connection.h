@@ -0,0 +1,112 @@
+/**
+ * note (David)
+ * /CONNECTION/
+ * everything a command needs to know about the client that sent it. a
+ * connection is only touched by the worker running its handler (and by the
+ * shard executor running its command while the handler waits), so none of it
+ * needs locking.
+ *
+ * the AOF replay and the replica link execute with a connection of their own
+ * on the stack, with sock -1 their replies go nowhere.
+ *
+ * the output queue is the exception, publishers and blocking pops write to
+ * other connections, see /OUTPUT/.
+ */
+#ifndef __TINY_DB_CONNECTION
+#define __TINY_DB_CONNECTION
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tinydb_database.h"
+#include "tinydb_user.h"
+
+typedef struct Connection
+{
+  int32_t sock; // -1: not a client
+
+  // received bytes that were not parsed yet
+  char* buffer;
+  size_t buffer_size;
+  size_t total_read;
+
+  Database* db; // switched by SELECT
+  DB_User* user;
+  bool subscribed; // subscriptions are dropped when it closes
+
+  // replies that were not sent yet, see /OUTPUT/
+  struct OutputSystem* output; // NULL: replies are dropped
+  pthread_mutex_t output_lock;
+  struct OutputChunk* output_head;
+  struct OutputChunk* output_tail;
+  size_t output_pending;
+  bool output_armed;  // the output thread waits for the socket
+  bool output_closed; // over its limit or the peer is gone
+
+  // set by servers that read the socket themselves (see /IO_URING/), they
+  // stop reading it before a command takes it over (PSYNC). NULL: the
+  // command runs on the reader
+  void (*detach)(struct Connection* conn);
+  void* io;
+
+  // waiting in BLPOP/BRPOP, the commands after it are not executed until it
+  // is served or times out. resume is called once it is unblocked, NULL: the
+  // handler waits for unblocked
+  pthread_mutex_t block_lock;
+  pthread_cond_t unblocked;
+  atomic_bool blocked;
+  void (*resume)(struct Connection* conn);
+  struct BlockedClient* waiting; // under the lock of the BlockingSystem
+
+  int64_t connected_ms;
+  uint64_t num_commands;
+  uint64_t bytes_read;
+
+  // open connections, see TCP_Client_Shutdown_All
+  struct Connection* prev;
+  struct Connection* next;
+} Connection;
+
+/**
+ * @returns connection of a client on sock, NULL when out of memory
+ */
+Connection*
+Create_Connection(int32_t sock, Database* db, DB_User* user);
+
+/**
+ * grows the buffer until len more bytes and the terminating '\0' fit after
+ * the ones it holds.
+ * @returns false when out of memory
+ */
+bool
+Connection_Reserve(Connection* conn, size_t len);
+
+void
+Connection_Block(Connection* conn);
+
+/**
+ * lets a blocked connection execute commands again.
+ */
+void
+Connection_Unblock(Connection* conn);
+
+bool
+Connection_Is_Blocked(Connection* conn);
+
+/**
+ * waits up to timeout_ms for conn to be unblocked.
+ * @returns true once it is not blocked
+ */
+bool
+Connection_Wait_Unblocked(Connection* conn, int64_t timeout_ms);
+
+/**
+ * frees the connection, the socket is left to the caller.
+ */
+void
+Destroy_Connection(Connection* conn);
+
+#endif // __TINY_DB_CONNECTION
@@ -1,13 +1,52 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "tinydb_context.h"
 #include "tinydb_hash.h"
 #include "tinydb_log.h"
 #include "tinydb_snapshot.h"
 #include "tinydb_pubsub.h"
 
+static const SaveRule save_rules[] = SAVE_RULES;
+
+static int32_t
+Initialize_Databases(RuntimeContext* context, int32_t num_databases)
+{
+  // all the slots exist up front, the ones past num_databases are not
+  // initialized until they are selected
+  int32_t num_slots =
+    num_databases > NUM_DATABASES ? num_databases : NUM_DATABASES;
+  context->db_manager.num_databases = num_slots;
+  context->db_manager.databases =
+    (Database*)calloc(num_slots, sizeof(Database));
+  if (context->db_manager.databases == NULL) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for databases");
+    return -1;
+  }
+
+  // initializing each db
+  for (int32_t i = 0; i < num_slots; ++i) {
+    Database* db = &context->db_manager.databases[i];
+    db->ID = i;
+    db->name = NULL;
+    if (i < num_databases && Initialize_Database(db) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
 RuntimeContext*
-Initialize_Context(int32_t num_databases, const char* snapshot_file)
+Initialize_Context(int32_t num_databases,
+                   const char* snapshot_file,
+                   bool snapshot_zero_copy,
+                   const char* aof_file,
+                   AOF_FSYNC_POLICY aof_fsync)
 {
-  RuntimeContext* context = (RuntimeContext*)malloc(sizeof(RuntimeContext));
+  // zeroed, Import_Snapshot releases whatever databases/users it finds
+  RuntimeContext* context = (RuntimeContext*)calloc(1, sizeof(RuntimeContext));
   if (context == NULL) {
     DB_Log(DB_LOG_ERROR, "Failed to allocate memory for RuntimeContext.");
     return NULL;
@@ -15,38 +54,82 @@ Initialize_Context(int32_t num_databases, const char* snapshot_file)
 
   context->Active.db = NULL;
   context->Active.user = NULL;
+  context->snapshot_zero_copy = snapshot_zero_copy;
+  pthread_mutex_init(&context->db_manager.init_lock, NULL);
 
   context->pubsub_system = Create_PubSub_System();
+  context->blocking_system = Create_Blocking_System();
 
-  if (snapshot_file != NULL) {
+  int32_t loaded = 0;
+  bool from_snapshot = false;
+
+  // the command log is always more recent than the last snapshot, unless it
+  // has nothing in it
+  struct stat aof_st;
+  bool aof_empty = aof_file == NULL || stat(aof_file, &aof_st) != 0 ||
+                   aof_st.st_size == 0;
+  if (!aof_empty) {
+    if (Initialize_Databases(context, num_databases) != 0) {
+      free(context);
+      return NULL;
+    }
+    if (AOF_Replay(context, aof_file) == 0) {
+      loaded = 1;
+    } else {
+      DB_Log(DB_LOG_WARNING, "Failed to replay AOF %s.", aof_file);
+    }
+  }
+
+  if (!loaded && snapshot_file != NULL) {
     if (Import_Snapshot(context, snapshot_file) == 0) {
-      return context;
+      loaded = 1;
+      from_snapshot = true;
     } else {
       DB_Log(DB_LOG_WARNING,
              "Failed to import snapshot. Initializing empty context.");
     }
   }
 
-  // normal initialization if there was no snapshot or failed to import
-  context->db_manager.num_databases = num_databases;
-  context->db_manager.databases =
-    (Database*)malloc(sizeof(Database) * num_databases);
-  if (context->db_manager.databases == NULL) {
-    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for databases");
-    free(context);
-    return NULL;
+  // normal initialization if there was nothing to load
+  if (!loaded) {
+    if (Initialize_Databases(context, num_databases) != 0) {
+      free(context);
+      return NULL;
+    }
+
+    context->user_manager.users = NULL;
+    context->user_manager.num_users = 0;
   }
 
-  // initializing each db
-  for (int32_t i = 0; i < num_databases; ++i) {
-    Database* db = &context->db_manager.databases[i];
-    db->ID = i;
-    db->name = NULL;
-    Initialize_Database(db);
+  // created after loading, replayed writes do not count towards the rules
+  if (snapshot_file != NULL) {
+    context->save_system =
+      Create_Save_System(context,
+                         snapshot_file,
+                         save_rules,
+                         sizeof(save_rules) / sizeof(save_rules[0]));
   }
 
-  context->user_manager.users = NULL;
-  context->user_manager.num_users = 0;
+  context->replication = Create_Replication(context);
+
+  if (aof_file != NULL) {
+    context->aof = Create_AOF(aof_file, aof_fsync);
+    if (context->aof == NULL) {
+      DB_Log(DB_LOG_WARNING, "AOF is disabled, writes will not be logged.");
+    } else if (from_snapshot && aof_empty) {
+      // the next start replays the log and skips the snapshot, what it
+      // loaded has to be in the log before the first write is appended
+      DB_Log(DB_LOG_INFO, "Writing the snapshot data to the new AOF.");
+      if (AOF_Rewrite_Start(context->aof, &context->db_manager) != 0 ||
+          AOF_Rewrite_Wait(context->aof) != 0) {
+        // the log stays empty, the next start loads the snapshot again
+        DB_Log(DB_LOG_WARNING,
+               "AOF is disabled, the snapshot data could not be logged.");
+        Destroy_AOF(context->aof);
+        context->aof = NULL;
+      }
+    }
+  }
 
   return context;
 }
@@ -57,6 +140,9 @@ Cleanup_Partial_Context(RuntimeContext* context, int32_t num_initialized_dbs)
   for (int32_t i = 0; i < num_initialized_dbs; ++i) {
     Database* db = &context->db_manager.databases[i];
     free(db->name);
+    if (!atomic_load(&db->ready)) {
+      continue;
+    }
     for (int j = 0; j < NUM_SHARDS; ++j) {
       HM_Destroy(db->shards[j].entries);
       pthread_rwlock_destroy(&db->shards[j].rwlock);
@@ -72,9 +158,24 @@ Free_Context(RuntimeContext* context)
   if (context == NULL)
     return;
 
+  if (context->replication) {
+    Destroy_Replication(context->replication);
+  }
+
+  if (context->save_system) {
+    Destroy_Save_System(context->save_system);
+  }
+
+  if (context->aof) {
+    Destroy_AOF(context->aof);
+  }
+
   for (int32_t i = 0; i < context->db_manager.num_databases; ++i) {
     Database* db = &context->db_manager.databases[i];
     free(db->name);
+    if (!atomic_load(&db->ready)) {
+      continue;
+    }
 
     for (int j = 0; j < NUM_SHARDS; ++j) {
       DatabaseShard* shard = &db->shards[j];
@@ -83,6 +184,11 @@ Free_Context(RuntimeContext* context)
     }
   }
   free(context->db_manager.databases);
+  pthread_mutex_destroy(&context->db_manager.init_lock);
+
+  if (context->snapshot_mapping) {
+    munmap(context->snapshot_mapping, context->snapshot_mapping_size);
+  }
 
   for (int32_t i = 0; i < context->user_manager.num_users; ++i) {
     free(context->user_manager.users[i].name);
@@ -8,25 +8,53 @@
 #include <string.h>
 
 #include "config.h"
+#include "tinydb_admission.h"
+#include "tinydb_aof.h"
+#include "tinydb_bgsave.h"
+#include "tinydb_blocking.h"
 #include "tinydb_database.h"
 #include "tinydb_datatype.h"
+#include "tinydb_output.h"
 #include "tinydb_pubsub.h"
+#include "tinydb_replication.h"
 #include "tinydb_user.h"
 
 typedef struct RuntimeContext
 {
   PubSubSystem* pubsub_system;
+  BlockingSystem* blocking_system;
+  OutputSystem* output_system;
+  AdmissionSystem* admission_system;
+  AOF* aof;
+  SaveSystem* save_system;
+  Replication* replication;
   DatabaseManager db_manager;
   UserManager user_manager;
+
+  // --snapshot-zero-copy, set before the snapshot is loaded
+  bool snapshot_zero_copy;
+  // mapping the zero copy string values point into
+  char* snapshot_mapping;
+  size_t snapshot_mapping_size;
+
   struct
   {
-    Database* db;
+    Database* db; // new connections start in it, SELECT switches theirs
     DB_User* user;
   } Active;
 } RuntimeContext;
 
+/**
+ * loads the data from the append only file when it exists, falls back to the
+ * snapshot and then to empty databases. the AOF is (re)opened for appending
+ * afterwards when aof_file is not NULL.
+ */
 RuntimeContext*
-Initialize_Context(int32_t num_databases, const char* snapshot_file);
+Initialize_Context(int32_t num_databases,
+                   const char* snapshot_file,
+                   bool snapshot_zero_copy,
+                   const char* aof_file,
+                   AOF_FSYNC_POLICY aof_fsync);
 
 void
 Cleanup_Partial_Context(RuntimeContext* context, int32_t num_initialized_dbs);
@@ -1,8 +1,14 @@
+#include <inttypes.h>
+#include <string.h>
+
 #include "tinydb_database.h"
 #include "tinydb_database_entry_destructor.h"
 #include "tinydb_hash.h"
 #include "tinydb_log.h"
 
+// threads the shards are spread over, 0: shared by everyone
+static int32_t num_shard_owners = 0;
+
 int32_t
 Pick_Shard(const char* key)
 {
@@ -11,28 +17,122 @@ Pick_Shard(const char* key)
 }
 
 void
+Set_Shard_Owners(int32_t num_owners)
+{
+  num_shard_owners = num_owners;
+}
+
+int32_t
+Shard_Owner(int32_t shard_id)
+{
+  return num_shard_owners > 0 ? shard_id % num_shard_owners : -1;
+}
+
+HashMap*
+Create_Shard_Map(int32_t shard_id, size_t expected)
+{
+  HashMap* map = HM_Create_With_Capacity(Database_Entry_Destructor, expected);
+  if (map) {
+    map->owner = Shard_Owner(shard_id);
+  }
+  return map;
+}
+
+void
+Shard_Read_Lock(DatabaseShard* shard)
+{
+  if (!HM_Is_Owner(shard->entries)) {
+    pthread_rwlock_rdlock(&shard->rwlock);
+  }
+}
+
+void
+Shard_Write_Lock(DatabaseShard* shard)
+{
+  if (!HM_Is_Owner(shard->entries)) {
+    pthread_rwlock_wrlock(&shard->rwlock);
+  }
+}
+
+void
+Shard_Unlock(DatabaseShard* shard)
+{
+  if (!HM_Is_Owner(shard->entries)) {
+    pthread_rwlock_unlock(&shard->rwlock);
+  }
+}
+
+int32_t
 Initialize_Database(Database* db)
 {
   for (int i = 0; i < NUM_SHARDS; i++) {
-    db->shards[i].entries = HM_Create(Database_Entry_Destructor);
+    db->shards[i].entries = Create_Shard_Map(i, 0);
     if (db->shards[i].entries == NULL) {
       DB_Log(DB_LOG_ERROR, "Failed to create hash map for shard %d", i);
       for (int j = 0; j < i; j++) {
         HM_Destroy(db->shards[j].entries);
+        db->shards[j].entries = NULL;
         pthread_rwlock_destroy(&db->shards[j].rwlock);
       }
-      return;
+      return -1;
     }
     db->shards[i].num_entries = 0;
+    atomic_init(&db->shards[i].num_commands, 0);
+    atomic_init(&db->shards[i].num_writes, 0);
 
     if (pthread_rwlock_init(&db->shards[i].rwlock, NULL) != 0) {
       DB_Log(DB_LOG_ERROR, "Error initializing rwlock for shard %d", i);
       for (int j = 0; j <= i; j++) {
         HM_Destroy(db->shards[j].entries);
+        db->shards[j].entries = NULL;
         if (j < i)
           pthread_rwlock_destroy(&db->shards[j].rwlock);
       }
-      return;
+      return -1;
     }
   }
+
+  // readers that see ready see the shards
+  atomic_store(&db->ready, true);
+  return 0;
+}
+
+Database*
+Select_Database(DatabaseManager* manager, int64_t id)
+{
+  if (id < 0 || id >= manager->num_databases) {
+    return NULL;
+  }
+
+  Database* db = &manager->databases[id];
+  if (atomic_load(&db->ready)) {
+    return db;
+  }
+
+  pthread_mutex_lock(&manager->init_lock);
+  if (!atomic_load(&db->ready)) {
+    DB_Log(DB_LOG_INFO, "Creating database %" PRId64, id);
+    Initialize_Database(db);
+  }
+  pthread_mutex_unlock(&manager->init_lock);
+
+  return atomic_load(&db->ready) ? db : NULL;
+}
+
+void
+Database_Stats(Database* db, DatabaseStats* stats)
+{
+  memset(stats, 0, sizeof(DatabaseStats));
+  if (!atomic_load(&db->ready)) {
+    return;
+  }
+
+  for (int i = 0; i < NUM_SHARDS; i++) {
+    DatabaseShard* shard = &db->shards[i];
+    stats->num_keys += atomic_load(&shard->num_entries);
+    stats->num_commands +=
+      atomic_load_explicit(&shard->num_commands, memory_order_relaxed);
+    stats->num_writes +=
+      atomic_load_explicit(&shard->num_writes, memory_order_relaxed);
+  }
 }
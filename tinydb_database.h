@@ -12,12 +12,18 @@ typedef struct
   HashMap* entries;
   atomic_size_t num_entries;
   pthread_rwlock_t rwlock;
+
+  // commands on keys of the shard, counted per shard rather than per database
+  // so the counters do not become the one cache line every worker writes
+  atomic_uint_fast64_t num_commands;
+  atomic_uint_fast64_t num_writes;
 } DatabaseShard;
 
 typedef struct
 {
   EntryID ID;
   char* name;
+  atomic_bool ready; // the shards exist, false until first selected
   DatabaseShard shards[NUM_SHARDS];
 } Database;
 
@@ -25,12 +31,67 @@ typedef struct DatabaseManager
 {
   Database* databases;
   int32_t num_databases;
+  pthread_mutex_t init_lock; // held while a database is created on first use
 } DatabaseManager;
 
+typedef struct DatabaseStats
+{
+  uint64_t num_keys;
+  uint64_t num_commands;
+  uint64_t num_writes;
+} DatabaseStats;
+
 int32_t
 Pick_Shard(const char* key);
 
+/**
+ * shard i of the databases created from now on belongs to owner
+ * i % num_owners (a shard executor), 0 shares them. set before the first
+ * database is created.
+ */
 void
+Set_Shard_Owners(int32_t num_owners);
+
+/**
+ * @returns owner of shard_id, -1 when the shards are shared
+ */
+int32_t
+Shard_Owner(int32_t shard_id);
+
+/**
+ * creates the map of shard shard_id, big enough for expected entries.
+ */
+HashMap*
+Create_Shard_Map(int32_t shard_id, size_t expected);
+
+/**
+ * shard->rwlock keeps walks over the whole shard apart from its writers, the
+ * owner of the shard takes none.
+ */
+void
+Shard_Read_Lock(DatabaseShard* shard);
+
+void
+Shard_Write_Lock(DatabaseShard* shard);
+
+void
+Shard_Unlock(DatabaseShard* shard);
+
+/**
+ * creates the shards of db.
+ * @returns 0 on success, -1 when they could not be created (db has none then)
+ */
+int32_t
 Initialize_Database(Database* db);
 
+/**
+ * @returns database id, its shards are created first when it was not used
+ * yet. NULL when id is out of range or the shards could not be created
+ */
+Database*
+Select_Database(DatabaseManager* manager, int64_t id);
+
+void
+Database_Stats(Database* db, DatabaseStats* stats);
+
 #endif // __TINY_DB_DATABASE
\ No newline at end of file
@@ -5,17 +5,17 @@
 #include "tinydb_list.h"
 
 void
-Database_Entry_Destructor(void* value)
+Database_Entry_Clear(DatabaseEntry* entry)
 {
-  if (value == NULL)
+  if (entry == NULL)
     return;
 
-  DatabaseEntry* entry = (DatabaseEntry*)value;
   free(entry->key);
+  entry->key = NULL;
 
   switch (entry->type) {
     case DB_ENTRY_STRING:
-      if (entry->value.string.value != NULL) {
+      if (entry->value.string.value != NULL && !entry->borrowed) {
         free(entry->value.string.value);
       }
       break;
@@ -36,7 +36,16 @@ Database_Entry_Destructor(void* value)
       // should never happen
       break;
   }
+}
 
+void
+Database_Entry_Destructor(void* value)
+{
+  if (value == NULL)
+    return;
+
+  DatabaseEntry* entry = (DatabaseEntry*)value;
+  Database_Entry_Clear(entry);
   free(entry);
 }
 
@@ -46,7 +55,14 @@ Destroy_DB_Object(DB_Object* obj)
   if (obj == NULL)
     return;
 
+  // compact fields are stored inline, only their key and value are owned
+  for (uint32_t i = 0; i < obj->num_compact; i++) {
+    Database_Entry_Clear(&obj->compact[i]);
+  }
+  free(obj->compact);
+
   HM_Destroy(obj->fields);
+  pthread_rwlock_destroy(&obj->rwlock);
   free(obj);
 }
 
@@ -56,13 +72,5 @@ HPLinkedList_Destroy(HPLinkedList* list)
   if (list == NULL)
     return;
 
-  ListNode* current = list->head;
-  while (current != NULL) {
-    ListNode* next = current->next;
-    Database_Entry_Destructor(&current->value);
-    free(current);
-    current = next;
-  }
-
-  free(list);
+  HPList_Destroy(list);
 }
@@ -3,6 +3,13 @@
 
 #include "tinydb_datatype.h"
 
+/**
+ * releases key and value of the entry but not the entry itself, used for
+ * entries that are stored inline.
+ */
+void
+Database_Entry_Clear(DatabaseEntry* entry);
+
 void
 Database_Entry_Destructor(void* value);
 
@@ -2,6 +2,7 @@
 #define __TINY_DB_DATATYPE
 
 #include <stdatomic.h>
+#include <stdbool.h>
 #include "tinydb_list.h"
 #include "tinydb_hashmap.h"
 
@@ -25,9 +26,24 @@ typedef struct DB_String
   char* value;
 } DB_String;
 
+typedef enum
+{
+  DB_OBJECT_ENCODING_COMPACT,
+  DB_OBJECT_ENCODING_HASHMAP
+} DB_OBJECT_ENCODING;
+
+/**
+ * small objects keep their fields in a flat array (compact), once they grow
+ * past DB_OBJECT_COMPACT_MAX_FIELDS the fields move into a HashMap.
+ */
 typedef struct DB_Object
 {
+  DB_OBJECT_ENCODING encoding;
+  struct DatabaseEntry* compact;
+  uint32_t num_compact;
+  uint32_t compact_capacity;
   HashMap* fields;
+  pthread_rwlock_t rwlock;
 } DB_Object;
 
 typedef union
@@ -38,11 +54,12 @@ typedef union
   HPLinkedList* list;
 } DB_Value;
 
-typedef struct
+typedef struct DatabaseEntry
 {
   char* key;
   DB_Value value;
   DB_ENTRY_TYPE type;
+  bool borrowed; // string value points into a mapped snapshot, not freed
 } DatabaseEntry;
 
 #endif // __TINY_DB_DATATYPE
\ No newline at end of file
@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 #include "tinydb_hash.h"
 
 static const uint32_t kernel[] = {
@@ -161,3 +163,58 @@ DJB2_Hash_String(const char* str)
   }
   return hash;
 }
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void
+CRC32C_Init_Table()
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int32_t j = 0; j < 8; j++) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc32c_table[0][i] = crc;
+  }
+
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = crc32c_table[0][i];
+    for (int32_t t = 1; t < 8; t++) {
+      crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+      crc32c_table[t][i] = crc;
+    }
+  }
+}
+
+// slicing by 8, consumes 8 bytes per step
+uint32_t
+CRC32C(uint32_t crc, const void* data, size_t len)
+{
+  pthread_once(&crc32c_once, CRC32C_Init_Table);
+
+  const uint8_t* p = (const uint8_t*)data;
+  crc = ~crc;
+
+  while (len >= 8) {
+    uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                         (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 |
+                  (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+          crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+          crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+
+  while (len--) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
@@ -35,4 +35,11 @@ SHA256(uint8_t hash[32], const void* input, size_t len);
 uint64_t
 DJB2_Hash_String(const char* str);
 
+/**
+ * CRC-32C (Castagnoli), crc is the value returned by the previous call (0 for
+ * the first one) so large inputs can be checksummed in pieces.
+ */
+uint32_t
+CRC32C(uint32_t crc, const void* data, size_t len);
+
 #endif // __TINY_DB_HASH
@@ -9,6 +9,53 @@
 #include "tinydb_hashmap.h"
 #include "tinydb_log.h"
 
+// owner of the maps the calling thread touches without locks, -1: none
+static _Thread_local int32_t thread_owner = -1;
+
+static inline bool
+owned(const HashMap* map)
+{
+  return map->owner >= 0 && map->owner == thread_owner;
+}
+
+static inline int
+read_lock(HashMap* map, pthread_rwlock_t* lock)
+{
+  return owned(map) ? 0 : pthread_rwlock_rdlock(lock);
+}
+
+static inline void
+write_lock(HashMap* map, pthread_rwlock_t* lock)
+{
+  if (!owned(map)) {
+    pthread_rwlock_wrlock(lock);
+  }
+}
+
+static inline void
+unlock(HashMap* map, pthread_rwlock_t* lock)
+{
+  if (!owned(map)) {
+    pthread_rwlock_unlock(lock);
+  }
+}
+
+static inline void
+lock_resize(HashMap* map)
+{
+  if (!owned(map)) {
+    pthread_mutex_lock(&map->resize_lock);
+  }
+}
+
+static inline void
+unlock_resize(HashMap* map)
+{
+  if (!owned(map)) {
+    pthread_mutex_unlock(&map->resize_lock);
+  }
+}
+
 static size_t
 hash(const char* key, size_t capacity)
 {
@@ -29,12 +76,23 @@ Quad_Probe(size_t index, size_t i, size_t cap)
 
 HashMap*
 HM_Create(ValueDestructor value_destructor)
+{
+  return HM_Create_With_Capacity(value_destructor, 0);
+}
+
+HashMap*
+HM_Create_With_Capacity(ValueDestructor value_destructor, size_t expected)
 {
   HashMap* map = (HashMap*)malloc(sizeof(HashMap));
   if (!map)
     return NULL;
 
+  // smallest power of 2 that holds expected entries below the load factor,
+  // so filling the map never triggers a resize
   map->capacity = INITIAL_CAPACITY;
+  while ((double)expected / map->capacity >= LOAD_FACTOR_THRESHOLD) {
+    map->capacity <<= 1;
+  }
   atomic_init(&map->size, 0);
   map->entries = (HashEntry*)calloc(map->capacity, sizeof(HashEntry));
   map->locks =
@@ -52,6 +110,7 @@ HM_Create(ValueDestructor value_destructor)
     atomic_flag_clear(&map->entries[i].is_migrating);
   }
 
+  pthread_rwlock_init(&map->table_lock, NULL);
   pthread_mutex_init(&map->resize_lock, NULL);
   atomic_init(&map->is_resizing, false);
   atomic_init(&map->resize_progress, 0);
@@ -60,9 +119,22 @@ HM_Create(ValueDestructor value_destructor)
   Memory_Pool_Init(&map->key_pool);
 
   map->value_destructor = value_destructor;
+  map->owner = -1;
   return map;
 }
 
+void
+HM_Set_Thread_Owner(int32_t owner)
+{
+  thread_owner = owner;
+}
+
+bool
+HM_Is_Owner(const HashMap* map)
+{
+  return owned(map);
+}
+
 void
 HM_Destroy(HashMap* map)
 {
@@ -94,6 +166,7 @@ HM_Destroy(HashMap* map)
     free(map->old_entries);
   }
 
+  pthread_rwlock_destroy(&map->table_lock);
   pthread_mutex_destroy(&map->resize_lock);
   free(map->entries);
   free(map->locks);
@@ -107,7 +180,7 @@ resize_increment(HashMap* map)
   if (!atomic_load(&map->is_resizing))
     return;
 
-  pthread_mutex_lock(&map->resize_lock);
+  lock_resize(map);
 
   size_t start = atomic_load(&map->resize_progress);
   size_t end = start + RESIZE_WORK_INCREMENT;
@@ -158,7 +231,7 @@ resize_increment(HashMap* map)
     atomic_store(&map->is_resizing, false);
   }
 
-  pthread_mutex_unlock(&map->resize_lock);
+  unlock_resize(map);
 }
 
 static void
@@ -171,7 +244,7 @@ resize_if_needed(HashMap* map)
   if (atomic_exchange(&map->is_resizing, true))
     return; // another thread is already resizing
 
-  pthread_mutex_lock(&map->resize_lock);
+  lock_resize(map);
 
   size_t new_capacity = map->capacity << 1; // double the capacity
   HashEntry* new_entries = (HashEntry*)calloc(new_capacity, sizeof(HashEntry));
@@ -182,7 +255,7 @@ resize_if_needed(HashMap* map)
     free(new_entries);
     free(new_locks);
     atomic_store(&map->is_resizing, false);
-    pthread_mutex_unlock(&map->resize_lock);
+    unlock_resize(map);
     return;
   }
 
@@ -199,11 +272,64 @@ resize_if_needed(HashMap* map)
   map->capacity = new_capacity;
   atomic_store(&map->resize_progress, 0);
 
-  pthread_mutex_unlock(&map->resize_lock);
+  unlock_resize(map);
 
   resize_increment(map);
 }
 
+// looks key up among the old entries the resize has not migrated yet, the
+// migrated ones are stale copies. caller holds table_lock
+static HashEntry*
+find_unmigrated(HashMap* map, const char* key)
+{
+  if (map->old_entries == NULL) {
+    return NULL;
+  }
+
+  size_t progress = atomic_load(&map->resize_progress);
+  size_t index = hash(key, map->old_capacity);
+  for (size_t i = 1; i <= map->old_capacity; i++) {
+    HashEntry* entry = &map->old_entries[index];
+    if (!entry->is_occupied) {
+      return NULL;
+    }
+    if (index >= progress && !entry->is_deleted &&
+        strcmp(entry->key, key) == 0) {
+      return entry;
+    }
+    index = Quad_Probe(index, i, map->old_capacity);
+  }
+  return NULL;
+}
+
+// moves key to the new table ahead of the resize, a write must not leave a
+// copy behind that is migrated over it later. caller holds table_lock for
+// writing
+static void
+migrate_key(HashMap* map, const char* key)
+{
+  HashEntry* old = find_unmigrated(map, key);
+  if (old == NULL) {
+    return;
+  }
+
+  lock_resize(map);
+  size_t index = hash(old->key, map->capacity);
+  size_t j = 1;
+  while (map->entries[index].is_occupied) {
+    index = Quad_Probe(index, j, map->capacity);
+    j++;
+  }
+  map->entries[index] = *old;
+  atomic_flag_clear(&map->entries[index].is_migrating);
+
+  // stays occupied, the probe sequences of the old entries go through it
+  old->key = NULL;
+  old->value = NULL;
+  old->is_deleted = true;
+  unlock_resize(map);
+}
+
 int8_t
 HM_Put(HashMap* map, const char* key, void* value)
 {
@@ -211,14 +337,16 @@ HM_Put(HashMap* map, const char* key, void* value)
     return HM_ACTION_FAILED;
   }
 
+  write_lock(map, &map->table_lock);
   resize_if_needed(map);
   resize_increment(map);
+  migrate_key(map, key);
 
   size_t index = hash(key, map->capacity);
   size_t i = 0;
 
   for (;;) {
-    pthread_rwlock_wrlock(&map->locks[index]);
+    write_lock(map, &map->locks[index]);
 
     if (!map->entries[index].is_occupied || map->entries[index].is_deleted) {
       if (map->entries[index].is_deleted) {
@@ -228,9 +356,9 @@ HM_Put(HashMap* map, const char* key, void* value)
         if (map->value_destructor && map->entries[index].value != NULL) {
           map->value_destructor(map->entries[index].value);
         }
-      } else {
-        atomic_fetch_add(&map->size, 1);
       }
+      // HM_Remove already took deleted slots out of the size
+      atomic_fetch_add(&map->size, 1);
 
       size_t key_len = strlen(key) + 1;
       char* new_key = Memory_Pool_Alloc(&map->key_pool, key_len);
@@ -242,7 +370,8 @@ HM_Put(HashMap* map, const char* key, void* value)
       map->entries[index].is_occupied = true;
       map->entries[index].is_deleted = false;
 
-      pthread_rwlock_unlock(&map->locks[index]);
+      unlock(map, &map->locks[index]);
+      unlock(map, &map->table_lock);
       return HM_ACTION_ADDED;
     }
 
@@ -252,11 +381,12 @@ HM_Put(HashMap* map, const char* key, void* value)
       }
       map->entries[index].value = value;
       map->entries[index].is_deleted = false;
-      pthread_rwlock_unlock(&map->locks[index]);
+      unlock(map, &map->locks[index]);
+      unlock(map, &map->table_lock);
       return HM_ACTION_MODIFIED;
     }
 
-    pthread_rwlock_unlock(&map->locks[index]);
+    unlock(map, &map->locks[index]);
     i++;
 
     index = Quad_Probe(index, i, map->capacity);
@@ -273,37 +403,48 @@ HM_Get(HashMap* map, const char* key)
     return NULL;
   }
 
-  resize_increment(map);
+  // lookups leave the migration to the writers, they can not move entries
+  // while other lookups walk the tables
+  read_lock(map, &map->table_lock);
 
   size_t index = hash(key, map->capacity);
   size_t i = 0;
   size_t start_index = index;
+  void* value = NULL;
 
   do {
-    if (pthread_rwlock_rdlock(&map->locks[index]) != 0) {
+    if (read_lock(map, &map->locks[index]) != 0) {
       DB_Log(DB_LOG_ERROR, "Failed to acquire read lock for index %zu", index);
+      unlock(map, &map->table_lock);
       return NULL;
     }
 
     if (!map->entries[index].is_occupied) {
-      pthread_rwlock_unlock(&map->locks[index]);
-      return NULL;
+      unlock(map, &map->locks[index]);
+      break;
     }
 
     if (!map->entries[index].is_deleted &&
         strcmp(map->entries[index].key, key) == 0) {
-      void* value = map->entries[index].value;
-      pthread_rwlock_unlock(&map->locks[index]);
+      value = map->entries[index].value;
+      unlock(map, &map->locks[index]);
+      unlock(map, &map->table_lock);
       return value;
     }
 
-    pthread_rwlock_unlock(&map->locks[index]);
+    unlock(map, &map->locks[index]);
     i++;
 
     index = Quad_Probe(index, i, map->capacity);
   } while (index != start_index);
 
-  return NULL;
+  // put before the resize started and not migrated yet
+  HashEntry* old = find_unmigrated(map, key);
+  if (old != NULL) {
+    value = old->value;
+  }
+  unlock(map, &map->table_lock);
+  return value;
 }
 
 int
@@ -313,17 +454,20 @@ HM_Remove(HashMap* map, const char* key)
     return 0;
   }
 
+  write_lock(map, &map->table_lock);
   resize_increment(map);
+  migrate_key(map, key);
 
   size_t index = hash(key, map->capacity);
   size_t i = 0;
   size_t start_index = index;
 
   do {
-    pthread_rwlock_wrlock(&map->locks[index]);
+    write_lock(map, &map->locks[index]);
 
     if (!map->entries[index].is_occupied) {
-      pthread_rwlock_unlock(&map->locks[index]);
+      unlock(map, &map->locks[index]);
+      unlock(map, &map->table_lock);
       return 0;
     }
 
@@ -331,8 +475,8 @@ HM_Remove(HashMap* map, const char* key)
         strcmp(map->entries[index].key, key) == 0) {
       // waiting if the entry is being migrated
       while (atomic_flag_test_and_set(&map->entries[index].is_migrating)) {
-        pthread_rwlock_unlock(&map->locks[index]);
-        pthread_rwlock_wrlock(&map->locks[index]);
+        unlock(map, &map->locks[index]);
+        write_lock(map, &map->locks[index]);
       }
 
       Memory_Pool_Free(
@@ -348,16 +492,18 @@ HM_Remove(HashMap* map, const char* key)
 
       atomic_fetch_sub(&map->size, 1);
       atomic_flag_clear(&map->entries[index].is_migrating);
-      pthread_rwlock_unlock(&map->locks[index]);
+      unlock(map, &map->locks[index]);
+      unlock(map, &map->table_lock);
       return 1;
     }
 
-    pthread_rwlock_unlock(&map->locks[index]);
+    unlock(map, &map->locks[index]);
     i++;
 
     index = Quad_Probe(index, i, map->capacity);
 
   } while (index != start_index);
 
+  unlock(map, &map->table_lock);
   return 0;
 }
@@ -36,6 +36,9 @@ typedef struct HashMap
   size_t capacity;
   atomic_size_t size;
   pthread_rwlock_t* locks;
+  // shared by lookups, writers (and so the migration) have the tables to
+  // themselves
+  pthread_rwlock_t table_lock;
   pthread_mutex_t resize_lock;
   atomic_bool is_resizing;
   atomic_size_t resize_progress;
@@ -43,14 +46,35 @@ typedef struct HashMap
   size_t old_capacity;
   MemoryPool key_pool;
   ValueDestructor value_destructor;
+  int32_t owner; // -1: shared, see HM_Set_Thread_Owner
 } HashMap;
 
 HashMap*
 HM_Create(ValueDestructor value_destructor);
 
+/**
+ * creates the map big enough to hold expected entries without resizing.
+ */
+HashMap*
+HM_Create_With_Capacity(ValueDestructor value_destructor, size_t expected);
+
 void
 HM_Destroy(HashMap* map);
 
+/**
+ * the calling thread owns the maps whose owner is owner from now on, it takes
+ * none of their locks. nothing else may touch them while it runs, the shard
+ * executors guarantee that for the maps of their shards.
+ */
+void
+HM_Set_Thread_Owner(int32_t owner);
+
+/**
+ * @returns true when the calling thread owns map and skips its locks
+ */
+bool
+HM_Is_Owner(const HashMap* map);
+
 /**
  * @returns -1 Failed, 0 Added, 1 Modified
  */
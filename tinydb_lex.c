@@ -1,10 +1,16 @@
 #include "tinydb_lex.h"
 #include <ctype.h>
 
-static const char* commands[] = { "set",    "get",   "rpush",  "lpush",
-                                  "lpop",   "rpop",  "llen",   "lrange",
-                                  "pub",    "sub",   "strlen", "incr",
-                                  "append", "unsub", "export", "insp" };
+static const char* commands[] = { "set",     "get",    "rpush",  "lpush",
+                                  "lpop",    "rpop",   "blpop",  "brpop",
+                                  "llen",    "lrange", "lindex", "hset",
+                                  "hget",    "hdel",   "hgetall", "hincrby",
+                                  "pub",     "sub",    "strlen", "incr",
+                                  "incrby",
+                                  "append",  "unsub",  "export", "insp",
+                                  "bgrewriteaof", "bgsave", "psync",
+                                  "replicaof", "role", "select", "dbstats",
+                                  "load" };
 
 char
 Lexer_Peek(Lexer* lexer, const uint8_t* buf)
@@ -18,6 +24,24 @@ Lexer_Consume(Lexer* lexer, const uint8_t* buf)
   return buf[lexer->cursor++];
 }
 
+static void
+Lexer_Push_Token(Lexer* lexer, Token tok)
+{
+  if (lexer->token_count == lexer->token_capacity) {
+    int32_t capacity = lexer->token_capacity == 0 ? LEX_INITIAL_TOKENS
+                                                  : lexer->token_capacity * 2;
+    Token* tokens = realloc(lexer->tokens, capacity * sizeof(Token));
+    if (!tokens) {
+      free(tok.value);
+      return;
+    }
+    lexer->tokens = tokens;
+    lexer->token_capacity = capacity;
+  }
+
+  lexer->tokens[lexer->token_count++] = tok;
+}
+
 char*
 Lexer_Token_To_String(LEX_TOKEN tok)
 {
@@ -26,6 +50,8 @@ Lexer_Token_To_String(LEX_TOKEN tok)
       return "End of File";
     case LEX_TOKEN_NUMBER:
       return "Number";
+    case LEX_TOKEN_FLOAT:
+      return "Float";
     case LEX_TOKEN_STRING:
       return "String";
     case LEX_TOKEN_IDENTIFIER:
@@ -73,11 +99,11 @@ Lexer_Lex(Lexer* lexer, const uint8_t* buf, size_t len)
             0 &&
           (lexer->cursor + cmd_len == len ||
            isspace(buf[lexer->cursor + cmd_len]))) {
-        lexer->tokens[lexer->token_count++] =
-          (Token){ .type = LEX_TOKEN_COMMAND,
-                   .value = strdup(commands[i]),
-                   .col = col_number,
-                   .line = line_number };
+        Lexer_Push_Token(lexer,
+                         (Token){ .type = LEX_TOKEN_COMMAND,
+                                  .value = strdup(commands[i]),
+                                  .col = col_number,
+                                  .line = line_number });
         lexer->cursor += cmd_len;
         col_number += cmd_len;
         command_found = 1;
@@ -89,11 +115,17 @@ Lexer_Lex(Lexer* lexer, const uint8_t* buf, size_t len)
       continue;
     }
 
+    // '\"' and '\\' inside stand for '"' and '\', other backslashes are kept
     if (c == '"') {
       int32_t start = lexer->cursor;
       col_number++;
       Lexer_Consume(lexer, buf); // opening quote
       while (lexer->cursor < len && Lexer_Peek(lexer, buf) != '"') {
+        if (Lexer_Peek(lexer, buf) == '\\' && lexer->cursor + 1 < len &&
+            (buf[lexer->cursor + 1] == '"' || buf[lexer->cursor + 1] == '\\')) {
+          Lexer_Consume(lexer, buf);
+          col_number++;
+        }
         Lexer_Consume(lexer, buf);
         col_number++;
       }
@@ -103,14 +135,21 @@ Lexer_Lex(Lexer* lexer, const uint8_t* buf, size_t len)
 
       int32_t length = lexer->cursor - start - 2;
       char* value = malloc(length + 1);
-      strncpy(value, (const char*)&buf[start + 1], length);
-      value[length] = '\0';
+      int32_t out = 0;
+      for (int32_t i = start + 1; i < start + 1 + length; i++) {
+        if (buf[i] == '\\' && i + 1 < start + 1 + length &&
+            (buf[i + 1] == '"' || buf[i + 1] == '\\')) {
+          i++;
+        }
+        value[out++] = buf[i];
+      }
+      value[out] = '\0';
 
-      lexer->tokens[lexer->token_count++] =
-        (Token){ .type = LEX_TOKEN_STRING,
-                 .value = value,
-                 .col = col_number - length - 2, // -2 both quotes
-                 .line = line_number };
+      Lexer_Push_Token(lexer,
+                       (Token){ .type = LEX_TOKEN_STRING,
+                                .value = value,
+                                .col = col_number - length - 2, // -2 both quotes
+                                .line = line_number });
       col_number++;
       continue;
     }
@@ -128,32 +167,72 @@ Lexer_Lex(Lexer* lexer, const uint8_t* buf, size_t len)
       strncpy(value, (const char*)&buf[start], length);
       value[length] = '\0';
 
-      lexer->tokens[lexer->token_count++] =
-        (Token){ .type = LEX_TOKEN_IDENTIFIER,
-                 .value = value,
-                 .col = col_number - length,
-                 .line = line_number };
+      Lexer_Push_Token(lexer,
+                       (Token){ .type = LEX_TOKEN_IDENTIFIER,
+                                .value = value,
+                                .col = col_number - length,
+                                .line = line_number });
 
       continue;
     }
 
-    // numbers, only integers for now.
-    if (isdigit(c)) {
+    // numbers, integers with an optional leading minus sign and floats with a
+    // fraction and/or an exponent ("0.5", "1e+20"). anything else that starts
+    // like one ("12ab", "1.") is kept whole as an identifier so handlers can
+    // parse the text themselves
+    if (isdigit(c) || (c == '-' && lexer->cursor + 1 < len &&
+                       isdigit(buf[lexer->cursor + 1]))) {
       int32_t start = lexer->cursor;
+      if (c == '-') {
+        Lexer_Consume(lexer, buf);
+        col_number++;
+      }
       while (lexer->cursor < len && isdigit(Lexer_Peek(lexer, buf))) {
         Lexer_Consume(lexer, buf);
         col_number++;
       }
 
+      LEX_TOKEN type = LEX_TOKEN_NUMBER;
+      if (lexer->cursor + 1 < len && Lexer_Peek(lexer, buf) == '.' &&
+          isdigit(buf[lexer->cursor + 1])) {
+        type = LEX_TOKEN_FLOAT;
+        do {
+          Lexer_Consume(lexer, buf);
+          col_number++;
+        } while (lexer->cursor < len && isdigit(Lexer_Peek(lexer, buf)));
+      }
+      if (lexer->cursor < len && tolower(Lexer_Peek(lexer, buf)) == 'e') {
+        size_t digits = lexer->cursor + 1;
+        if (digits < len && (buf[digits] == '+' || buf[digits] == '-')) {
+          digits++;
+        }
+        if (digits < len && isdigit(buf[digits])) {
+          type = LEX_TOKEN_FLOAT;
+          col_number += digits - lexer->cursor;
+          lexer->cursor = digits;
+          while (lexer->cursor < len && isdigit(Lexer_Peek(lexer, buf))) {
+            Lexer_Consume(lexer, buf);
+            col_number++;
+          }
+        }
+      }
+
+      while (lexer->cursor < len && !isspace(Lexer_Peek(lexer, buf))) {
+        type = LEX_TOKEN_IDENTIFIER;
+        Lexer_Consume(lexer, buf);
+        col_number++;
+      }
+
       int32_t length = lexer->cursor - start;
       char* value = malloc(length + 1);
       strncpy(value, (const char*)&buf[start], length);
       value[length] = '\0';
 
-      lexer->tokens[lexer->token_count++] = (Token){ .type = LEX_TOKEN_NUMBER,
-                                                     .value = value,
-                                                     .col = col_number - length,
-                                                     .line = line_number };
+      Lexer_Push_Token(lexer,
+                       (Token){ .type = type,
+                                .value = value,
+                                .col = col_number - length,
+                                .line = line_number });
 
       continue;
     }
@@ -164,10 +243,11 @@ Lexer_Lex(Lexer* lexer, const uint8_t* buf, size_t len)
   }
 
   // EOF
-  lexer->tokens[lexer->token_count++] = (Token){ .type = LEX_TOKEN_EOF,
-                                                 .value = strdup(""),
-                                                 .col = col_number,
-                                                 .line = line_number };
+  Lexer_Push_Token(lexer,
+                   (Token){ .type = LEX_TOKEN_EOF,
+                            .value = strdup(""),
+                            .col = col_number,
+                            .line = line_number });
 }
 
 void
@@ -186,6 +266,18 @@ Lexer_Free_Token_Value(Token* tok)
   }
 }
 
+void
+Lexer_Free(Lexer* lexer)
+{
+  for (int32_t i = 0; i < lexer->token_count; i++) {
+    Lexer_Free_Token_Value(&lexer->tokens[i]);
+  }
+  free(lexer->tokens);
+  lexer->tokens = NULL;
+  lexer->token_count = 0;
+  lexer->token_capacity = 0;
+}
+
 void
 Lexer_Print_Tokens(Lexer* lexer)
 {
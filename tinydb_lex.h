@@ -7,7 +7,8 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define LEX_MAX_TOKENS 255
+// initial token capacity, the token array grows on demand
+#define LEX_INITIAL_TOKENS 16
 
 typedef enum LEX_TOKEN
 {
@@ -16,6 +17,7 @@ typedef enum LEX_TOKEN
   LEX_TOKEN_NUMBER,
   LEX_TOKEN_IDENTIFIER,
   LEX_TOKEN_COMMAND,
+  LEX_TOKEN_FLOAT,
 } LEX_TOKEN;
 
 typedef struct Token
@@ -30,7 +32,8 @@ typedef struct Lexer
 {
   int32_t cursor;
   int32_t token_count;
-  Token tokens[LEX_MAX_TOKENS];
+  int32_t token_capacity;
+  Token* tokens;
 } Lexer;
 
 char*
@@ -54,4 +57,7 @@ Lexer_Print_Tokens(Lexer* lexer);
 void
 Lexer_Free_Token_Value(Token* tok);
 
+void
+Lexer_Free(Lexer* lexer);
+
 #endif // __TINY_DB_LEX_H
\ No newline at end of file
@@ -1,60 +1,245 @@
 #include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "config.h"
 #include "tinydb_list.h"
 #include "tinydb_log.h"
-#include "tinydb_utils.h"
+#include "tinydb_varint.h"
 
-HPLinkedList*
-HPList_Create()
+// smallest data capacity of a freshly allocated chunk, chunks grow by doubling
+// until they reach HPLIST_CHUNK_SIZE
+#define HPLIST_CHUNK_MIN_CAPACITY 64
+
+static size_t
+encoded_size(const ListNode* node)
 {
-  HPLinkedList* list = (HPLinkedList*)malloc(sizeof(HPLinkedList));
-  if (!list) {
-    DB_Log(DB_LOG_WARNING, "HPList_Create failed, could not allocate memory");
+  switch (node->type) {
+    case TYPE_INT:
+      return 1 + Varint_Size(Zigzag_Encode(node->value.int_value));
+    case TYPE_FLOAT:
+      return 1 + sizeof(double);
+    case TYPE_STRING: {
+      size_t len = strlen(node->value.string_value);
+      return 1 + Varint_Size(len) + len + 1;
+    }
+  }
+  return 0;
+}
+
+static size_t
+encode_node(uint8_t* p, const ListNode* node)
+{
+  size_t offset = 0;
+  p[offset++] = (uint8_t)node->type;
+
+  switch (node->type) {
+    case TYPE_INT:
+      offset += Varint_Write(p + offset, Zigzag_Encode(node->value.int_value));
+      break;
+    case TYPE_FLOAT:
+      memcpy(p + offset, &node->value.float_value, sizeof(double));
+      offset += sizeof(double);
+      break;
+    case TYPE_STRING: {
+      size_t len = strlen(node->value.string_value);
+      offset += Varint_Write(p + offset, len);
+      memcpy(p + offset, node->value.string_value, len + 1);
+      offset += len + 1;
+    } break;
+  }
+
+  return offset;
+}
+
+// string values point into the chunk, nothing is copied
+static size_t
+decode_node(const uint8_t* p, ListNode* out)
+{
+  size_t offset = 0;
+  uint64_t raw = 0;
+  out->type = (ValueType)p[offset++];
+
+  switch (out->type) {
+    case TYPE_INT:
+      offset += Varint_Read(p + offset, &raw);
+      out->value.int_value = Zigzag_Decode(raw);
+      break;
+    case TYPE_FLOAT:
+      memcpy(&out->value.float_value, p + offset, sizeof(double));
+      offset += sizeof(double);
+      break;
+    case TYPE_STRING:
+      offset += Varint_Read(p + offset, &raw);
+      out->value.string_value = (char*)(p + offset);
+      offset += raw + 1;
+      break;
+  }
+
+  return offset;
+}
+
+// same as decode_node, but the caller owns the string
+static size_t
+decode_node_copy(const uint8_t* p, ListNode* out)
+{
+  size_t size = decode_node(p, out);
+  if (out->type == TYPE_STRING) {
+    size_t len = strlen(out->value.string_value);
+    char* copy = (char*)malloc(len + 1);
+    if (copy) {
+      memcpy(copy, out->value.string_value, len + 1);
+    }
+    out->value.string_value = copy;
+  }
+  return size;
+}
+
+static ListChunk*
+chunk_create(size_t capacity)
+{
+  ListChunk* chunk = (ListChunk*)malloc(sizeof(ListChunk) + capacity);
+  if (!chunk) {
+    DB_Log(DB_LOG_WARNING, "HPList could not allocate chunk");
     return NULL;
   }
 
-  list->head = list->tail = NULL;
-  list->count = 0;
-  list->freed_node_count = 0;
-  pthread_rwlock_init(&list->rwlock, NULL);
-  Memory_Pool_Init(&list->node_pool);
-  Memory_Pool_Init(&list->string_pool);
-  return list;
+  chunk->next = chunk->prev = NULL;
+  chunk->count = 0;
+  chunk->used = 0;
+  chunk->capacity = (uint32_t)capacity;
+  return chunk;
 }
 
-void
-HPList_FreeNode(HPLinkedList* list, ListNode* node)
+static size_t
+chunk_capacity_for(size_t need)
 {
-  if (!node) {
-    DB_Log(DB_LOG_WARNING,
-           "HPList_FreeNode could not free the node it was NULL");
-    return;
+  size_t capacity = HPLIST_CHUNK_MIN_CAPACITY;
+  while (capacity < need && capacity < HPLIST_CHUNK_SIZE) {
+    capacity <<= 1;
   }
+  return capacity < need ? need : capacity;
+}
 
-  if (node->type == TYPE_STRING && node->value.string_value) {
-    size_t string_size = strlen(node->value.string_value) + 1;
-    Memory_Pool_Free(&list->string_pool, node->value.string_value, string_size);
-    node->value.string_value = NULL;
+static void
+chunk_unlink(HPLinkedList* list, ListChunk* chunk)
+{
+  if (chunk->prev) {
+    chunk->prev->next = chunk->next;
+  } else {
+    list->head = chunk->next;
+  }
+
+  if (chunk->next) {
+    chunk->next->prev = chunk->prev;
+  } else {
+    list->tail = chunk->prev;
+  }
+
+  list->num_chunks--;
+  free(chunk);
+}
+
+/**
+ * makes sure chunk can take `need` more bytes, growing it in place when it is
+ * still below HPLIST_CHUNK_SIZE. returns the (possibly moved) chunk or NULL
+ * when the element belongs in a new chunk.
+ */
+static ListChunk*
+chunk_reserve(HPLinkedList* list, ListChunk* chunk, size_t need)
+{
+  if (!chunk || chunk->count >= HPLIST_CHUNK_MAX_ENTRIES) {
+    return NULL;
+  }
+
+  size_t required = chunk->used + need;
+  if (required <= chunk->capacity) {
+    return chunk;
   }
 
-  // add node to the reuse pool
-  if (list->freed_node_count < MAX_FREED_NODES) {
-    list->freed_nodes[list->freed_node_count++] = node;
+  if (required > HPLIST_CHUNK_SIZE) {
+    return NULL;
+  }
+
+  size_t capacity = chunk_capacity_for(required);
+  ListChunk* grown = (ListChunk*)realloc(chunk, sizeof(ListChunk) + capacity);
+  if (!grown) {
+    return NULL;
+  }
+
+  grown->capacity = (uint32_t)capacity;
+  if (grown->prev) {
+    grown->prev->next = grown;
+  } else {
+    list->head = grown;
+  }
+  if (grown->next) {
+    grown->next->prev = grown;
   } else {
-    // we need to free the node if reuse pool is full
-    Memory_Pool_Free(&list->node_pool, node, sizeof(ListNode));
+    list->tail = grown;
   }
+
+  return grown;
 }
 
-void
-HPList_LazyFreeNodes(HPLinkedList* list)
+// walks the chunk to find the offset of the element at position index
+static uint32_t
+chunk_offset_of(ListChunk* chunk, uint32_t index)
+{
+  uint32_t offset = 0;
+  ListNode scratch;
+  while (index--) {
+    offset += decode_node(chunk->data + offset, &scratch);
+  }
+  return offset;
+}
+
+// skips whole chunks from whichever end is closer, caller holds the lock
+static ListChunk*
+locate(HPLinkedList* list, size_t index, uint32_t* offset)
+{
+  ListChunk* chunk = NULL;
+
+  if (index < list->count / 2) {
+    chunk = list->head;
+    while (chunk && index >= chunk->count) {
+      index -= chunk->count;
+      chunk = chunk->next;
+    }
+  } else {
+    size_t from_tail = list->count - 1 - index;
+    chunk = list->tail;
+    while (chunk && from_tail >= chunk->count) {
+      from_tail -= chunk->count;
+      chunk = chunk->prev;
+    }
+    if (chunk) {
+      index = chunk->count - 1 - from_tail;
+    }
+  }
+
+  if (chunk) {
+    *offset = chunk_offset_of(chunk, (uint32_t)index);
+  }
+  return chunk;
+}
+
+HPLinkedList*
+HPList_Create()
 {
-  while (list->freed_node_count > 0) {
-    HPList_FreeNode(list, list->freed_nodes[--list->freed_node_count]);
+  HPLinkedList* list = (HPLinkedList*)malloc(sizeof(HPLinkedList));
+  if (!list) {
+    DB_Log(DB_LOG_WARNING, "HPList_Create failed, could not allocate memory");
+    return NULL;
   }
+
+  list->head = list->tail = NULL;
+  list->count = 0;
+  list->num_chunks = 0;
+  pthread_rwlock_init(&list->rwlock, NULL);
+  return list;
 }
 
 void
@@ -67,486 +252,519 @@ HPList_Destroy(HPLinkedList* list)
   }
 
   pthread_rwlock_wrlock(&list->rwlock);
-  ListNode* current = list->head;
+  ListChunk* current = list->head;
   while (current) {
-    ListNode* next = current->next;
-    HPList_FreeNode(list, current);
+    ListChunk* next = current->next;
+    free(current);
     current = next;
   }
-  HPList_LazyFreeNodes(list);
+  list->head = list->tail = NULL;
+  list->count = 0;
   pthread_rwlock_unlock(&list->rwlock);
   pthread_rwlock_destroy(&list->rwlock);
-  Memory_Pool_Destroy(&list->node_pool);
-  Memory_Pool_Destroy(&list->string_pool);
   free(list);
 }
 
-ListNode*
-reuse_or_create_node(HPLinkedList* list)
-{
-  if (list->freed_node_count > 0) {
-    ListNode* node = list->freed_nodes[--list->freed_node_count];
-    node->next = node->prev = NULL;
-    return node;
-  }
-
-  return (ListNode*)Memory_Pool_Alloc(&list->node_pool, sizeof(ListNode));
-}
-
-ListNode*
-create_node_int(HPLinkedList* list, int64_t value)
+static int32_t
+validate_node(const ListNode* node)
 {
-  ListNode* node = reuse_or_create_node(list);
   if (!node) {
-    DB_Log(DB_LOG_WARNING, "create_node_int could not create a node");
-    return NULL;
+    return 0;
   }
 
-  node->type = TYPE_INT;
-  node->value.int_value = value;
-  node->next = node->prev = NULL;
-  return node;
-}
-
-ListNode*
-create_node_float(HPLinkedList* list, double value)
-{
-  ListNode* node = reuse_or_create_node(list);
-  if (!node) {
-    DB_Log(DB_LOG_WARNING, "create_node_float could not create a node");
-    return NULL;
+  if (node->type == TYPE_STRING) {
+    if (!node->value.string_value) {
+      return 0;
+    }
+    size_t value_length = strlen(node->value.string_value);
+    if (value_length > MAX_STRING_LENGTH) {
+      DB_Log(DB_LOG_WARNING,
+             "HPList string was way too long. Current Max=%d",
+             MAX_STRING_LENGTH);
+      return 0;
+    }
   }
 
-  node->type = TYPE_FLOAT;
-  node->value.float_value = value;
-  node->next = node->prev = NULL;
-  return node;
+  return 1;
 }
 
-ListNode*
-create_node_string(HPLinkedList* list, const char* value)
+// caller must hold the write lock
+static int32_t
+push_tail(HPLinkedList* list, const ListNode* node)
 {
-  if (!value) {
-    DB_Log(DB_LOG_WARNING, "create_node_string could not create a node");
-    return NULL;
-  }
-
-  size_t value_length = strlen(value);
-  if (value_length > MAX_STRING_LENGTH) {
-    DB_Log(DB_LOG_WARNING,
-           "CREATE_NODE_STRING Buffer was way too long. Current Max=%d",
-           MAX_STRING_LENGTH);
-    return NULL;
-  }
+  size_t size = encoded_size(node);
+  ListChunk* chunk = chunk_reserve(list, list->tail, size);
 
-  ListNode* node = reuse_or_create_node(list);
-  if (!node) {
-    DB_Log(
-      DB_LOG_WARNING,
-      "In create_node_string, reuse_or_create_node failed to create node.");
-    return NULL;
-  }
+  if (!chunk) {
+    chunk = chunk_create(chunk_capacity_for(size));
+    if (!chunk) {
+      return -1;
+    }
 
-  char* new_value =
-    (char*)Memory_Pool_Alloc(&list->string_pool, value_length + 1);
-  if (!new_value) {
-    DB_Log(DB_LOG_WARNING, "CREATE_NODE_STRING Memory allocation failed");
-    if (list->freed_node_count < MAX_FREED_NODES) {
-      list->freed_nodes[list->freed_node_count++] = node;
+    chunk->prev = list->tail;
+    if (list->tail) {
+      list->tail->next = chunk;
+    } else {
+      list->head = chunk;
     }
-    return NULL;
+    list->tail = chunk;
+    list->num_chunks++;
   }
 
-  strncpy(new_value, value, value_length);
-  new_value[value_length] = '\0';
-
-  node->type = TYPE_STRING;
-  node->value.string_value = new_value;
-  node->next = node->prev = NULL;
-  return node;
+  chunk->used += encode_node(chunk->data + chunk->used, node);
+  chunk->count++;
+  list->count++;
+  return list->count;
 }
 
-int32_t
-HPList_LPush(HPLinkedList* list, ListNode* node)
+// caller must hold the write lock
+static int32_t
+push_head(HPLinkedList* list, const ListNode* node)
 {
-  if (!node) {
-    DB_Log(DB_LOG_WARNING,
-           "HPList_LPush could not access the node. node was NULL");
-    return 0;
-  }
+  size_t size = encoded_size(node);
+  ListChunk* chunk = chunk_reserve(list, list->head, size);
 
-  if (list->head) {
-    list->head->prev = node;
-    node->next = list->head;
-    list->head = node;
-  } else {
-    list->head = list->tail = node;
+  if (!chunk) {
+    chunk = chunk_create(chunk_capacity_for(size));
+    if (!chunk) {
+      return -1;
+    }
+
+    chunk->next = list->head;
+    if (list->head) {
+      list->head->prev = chunk;
+    } else {
+      list->tail = chunk;
+    }
+    list->head = chunk;
+    list->num_chunks++;
   }
 
+  memmove(chunk->data + size, chunk->data, chunk->used);
+  encode_node(chunk->data, node);
+  chunk->used += size;
+  chunk->count++;
   list->count++;
   return list->count;
 }
 
 int32_t
-HPList_RPush_Int(HPLinkedList* list, int64_t value)
+HPList_RPush(HPLinkedList* list, const ListNode* node)
 {
-  ListNode* node = create_node_int(list, value);
-  if (!node) {
-    DB_Log(DB_LOG_WARNING,
-           "create_node_int failed while trying to RPUSH the int");
+  if (!validate_node(node)) {
+    DB_Log(DB_LOG_WARNING, "HPList_RPush received an invalid node");
     return -1;
   }
 
   pthread_rwlock_wrlock(&list->rwlock);
-  int32_t result = HPList_RPush(list, node);
+  int32_t result = push_tail(list, node);
   pthread_rwlock_unlock(&list->rwlock);
   return result;
 }
 
 int32_t
-HPList_RPush_Float(HPLinkedList* list, double value)
+HPList_LPush(HPLinkedList* list, const ListNode* node)
 {
-  ListNode* node = create_node_float(list, value);
-  if (!node) {
-    DB_Log(DB_LOG_WARNING,
-           "create_node_float failed while trying to RPUSH the float");
+  if (!validate_node(node)) {
+    DB_Log(DB_LOG_WARNING, "HPList_LPush received an invalid node");
     return -1;
   }
 
   pthread_rwlock_wrlock(&list->rwlock);
-  int32_t result = HPList_RPush(list, node);
+  int32_t result = push_head(list, node);
   pthread_rwlock_unlock(&list->rwlock);
   return result;
 }
 
-int32_t
-HPList_RPush_String(HPLinkedList* list, const char* value)
+// removes the last element without decoding it, caller must hold the write
+// lock. never allocates, so a failed push can always be undone
+static void
+drop_tail(HPLinkedList* list)
 {
-  ListNode* node = create_node_string(list, value);
-  if (!node) {
-    DB_Log(DB_LOG_WARNING,
-           "create_node_string failed while trying to RPUSH the string");
-    return -1;
+  ListChunk* chunk = list->tail;
+  chunk->used = chunk_offset_of(chunk, chunk->count - 1);
+  chunk->count--;
+  list->count--;
+  if (chunk->count == 0) {
+    chunk_unlink(list, chunk);
   }
+}
 
-  pthread_rwlock_wrlock(&list->rwlock);
-  int32_t result = HPList_RPush(list, node);
-  pthread_rwlock_unlock(&list->rwlock);
-  return result;
+static void
+drop_head(HPLinkedList* list)
+{
+  ListChunk* chunk = list->head;
+  ListNode scratch;
+  size_t size = decode_node(chunk->data, &scratch);
+  memmove(chunk->data, chunk->data + size, chunk->used - size);
+  chunk->used -= size;
+  chunk->count--;
+  list->count--;
+  if (chunk->count == 0) {
+    chunk_unlink(list, chunk);
+  }
 }
 
 int32_t
-HPList_LPush_Int(HPLinkedList* list, int64_t value)
+HPList_RPush_Many(HPLinkedList* list, const ListNode* nodes, size_t count)
 {
-  ListNode* node = create_node_int(list, value);
-  if (!node) {
-    DB_Log(DB_LOG_WARNING,
-           "create_node_int failed while trying to LPUSH the int");
-    return -1;
+  for (size_t i = 0; i < count; i++) {
+    if (!validate_node(&nodes[i])) {
+      DB_Log(DB_LOG_WARNING, "HPList_RPush_Many received an invalid node");
+      return -1;
+    }
   }
 
   pthread_rwlock_wrlock(&list->rwlock);
-  int32_t result = HPList_LPush(list, node);
+  int32_t result = list->count;
+  size_t pushed = 0;
+  for (; pushed < count && result >= 0; pushed++) {
+    result = push_tail(list, &nodes[pushed]);
+  }
+  // all or nothing, the command fails as a whole
+  if (result < 0) {
+    for (size_t i = 1; i < pushed; i++) {
+      drop_tail(list);
+    }
+  }
   pthread_rwlock_unlock(&list->rwlock);
   return result;
 }
 
 int32_t
-HPList_LPush_Float(HPLinkedList* list, double value)
+HPList_LPush_Many(HPLinkedList* list, const ListNode* nodes, size_t count)
 {
-  ListNode* node = create_node_float(list, value);
-  if (!node) {
-    DB_Log(DB_LOG_WARNING,
-           "create_node_float failed while trying to LPUSH the float");
-    return -1;
+  for (size_t i = 0; i < count; i++) {
+    if (!validate_node(&nodes[i])) {
+      DB_Log(DB_LOG_WARNING, "HPList_LPush_Many received an invalid node");
+      return -1;
+    }
   }
 
   pthread_rwlock_wrlock(&list->rwlock);
-  int32_t result = HPList_LPush(list, node);
+  int32_t result = list->count;
+  size_t pushed = 0;
+  for (; pushed < count && result >= 0; pushed++) {
+    result = push_head(list, &nodes[pushed]);
+  }
+  // all or nothing, the command fails as a whole
+  if (result < 0) {
+    for (size_t i = 1; i < pushed; i++) {
+      drop_head(list);
+    }
+  }
   pthread_rwlock_unlock(&list->rwlock);
   return result;
 }
 
 int32_t
-HPList_LPush_String(HPLinkedList* list, const char* value)
+HPList_RPush_Int(HPLinkedList* list, int64_t value)
 {
-  ListNode* node = create_node_string(list, value);
-  if (!node) {
-    DB_Log(DB_LOG_WARNING,
-           "create_node_string failed while trying to LPUSH the string");
-    return -1;
-  }
+  ListNode node = { .type = TYPE_INT, .value = { .int_value = value } };
+  return HPList_RPush(list, &node);
+}
 
-  pthread_rwlock_wrlock(&list->rwlock);
-  int32_t result = HPList_LPush(list, node);
-  pthread_rwlock_unlock(&list->rwlock);
-  return result;
+int32_t
+HPList_RPush_Float(HPLinkedList* list, double value)
+{
+  ListNode node = { .type = TYPE_FLOAT, .value = { .float_value = value } };
+  return HPList_RPush(list, &node);
 }
 
 int32_t
-HPList_RPush(HPLinkedList* list, ListNode* node)
+HPList_RPush_String(HPLinkedList* list, const char* value)
 {
-  if (!node)
-    return list->count;
+  ListNode node = { .type = TYPE_STRING,
+                    .value = { .string_value = (char*)value } };
+  return HPList_RPush(list, &node);
+}
 
-  if (list->tail) {
-    list->tail->next = node;
-    node->prev = list->tail;
-    list->tail = node;
-  } else {
-    list->head = list->tail = node;
-  }
+int32_t
+HPList_LPush_Int(HPLinkedList* list, int64_t value)
+{
+  ListNode node = { .type = TYPE_INT, .value = { .int_value = value } };
+  return HPList_LPush(list, &node);
+}
 
-  list->count++;
-  return list->count;
+int32_t
+HPList_LPush_Float(HPLinkedList* list, double value)
+{
+  ListNode node = { .type = TYPE_FLOAT, .value = { .float_value = value } };
+  return HPList_LPush(list, &node);
 }
 
-ListNode*
-HPList_RPop(HPLinkedList* list)
+int32_t
+HPList_LPush_String(HPLinkedList* list, const char* value)
 {
-  pthread_rwlock_wrlock(&list->rwlock);
+  ListNode node = { .type = TYPE_STRING,
+                    .value = { .string_value = (char*)value } };
+  return HPList_LPush(list, &node);
+}
 
-  if (!list->tail) {
-    pthread_rwlock_unlock(&list->rwlock);
-    return NULL;
+int32_t
+HPList_Format_Float(char* out, size_t size, double value)
+{
+  int32_t len = 0;
+  for (int32_t precision = 15; precision <= 17; precision++) {
+    len = snprintf(out, size, "%.*g", precision, value);
+    if (strtod(out, NULL) == value) {
+      break;
+    }
   }
 
-  ListNode* node = list->tail;
+  // "1000" would come back as an integer
+  if (isfinite(value) && strpbrk(out, ".e") == NULL &&
+      (size_t)len + 2 < size) {
+    memcpy(out + len, ".0", 3);
+    len += 2;
+  }
+  return len;
+}
 
-  if (list->head == list->tail) {
-    list->head = list->tail = NULL;
-  } else {
-    list->tail = list->tail->prev;
-    list->tail->next = NULL;
+bool
+HPList_Parse_Float(const char* text, double* value)
+{
+  char* end;
+  *value = strtod(text, &end);
+  if (end == text || *end != '\0' || !isfinite(*value)) {
+    return false;
   }
 
+  char formatted[HPLIST_FLOAT_LENGTH];
+  HPList_Format_Float(formatted, sizeof(formatted), *value);
+  return strcmp(formatted, text) == 0;
+}
+
+int32_t
+HPList_RPop(HPLinkedList* list, ListNode* out)
+{
+  pthread_rwlock_wrlock(&list->rwlock);
+
+  ListChunk* chunk = list->tail;
+  if (!chunk) {
+    pthread_rwlock_unlock(&list->rwlock);
+    return 0;
+  }
+
+  uint32_t offset = chunk_offset_of(chunk, chunk->count - 1);
+  decode_node_copy(chunk->data + offset, out);
+  chunk->used = offset;
+  chunk->count--;
   list->count--;
-  node->next = node->prev = NULL;
 
-  // add node to the reuse pool
-  if (list->freed_node_count < MAX_FREED_NODES) {
-    list->freed_nodes[list->freed_node_count++] = node;
-  } else {
-    HPList_FreeNode(list, node);
+  if (chunk->count == 0) {
+    chunk_unlink(list, chunk);
   }
 
   pthread_rwlock_unlock(&list->rwlock);
-  return node;
+  return 1;
 }
 
-ListNode*
-HPList_LPop(HPLinkedList* list)
+int32_t
+HPList_LPop(HPLinkedList* list, ListNode* out)
 {
   pthread_rwlock_wrlock(&list->rwlock);
 
-  if (!list->head) {
+  ListChunk* chunk = list->head;
+  if (!chunk) {
     pthread_rwlock_unlock(&list->rwlock);
-    return NULL;
-  }
-
-  ListNode* node = list->head;
-
-  if (list->head == list->tail) {
-    list->head = list->tail = NULL;
-  } else {
-    list->head = list->head->next;
-    list->head->prev = NULL;
+    return 0;
   }
 
+  size_t size = decode_node_copy(chunk->data, out);
+  memmove(chunk->data, chunk->data + size, chunk->used - size);
+  chunk->used -= size;
+  chunk->count--;
   list->count--;
-  node->next = node->prev = NULL;
 
-  // add node to the reuse pool
-  if (list->freed_node_count < MAX_FREED_NODES) {
-    list->freed_nodes[list->freed_node_count++] = node;
-  } else {
-    HPList_FreeNode(list, node);
+  if (chunk->count == 0) {
+    chunk_unlink(list, chunk);
   }
 
   pthread_rwlock_unlock(&list->rwlock);
-  return node;
+  return 1;
 }
 
-char*
-HPList_ToString(HPLinkedList* list)
+void
+HPList_Release_Node(ListNode* node)
 {
-  if (!list || list->count == 0) {
-    return strdup("[]");
+  if (node && node->type == TYPE_STRING) {
+    free(node->value.string_value);
+    node->value.string_value = NULL;
   }
+}
 
+int32_t
+HPList_Index(HPLinkedList* list, int64_t index, ListNode* out)
+{
   pthread_rwlock_rdlock(&list->rwlock);
 
-  size_t estimated_size = list->count * 32;
-  char** elements = (char**)malloc(list->count * sizeof(char*));
-  if (!elements) {
-    pthread_rwlock_unlock(&list->rwlock);
-    return NULL;
+  if (index < 0) {
+    index += (int64_t)list->count;
   }
 
-  size_t total_size = 2; // for '[' and ']'
-  size_t index = 0;
-  ListNode* current = list->head;
-
-  while (current) {
-    char* element_str = NULL;
-    size_t len = 0;
-
-    if (current->type == TYPE_STRING) {
-      len = strlen(current->value.string_value) +
-            3; // for quotes and null terminator
-      element_str = (char*)malloc(len);
-      if (element_str) {
-        snprintf(element_str, len, "\"%s\"", current->value.string_value);
-      }
-    } else if (current->type == TYPE_INT) {
-      len = 32;
-      element_str = (char*)malloc(len);
-      if (element_str) {
-        snprintf(element_str, len, "%" PRId64, current->value.int_value);
-      }
-    } else if (current->type == TYPE_FLOAT) {
-      len = 32;
-      element_str = (char*)malloc(len);
-      if (element_str) {
-        snprintf(element_str, len, "%f", current->value.float_value);
-      }
-    }
-
-    if (element_str) {
-      elements[index++] = element_str;
-      total_size += strlen(element_str) + 2; // For ', '
-    }
+  if (index < 0 || index >= (int64_t)list->count) {
+    pthread_rwlock_unlock(&list->rwlock);
+    return 0;
+  }
 
-    current = current->next;
+  uint32_t offset = 0;
+  ListChunk* chunk = locate(list, (size_t)index, &offset);
+  if (chunk) {
+    decode_node_copy(chunk->data + offset, out);
   }
 
   pthread_rwlock_unlock(&list->rwlock);
-  char* result = (char*)malloc(total_size + 1); // +1 for null terminator
-  if (!result) {
-    for (size_t i = 0; i < index; i++) {
-      free(elements[i]);
-    }
-    free(elements);
-    return NULL;
-  }
+  return chunk != NULL;
+}
 
-  char* ptr = result;
-  *ptr++ = '[';
+HPList_Iterator
+HPList_Iter(HPLinkedList* list)
+{
+  HPList_Iterator it;
+  it.chunk = list ? list->head : NULL;
+  it.offset = 0;
+  return it;
+}
 
-  for (size_t i = 0; i < index; i++) {
-    if (i > 0) {
-      *ptr++ = ',';
-      *ptr++ = ' ';
-    }
-    size_t len = strlen(elements[i]);
-    memcpy(ptr, elements[i], len);
-    ptr += len;
-    free(elements[i]);
+int32_t
+HPList_Iter_Next(HPList_Iterator* it, ListNode* out)
+{
+  while (it->chunk && it->offset >= it->chunk->used) {
+    it->chunk = it->chunk->next;
+    it->offset = 0;
   }
 
-  *ptr++ = ']';
-  *ptr = '\0';
+  if (!it->chunk) {
+    return 0;
+  }
 
-  free(elements);
-  return result;
+  it->offset += decode_node(it->chunk->data + it->offset, out);
+  return 1;
 }
 
 char*
-HPList_RangeToString(HPLinkedList* list, int32_t start, int32_t stop)
+HPList_ToString(HPLinkedList* list)
 {
-  if (!list || list->count == 0) {
-    return strdup("[]");
+  return HPList_RangeToString(list, 0, -1);
+}
+
+static void
+write_node(ListNode* node, HPList_Writer writer, void* ctx)
+{
+  char number[32];
+  int32_t len = 0;
+
+  switch (node->type) {
+    case TYPE_STRING: {
+      writer(ctx, "\"", 1);
+      writer(ctx, node->value.string_value, strlen(node->value.string_value));
+      writer(ctx, "\"", 1);
+    } break;
+    case TYPE_INT: {
+      len = snprintf(number, sizeof(number), "%" PRId64, node->value.int_value);
+      writer(ctx, number, len);
+    } break;
+    case TYPE_FLOAT: {
+      len = HPList_Format_Float(number, sizeof(number), node->value.float_value);
+      writer(ctx, number, len);
+    } break;
   }
+}
 
-  if (start < 0)
-    start = 0;
-  if (stop >= list->count)
-    stop = list->count - 1;
-  if (start > stop)
-    return strdup("[]");
+int32_t
+HPList_Normalize_Range(size_t count, int64_t* start, int64_t* stop)
+{
+  // negative indexes are counted from the tail, -1 being the last element
+  if (*start < 0)
+    *start += (int64_t)count;
+  if (*stop < 0)
+    *stop += (int64_t)count;
+
+  if (*start < 0)
+    *start = 0;
+  if (*stop >= (int64_t)count)
+    *stop = (int64_t)count - 1;
+
+  return *start <= *stop;
+}
 
-  pthread_rwlock_rdlock(&list->rwlock);
+size_t
+HPList_RangeWrite(HPLinkedList* list,
+                  int64_t start,
+                  int64_t stop,
+                  HPList_Writer writer,
+                  void* ctx)
+{
+  size_t written = 0;
+  writer(ctx, "[", 1);
+
+  if (list) {
+    pthread_rwlock_rdlock(&list->rwlock);
+
+    if (HPList_Normalize_Range(list->count, &start, &stop)) {
+      HPList_Iterator it = { 0 };
+      it.chunk = locate(list, (size_t)start, &it.offset);
+
+      ListNode node;
+      for (int64_t i = start; i <= stop && HPList_Iter_Next(&it, &node); i++) {
+        if (written > 0) {
+          writer(ctx, ", ", 2);
+        }
+        write_node(&node, writer, ctx);
+        written++;
+      }
+    }
 
-  int32_t range_count = stop - start + 1;
-  char** elements = (char**)malloc(range_count * sizeof(char*));
-  if (!elements) {
     pthread_rwlock_unlock(&list->rwlock);
-    return NULL;
   }
 
-  size_t total_size = 2; // for '[' and ']'
-  int32_t index = 0;
-  int32_t element_index = 0;
-  ListNode* current = list->head;
+  writer(ctx, "]", 1);
+  return written;
+}
 
-  // skip to the starting index
-  while (current && index < start) {
-    current = current->next;
-    index++;
-  }
+typedef struct
+{
+  char* buffer;
+  size_t size;
+  size_t len;
+} String_Writer;
 
-  while (current && index <= stop) {
-    char* element_str = NULL;
-    size_t len = 0;
+static void
+string_writer(void* ctx, const char* data, size_t len)
+{
+  String_Writer* sw = (String_Writer*)ctx;
+  if (!sw->buffer) {
+    return;
+  }
 
-    if (current->type == TYPE_STRING) {
-      len = strlen(current->value.string_value) +
-            3; // for quotes and null terminator
-      element_str = (char*)malloc(len);
-      if (element_str) {
-        snprintf(element_str, len, "\"%s\"", current->value.string_value);
-      }
-    } else if (current->type == TYPE_INT) {
-      len = 32;
-      element_str = (char*)malloc(len);
-      if (element_str) {
-        snprintf(element_str, len, "%" PRId64, current->value.int_value);
-      }
-    } else if (current->type == TYPE_FLOAT) {
-      len = 32;
-      element_str = (char*)malloc(len);
-      if (element_str) {
-        snprintf(element_str, len, "%f", current->value.float_value);
-      }
+  if (sw->len + len + 1 > sw->size) {
+    while (sw->len + len + 1 > sw->size) {
+      sw->size *= 2;
     }
-
-    if (element_str) {
-      elements[element_index++] = element_str;
-      total_size += strlen(element_str) + 2; // for ', '
+    char* temp = realloc(sw->buffer, sw->size);
+    if (!temp) {
+      free(sw->buffer);
+      sw->buffer = NULL;
+      return;
     }
-
-    current = current->next;
-    index++;
+    sw->buffer = temp;
   }
 
-  pthread_rwlock_unlock(&list->rwlock);
+  memcpy(sw->buffer + sw->len, data, len);
+  sw->len += len;
+  sw->buffer[sw->len] = '\0';
+}
 
-  char* result = (char*)malloc(total_size + 1); // +1 for null terminator
-  if (!result) {
-    for (int32_t i = 0; i < element_index; i++) {
-      free(elements[i]);
-    }
-    free(elements);
+char*
+HPList_RangeToString(HPLinkedList* list, int32_t start, int32_t stop)
+{
+  String_Writer sw = { .buffer = malloc(64), .size = 64, .len = 0 };
+  if (!sw.buffer) {
     return NULL;
   }
+  sw.buffer[0] = '\0';
 
-  char* ptr = result;
-  *ptr++ = '[';
-
-  for (int32_t i = 0; i < element_index; i++) {
-    if (i > 0) {
-      *ptr++ = ',';
-      *ptr++ = ' ';
-    }
-    size_t len = strlen(elements[i]);
-    memcpy(ptr, elements[i], len);
-    ptr += len;
-    free(elements[i]);
-  }
-
-  *ptr++ = ']';
-  *ptr = '\0';
-
-  free(elements);
-  return result;
+  HPList_RangeWrite(list, start, stop, string_writer, &sw);
+  return sw.buffer;
 }
@@ -1,11 +1,32 @@
+/**
+ * note (David)
+ * /UNROLLED LIST/
+ * list elements are not allocated one by one, they are packed back to back
+ * into chunks (listpack style). every element is encoded as a one byte tag
+ * followed by the payload:
+ *
+ *   LIST_ENC_INT    tag | zigzag varint
+ *   LIST_ENC_FLOAT  tag | 8 bytes double
+ *   LIST_ENC_STRING tag | varint length | bytes | '\0'
+ *
+ * strings keep their terminator inside the chunk so decoded elements can be
+ * handed out as plain C strings without copying. index access skips whole
+ * chunks using their element count, so it is O(n / HPLIST_CHUNK_MAX_ENTRIES).
+ */
 #ifndef __TINY_DB_LIST
 #define __TINY_DB_LIST
 
-#include "tinydb_memory_pool.h"
 #include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#define MAX_FREED_NODES 1000
+// target size of the packed data of a single chunk in bytes, elements that
+// are bigger than this get a dedicated chunk.
+#define HPLIST_CHUNK_SIZE 4096
+
+// upper bound of elements per chunk, keeps in-chunk walks short
+#define HPLIST_CHUNK_MAX_ENTRIES 128
 
 typedef enum
 {
@@ -21,26 +42,45 @@ typedef union
   char* string_value;
 } Value;
 
+// decoded view of a single list element
 typedef struct ListNode
 {
   ValueType type;
   Value value;
-  struct ListNode* next;
-  struct ListNode* prev;
 } ListNode;
 
+typedef struct ListChunk
+{
+  struct ListChunk* next;
+  struct ListChunk* prev;
+  uint32_t count;
+  uint32_t used;
+  uint32_t capacity;
+  uint8_t data[];
+} ListChunk;
+
 typedef struct
 {
-  ListNode* head;
-  ListNode* tail;
+  ListChunk* head;
+  ListChunk* tail;
   size_t count;
+  size_t num_chunks;
   pthread_rwlock_t rwlock;
-  MemoryPool node_pool;
-  MemoryPool string_pool;
-  ListNode* freed_nodes[MAX_FREED_NODES];
-  size_t freed_node_count;
 } HPLinkedList;
 
+/**
+ * forward iterator over the packed elements, caller must hold list->rwlock
+ * while iterating. string values point into the chunk and are valid until the
+ * list is modified.
+ */
+typedef struct
+{
+  ListChunk* chunk;
+  uint32_t offset;
+} HPList_Iterator;
+
+typedef void (*HPList_Writer)(void* ctx, const char* data, size_t len);
+
 HPLinkedList*
 HPList_Create();
 
@@ -48,7 +88,22 @@ void
 HPList_Destroy(HPLinkedList* list);
 
 int32_t
-HPList_RPush(HPLinkedList* list, ListNode* node);
+HPList_RPush(HPLinkedList* list, const ListNode* node);
+
+int32_t
+HPList_LPush(HPLinkedList* list, const ListNode* node);
+
+/**
+ * pushes count elements while taking the write lock once, LPush_Many inserts
+ * them one by one at the head so the last element ends up first.
+ * @returns new length of the list or -1 when an element was invalid or did
+ * not fit in memory, the list is unchanged then
+ */
+int32_t
+HPList_RPush_Many(HPLinkedList* list, const ListNode* nodes, size_t count);
+
+int32_t
+HPList_LPush_Many(HPLinkedList* list, const ListNode* nodes, size_t count);
 
 int32_t
 HPList_RPush_Int(HPLinkedList* list, int64_t value);
@@ -68,16 +123,78 @@ HPList_LPush_Float(HPLinkedList* list, double value);
 int32_t
 HPList_LPush_String(HPLinkedList* list, const char* value);
 
-ListNode*
-HPList_RPop(HPLinkedList* list);
+// room HPList_Format_Float needs, "-2.2250738585072014e-308" and the '\0'
+#define HPLIST_FLOAT_LENGTH 32
 
-ListNode*
-HPList_LPop(HPLinkedList* list);
+/**
+ * writes the shortest text that reads back as value, with a fraction or an
+ * exponent so it is lexed as a float again ("1000.0", "1e+20").
+ * @returns length of the text
+ */
+int32_t
+HPList_Format_Float(char* out, size_t size, double value);
+
+/**
+ * @returns true and the value when text is a finite float written the way
+ * HPList_Format_Float writes it, "1.50" or "1e3" keep their text as strings
+ */
+bool
+HPList_Parse_Float(const char* text, double* value);
+
+/**
+ * pops the element into out, string values are copied to the heap and must
+ * be released with HPList_Release_Node.
+ * @returns 1 when an element was popped, 0 when the list was empty
+ */
+int32_t
+HPList_RPop(HPLinkedList* list, ListNode* out);
+
+int32_t
+HPList_LPop(HPLinkedList* list, ListNode* out);
+
+void
+HPList_Release_Node(ListNode* node);
+
+/**
+ * copies the element at index (negative values count from the tail) into out,
+ * string values must be released with HPList_Release_Node.
+ * @returns 1 when the index exists, 0 otherwise
+ */
+int32_t
+HPList_Index(HPLinkedList* list, int64_t index, ListNode* out);
+
+HPList_Iterator
+HPList_Iter(HPLinkedList* list);
+
+/**
+ * @returns 1 and decodes the next element into out, 0 at the end of the list
+ */
+int32_t
+HPList_Iter_Next(HPList_Iterator* it, ListNode* out);
 
 char*
 HPList_ToString(HPLinkedList* list);
 
+/**
+ * clamps start/stop (negative values count from the tail) to the list bounds
+ * @returns 1 when the range is not empty, 0 otherwise
+ */
+int32_t
+HPList_Normalize_Range(size_t count, int64_t* start, int64_t* stop);
+
+/**
+ * streams the elements in [start, stop] to the writer without building the
+ * whole reply on the heap first.
+ * @returns number of elements written
+ */
+size_t
+HPList_RangeWrite(HPLinkedList* list,
+                  int64_t start,
+                  int64_t stop,
+                  HPList_Writer writer,
+                  void* ctx);
+
 char*
 HPList_RangeToString(HPLinkedList* list, int32_t start, int32_t stop);
 
-#endif // __TINY_DB_LIST
\ No newline at end of file
+#endif // __TINY_DB_LIST
@@ -23,28 +23,37 @@ Memory_Pool_Destroy(MemoryPool* pool)
   pthread_mutex_destroy(&pool->lock);
 }
 
+// aligned to 8 bytes and big enough to hold the free list link once freed
+static size_t
+Memory_Pool_Chunk_Size(size_t size)
+{
+  size = (size + 7) & ~7;
+  return size < sizeof(FreeChunk) ? sizeof(FreeChunk) : size;
+}
+
 void*
 Memory_Pool_Alloc(MemoryPool* pool, size_t size)
 {
   pthread_mutex_lock(&pool->lock);
 
-  // align size to 8 bytes
-  size = (size + 7) & ~7;
+  size = Memory_Pool_Chunk_Size(size);
 
-  // check free lists in existing blocks
+  // check free lists in existing blocks, a chunk is only reused for the size
+  // it was allocated with so the block's used count stays exact
   MemoryBlock* block = pool->head;
   while (block) {
     FreeChunk* prev = NULL;
     FreeChunk* chunk = block->free_list;
 
     while (chunk) {
-      if (size <= MEMORY_POOL_SIZE) {
+      if (chunk->size == size) {
         // remove chunk from free list and return it
         if (prev) {
           prev->next = chunk->next;
         } else {
           block->free_list = chunk->next;
         }
+        block->used += size;
         pthread_mutex_unlock(&pool->lock);
         return (void*)chunk;
       }
@@ -64,7 +73,7 @@ Memory_Pool_Alloc(MemoryPool* pool, size_t size)
   // find a block with enough space or create a new one
   block = pool->head;
   MemoryBlock* prev_block = NULL;
-  while (block && block->used + size > block->size) {
+  while (block && block->top + size > block->size) {
     prev_block = block;
     block = block->next;
   }
@@ -83,6 +92,7 @@ Memory_Pool_Alloc(MemoryPool* pool, size_t size)
     }
     block->size = MEMORY_POOL_SIZE;
     block->used = 0;
+    block->top = 0;
     block->next = NULL;
     block->free_list = NULL;
 
@@ -93,7 +103,8 @@ Memory_Pool_Alloc(MemoryPool* pool, size_t size)
     }
   }
 
-  void* result = block->memory + block->used;
+  void* result = block->memory + block->top;
+  block->top += size;
   block->used += size;
 
   pthread_mutex_unlock(&pool->lock);
@@ -107,6 +118,7 @@ Memory_Pool_Free(MemoryPool* pool, void* ptr, size_t size)
     return;
 
   pthread_mutex_lock(&pool->lock);
+  size = Memory_Pool_Chunk_Size(size);
 
   // try to find the block that contains the pointer
   MemoryBlock* block = pool->head;
@@ -114,6 +126,7 @@ Memory_Pool_Free(MemoryPool* pool, void* ptr, size_t size)
     if (ptr >= (void*)block->memory &&
         ptr < (void*)(block->memory + block->size)) {
       FreeChunk* chunk = (FreeChunk*)ptr;
+      chunk->size = size;
       chunk->next = block->free_list;
       block->free_list = chunk;
 
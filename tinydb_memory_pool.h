@@ -11,13 +11,15 @@
 typedef struct FreeChunk
 {
   struct FreeChunk* next;
+  size_t size;
 } FreeChunk;
 
 typedef struct MemoryBlock
 {
   char* memory;
   size_t size;
-  size_t used;
+  size_t used; // bytes of live chunks, the block is released at 0
+  size_t top;  // chunks are carved from here, freed ones go to free_list
   struct MemoryBlock* next;
   FreeChunk* free_list;
 } MemoryBlock;
@@ -1,37 +1,219 @@
 #include "tinydb_object.h"
 #include "tinydb_database_entry_destructor.h"
+#include "tinydb_log.h"
 
 DB_Object*
 CreateDBObject()
 {
   DB_Object* obj = (DB_Object*)malloc(sizeof(DB_Object));
-  obj->fields = HM_Create(Database_Entry_Destructor);
+  if (!obj) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for DB_Object");
+    return NULL;
+  }
+
+  obj->encoding = DB_OBJECT_ENCODING_COMPACT;
+  obj->compact = NULL;
+  obj->num_compact = 0;
+  obj->compact_capacity = 0;
+  obj->fields = NULL;
+  pthread_rwlock_init(&obj->rwlock, NULL);
   return obj;
 }
 
-int32_t
-DBObject_AddField(DB_Object* obj,
-                  const char* field_name,
-                  DB_Value value,
-                  DB_ENTRY_TYPE type)
+static int32_t
+compact_find(DB_Object* obj, const char* field_name)
+{
+  for (uint32_t i = 0; i < obj->num_compact; i++) {
+    if (strcmp(obj->compact[i].key, field_name) == 0) {
+      return (int32_t)i;
+    }
+  }
+  return -1;
+}
+
+// moves every compact field into a freshly created HashMap
+static int32_t
+upgrade_to_hashmap(DB_Object* obj)
+{
+  HashMap* fields = HM_Create(Database_Entry_Destructor);
+  if (!fields) {
+    DB_Log(DB_LOG_ERROR, "Failed to upgrade object to HashMap encoding");
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < obj->num_compact; i++) {
+    DatabaseEntry* entry = (DatabaseEntry*)malloc(sizeof(DatabaseEntry));
+    *entry = obj->compact[i];
+    HM_Put(fields, entry->key, entry);
+  }
+
+  free(obj->compact);
+  obj->compact = NULL;
+  obj->num_compact = 0;
+  obj->compact_capacity = 0;
+  obj->fields = fields;
+  obj->encoding = DB_OBJECT_ENCODING_HASHMAP;
+  return 0;
+}
+
+// caller holds the write lock
+static int32_t
+add_field(DB_Object* obj,
+          const char* field_name,
+          DB_Value value,
+          DB_ENTRY_TYPE type)
 {
+  if (obj->encoding == DB_OBJECT_ENCODING_COMPACT) {
+    int32_t index = compact_find(obj, field_name);
+    if (index >= 0) {
+      DatabaseEntry* entry = &obj->compact[index];
+      char* key = entry->key;
+      entry->key = NULL;
+      Database_Entry_Clear(entry);
+      entry->key = key;
+      entry->value = value;
+      entry->type = type;
+      entry->borrowed = false;
+      return HM_ACTION_MODIFIED;
+    }
+
+    if (obj->num_compact < DB_OBJECT_COMPACT_MAX_FIELDS) {
+      if (obj->num_compact == obj->compact_capacity) {
+        uint32_t capacity =
+          obj->compact_capacity == 0 ? 4 : obj->compact_capacity * 2;
+        DatabaseEntry* compact =
+          realloc(obj->compact, capacity * sizeof(DatabaseEntry));
+        if (!compact) {
+          return HM_ACTION_FAILED;
+        }
+        obj->compact = compact;
+        obj->compact_capacity = capacity;
+      }
+
+      DatabaseEntry* entry = &obj->compact[obj->num_compact++];
+      entry->key = strdup(field_name);
+      entry->value = value;
+      entry->type = type;
+      entry->borrowed = false;
+      return HM_ACTION_ADDED;
+    }
+
+    if (upgrade_to_hashmap(obj) != 0) {
+      return HM_ACTION_FAILED;
+    }
+  }
+
   DatabaseEntry* new_entry = (DatabaseEntry*)malloc(sizeof(DatabaseEntry));
   new_entry->key = strdup(field_name);
   new_entry->value = value;
   new_entry->type = type;
+  new_entry->borrowed = false;
 
-  int8_t state = HM_Put(obj->fields, new_entry->key, new_entry);
+  return HM_Put(obj->fields, new_entry->key, new_entry);
+}
+
+int32_t
+DBObject_AddField(DB_Object* obj,
+                  const char* field_name,
+                  DB_Value value,
+                  DB_ENTRY_TYPE type)
+{
+  pthread_rwlock_wrlock(&obj->rwlock);
+  int32_t state = add_field(obj, field_name, value, type);
+  pthread_rwlock_unlock(&obj->rwlock);
   return state;
 }
 
 DatabaseEntry*
 DBObject_GetField(DB_Object* obj, const char* field_name)
 {
+  if (obj->encoding == DB_OBJECT_ENCODING_COMPACT) {
+    int32_t index = compact_find(obj, field_name);
+    return index >= 0 ? &obj->compact[index] : NULL;
+  }
+
   return (DatabaseEntry*)HM_Get(obj->fields, field_name);
 }
 
 int32_t
 DBObject_RemoveField(DB_Object* obj, const char* field_name)
 {
-  return HM_Remove(obj->fields, field_name);
+  int32_t removed = 0;
+  pthread_rwlock_wrlock(&obj->rwlock);
+
+  if (obj->encoding == DB_OBJECT_ENCODING_COMPACT) {
+    int32_t index = compact_find(obj, field_name);
+    if (index >= 0) {
+      Database_Entry_Clear(&obj->compact[index]);
+      // order is not significant, move the last field into the hole
+      obj->compact[index] = obj->compact[--obj->num_compact];
+      removed = 1;
+    }
+  } else {
+    removed = HM_Remove(obj->fields, field_name);
+  }
+
+  pthread_rwlock_unlock(&obj->rwlock);
+  return removed;
+}
+
+int32_t
+DBObject_IncrField(DB_Object* obj,
+                   const char* field_name,
+                   int64_t delta,
+                   int64_t* result)
+{
+  pthread_rwlock_wrlock(&obj->rwlock);
+
+  DatabaseEntry* entry = DBObject_GetField(obj, field_name);
+  if (entry == NULL) {
+    DB_Value value = { .number = { .value = delta } };
+    add_field(obj, field_name, value, DB_ENTRY_NUMBER);
+    *result = delta;
+    pthread_rwlock_unlock(&obj->rwlock);
+    return DB_OBJECT_INCR_OK;
+  }
+
+  if (entry->type != DB_ENTRY_NUMBER) {
+    pthread_rwlock_unlock(&obj->rwlock);
+    return DB_OBJECT_INCR_NOT_NUMBER;
+  }
+
+  *result = atomic_fetch_add(&entry->value.number.value, delta) + delta;
+  pthread_rwlock_unlock(&obj->rwlock);
+  return DB_OBJECT_INCR_OK;
+}
+
+size_t
+DBObject_Count(DB_Object* obj)
+{
+  if (obj->encoding == DB_OBJECT_ENCODING_COMPACT) {
+    return obj->num_compact;
+  }
+  return atomic_load(&obj->fields->size);
+}
+
+DBObject_Iterator
+DBObject_Iter(DB_Object* obj)
+{
+  DBObject_Iterator it;
+  it.obj = obj;
+  it.index = 0;
+  if (obj->encoding == DB_OBJECT_ENCODING_HASHMAP) {
+    it.it = HM_Iterator(obj->fields);
+  }
+  return it;
+}
+
+DatabaseEntry*
+DBObject_Iter_Next(DBObject_Iterator* it)
+{
+  if (it->obj->encoding == DB_OBJECT_ENCODING_COMPACT) {
+    if (it->index < it->obj->num_compact) {
+      return &it->obj->compact[it->index++];
+    }
+    return NULL;
+  }
+
+  return HM_IteratorNext(&it->it);
 }
@@ -53,14 +53,14 @@ extending current query parser implementation. - David.
     DatabaseEntry* emails_entry = DBObject_GetField(user_object, "emails");
     if (emails_entry && emails_entry->type == DB_ENTRY_LIST) {
       HPLinkedList* email_list = emails_entry->value.list;
-      ListNode* current_node = email_list->head;
+      HPList_Iterator it = HPList_Iter(email_list);
+      ListNode current_node;
 
       printf("User emails:\n");
-      while (current_node != NULL) {
-        if (current_node->type == TYPE_STRING) {
-          printf("  %s\n", current_node->value.string_value);
+      while (HPList_Iter_Next(&it, &current_node)) {
+        if (current_node.type == TYPE_STRING) {
+          printf("  %s\n", current_node.value.string_value);
         }
-        current_node = current_node->next;
       }
     }
   }
@@ -100,20 +100,63 @@ extending current query parser implementation. - David.
 
 #include "tinydb_datatype.h"
 #include "tinydb_hashmap.h"
+#include "tinydb_hashmap_iterator.h"
+
+// objects with more fields than this are upgraded from the flat array to a
+// HashMap, lookups in the compact encoding are linear.
+#define DB_OBJECT_COMPACT_MAX_FIELDS 32
+
+#define DB_OBJECT_INCR_OK 0
+#define DB_OBJECT_INCR_NOT_NUMBER -1
+
+typedef struct DBObject_Iterator
+{
+  DB_Object* obj;
+  uint32_t index;
+  HashMapIterator it;
+} DBObject_Iterator;
 
 DB_Object*
 CreateDBObject();
 
+/**
+ * takes ownership of the value, replaces (and destroys) an existing field.
+ * @returns HM_ACTION_ADDED, HM_ACTION_MODIFIED or HM_ACTION_FAILED
+ */
 int32_t
 DBObject_AddField(DB_Object* obj,
                   const char* field_name,
                   DB_Value value,
                   DB_ENTRY_TYPE type);
 
+/**
+ * caller must hold obj->rwlock, the returned entry is only valid until the
+ * object is modified.
+ */
 DatabaseEntry*
 DBObject_GetField(DB_Object* obj, const char* field_name);
 
 int32_t
 DBObject_RemoveField(DB_Object* obj, const char* field_name);
 
+/**
+ * adds delta to a number field, missing fields start at 0.
+ * @returns DB_OBJECT_INCR_OK or DB_OBJECT_INCR_NOT_NUMBER
+ */
+int32_t
+DBObject_IncrField(DB_Object* obj,
+                   const char* field_name,
+                   int64_t delta,
+                   int64_t* result);
+
+size_t
+DBObject_Count(DB_Object* obj);
+
+// caller must hold obj->rwlock while iterating
+DBObject_Iterator
+DBObject_Iter(DB_Object* obj);
+
+DatabaseEntry*
+DBObject_Iter_Next(DBObject_Iterator* it);
+
 #endif // __TINY_DB_OBJECT
\ No newline at end of file
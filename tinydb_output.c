@@ -0,0 +1,330 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "tinydb_log.h"
+#include "tinydb_output.h"
+
+// chunks handed to a single sendmsg
+#define OUTPUT_MAX_IOV 16
+
+// events taken by a single epoll_wait of the output thread
+#define OUTPUT_MAX_EVENTS 64
+
+// caller holds conn->output_lock
+static void
+drop_output_locked(Connection* conn)
+{
+  OutputChunk* chunk = conn->output_head;
+  while (chunk) {
+    OutputChunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  conn->output_head = NULL;
+  conn->output_tail = NULL;
+  conn->output_pending = 0;
+}
+
+// caller holds conn->output_lock
+static void
+close_locked(Connection* conn)
+{
+  drop_output_locked(conn);
+  conn->output_closed = true;
+  // recv of its handler returns 0 and the handler closes it
+  shutdown(conn->sock, SHUT_RDWR);
+}
+
+// caller holds conn->output_lock
+static void
+arm_locked(Connection* conn)
+{
+  struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT,
+                            .data.fd = conn->sock };
+  if (epoll_ctl(conn->output->epoll_fd, EPOLL_CTL_MOD, conn->sock, &ev) != 0) {
+    DB_Log(DB_LOG_ERROR,
+           "OUTPUT Unable to wait for socket %d: %s",
+           conn->sock,
+           strerror(errno));
+    close_locked(conn);
+    return;
+  }
+  conn->output_armed = true;
+}
+
+// caller holds conn->output_lock. the last chunk is kept for the next reply
+static void
+consume_locked(Connection* conn, size_t sent)
+{
+  conn->output_pending -= sent;
+  while (sent > 0) {
+    OutputChunk* chunk = conn->output_head;
+    size_t left = chunk->len - chunk->sent;
+    size_t n = sent < left ? sent : left;
+    chunk->sent += n;
+    sent -= n;
+
+    if (chunk->sent < chunk->len) {
+      break;
+    }
+    if (chunk->next) {
+      conn->output_head = chunk->next;
+      free(chunk);
+    } else {
+      chunk->len = 0;
+      chunk->sent = 0;
+    }
+  }
+}
+
+// caller holds conn->output_lock
+static void
+flush_locked(Connection* conn)
+{
+  while (conn->output_pending > 0) {
+    struct iovec iov[OUTPUT_MAX_IOV];
+    int32_t num_iov = 0;
+    for (OutputChunk* chunk = conn->output_head;
+         chunk && num_iov < OUTPUT_MAX_IOV;
+         chunk = chunk->next) {
+      iov[num_iov].iov_base = chunk->data + chunk->sent;
+      iov[num_iov].iov_len = chunk->len - chunk->sent;
+      num_iov++;
+    }
+
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = num_iov };
+    ssize_t n = sendmsg(conn->sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        arm_locked(conn);
+        return;
+      }
+      // the peer is gone, its handler notices on the next recv
+      drop_output_locked(conn);
+      conn->output_closed = true;
+      return;
+    }
+    consume_locked(conn, (size_t)n);
+  }
+}
+
+static void*
+Output_Thread_Function(void* arg)
+{
+  OutputSystem* system = (OutputSystem*)arg;
+  struct epoll_event events[OUTPUT_MAX_EVENTS];
+
+  while (1) {
+    int32_t n = epoll_wait(system->epoll_fd, events, OUTPUT_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DB_Log(DB_LOG_ERROR, "OUTPUT epoll_wait failed: %s", strerror(errno));
+      return NULL;
+    }
+
+    pthread_mutex_lock(&system->lock);
+    for (int32_t i = 0; i < n; i++) {
+      int32_t fd = events[i].data.fd;
+      if (fd == system->wakeup_fd) {
+        pthread_mutex_unlock(&system->lock);
+        return NULL;
+      }
+
+      // the socket could belong to a newer connection by now, flushing that
+      // one does no harm either
+      Connection* conn = fd < system->capacity ? system->connections[fd] : NULL;
+      if (conn) {
+        pthread_mutex_lock(&conn->output_lock);
+        conn->output_armed = false;
+        flush_locked(conn);
+        pthread_mutex_unlock(&conn->output_lock);
+      }
+    }
+    pthread_mutex_unlock(&system->lock);
+  }
+}
+
+OutputSystem*
+Create_Output_System()
+{
+  OutputSystem* system = (OutputSystem*)calloc(1, sizeof(OutputSystem));
+  if (!system) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for OutputSystem");
+    return NULL;
+  }
+
+  system->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  system->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = system->wakeup_fd };
+  if (system->epoll_fd < 0 || system->wakeup_fd < 0 ||
+      epoll_ctl(system->epoll_fd, EPOLL_CTL_ADD, system->wakeup_fd, &ev) != 0) {
+    DB_Log(DB_LOG_ERROR, "OUTPUT Unable to create epoll: %s", strerror(errno));
+    if (system->epoll_fd >= 0) {
+      close(system->epoll_fd);
+    }
+    if (system->wakeup_fd >= 0) {
+      close(system->wakeup_fd);
+    }
+    free(system);
+    return NULL;
+  }
+
+  pthread_mutex_init(&system->lock, NULL);
+  pthread_create(
+    &system->thread, NULL, Output_Thread_Function, (void*)system);
+  return system;
+}
+
+int32_t
+Output_Register(OutputSystem* system, Connection* conn)
+{
+  pthread_mutex_lock(&system->lock);
+  if (conn->sock >= system->capacity) {
+    int32_t capacity = system->capacity > 0 ? system->capacity : 64;
+    while (capacity <= conn->sock) {
+      capacity *= 2;
+    }
+    Connection** connections = (Connection**)realloc(
+      system->connections, capacity * sizeof(Connection*));
+    if (!connections) {
+      pthread_mutex_unlock(&system->lock);
+      DB_Log(DB_LOG_ERROR, "Failed to allocate memory for output connections");
+      return -1;
+    }
+    memset(connections + system->capacity,
+           0,
+           (capacity - system->capacity) * sizeof(Connection*));
+    system->connections = connections;
+    system->capacity = capacity;
+  }
+
+  // not waiting for anything until output is left over
+  struct epoll_event ev = { .events = EPOLLONESHOT, .data.fd = conn->sock };
+  if (epoll_ctl(system->epoll_fd, EPOLL_CTL_ADD, conn->sock, &ev) != 0) {
+    pthread_mutex_unlock(&system->lock);
+    DB_Log(DB_LOG_ERROR,
+           "OUTPUT Unable to register socket %d: %s",
+           conn->sock,
+           strerror(errno));
+    return -1;
+  }
+  system->connections[conn->sock] = conn;
+  conn->output = system;
+  pthread_mutex_unlock(&system->lock);
+  return 0;
+}
+
+void
+Output_Unregister(OutputSystem* system, Connection* conn)
+{
+  pthread_mutex_lock(&system->lock);
+  epoll_ctl(system->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+  system->connections[conn->sock] = NULL;
+  pthread_mutex_unlock(&system->lock);
+
+  pthread_mutex_lock(&conn->output_lock);
+  drop_output_locked(conn);
+  conn->output = NULL;
+  pthread_mutex_unlock(&conn->output_lock);
+}
+
+void
+Output_Write(Connection* conn, const char* data, size_t len)
+{
+  if (!conn->output) {
+    return;
+  }
+
+  pthread_mutex_lock(&conn->output_lock);
+  if (!conn->output || conn->output_closed) {
+    pthread_mutex_unlock(&conn->output_lock);
+    return;
+  }
+
+  while (len > 0) {
+    OutputChunk* tail = conn->output_tail;
+    if (!tail || tail->len == OUTPUT_CHUNK_SIZE) {
+      OutputChunk* chunk = (OutputChunk*)malloc(sizeof(OutputChunk));
+      if (!chunk) {
+        DB_Log(DB_LOG_ERROR, "Failed to allocate memory for OutputChunk");
+        close_locked(conn);
+        pthread_mutex_unlock(&conn->output_lock);
+        return;
+      }
+      chunk->len = 0;
+      chunk->sent = 0;
+      chunk->next = NULL;
+      if (tail) {
+        tail->next = chunk;
+      } else {
+        conn->output_head = chunk;
+      }
+      conn->output_tail = tail = chunk;
+    }
+
+    size_t space = OUTPUT_CHUNK_SIZE - tail->len;
+    size_t n = len < space ? len : space;
+    memcpy(tail->data + tail->len, data, n);
+    tail->len += n;
+    conn->output_pending += n;
+    data += n;
+    len -= n;
+  }
+
+  // large replies go out while they are produced
+  if (conn->output_pending >= OUTPUT_CHUNK_SIZE && !conn->output_armed) {
+    flush_locked(conn);
+  }
+
+  size_t limit =
+    conn->subscribed ? SUBSCRIBER_OUTPUT_LIMIT : CLIENT_OUTPUT_LIMIT;
+  if (limit > 0 && conn->output_pending > limit) {
+    DB_Log(DB_LOG_WARNING,
+           "OUTPUT Client on socket %d exceeded its output limit, closing",
+           conn->sock);
+    close_locked(conn);
+  }
+  pthread_mutex_unlock(&conn->output_lock);
+}
+
+void
+Output_Flush(Connection* conn)
+{
+  if (!conn->output) {
+    return;
+  }
+
+  pthread_mutex_lock(&conn->output_lock);
+  // armed: the output thread sends it once the socket is writable
+  if (conn->output && !conn->output_armed) {
+    flush_locked(conn);
+  }
+  pthread_mutex_unlock(&conn->output_lock);
+}
+
+void
+Destroy_Output_System(OutputSystem* system)
+{
+  uint64_t one = 1;
+  if (write(system->wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+    DB_Log(DB_LOG_ERROR, "OUTPUT Unable to stop the output thread");
+  }
+  pthread_join(system->thread, NULL);
+
+  close(system->wakeup_fd);
+  close(system->epoll_fd);
+  pthread_mutex_destroy(&system->lock);
+  free(system->connections);
+  free(system);
+}
@@ -0,0 +1,82 @@
+/**
+ * note (David)
+ * /OUTPUT/
+ * replies are queued on their connection instead of being written from the
+ * command. Output_Flush sends whatever is queued without blocking, the rest
+ * stays queued and the output thread sends it once the socket is writable
+ * again (EPOLLOUT). a slow reader therefore never holds the worker that
+ * executed its command, nor the thread publishing to it.
+ *
+ * a connection that lets more than its limit pile up (CLIENT_OUTPUT_LIMIT,
+ * SUBSCRIBER_OUTPUT_LIMIT) loses its output and is disconnected.
+ */
+#ifndef __TINY_DB_OUTPUT
+#define __TINY_DB_OUTPUT
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "tinydb_connection.h"
+
+typedef struct OutputChunk
+{
+  size_t len;  // bytes queued
+  size_t sent; // bytes of them already written
+  struct OutputChunk* next;
+  char data[OUTPUT_CHUNK_SIZE];
+} OutputChunk;
+
+typedef struct OutputSystem
+{
+  int32_t epoll_fd;
+  int32_t wakeup_fd; // eventfd, stops the output thread
+  pthread_t thread;
+
+  // registered connections by socket, the output thread only touches the
+  // connections it finds here while it holds the lock
+  pthread_mutex_t lock;
+  Connection** connections;
+  int32_t capacity;
+} OutputSystem;
+
+OutputSystem*
+Create_Output_System();
+
+/**
+ * replies to conn are queued from now on, until then they are dropped.
+ * @returns -1 when out of memory
+ */
+int32_t
+Output_Register(OutputSystem* system, Connection* conn);
+
+/**
+ * once this returns the output thread does not touch conn anymore, whatever
+ * is still queued is dropped with it.
+ */
+void
+Output_Unregister(OutputSystem* system, Connection* conn);
+
+/**
+ * queues len bytes of data, they are sent right away once a chunk worth of
+ * output is queued, otherwise by the next Output_Flush.
+ */
+void
+Output_Write(Connection* conn, const char* data, size_t len);
+
+/**
+ * sends as much of the queued output as the socket takes without blocking,
+ * the output thread sends the rest.
+ */
+void
+Output_Flush(Connection* conn);
+
+/**
+ * the connections have to be unregistered already.
+ */
+void
+Destroy_Output_System(OutputSystem* system);
+
+#endif // __TINY_DB_OUTPUT
@@ -1,9 +1,9 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 
 #include "tinydb_log.h"
+#include "tinydb_output.h"
 #include "tinydb_pubsub.h"
 #include "tinydb_webhook.h"
 
@@ -17,7 +17,7 @@ Create_PubSub_System()
 }
 
 void
-Subscribe(PubSubSystem* system, const char* channel_name, int32_t socket_fd)
+Subscribe(PubSubSystem* system, const char* channel_name, Connection* conn)
 {
   if (channel_name == NULL) {
     DB_Log(DB_LOG_ERROR, "Channel name cannot be NULL\n");
@@ -35,7 +35,7 @@ Subscribe(PubSubSystem* system, const char* channel_name, int32_t socket_fd)
   }
 
   Subscriber* new_sub = malloc(sizeof(Subscriber));
-  new_sub->socket_fd = socket_fd;
+  new_sub->conn = conn;
   new_sub->next = channel->subscribers;
   channel->subscribers = new_sub;
 
@@ -43,7 +43,7 @@ Subscribe(PubSubSystem* system, const char* channel_name, int32_t socket_fd)
 }
 
 void
-Unsubscribe(PubSubSystem* system, const char* channel_name, int32_t socket_fd)
+Unsubscribe(PubSubSystem* system, const char* channel_name, Connection* conn)
 {
   pthread_mutex_lock(&system->lock);
   Channel* channel = Find_Channel(system, channel_name);
@@ -54,7 +54,7 @@ Unsubscribe(PubSubSystem* system, const char* channel_name, int32_t socket_fd)
   Subscriber* prev = NULL;
   Subscriber* sub = channel->subscribers;
   while (sub) {
-    if (sub->socket_fd == socket_fd) {
+    if (sub->conn == conn) {
       if (prev) {
         prev->next = sub->next;
       } else {
@@ -76,7 +76,7 @@ Unsubscribe(PubSubSystem* system, const char* channel_name, int32_t socket_fd)
 }
 
 void
-Unsubscribe_All(PubSubSystem* system, int32_t socket_fd)
+Unsubscribe_All(PubSubSystem* system, Connection* conn)
 {
   pthread_mutex_lock(&system->lock);
   Channel* channel = system->channels;
@@ -87,7 +87,7 @@ Unsubscribe_All(PubSubSystem* system, int32_t socket_fd)
     Subscriber* sub = channel->subscribers;
 
     while (sub) {
-      if (sub->socket_fd == socket_fd) {
+      if (sub->conn == conn) {
         if (prev_sub) {
           prev_sub->next = sub->next;
         } else {
@@ -167,12 +167,13 @@ Publish(PubSubSystem* system, const char* channel_name, const char* message)
     return;
   }
 
+  // the subscribers stay alive while we hold the lock, see Unsubscribe_All
+  size_t len = strlen(message);
   Subscriber* sub = channel->subscribers;
   while (sub) {
-    SendMessageArgs* args = (SendMessageArgs*)malloc(sizeof(SendMessageArgs));
-    args->socket_fd = sub->socket_fd;
-    args->message = strdup(message);
-    Thread_Pool_Add_Task(Send_Message, (void*)args);
+    Output_Write(sub->conn, message, len);
+    Output_Write(sub->conn, "\n", 1);
+    Output_Flush(sub->conn);
     sub = sub->next;
   }
 
@@ -181,20 +182,6 @@ Publish(PubSubSystem* system, const char* channel_name, const char* message)
   pthread_mutex_unlock(&system->lock);
 }
 
-void
-Send_Message(void* args)
-{
-  SendMessageArgs* send_args = (SendMessageArgs*)args;
-  int32_t sock = send_args->socket_fd;
-  char* message = send_args->message;
-  if (write(sock, message, strlen(message)) == -1) {
-    DB_Log(DB_LOG_ERROR, "Unable to send message to subscriber");
-  }
-  write(sock, "\n", 1);
-  free(message);
-  free(send_args);
-}
-
 void
 Destroy_PubSub_System(PubSubSystem* system)
 {
@@ -1,14 +1,14 @@
 #ifndef __TINY_DB_PUBSUB
 #define __TINY_DB_PUBSUB
 
-#include "tinydb_thread_pool.h"
+#include "tinydb_connection.h"
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
 typedef struct Subscriber
 {
-  int32_t socket_fd;
+  Connection* conn;
   struct Subscriber* next;
 } Subscriber;
 
@@ -25,23 +25,17 @@ typedef struct PubSubSystem
   pthread_mutex_t lock;
 } PubSubSystem;
 
-typedef struct
-{
-  int32_t socket_fd;
-  char* message;
-} SendMessageArgs;
-
 PubSubSystem*
 Create_PubSub_System();
 
 void
-Subscribe(PubSubSystem* system, const char* channel_name, int32_t socket_fd);
+Subscribe(PubSubSystem* system, const char* channel_name, Connection* conn);
 
 void
-Unsubscribe(PubSubSystem* system, const char* channel_name, int32_t socket_fd);
+Unsubscribe(PubSubSystem* system, const char* channel_name, Connection* conn);
 
 void
-Unsubscribe_All(PubSubSystem* system, int32_t socket_fd);
+Unsubscribe_All(PubSubSystem* system, Connection* conn);
 
 Channel*
 Find_Channel(PubSubSystem* system, const char* channel_name);
@@ -49,12 +43,13 @@ Find_Channel(PubSubSystem* system, const char* channel_name);
 void
 Remove_Empty_Channel(PubSubSystem* system, const char* channel_name);
 
+/**
+ * queues message on the output of every subscriber, none of them is waited
+ * for.
+ */
 void
 Publish(PubSubSystem* system, const char* channel_name, const char* message);
 
-void
-Send_Message(void* socket_desc);
-
 void
 Destroy_PubSub_System(PubSubSystem* system);
 
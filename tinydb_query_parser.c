@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +17,9 @@ To_Command_Token(LEX_TOKEN ltok)
     case LEX_TOKEN_NUMBER:
       return TOKEN_NUMBER;
       break;
+    case LEX_TOKEN_FLOAT:
+      return TOKEN_FLOAT;
+      break;
     default:
       return TOKEN_STRING;
       break;
@@ -38,6 +42,15 @@ Parse_Command(char* buffer, size_t buffer_size, size_t* total_read)
   *(total_read) = 0;
   memset(buffer, 0, buffer_size);
 
+  size_t max_args =
+    cmd->lex.token_count > MAX_ARGS ? cmd->lex.token_count : MAX_ARGS;
+  cmd->argv = calloc(max_args, sizeof(char*));
+  cmd->types = calloc(max_args, sizeof(TOKEN));
+  if (!cmd->argv || !cmd->types) {
+    Free_Parsed_Command(cmd);
+    return NULL;
+  }
+
   if (cmd->lex.token_count > 0) {
     for (size_t i = 0; i < cmd->lex.token_count; ++i) {
       Token t = cmd->lex.tokens[i];
@@ -63,17 +76,42 @@ Parse_Command(char* buffer, size_t buffer_size, size_t* total_read)
 void
 Free_Parsed_Command(ParsedCommand* cmd)
 {
-  // free the lexer stuff
-  for (size_t i = 0; i < cmd->lex.token_count; i++) {
-    Lexer_Free_Token_Value(&cmd->lex.tokens[i]);
+  if (!cmd) {
+    return;
   }
 
+  // free the lexer stuff
+  Lexer_Free(&cmd->lex);
+
   // free the cmd stuff
-  if (cmd) {
-    free(cmd->command);
-    for (int i = 0; i < cmd->argc; i++) {
-      free(cmd->argv[i]);
-    }
-    free(cmd);
+  free(cmd->command);
+  for (int i = 0; i < cmd->argc; i++) {
+    free(cmd->argv[i]);
   }
-}
\ No newline at end of file
+  free(cmd->argv);
+  free(cmd->types);
+  free(cmd);
+}
+bool
+Parse_Timeout(const char* text, int64_t* timeout_ms)
+{
+  if (text == NULL || *text == '\0' || isspace((unsigned char)*text)) {
+    return false;
+  }
+
+  char* end;
+  double seconds = strtod(text, &end);
+  // a year is plenty and keeps the deadline far from overflowing
+  if (*end != '\0' || !isfinite(seconds) || seconds < 0 ||
+      seconds > 365.0 * 24 * 3600) {
+    return false;
+  }
+
+  // rounded up, a short timeout must not turn into no timeout
+  double ms = seconds * 1000;
+  *timeout_ms = (int64_t)ms;
+  if ((double)*timeout_ms < ms) {
+    (*timeout_ms)++;
+  }
+  return true;
+}
@@ -1,22 +1,27 @@
 #ifndef __TINY_DB_QUERY_PARSER
 #define __TINY_DB_QUERY_PARSER
 
+#include <stdbool.h>
+
 #include "tinydb_lex.h"
 
+// argv always has room for at least MAX_ARGS entries so handlers can probe
+// optional arguments without checking argc, variadic commands get more.
 #define MAX_ARGS 10
 
 typedef enum TOKEN
 {
   TOKEN_STRING = 0,
-  TOKEN_NUMBER
+  TOKEN_NUMBER,
+  TOKEN_FLOAT
 } TOKEN;
 
 typedef struct
 {
   char* command;
   int32_t argc;
-  char* argv[MAX_ARGS];
-  TOKEN types[MAX_ARGS];
+  char** argv;
+  TOKEN* types;
   Lexer lex;
 } ParsedCommand;
 
@@ -26,4 +31,11 @@ Parse_Command(char* buffer, size_t buffer_size, size_t* total_read);
 void
 Free_Parsed_Command(ParsedCommand* cmd);
 
+/**
+ * parses a timeout given in seconds ("2", "0.25"), 0 means no timeout.
+ * @returns false when text is not a number or is negative
+ */
+bool
+Parse_Timeout(const char* text, int64_t* timeout_ms);
+
 #endif // __TINY_DB_QUERY_PARSER
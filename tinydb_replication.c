@@ -0,0 +1,1105 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tinydb_aof.h"
+#include "tinydb_clock.h"
+#include "tinydb_command_executor.h"
+#include "tinydb_context.h"
+#include "tinydb_hash.h"
+#include "tinydb_log.h"
+#include "tinydb_replication.h"
+#include "tinydb_snapshot.h"
+
+// names the staged snapshots of full resyncs, both directions
+static atomic_uint_fast32_t sync_counter = 0;
+
+static struct timespec
+deadline_in(int64_t ms)
+{
+  int64_t deadline = Now_Ms() + ms;
+  struct timespec ts;
+  ts.tv_sec = deadline / 1000;
+  ts.tv_nsec = (deadline % 1000) * 1000000;
+  return ts;
+}
+
+// ids only have to tell histories apart, they are not secrets
+static void
+new_replid(char replid[REPL_ID_SIZE + 1])
+{
+  uint8_t bytes[REPL_ID_SIZE / 2];
+  int32_t fd = open("/dev/urandom", O_RDONLY);
+  if (fd < 0 || read(fd, bytes, sizeof(bytes)) != (ssize_t)sizeof(bytes)) {
+    uint64_t seed = (uint64_t)Now_Ms() ^ ((uint64_t)getpid() << 32);
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      bytes[i] = (uint8_t)(seed >> 56);
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  static const char hex[] = "0123456789abcdef";
+  for (size_t i = 0; i < sizeof(bytes); i++) {
+    replid[i * 2] = hex[bytes[i] >> 4];
+    replid[i * 2 + 1] = hex[bytes[i] & 15];
+  }
+  replid[REPL_ID_SIZE] = '\0';
+}
+
+static int32_t
+send_all(int32_t sock, const char* data, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+Replication*
+Create_Replication(RuntimeContext* ctx)
+{
+  Replication* repl = (Replication*)calloc(1, sizeof(Replication));
+  if (!repl) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for Replication");
+    return NULL;
+  }
+
+  repl->ctx = ctx;
+  repl->link_fd = -1;
+  repl->link_state = REPL_LINK_NONE;
+  repl->synced_ms = -1;
+  repl->feed_db = -1;
+  atomic_init(&repl->active, false);
+  atomic_init(&repl->read_only, false);
+  new_replid(repl->replid);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&repl->fed, &attr);
+  pthread_cond_init(&repl->link_wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_mutex_init(&repl->lock, NULL);
+  pthread_mutex_init(&repl->link_lock, NULL);
+  pthread_mutex_init(&repl->primary_lock, NULL);
+  for (int32_t i = 0; i < REPL_KEY_LOCKS; i++) {
+    pthread_mutex_init(&repl->key_locks[i], NULL);
+  }
+
+  return repl;
+}
+
+// caller holds repl->lock
+static void
+append_locked(Replication* repl, const char* data, size_t len)
+{
+  uint64_t end = repl->offset + len;
+
+  // only the tail of a line longer than the whole backlog survives
+  if (len > REPL_BACKLOG_SIZE) {
+    data += len - REPL_BACKLOG_SIZE;
+    len = REPL_BACKLOG_SIZE;
+  }
+
+  size_t pos = (end - len) % REPL_BACKLOG_SIZE;
+  size_t first = len < REPL_BACKLOG_SIZE - pos ? len : REPL_BACKLOG_SIZE - pos;
+  memcpy(repl->backlog + pos, data, first);
+  memcpy(repl->backlog, data + first, len - first);
+
+  repl->offset = end;
+  if (end - repl->backlog_start > REPL_BACKLOG_SIZE) {
+    repl->backlog_start = end - REPL_BACKLOG_SIZE;
+  }
+}
+
+// caller holds repl->lock, from has to be within the backlog
+static size_t
+copy_locked(Replication* repl, uint64_t from, char* out, size_t max)
+{
+  size_t len = repl->offset - from < max ? repl->offset - from : max;
+  size_t pos = from % REPL_BACKLOG_SIZE;
+  size_t first = len < REPL_BACKLOG_SIZE - pos ? len : REPL_BACKLOG_SIZE - pos;
+  memcpy(out, repl->backlog + pos, first);
+  memcpy(out + first, repl->backlog, len - first);
+  return len;
+}
+
+// a new id tells our replicas that the history they follow ended
+static void
+new_history(Replication* repl)
+{
+  pthread_mutex_lock(&repl->lock);
+  new_replid(repl->replid);
+  repl->backlog_start = repl->offset;
+  pthread_cond_broadcast(&repl->fed);
+  pthread_mutex_unlock(&repl->lock);
+}
+
+void
+Replication_New_History(Replication* repl)
+{
+  new_history(repl);
+}
+
+void
+Replication_Feed(Replication* repl,
+                 int32_t db,
+                 const char* command,
+                 char* const* argv,
+                 const TOKEN* types,
+                 int32_t argc)
+{
+  if (!atomic_load(&repl->active)) {
+    return;
+  }
+
+  char stack_line[1024];
+  size_t capacity = AOF_Command_Length(command, argv, argc);
+  char* line = capacity <= sizeof(stack_line) ? stack_line : malloc(capacity);
+  if (!line) {
+    // a gap in the stream would go unnoticed, replicas resync instead
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for a backlog line");
+    new_history(repl);
+    return;
+  }
+  size_t len = AOF_Format_Command(line, command, argv, types, argc);
+
+  pthread_mutex_lock(&repl->lock);
+  if (repl->feed_db != db) {
+    char select[AOF_SELECT_LENGTH];
+    append_locked(repl, select, AOF_Format_Select(select, db));
+    repl->feed_db = db;
+  }
+  append_locked(repl, line, len);
+  pthread_cond_broadcast(&repl->fed);
+  pthread_mutex_unlock(&repl->lock);
+
+  if (line != stack_line) {
+    free(line);
+  }
+}
+
+void
+Replication_Lock_Key(Replication* repl, const char* key)
+{
+  pthread_mutex_lock(
+    &repl->key_locks[DJB2_Hash_String(key) & (REPL_KEY_LOCKS - 1)]);
+}
+
+void
+Replication_Unlock_Key(Replication* repl, const char* key)
+{
+  pthread_mutex_unlock(
+    &repl->key_locks[DJB2_Hash_String(key) & (REPL_KEY_LOCKS - 1)]);
+}
+
+uint64_t
+Replication_Sync_Offset(Replication* repl)
+{
+  pthread_mutex_lock(&repl->lock);
+  uint64_t offset = repl->offset;
+  repl->feed_db = -1;
+  pthread_mutex_unlock(&repl->lock);
+  return offset;
+}
+
+static int32_t
+activate_backlog(Replication* repl)
+{
+  pthread_mutex_lock(&repl->lock);
+  if (!repl->backlog) {
+    repl->backlog = malloc(REPL_BACKLOG_SIZE);
+    if (!repl->backlog) {
+      pthread_mutex_unlock(&repl->lock);
+      DB_Log(DB_LOG_ERROR, "Failed to allocate the replication backlog");
+      return -1;
+    }
+    repl->backlog_start = repl->offset;
+    atomic_store(&repl->active, true);
+  }
+  pthread_mutex_unlock(&repl->lock);
+  return 0;
+}
+
+// forks a snapshot like BGSAVE, offset receives the position of the stream it
+// corresponds to
+static int32_t
+send_snapshot(Replication* repl,
+              int32_t sock,
+              const char* replid,
+              uint64_t* offset)
+{
+  SaveSystem* save_system = repl->ctx->save_system;
+  if (!save_system) {
+    DB_Log(DB_LOG_ERROR, "Full resync needs a snapshot file to fork into");
+    return -1;
+  }
+
+  char filename[64];
+  snprintf(filename,
+           sizeof(filename),
+           REPL_SYNC_FILE,
+           (int32_t)getpid(),
+           (uint32_t)atomic_fetch_add(&sync_counter, 1));
+
+  pid_t pid = Save_Fork(save_system, filename, offset);
+  if (pid < 0) {
+    return -1;
+  }
+
+  int32_t status = 0;
+  pid_t waited;
+  do {
+    waited = waitpid(pid, &status, 0);
+  } while (waited < 0 && errno == EINTR);
+
+  int32_t fd = -1;
+  if (waited != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+      (fd = open(filename, O_RDONLY)) < 0) {
+    DB_Log(DB_LOG_ERROR, "Failed to write the snapshot for a full resync");
+    unlink(filename);
+    return -1;
+  }
+  // the descriptor keeps the file alive
+  unlink(filename);
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  char header[128];
+  int32_t len = snprintf(header,
+                         sizeof(header),
+                         "FULLRESYNC %s %" PRIu64 " %" PRIu64 "\n",
+                         replid,
+                         *offset,
+                         (uint64_t)st.st_size);
+  int32_t res = send_all(sock, header, len);
+
+  char* chunk = malloc(REPL_CHUNK_SIZE);
+  if (!chunk) {
+    res = -1;
+  }
+  while (res == 0) {
+    ssize_t n = read(fd, chunk, REPL_CHUNK_SIZE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      res = n == 0 ? 0 : -1;
+      break;
+    }
+    res = send_all(sock, chunk, n);
+  }
+  free(chunk);
+  close(fd);
+
+  if (res == 0) {
+    DB_Log(DB_LOG_INFO,
+           "Sent %" PRIu64 " bytes of snapshot to replica on socket %d",
+           (uint64_t)st.st_size,
+           sock);
+  }
+  return res;
+}
+
+// caller holds repl->lock
+static void
+handle_ack_locked(ReplicaLink* link)
+{
+  uint64_t offset;
+  if (sscanf(link->ack_line, "replconf ack %" SCNu64, &offset) == 1) {
+    link->ack_offset = offset;
+    link->ack_ms = Now_Ms();
+  }
+}
+
+// drains what the replica sent (its acks)
+// @returns -1 once the replica closed the link
+static int32_t
+drain_replica(Replication* repl, ReplicaLink* link)
+{
+  char buffer[256];
+  for (;;) {
+    ssize_t n = recv(link->sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return 0;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+
+    pthread_mutex_lock(&repl->lock);
+    for (ssize_t i = 0; i < n; i++) {
+      if (buffer[i] == '\n') {
+        link->ack_line[link->ack_len] = '\0';
+        handle_ack_locked(link);
+        link->ack_len = 0;
+      } else if (link->ack_len < sizeof(link->ack_line) - 1) {
+        link->ack_line[link->ack_len++] = buffer[i];
+      }
+    }
+    pthread_mutex_unlock(&repl->lock);
+  }
+}
+
+// room after a chunk for the offset line
+#define REPL_OFFSET_LINE_SIZE 48
+
+static void
+stream_backlog(Replication* repl,
+               ReplicaLink* link,
+               const char* replid,
+               uint64_t sent)
+{
+  int32_t sock = link->sock;
+  char* chunk = malloc(REPL_CHUNK_SIZE + REPL_OFFSET_LINE_SIZE);
+  if (!chunk) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for the replica stream");
+    return;
+  }
+
+  int64_t last_send_ms = Now_Ms();
+  for (;;) {
+    pthread_mutex_lock(&repl->lock);
+    if (repl->offset == sent && !repl->stop) {
+      struct timespec ts = deadline_in(REPL_PING_INTERVAL_MS);
+      pthread_cond_timedwait(&repl->fed, &repl->lock, &ts);
+    }
+
+    bool stop = repl->stop;
+    bool lost =
+      strcmp(repl->replid, replid) != 0 || sent < repl->backlog_start;
+    uint64_t head = repl->offset;
+    size_t len =
+      stop || lost ? 0 : copy_locked(repl, sent, chunk, REPL_CHUNK_SIZE);
+    pthread_mutex_unlock(&repl->lock);
+
+    if (stop) {
+      break;
+    }
+    if (lost) {
+      DB_Log(DB_LOG_WARNING,
+             "Replica on socket %d fell out of the backlog, it has to resync",
+             sock);
+      break;
+    }
+
+    // the backlog only holds whole lines, a chunk that stops short of the
+    // head is cut back to its last one so the offset line can follow it
+    size_t end = len;
+    if (sent + len < head) {
+      while (end > 0 && chunk[end - 1] != '\n') {
+        end--;
+      }
+      if (end == 0) {
+        end = len; // a single line longer than the chunk
+      }
+    }
+
+    size_t out = end;
+    bool boundary = sent + len == head || chunk[end - 1] == '\n';
+    if (boundary &&
+        (end > 0 || Now_Ms() - last_send_ms >= REPL_PING_INTERVAL_MS)) {
+      out += snprintf(chunk + end,
+                      REPL_OFFSET_LINE_SIZE,
+                      "replconf offset %" PRIu64 "\n",
+                      head);
+    }
+
+    if (out > 0) {
+      if (send_all(sock, chunk, out) != 0) {
+        break;
+      }
+      last_send_ms = Now_Ms();
+    }
+    sent += end;
+
+    if (drain_replica(repl, link) != 0) {
+      break;
+    }
+  }
+
+  free(chunk);
+}
+
+void
+Replication_Serve(Replication* repl,
+                  int32_t sock,
+                  const char* replid,
+                  int64_t offset)
+{
+  if (sock < 0 || activate_backlog(repl) != 0) {
+    return;
+  }
+
+  ReplicaLink link = { .sock = sock, .ack_ms = -1 };
+  char current_replid[REPL_ID_SIZE + 1];
+  pthread_mutex_lock(&repl->lock);
+  memcpy(current_replid, repl->replid, sizeof(current_replid));
+  bool partial = replid && strcmp(replid, repl->replid) == 0 &&
+                 offset >= 0 && (uint64_t)offset >= repl->backlog_start &&
+                 (uint64_t)offset <= repl->offset;
+  repl->num_replicas++;
+  link.next = repl->replicas;
+  repl->replicas = &link;
+  pthread_mutex_unlock(&repl->lock);
+
+  uint64_t sent = (uint64_t)offset;
+  int32_t res;
+  if (partial) {
+    DB_Log(DB_LOG_INFO,
+           "Replica on socket %d continues at offset %" PRIu64,
+           sock,
+           sent);
+    res = send_all(sock, "CONTINUE\n", 9);
+  } else {
+    DB_Log(DB_LOG_INFO, "Replica on socket %d needs a full resync", sock);
+    res = send_snapshot(repl, sock, current_replid, &sent);
+  }
+
+  if (res == 0) {
+    stream_backlog(repl, &link, current_replid, sent);
+  }
+  DB_Log(DB_LOG_INFO, "Replica on socket %d disconnected", sock);
+
+  pthread_mutex_lock(&repl->lock);
+  ReplicaLink** next = &repl->replicas;
+  while (*next != &link) {
+    next = &(*next)->next;
+  }
+  *next = link.next;
+  repl->num_replicas--;
+  pthread_cond_broadcast(&repl->fed);
+  pthread_mutex_unlock(&repl->lock);
+
+  // the client handler sees the closed connection and cleans up
+  shutdown(sock, SHUT_RDWR);
+}
+
+/**
+ * replica side
+ */
+
+typedef struct LinkReader
+{
+  int32_t fd;
+  char* buffer;
+  size_t len;
+  size_t capacity;
+} LinkReader;
+
+static bool
+link_stopped(Replication* repl)
+{
+  pthread_mutex_lock(&repl->link_lock);
+  bool stop = repl->link_stop;
+  pthread_mutex_unlock(&repl->link_lock);
+  return stop;
+}
+
+static void
+link_set_state(Replication* repl, REPL_LINK_STATE state)
+{
+  pthread_mutex_lock(&repl->link_lock);
+  repl->link_state = state;
+  pthread_mutex_unlock(&repl->link_lock);
+}
+
+// @returns bytes received, 0 when recv timed out, -1 once the link is closed
+static ssize_t
+link_fill(LinkReader* reader)
+{
+  if (reader->len == reader->capacity) {
+    size_t capacity = reader->capacity ? reader->capacity * 2 : REPL_CHUNK_SIZE;
+    char* buffer = realloc(reader->buffer, capacity);
+    if (!buffer) {
+      DB_Log(DB_LOG_ERROR, "Failed to allocate memory for the replica link");
+      return -1;
+    }
+    reader->buffer = buffer;
+    reader->capacity = capacity;
+  }
+
+  ssize_t n = recv(reader->fd,
+                   reader->buffer + reader->len,
+                   reader->capacity - reader->len,
+                   0);
+  if (n > 0) {
+    reader->len += n;
+    return n;
+  }
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 0;
+  }
+  return -1;
+}
+
+static void
+link_consume(LinkReader* reader, size_t len)
+{
+  memmove(reader->buffer, reader->buffer + len, reader->len - len);
+  reader->len -= len;
+}
+
+static int32_t
+connect_to_primary(const char* host, int32_t port)
+{
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+
+  struct addrinfo hints = { 0 };
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo* addresses;
+  int32_t rc = getaddrinfo(host, service, &hints, &addresses);
+  if (rc != 0) {
+    DB_Log(DB_LOG_ERROR, "Unable to resolve %s: %s", host, gai_strerror(rc));
+    return -1;
+  }
+
+  int32_t fd = -1;
+  for (struct addrinfo* ai = addresses; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+
+  if (fd < 0) {
+    DB_Log(DB_LOG_WARNING, "Unable to connect to primary %s:%d", host, port);
+    return -1;
+  }
+
+  // recv wakes up regularly to send the ack and to notice REPLICAOF changes
+  struct timeval timeout;
+  timeout.tv_sec = REPL_ACK_INTERVAL_MS / 1000;
+  timeout.tv_usec = (REPL_ACK_INTERVAL_MS % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+static int32_t
+load_snapshot(Replication* repl, LinkReader* reader, uint64_t size)
+{
+  char filename[64];
+  snprintf(filename,
+           sizeof(filename),
+           REPL_SYNC_FILE,
+           (int32_t)getpid(),
+           (uint32_t)atomic_fetch_add(&sync_counter, 1));
+
+  int32_t fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    DB_Log(DB_LOG_ERROR, "Unable to open file %s for writing", filename);
+    return -1;
+  }
+
+  int64_t start = Now_Ms();
+  uint64_t remaining = size;
+  int32_t res = 0;
+  while (remaining > 0 && res == 0) {
+    if (reader->len == 0) {
+      if (link_fill(reader) < 0 || link_stopped(repl)) {
+        res = -1;
+      }
+      continue;
+    }
+
+    size_t len = reader->len < remaining ? reader->len : remaining;
+    if (write(fd, reader->buffer, len) != (ssize_t)len) {
+      DB_Log(DB_LOG_ERROR, "Failed to write %s: %s", filename, strerror(errno));
+      res = -1;
+      break;
+    }
+    link_consume(reader, len);
+    remaining -= len;
+  }
+  close(fd);
+
+  if (res == 0) {
+    // a write like any other, BGSAVE never forks in the middle of the swap
+    SaveSystem* save_system = repl->ctx->save_system;
+    if (save_system) {
+      Save_Begin_Write(save_system);
+    }
+    res = Import_Snapshot_Live(repl->ctx, filename);
+    if (save_system) {
+      Save_End_Write(save_system, res == 0);
+    }
+  }
+  unlink(filename);
+
+  if (res != 0) {
+    DB_Log(DB_LOG_ERROR, "Failed to load the snapshot of the primary");
+    return -1;
+  }
+
+  DB_Log(DB_LOG_INFO,
+         "Loaded %" PRIu64 " bytes of snapshot from the primary in %" PRId64
+         " ms",
+         size,
+         Now_Ms() - start);
+
+  // the stream names its database before the first write
+  repl->link_db = 0;
+
+  // the log still describes the data we had before
+  AOF* aof = repl->ctx->aof;
+  if (aof && AOF_Rewrite_Start(aof, &repl->ctx->db_manager)) {
+    DB_Log(DB_LOG_WARNING,
+           "AOF rewrite is already running, the loaded snapshot is only "
+           "logged by the next one");
+  }
+
+  new_history(repl);
+  return 0;
+}
+
+// executes the complete lines received so far, like AOF_Replay
+static void
+apply_stream(Replication* repl,
+             LinkReader* reader,
+             char** line,
+             size_t* line_capacity)
+{
+  // replies go nowhere
+  Connection link = {
+    .sock = -1,
+    .db = Select_Database(&repl->ctx->db_manager, repl->link_db),
+  };
+  if (!link.db) {
+    link.db = &repl->ctx->db_manager.databases[0];
+  }
+  char* ptr = reader->buffer;
+  char* end = reader->buffer + reader->len;
+  char* eol;
+  size_t skipped = 0; // offset lines are not part of the stream
+
+  while (ptr < end && (eol = memchr(ptr, '\n', end - ptr)) != NULL) {
+    size_t len = eol - ptr;
+    if (len + 1 > *line_capacity) {
+      char* temp = realloc(*line, len + 1);
+      if (!temp) {
+        DB_Log(DB_LOG_ERROR, "Failed to allocate memory for a stream line");
+        break;
+      }
+      *line = temp;
+      *line_capacity = len + 1;
+    }
+    memcpy(*line, ptr, len);
+    (*line)[len] = '\0';
+    ptr = eol + 1;
+
+    uint64_t reported;
+    if (sscanf(*line, "replconf offset %" SCNu64, &reported) == 1) {
+      skipped += len + 1;
+      size_t applied = ptr - reader->buffer - skipped;
+
+      // everything the primary had when it wrote the line is applied
+      pthread_mutex_lock(&repl->link_lock);
+      repl->primary_reported = reported;
+      if (repl->primary_offset + applied >= reported) {
+        repl->synced_ms = Now_Ms();
+      }
+      pthread_mutex_unlock(&repl->link_lock);
+      continue;
+    }
+
+    size_t total_read = len;
+    ParsedCommand* cmd = Parse_Command(*line, len + 1, &total_read);
+    if (cmd != NULL) {
+      Execute_Command(&link, cmd);
+      Free_Parsed_Command(cmd);
+    }
+  }
+  repl->link_db = (int32_t)link.db->ID;
+
+  size_t consumed = ptr - reader->buffer;
+  pthread_mutex_lock(&repl->link_lock);
+  repl->primary_offset += consumed - skipped;
+  pthread_mutex_unlock(&repl->link_lock);
+  link_consume(reader, consumed);
+}
+
+static void
+sync_with_primary(Replication* repl,
+                  LinkReader* reader,
+                  char** line,
+                  size_t* line_capacity)
+{
+  char request[128];
+  pthread_mutex_lock(&repl->link_lock);
+  if (repl->primary_replid[0]) {
+    snprintf(request,
+             sizeof(request),
+             "psync \"%s\" %" PRIu64 "\n",
+             repl->primary_replid,
+             repl->primary_offset);
+  } else {
+    snprintf(request, sizeof(request), "psync \"?\" -1\n");
+  }
+  repl->link_state = REPL_LINK_SYNCING;
+  pthread_mutex_unlock(&repl->link_lock);
+
+  if (send_all(reader->fd, request, strlen(request)) != 0) {
+    return;
+  }
+
+  char* eol;
+  while (!reader->len || !(eol = memchr(reader->buffer, '\n', reader->len))) {
+    if (link_fill(reader) < 0 || link_stopped(repl)) {
+      return;
+    }
+  }
+  *eol = '\0';
+
+  char replid[REPL_ID_SIZE + 1];
+  uint64_t offset;
+  uint64_t size;
+  if (strcmp(reader->buffer, "CONTINUE") == 0) {
+    DB_Log(DB_LOG_INFO, "Partial resync with the primary");
+    link_consume(reader, eol + 1 - reader->buffer);
+  } else if (sscanf(reader->buffer,
+                    "FULLRESYNC %40s %" SCNu64 " %" SCNu64,
+                    replid,
+                    &offset,
+                    &size) == 3) {
+    DB_Log(DB_LOG_INFO, "Full resync with the primary");
+    link_consume(reader, eol + 1 - reader->buffer);
+    if (load_snapshot(repl, reader, size) != 0) {
+      return;
+    }
+
+    pthread_mutex_lock(&repl->link_lock);
+    memcpy(repl->primary_replid, replid, sizeof(replid));
+    repl->primary_offset = offset;
+    repl->primary_reported = offset;
+    pthread_mutex_unlock(&repl->link_lock);
+  } else {
+    DB_Log(DB_LOG_ERROR, "Unexpected reply to psync: %s", reader->buffer);
+    return;
+  }
+
+  link_set_state(repl, REPL_LINK_CONNECTED);
+
+  int64_t last_ack_ms = 0;
+  while (!link_stopped(repl)) {
+    apply_stream(repl, reader, line, line_capacity);
+
+    if (Now_Ms() - last_ack_ms >= REPL_ACK_INTERVAL_MS) {
+      pthread_mutex_lock(&repl->link_lock);
+      snprintf(request,
+               sizeof(request),
+               "replconf ack %" PRIu64 "\n",
+               repl->primary_offset);
+      pthread_mutex_unlock(&repl->link_lock);
+
+      if (send_all(reader->fd, request, strlen(request)) != 0) {
+        break;
+      }
+      last_ack_ms = Now_Ms();
+    }
+
+    if (link_fill(reader) < 0) {
+      break;
+    }
+  }
+}
+
+static void*
+Replication_Link_Function(void* arg)
+{
+  Replication* repl = (Replication*)arg;
+  LinkReader reader = { 0 };
+  char* line = NULL;
+  size_t line_capacity = 0;
+
+  pthread_mutex_lock(&repl->link_lock);
+  while (!repl->link_stop) {
+    repl->link_state = REPL_LINK_CONNECTING;
+    const char* host = repl->primary_host;
+    int32_t port = repl->primary_port;
+    pthread_mutex_unlock(&repl->link_lock);
+
+    int32_t fd = connect_to_primary(host, port);
+
+    // REPLICAOF shuts the link down to stop us
+    pthread_mutex_lock(&repl->link_lock);
+    repl->link_fd = fd;
+    bool stop = repl->link_stop;
+    pthread_mutex_unlock(&repl->link_lock);
+
+    if (fd >= 0 && !stop) {
+      DB_Log(DB_LOG_INFO, "Connected to primary %s:%d", host, port);
+      reader.fd = fd;
+      reader.len = 0;
+      sync_with_primary(repl, &reader, &line, &line_capacity);
+      DB_Log(DB_LOG_WARNING, "Lost the link to primary %s:%d", host, port);
+    }
+
+    pthread_mutex_lock(&repl->link_lock);
+    if (fd >= 0) {
+      close(fd);
+    }
+    repl->link_fd = -1;
+    if (!repl->link_stop) {
+      repl->link_state = REPL_LINK_CONNECTING;
+      struct timespec ts = deadline_in(REPL_RETRY_MS);
+      pthread_cond_timedwait(&repl->link_wakeup, &repl->link_lock, &ts);
+    }
+  }
+  repl->link_state = REPL_LINK_NONE;
+  pthread_mutex_unlock(&repl->link_lock);
+
+  free(reader.buffer);
+  free(line);
+  return NULL;
+}
+
+// caller holds primary_lock
+static void
+stop_link(Replication* repl)
+{
+  pthread_mutex_lock(&repl->link_lock);
+  if (!repl->link_running) {
+    pthread_mutex_unlock(&repl->link_lock);
+    return;
+  }
+  repl->link_stop = true;
+  if (repl->link_fd >= 0) {
+    shutdown(repl->link_fd, SHUT_RDWR);
+  }
+  pthread_cond_signal(&repl->link_wakeup);
+  pthread_mutex_unlock(&repl->link_lock);
+
+  pthread_join(repl->link_thread, NULL);
+  repl->link_running = false;
+}
+
+int32_t
+Replication_Set_Primary(Replication* repl, const char* host, int32_t port)
+{
+  pthread_mutex_lock(&repl->primary_lock);
+  stop_link(repl);
+
+  char* new_host = host ? strdup(host) : NULL;
+  pthread_mutex_lock(&repl->link_lock);
+  free(repl->primary_host);
+  repl->primary_host = new_host;
+  repl->primary_port = port;
+  repl->link_stop = false;
+  pthread_mutex_unlock(&repl->link_lock);
+
+  atomic_store(&repl->read_only, host != NULL);
+
+  int32_t res = 0;
+  if (host == NULL) {
+    DB_Log(DB_LOG_INFO, "Stopped replicating, serving as a primary");
+  } else if (new_host == NULL ||
+             pthread_create(&repl->link_thread,
+                            NULL,
+                            Replication_Link_Function,
+                            (void*)repl) != 0) {
+    DB_Log(DB_LOG_ERROR, "Failed to start the link to %s:%d", host, port);
+    res = -1;
+  } else {
+    DB_Log(DB_LOG_INFO, "Replicating from %s:%d", host, port);
+    repl->link_running = true;
+  }
+
+  pthread_mutex_unlock(&repl->primary_lock);
+  return res;
+}
+
+bool
+Replication_Is_Read_Only(Replication* repl)
+{
+  return atomic_load(&repl->read_only);
+}
+
+int64_t
+Replication_Lag_Ms(Replication* repl)
+{
+  if (!atomic_load(&repl->read_only)) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&repl->link_lock);
+  int64_t lag = repl->synced_ms < 0 ? -1 : Now_Ms() - repl->synced_ms;
+  pthread_mutex_unlock(&repl->link_lock);
+  return lag;
+}
+
+static const char*
+link_state_name(REPL_LINK_STATE state)
+{
+  switch (state) {
+    case REPL_LINK_CONNECTING:
+      return "connecting";
+    case REPL_LINK_SYNCING:
+      return "syncing";
+    case REPL_LINK_CONNECTED:
+      return "connected";
+    default:
+      return "none";
+  }
+}
+
+// appends to the line Replication_Role builds, out grows as needed
+static int32_t
+role_append(char** out, size_t* len, size_t* capacity, const char* fmt, ...)
+{
+  for (;;) {
+    va_list args;
+    va_start(args, fmt);
+    int32_t n = vsnprintf(*out + *len, *capacity - *len, fmt, args);
+    va_end(args);
+    if (n < 0) {
+      return -1;
+    }
+    if ((size_t)n < *capacity - *len) {
+      *len += n;
+      return 0;
+    }
+
+    size_t capacity_new = (*capacity + n) * 2;
+    char* temp = realloc(*out, capacity_new);
+    if (!temp) {
+      return -1;
+    }
+    *out = temp;
+    *capacity = capacity_new;
+  }
+}
+
+char*
+Replication_Role(Replication* repl)
+{
+  size_t len = 0;
+  size_t capacity = 256;
+  char* out = malloc(capacity);
+  if (!out) {
+    return NULL;
+  }
+
+  int64_t now = Now_Ms();
+  int32_t res = 0;
+  if (atomic_load(&repl->read_only)) {
+    pthread_mutex_lock(&repl->link_lock);
+    uint64_t behind = repl->primary_reported > repl->primary_offset
+                        ? repl->primary_reported - repl->primary_offset
+                        : 0;
+    res = role_append(&out,
+                      &len,
+                      &capacity,
+                      "{\"role\": \"replica\", \"primary\": \"%s:%d\", "
+                      "\"link\": \"%s\", \"offset\": %" PRIu64
+                      ", \"lag\": %" PRIu64 ", \"lag_ms\": %" PRId64 "}\n",
+                      repl->primary_host ? repl->primary_host : "",
+                      repl->primary_port,
+                      link_state_name(repl->link_state),
+                      repl->primary_offset,
+                      behind,
+                      repl->synced_ms < 0 ? -1 : now - repl->synced_ms);
+    pthread_mutex_unlock(&repl->link_lock);
+  } else {
+    pthread_mutex_lock(&repl->lock);
+    res = role_append(&out,
+                      &len,
+                      &capacity,
+                      "{\"role\": \"primary\", \"replid\": \"%s\", "
+                      "\"offset\": %" PRIu64 ", \"replicas\": [",
+                      repl->replid,
+                      repl->offset);
+    for (ReplicaLink* link = repl->replicas; link && res == 0;
+         link = link->next) {
+      uint64_t behind = link->ack_offset < repl->offset
+                          ? repl->offset - link->ack_offset
+                          : 0;
+      res = role_append(&out,
+                        &len,
+                        &capacity,
+                        "%s{\"socket\": %d, \"offset\": %" PRIu64
+                        ", \"lag\": %" PRIu64 ", \"last_ack_ms\": %" PRId64
+                        "}",
+                        link == repl->replicas ? "" : ", ",
+                        link->sock,
+                        link->ack_offset,
+                        behind,
+                        link->ack_ms < 0 ? -1 : now - link->ack_ms);
+    }
+    pthread_mutex_unlock(&repl->lock);
+    if (res == 0) {
+      res = role_append(&out, &len, &capacity, "]}\n");
+    }
+  }
+
+  if (res != 0) {
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+void
+Destroy_Replication(Replication* repl)
+{
+  pthread_mutex_lock(&repl->primary_lock);
+  stop_link(repl);
+  pthread_mutex_unlock(&repl->primary_lock);
+
+  // replica connections notice within REPL_ACK_INTERVAL_MS
+  pthread_mutex_lock(&repl->lock);
+  repl->stop = true;
+  pthread_cond_broadcast(&repl->fed);
+  while (repl->num_replicas > 0) {
+    pthread_cond_wait(&repl->fed, &repl->lock);
+  }
+  pthread_mutex_unlock(&repl->lock);
+
+  for (int32_t i = 0; i < REPL_KEY_LOCKS; i++) {
+    pthread_mutex_destroy(&repl->key_locks[i]);
+  }
+  pthread_cond_destroy(&repl->link_wakeup);
+  pthread_cond_destroy(&repl->fed);
+  pthread_mutex_destroy(&repl->primary_lock);
+  pthread_mutex_destroy(&repl->link_lock);
+  pthread_mutex_destroy(&repl->lock);
+
+  free(repl->primary_host);
+  free(repl->backlog);
+  free(repl);
+}
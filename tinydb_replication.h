@@ -0,0 +1,233 @@
+/**
+ * note (David)
+ * /REPLICATION/
+ * every write this server executes is also appended to the replication
+ * backlog, a ring buffer holding the most recent REPL_BACKLOG_SIZE bytes of
+ * the stream. the lines are the ones of the AOF. a position in the stream
+ * is its offset, the number of bytes fed since the replication id was
+ * created.
+ *
+ * a replica connects like any client and sends
+ *
+ *   psync "<replication id>" <offset>
+ *
+ * with the id and offset it got so far ("?" and -1 the first time). when the
+ * id matches and the offset is still in the backlog the primary answers
+ *
+ *   CONTINUE
+ *
+ * and streams from there (partial resync). otherwise it forks a snapshot,
+ * like BGSAVE, and answers
+ *
+ *   FULLRESYNC <replication id> <offset> <snapshot size>
+ *
+ * followed by the snapshot and the stream from the offset the snapshot was
+ * taken at. the connection then stays a replication link, the replica
+ * executes the lines as they come and reports its offset every
+ * REPL_ACK_INTERVAL_MS with "replconf ack <offset>".
+ *
+ * a replica keeps a backlog of its own, with its own id, so replicas can be
+ * chained and a promoted replica can serve the others. loading a full resync
+ * gives it a new id since its history changed.
+ *
+ * /LAG/
+ * whenever a chunk of the stream ends at a line boundary, and at least every
+ * REPL_PING_INTERVAL_MS when there is nothing to send, the primary adds
+ *
+ *   replconf offset <offset>
+ *
+ * with its own offset at that moment. the line is not part of the stream, it
+ * is neither counted in the offset nor kept in the backlog. a replica that has
+ * applied everything up to that offset when the line arrives was in sync with
+ * the primary of (at most a network delay) ago. its lag is then
+ *
+ *   bytes: last offset the primary reported - offset applied
+ *   ms:    time since the replica was last in sync
+ *
+ * the primary knows the lag of its replicas from their acks. replicas are read
+ * only, ROLE reports both sides.
+ *
+ * /DATABASES/
+ * like in the AOF a "select <db>" line precedes a write to another database
+ * than the one of the line before. the stream following a snapshot taken for
+ * a full resync always starts with one, the replica does not know which
+ * database the primary wrote to last.
+ */
+#ifndef __TINY_DB_REPLICATION
+#define __TINY_DB_REPLICATION
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "tinydb_query_parser.h"
+
+// hex characters of a replication id
+#define REPL_ID_SIZE 40
+
+// number of key lock stripes used when there is no AOF, must be a power of 2
+#define REPL_KEY_LOCKS 64
+
+// bytes sent to a replica per wakeup
+#define REPL_CHUNK_SIZE 65536
+
+// how often the replica reports its offset, the primary checks for it
+// (and for a closed link) at the same interval
+#define REPL_ACK_INTERVAL_MS 1000
+
+// longest the primary stays silent on a link, bounds the lag a replica
+// reports when there are no writes
+#define REPL_PING_INTERVAL_MS 100
+
+// wait before reconnecting to the primary
+#define REPL_RETRY_MS 1000
+
+// snapshots of full resyncs are staged in files named like this (pid, counter)
+#define REPL_SYNC_FILE "replsync.%d.%u.tmp"
+
+struct RuntimeContext;
+
+typedef enum REPL_LINK_STATE
+{
+  REPL_LINK_NONE, // not a replica
+  REPL_LINK_CONNECTING,
+  REPL_LINK_SYNCING, // waiting for or loading the snapshot
+  REPL_LINK_CONNECTED
+} REPL_LINK_STATE;
+
+// a replica connected to us, lives on the stack of the worker serving it
+typedef struct ReplicaLink
+{
+  int32_t sock;
+  uint64_t ack_offset;
+  int64_t ack_ms; // -1 until the first ack
+  char ack_line[64];
+  size_t ack_len;
+  struct ReplicaLink* next;
+} ReplicaLink;
+
+typedef struct Replication
+{
+  struct RuntimeContext* ctx;
+
+  // allocated when the first replica asks for it, writes are not copied
+  // before that
+  atomic_bool active;
+  char replid[REPL_ID_SIZE + 1];
+  char* backlog;
+  uint64_t offset;        // byte i of the stream is backlog[i % size]
+  uint64_t backlog_start; // oldest offset still in the backlog
+  int32_t feed_db;        // database of the last line fed, -1 none yet
+  int32_t num_replicas;
+  ReplicaLink* replicas;
+  bool stop;
+  pthread_mutex_t lock;
+  pthread_cond_t fed;
+
+  // orders backlog + execute of writes to the same key when the AOF key locks
+  // are not there to do it
+  pthread_mutex_t key_locks[REPL_KEY_LOCKS];
+
+  // serializes REPLICAOF, the link thread is stopped and started under it
+  pthread_mutex_t primary_lock;
+
+  // set while this server is a replica, clients can only read then
+  atomic_bool read_only;
+
+  // link to the primary when this server is a replica, guarded by link_lock
+  pthread_mutex_t link_lock;
+  pthread_cond_t link_wakeup;
+  REPL_LINK_STATE link_state;
+  char* primary_host;
+  int32_t primary_port;
+  char primary_replid[REPL_ID_SIZE + 1];
+  uint64_t primary_offset;   // applied so far
+  uint64_t primary_reported; // last offset the primary told us it had
+  int64_t synced_ms;         // last time we were in sync, -1 never
+  int32_t link_db;           // database the stream writes to, link thread only
+  int32_t link_fd;
+  bool link_stop;
+  bool link_running;
+  pthread_t link_thread;
+} Replication;
+
+Replication*
+Create_Replication(struct RuntimeContext* ctx);
+
+/**
+ * appends the write to database db to the backlog, see AOF_Feed. the caller
+ * holds the key lock of argv[0] so the stream has the writes of a key in
+ * execution order.
+ */
+void
+Replication_Feed(Replication* repl,
+                 int32_t db,
+                 const char* command,
+                 char* const* argv,
+                 const TOKEN* types,
+                 int32_t argc);
+
+/**
+ * ends the history the replicas follow, they resync in full. for changes
+ * that are not fed as commands (LOAD).
+ */
+void
+Replication_New_History(Replication* repl);
+
+void
+Replication_Lock_Key(Replication* repl, const char* key);
+
+void
+Replication_Unlock_Key(Replication* repl, const char* key);
+
+/**
+ * called while no write is in flight, when a snapshot for a full resync is
+ * taken. the next line fed names its database.
+ * @returns offset of the next byte fed to the backlog
+ */
+uint64_t
+Replication_Sync_Offset(Replication* repl);
+
+/**
+ * handles psync on the connection of a replica and streams the backlog to it
+ * until the link breaks or the replica falls out of the backlog.
+ */
+void
+Replication_Serve(Replication* repl,
+                  int32_t sock,
+                  const char* replid,
+                  int64_t offset);
+
+/**
+ * makes this server a replica of host:port, the link runs on its own thread
+ * and reconnects on its own. host NULL (REPLICAOF NO ONE) stops replicating
+ * and keeps the data.
+ * @returns 0 on success, -1 when the link could not be started
+ */
+int32_t
+Replication_Set_Primary(Replication* repl, const char* host, int32_t port);
+
+bool
+Replication_Is_Read_Only(Replication* repl);
+
+/**
+ * @returns milliseconds since this replica was last in sync with its primary,
+ * 0 on a primary and -1 when it never was
+ */
+int64_t
+Replication_Lag_Ms(Replication* repl);
+
+/**
+ * describes the role of this server and the lag of the link(s) as one line,
+ * the caller frees it.
+ * @returns the line or NULL when out of memory
+ */
+char*
+Replication_Role(Replication* repl);
+
+void
+Destroy_Replication(Replication* repl);
+
+#endif // __TINY_DB_REPLICATION
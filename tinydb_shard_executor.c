@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tinydb_command_executor.h"
+#include "tinydb_database.h"
+#include "tinydb_hashmap.h"
+#include "tinydb_log.h"
+#include "tinydb_shard_executor.h"
+#include "tinydb_thread_pool.h"
+
+ShardExecutors shard_executors;
+
+// index of the executor running on this thread, -1 everywhere else
+static _Thread_local int32_t current_executor = -1;
+
+// the thread holds the executors paused and touches the shards itself
+static _Thread_local bool pausing = false;
+
+// commands that only touch the key in argv[0]
+static const char* keyed_commands[] = { "set",    "get",    "append", "strlen",
+                                        "incr",   "incrby", "rpush",  "lpush",
+                                        "rpop",   "lpop",   "blpop",  "brpop",
+                                        "llen",   "lrange", "lindex", "hset",
+                                        "hget",   "hdel",   "hgetall",
+                                        "hincrby" };
+
+static bool
+is_keyed_command(const char* command)
+{
+  int32_t num_commands = sizeof(keyed_commands) / sizeof(keyed_commands[0]);
+  for (int32_t i = 0; i < num_commands; i++) {
+    if (strcmp(command, keyed_commands[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool
+ring_push(ShardRing* ring, ShardRequest* request)
+{
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head == SHARD_RING_SIZE) {
+    return false;
+  }
+  ring->slots[tail & (SHARD_RING_SIZE - 1)] = request;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+static ShardRequest*
+ring_pop(ShardRing* ring)
+{
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head == tail) {
+    return NULL;
+  }
+  ShardRequest* request = ring->slots[head & (SHARD_RING_SIZE - 1)];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return request;
+}
+
+static ShardRequest*
+queue_pop(ShardExecutor* executor)
+{
+  if (atomic_load(&executor->queued) == 0) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&executor->queue_lock);
+  ShardRequest* request = executor->queue_head;
+  if (request) {
+    executor->queue_head = request->next;
+    if (!executor->queue_head) {
+      executor->queue_tail = NULL;
+    }
+    atomic_fetch_sub(&executor->queued, 1);
+  }
+  pthread_mutex_unlock(&executor->queue_lock);
+  return request;
+}
+
+static bool
+has_requests(ShardExecutor* executor)
+{
+  for (int32_t i = 0; i < shard_executors.num_producers; i++) {
+    ShardRing* ring = &executor->rings[i];
+    if (atomic_load(&ring->head) != atomic_load(&ring->tail)) {
+      return true;
+    }
+  }
+  return atomic_load(&executor->queued) > 0;
+}
+
+// @returns false when the executor stopped, the caller runs request itself
+static bool
+submit(ShardExecutor* executor, ShardRequest* request)
+{
+  int32_t producer = Thread_Pool_Current_Worker();
+  if (producer >= 0 && producer < shard_executors.num_producers) {
+    while (!ring_push(&executor->rings[producer], request)) {
+      sched_yield();
+    }
+  } else {
+    pthread_mutex_lock(&executor->queue_lock);
+    if (executor->stopped) {
+      pthread_mutex_unlock(&executor->queue_lock);
+      return false;
+    }
+    request->next = NULL;
+    if (executor->queue_tail) {
+      executor->queue_tail->next = request;
+    } else {
+      executor->queue_head = request;
+    }
+    executor->queue_tail = request;
+    atomic_fetch_add(&executor->queued, 1);
+    pthread_mutex_unlock(&executor->queue_lock);
+  }
+
+  // the executor either sees the request or we see it sleeping
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_exchange(&executor->sleeping, false)) {
+    sem_post(&executor->wakeup);
+  }
+  return true;
+}
+
+static void
+wait_done(ShardRequest* request)
+{
+  while (sem_wait(&request->done) != 0 && errno == EINTR) {
+  }
+  sem_destroy(&request->done);
+}
+
+// @returns false when the executor stopped and nothing ran
+static bool
+run_on(ShardExecutor* executor, void (*function)(void*), void* argument)
+{
+  ShardRequest request = { .function = function, .argument = argument };
+  sem_init(&request.done, 0, 0);
+  if (!submit(executor, &request)) {
+    sem_destroy(&request.done);
+    return false;
+  }
+  wait_done(&request);
+  return true;
+}
+
+static void*
+Shard_Executor_Function(void* arg)
+{
+  ShardExecutor* executor = (ShardExecutor*)arg;
+  current_executor = executor->index;
+  HM_Set_Thread_Owner(executor->index);
+
+  for (;;) {
+    bool worked = false;
+    ShardRequest* request;
+    for (int32_t i = 0; i < shard_executors.num_producers; i++) {
+      while ((request = ring_pop(&executor->rings[i])) != NULL) {
+        request->function(request->argument);
+        sem_post(&request->done);
+        worked = true;
+      }
+    }
+    while ((request = queue_pop(executor)) != NULL) {
+      request->function(request->argument);
+      sem_post(&request->done);
+      worked = true;
+    }
+    if (worked) {
+      continue;
+    }
+
+    if (atomic_load(&shard_executors.stop)) {
+      // the pool is gone, only the queue can still get requests
+      pthread_mutex_lock(&executor->queue_lock);
+      executor->stopped = executor->queue_head == NULL;
+      pthread_mutex_unlock(&executor->queue_lock);
+      if (executor->stopped) {
+        break;
+      }
+      continue;
+    }
+
+    // a producer either sees sleeping or we see its request
+    atomic_store(&executor->sleeping, true);
+    if (has_requests(executor) || atomic_load(&shard_executors.stop)) {
+      atomic_store(&executor->sleeping, false);
+      continue;
+    }
+    while (sem_wait(&executor->wakeup) != 0 && errno == EINTR) {
+    }
+    atomic_store(&executor->sleeping, false);
+  }
+  return NULL;
+}
+
+// executor k runs on the k-th cpu the process may use
+static int32_t
+executor_cpu(int32_t index)
+{
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) != 0 || CPU_COUNT(&set) == 0) {
+    return -1;
+  }
+
+  int32_t nth = index % CPU_COUNT(&set);
+  for (int32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set) && nth-- == 0) {
+      return cpu;
+    }
+  }
+  return -1;
+}
+
+int32_t
+Shard_Executors_Init(int32_t num_executors)
+{
+  if (num_executors <= 0) {
+    return 0;
+  }
+  if (num_executors > NUM_SHARDS) {
+    DB_Log(DB_LOG_WARNING,
+           "Only %d shards to own, starting %d shard executors",
+           NUM_SHARDS,
+           NUM_SHARDS);
+    num_executors = NUM_SHARDS;
+  }
+
+  shard_executors.num_producers = Thread_Pool_Size();
+  shard_executors.executors =
+    (ShardExecutor*)calloc(num_executors, sizeof(ShardExecutor));
+  if (!shard_executors.executors) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for ShardExecutors");
+    return -1;
+  }
+  atomic_init(&shard_executors.stop, false);
+  pthread_mutex_init(&shard_executors.pause_lock, NULL);
+  sem_init(&shard_executors.paused, 0, 0);
+  sem_init(&shard_executors.resume, 0, 0);
+
+  for (int32_t i = 0; i < num_executors; i++) {
+    ShardExecutor* executor = &shard_executors.executors[i];
+    executor->index = i;
+    executor->cpu = executor_cpu(i);
+    executor->rings = (ShardRing*)aligned_alloc(
+      _Alignof(ShardRing), sizeof(ShardRing) * shard_executors.num_producers);
+    if (!executor->rings) {
+      DB_Log(DB_LOG_ERROR, "Failed to allocate memory for ShardExecutor");
+      break;
+    }
+    for (int32_t j = 0; j < shard_executors.num_producers; j++) {
+      atomic_init(&executor->rings[j].head, 0);
+      atomic_init(&executor->rings[j].tail, 0);
+    }
+    pthread_mutex_init(&executor->queue_lock, NULL);
+    atomic_init(&executor->queued, 0);
+    atomic_init(&executor->sleeping, false);
+    sem_init(&executor->wakeup, 0, 0);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (executor->cpu >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(executor->cpu, &set);
+      pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    int rc = pthread_create(
+      &executor->thread, &attr, Shard_Executor_Function, (void*)executor);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+      DB_Log(
+        DB_LOG_ERROR, "Failed to start shard executor %d: %s", i, strerror(rc));
+      pthread_mutex_destroy(&executor->queue_lock);
+      sem_destroy(&executor->wakeup);
+      free(executor->rings);
+      break;
+    }
+    shard_executors.num_executors++;
+  }
+
+  if (shard_executors.num_executors < num_executors) {
+    Shard_Executors_Destroy();
+    return -1;
+  }
+
+  Set_Shard_Owners(shard_executors.num_executors);
+  DB_Log(DB_LOG_INFO,
+         "%d shard executors own %d shards",
+         shard_executors.num_executors,
+         NUM_SHARDS);
+  return 0;
+}
+
+int32_t
+Shard_Executors_Size()
+{
+  return shard_executors.num_executors;
+}
+
+int32_t
+Shard_Executors_Current()
+{
+  return current_executor;
+}
+
+typedef struct ExecuteArgs
+{
+  Connection* conn;
+  ParsedCommand* cmd;
+} ExecuteArgs;
+
+static void
+execute(void* arg)
+{
+  ExecuteArgs* args = (ExecuteArgs*)arg;
+  Execute_Command(args->conn, args->cmd);
+}
+
+bool
+Shard_Executors_Execute(Connection* conn, ParsedCommand* cmd)
+{
+  if (shard_executors.num_executors == 0 || pausing || !cmd->command ||
+      cmd->argc < 1 || !cmd->argv[0] || !is_keyed_command(cmd->command)) {
+    return false;
+  }
+
+  int32_t owner = Shard_Owner(Pick_Shard(cmd->argv[0]));
+  if (owner < 0 || owner == current_executor) {
+    return false;
+  }
+
+  ExecuteArgs args = { .conn = conn, .cmd = cmd };
+  return run_on(&shard_executors.executors[owner], execute, &args);
+}
+
+void
+Shard_Executors_Run(int32_t shard_id,
+                    void (*function)(void*),
+                    void* argument)
+{
+  int32_t owner = Shard_Owner(shard_id);
+  if (owner < 0 || shard_executors.num_executors == 0 || pausing ||
+      owner == current_executor ||
+      !run_on(&shard_executors.executors[owner], function, argument)) {
+    function(argument);
+  }
+}
+
+static void
+park(void* arg)
+{
+  (void)arg;
+  sem_post(&shard_executors.paused);
+  while (sem_wait(&shard_executors.resume) != 0 && errno == EINTR) {
+  }
+}
+
+void
+Shard_Executors_Pause()
+{
+  if (shard_executors.num_executors == 0) {
+    return;
+  }
+
+  // two pausers would each wait for the executors the other one parked
+  pthread_mutex_lock(&shard_executors.pause_lock);
+  for (int32_t i = 0; i < shard_executors.num_executors; i++) {
+    ShardExecutor* executor = &shard_executors.executors[i];
+    executor->park.function = park;
+    executor->park.argument = NULL;
+    sem_init(&executor->park.done, 0, 0);
+    executor->parked = submit(executor, &executor->park);
+    if (!executor->parked) {
+      sem_destroy(&executor->park.done);
+    }
+  }
+  for (int32_t i = 0; i < shard_executors.num_executors; i++) {
+    if (shard_executors.executors[i].parked) {
+      while (sem_wait(&shard_executors.paused) != 0 && errno == EINTR) {
+      }
+    }
+  }
+  pausing = true;
+}
+
+void
+Shard_Executors_Resume()
+{
+  if (shard_executors.num_executors == 0) {
+    return;
+  }
+
+  pausing = false;
+  for (int32_t i = 0; i < shard_executors.num_executors; i++) {
+    if (shard_executors.executors[i].parked) {
+      sem_post(&shard_executors.resume);
+    }
+  }
+  for (int32_t i = 0; i < shard_executors.num_executors; i++) {
+    ShardExecutor* executor = &shard_executors.executors[i];
+    if (executor->parked) {
+      wait_done(&executor->park);
+      executor->parked = false;
+    }
+  }
+  pthread_mutex_unlock(&shard_executors.pause_lock);
+}
+
+void
+Shard_Executors_Destroy()
+{
+  if (!shard_executors.executors) {
+    return;
+  }
+
+  atomic_store(&shard_executors.stop, true);
+  for (int32_t i = 0; i < shard_executors.num_executors; i++) {
+    ShardExecutor* executor = &shard_executors.executors[i];
+    sem_post(&executor->wakeup);
+    pthread_join(executor->thread, NULL);
+  }
+
+  // the executors are gone, nobody skips the locks of their maps anymore.
+  // the queues stay, a late caller finds them stopped and runs its request
+  Set_Shard_Owners(0);
+  for (int32_t i = 0; i < shard_executors.num_executors; i++) {
+    ShardExecutor* executor = &shard_executors.executors[i];
+    free(executor->rings);
+    executor->rings = NULL;
+  }
+}
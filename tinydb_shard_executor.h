@@ -0,0 +1,147 @@
+/**
+ * note (David)
+ * /SHARD PER CORE/
+ * optional execution mode (--shard-executors N). executor k runs on its own
+ * cpu and owns the shards s with s % N == k, of every database. the maps of
+ * those shards are only ever touched by their owner, which takes none of
+ * their locks (see HM_Set_Thread_Owner) nor the shard locks.
+ *
+ * the connection handlers only parse, every command on a single key is handed
+ * to the owner of the key's shard through a single producer single consumer
+ * ring (one per pool worker and executor, so no two threads ever push to the
+ * same ring) and the handler waits for it before it reads the next one.
+ * replies are written by the executor. threads outside the pool (the replica
+ * link, the AOF rewrite, the save cron) use a mutex protected queue per
+ * executor instead, they are not on the hot path.
+ *
+ * whatever has to walk a whole shard runs on its owner as well: the AOF
+ * rewrite dumps a stripe there, LOAD and a replica's full resync move the
+ * staged entries into the live shards there, EXPORT collects a shard's
+ * entries there, and so do the webhook lookups of a channel. a fork (BGSAVE,
+ * full resyncs) pauses every executor between two commands, so the executors
+ * never take the fork lock either. the AOF replay at startup runs with the
+ * executors paused.
+ */
+#ifndef __TINY_DB_SHARD_EXECUTOR
+#define __TINY_DB_SHARD_EXECUTOR
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "tinydb_connection.h"
+#include "tinydb_query_parser.h"
+
+// slots of every ring, must be a power of 2. a producer has at most one
+// request in flight per executor so this only has to be > 0
+#define SHARD_RING_SIZE 8
+
+typedef struct ShardRequest
+{
+  void (*function)(void*);
+  void* argument;
+  sem_t done;
+  struct ShardRequest* next; // in the queue of the threads outside the pool
+} ShardRequest;
+
+typedef struct ShardRing
+{
+  _Alignas(64) atomic_size_t head; // next slot the executor pops
+  _Alignas(64) atomic_size_t tail; // next slot the producer fills
+  ShardRequest* slots[SHARD_RING_SIZE];
+} ShardRing;
+
+typedef struct ShardExecutor
+{
+  int32_t index;
+  int32_t cpu; // -1: not pinned
+  ShardRing* rings; // one per pool worker
+
+  // requests of the threads outside the pool. once the executor stopped
+  // they run on the caller, which takes the map locks like everyone then
+  pthread_mutex_t queue_lock;
+  ShardRequest* queue_head;
+  ShardRequest* queue_tail;
+  bool stopped;
+
+  ShardRequest park; // queued by Shard_Executors_Pause
+  bool parked;
+
+  atomic_int queued;
+  atomic_bool sleeping;
+  sem_t wakeup;
+  pthread_t thread;
+} ShardExecutor;
+
+typedef struct ShardExecutors
+{
+  int32_t num_executors; // 0: not running
+  int32_t num_producers;
+  ShardExecutor* executors;
+  pthread_mutex_t pause_lock; // held from Pause to Resume
+  sem_t paused;
+  sem_t resume;
+  atomic_bool stop;
+} ShardExecutors;
+
+/**
+ * starts num_executors executors and makes them the owners of the shards of
+ * every database created afterwards, so it runs after Thread_Pool_Init and
+ * before the context is created.
+ * @returns 0 on success (num_executors 0 starts none), -1 on failure
+ */
+int32_t
+Shard_Executors_Init(int32_t num_executors);
+
+/**
+ * @returns number of running executors, 0 when the mode is off
+ */
+int32_t
+Shard_Executors_Size();
+
+/**
+ * @returns index of the executor running the caller, -1 for other threads
+ */
+int32_t
+Shard_Executors_Current();
+
+/**
+ * runs cmd on the executor that owns its key and waits for it.
+ * @returns false when cmd is not for an executor (no key, the mode is off,
+ * the caller owns the key or paused the executors), the caller executes it
+ */
+bool
+Shard_Executors_Execute(Connection* conn, ParsedCommand* cmd);
+
+/**
+ * runs function(argument) on the owner of shard_id and waits for it. it runs
+ * on the caller when the shards have no owners or the caller may touch
+ * them.
+ */
+void
+Shard_Executors_Run(int32_t shard_id,
+                    void (*function)(void*),
+                    void* argument);
+
+/**
+ * parks every executor between two commands until Shard_Executors_Resume.
+ * meanwhile the caller may touch any shard (with the locks), commands it
+ * executes are not handed to the executors. an executor must not call it.
+ */
+void
+Shard_Executors_Pause();
+
+void
+Shard_Executors_Resume();
+
+/**
+ * the connection handlers have to be done, see Thread_Pool_Destroy. requests
+ * of other threads run on their caller from then on.
+ */
+void
+Shard_Executors_Destroy();
+
+#endif // __TINY_DB_SHARD_EXECUTOR
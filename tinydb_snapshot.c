@@ -1,64 +1,434 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "tinydb_compress.h"
+#include "tinydb_hash.h"
 #include "tinydb_log.h"
+#include "tinydb_object.h"
 #include "tinydb_snapshot.h"
 #include "tinydb_database_entry_destructor.h"
+#include "tinydb_shard_executor.h"
+#include "tinydb_thread_pool.h"
+#include "tinydb_varint.h"
 
-void
-write_string(FILE* file, const char* str)
+typedef struct SnapshotWriter
+{
+  int32_t fd;
+  uint8_t* buffer;
+  size_t len;
+  uint64_t offset; // bytes put so far, position in the file
+  uint32_t crc;
+  int32_t failed;
+  bool zero_copy; // blocks that barely compress stay raw
+} SnapshotWriter;
+
+static void
+writer_flush(SnapshotWriter* writer)
+{
+  if (writer->failed || writer->len == 0) {
+    writer->len = 0;
+    return;
+  }
+
+  writer->crc = CRC32C(writer->crc, writer->buffer, writer->len);
+
+  size_t written = 0;
+  while (written < writer->len) {
+    ssize_t n =
+      write(writer->fd, writer->buffer + written, writer->len - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DB_Log(DB_LOG_ERROR, "Snapshot write failed: %s", strerror(errno));
+      writer->failed = 1;
+      break;
+    }
+    written += n;
+  }
+  writer->len = 0;
+}
+
+static void
+writer_put(SnapshotWriter* writer, const void* data, size_t len)
+{
+  const uint8_t* src = (const uint8_t*)data;
+  writer->offset += len;
+  while (len > 0) {
+    if (writer->len == SNAPSHOT_BUFFER_SIZE) {
+      writer_flush(writer);
+    }
+
+    size_t n = SNAPSHOT_BUFFER_SIZE - writer->len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(writer->buffer + writer->len, src, n);
+    writer->len += n;
+    src += n;
+    len -= n;
+  }
+}
+
+static void
+writer_put_varint(SnapshotWriter* writer, uint64_t value)
+{
+  uint8_t varint[VARINT_MAX];
+  writer_put(writer, varint, Varint_Write(varint, value));
+}
+
+// strings keep their terminator in the file so the import can point into the
+// mapping instead of copying them
+static void
+write_string(SnapshotWriter* writer, const char* str)
 {
   if (str == NULL) {
     DB_Log(DB_LOG_ERROR, "Attempting to write NULL string");
-    uint32_t len = 0;
-    fwrite(&len, sizeof(uint32_t), 1, file);
+    str = "";
+  }
+
+  size_t len = strlen(str);
+  writer_put_varint(writer, len);
+  writer_put(writer, str, len + 1);
+}
+
+// payloads are built in memory first since the record header needs their
+// length, shard entries are cut into blocks of about SNAPSHOT_BLOCK_SIZE
+// bytes which are compressed on their own, an entry never spans two blocks
+typedef struct SnapshotBlock
+{
+  uint8_t* data;
+  size_t len;
+  size_t capacity;
+  uint8_t* packed;
+  size_t packed_capacity;
+  int32_t failed;
+} SnapshotBlock;
+
+static bool
+reserve_block(uint8_t** buffer, size_t* capacity, size_t needed)
+{
+  if (needed <= *capacity) {
+    return true;
+  }
+
+  size_t new_capacity = *capacity ? *capacity : SNAPSHOT_BLOCK_SIZE;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+
+  uint8_t* new_buffer = realloc(*buffer, new_capacity);
+  if (!new_buffer) {
+    return false;
+  }
+  *buffer = new_buffer;
+  *capacity = new_capacity;
+  return true;
+}
+
+static void
+block_put(SnapshotBlock* block, const void* data, size_t len)
+{
+  if (!reserve_block(&block->data, &block->capacity, block->len + len)) {
+    if (!block->failed) {
+      DB_Log(DB_LOG_ERROR, "Failed to allocate memory for snapshot block");
+    }
+    block->failed = 1;
+    return;
+  }
+
+  memcpy(block->data + block->len, data, len);
+  block->len += len;
+}
+
+static void
+block_put_varint(SnapshotBlock* block, uint64_t value)
+{
+  uint8_t varint[VARINT_MAX];
+  block_put(block, varint, Varint_Write(varint, value));
+}
+
+static void
+block_put_tag(SnapshotBlock* block, uint8_t tag)
+{
+  block_put(block, &tag, sizeof(uint8_t));
+}
+
+static void
+block_put_string(SnapshotBlock* block, const char* str)
+{
+  if (str == NULL) {
+    str = "";
+  }
+
+  size_t len = strlen(str);
+  block_put_varint(block, len);
+  block_put(block, str, len + 1);
+}
+
+static void
+block_put_entry(SnapshotBlock* block, DatabaseEntry* entry)
+{
+  block_put_string(block, entry->key);
+  block_put_tag(block, (uint8_t)entry->type);
+
+  switch (entry->type) {
+    case DB_ENTRY_NUMBER:
+      block_put_varint(block,
+                       Zigzag_Encode(atomic_load(&entry->value.number.value)));
+      break;
+    case DB_ENTRY_STRING:
+      block_put_string(block, entry->value.string.value);
+      break;
+    case DB_ENTRY_LIST: {
+      HPLinkedList* list = entry->value.list;
+      pthread_rwlock_rdlock(&list->rwlock);
+      block_put_varint(block, list->count);
+
+      ListNode current;
+      HPList_Iterator it = HPList_Iter(list);
+      while (HPList_Iter_Next(&it, &current)) {
+        block_put_tag(block, (uint8_t)current.type);
+
+        switch (current.type) {
+          case TYPE_STRING:
+            block_put_string(block, current.value.string_value);
+            break;
+          case TYPE_INT:
+            block_put_varint(block, Zigzag_Encode(current.value.int_value));
+            break;
+          case TYPE_FLOAT:
+            block_put(block, &current.value.float_value, sizeof(double));
+            break;
+        }
+      }
+      pthread_rwlock_unlock(&list->rwlock);
+    } break;
+    case DB_ENTRY_OBJECT: {
+      // fields are entries themselves, nested objects recurse
+      DB_Object* obj = entry->value.object;
+      pthread_rwlock_rdlock(&obj->rwlock);
+      block_put_varint(block, DBObject_Count(obj));
+
+      DBObject_Iterator it = DBObject_Iter(obj);
+      DatabaseEntry* field;
+      while ((field = DBObject_Iter_Next(&it)) != NULL) {
+        block_put_entry(block, field);
+      }
+      pthread_rwlock_unlock(&obj->rwlock);
+    } break;
+  }
+}
+
+// writes the block as a record of type tag and empties it
+static void
+writer_put_record(SnapshotWriter* writer, uint8_t tag, SnapshotBlock* block)
+{
+  if (block->failed) {
+    writer->failed = 1;
+  }
+
+  writer_put(writer, &tag, sizeof(uint8_t));
+  writer_put_varint(writer, block->len);
+  writer_put(writer, block->data, block->len);
+  block->len = 0;
+}
+
+// shard data, compressed as <raw length> <packed data> when that is smaller
+static void
+writer_put_block(SnapshotWriter* writer, SnapshotBlock* block)
+{
+  if (block->len == 0) {
+    return;
+  }
+
+  size_t packed_len = 0;
+  if (SNAPSHOT_COMPRESSION && !block->failed &&
+      reserve_block(&block->packed,
+                    &block->packed_capacity,
+                    LZ_Compress_Bound(block->len))) {
+    packed_len = LZ_Compress(
+      block->data, block->len, block->packed, block->packed_capacity);
+  }
+
+  uint8_t varint[VARINT_MAX];
+  size_t varint_len = Varint_Write(varint, block->len);
+  size_t max_len = writer->zero_copy
+                     ? block->len / 100 * (100 - SNAPSHOT_ZERO_COPY_MIN_SAVING)
+                     : block->len;
+  if (packed_len == 0 || varint_len + packed_len >= max_len) {
+    writer_put_record(writer, SNAPSHOT_RECORD_BLOCK, block);
     return;
   }
 
-  uint32_t len = strlen(str);
-  fwrite(&len, sizeof(uint32_t), 1, file);
-  fwrite(str, 1, len, file);
+  uint8_t tag = SNAPSHOT_RECORD_BLOCK_LZ;
+  writer_put(writer, &tag, sizeof(uint8_t));
+  writer_put_varint(writer, varint_len + packed_len);
+  writer_put(writer, varint, varint_len);
+  writer_put(writer, block->packed, packed_len);
+  block->len = 0;
+}
+
+static int32_t
+sync_parent_directory(const char* filename)
+{
+  char* path = strdup(filename);
+  if (!path) {
+    return -1;
+  }
+
+  char* slash = strrchr(path, '/');
+  const char* dir = ".";
+  if (slash) {
+    *slash = '\0';
+    dir = slash == path ? "/" : path;
+  }
+
+  int32_t fd = open(dir, O_RDONLY);
+  int32_t res = fd >= 0 ? fsync(fd) : -1;
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(path);
+  return res;
+}
+
+static bool
+read_varint(char** ptr, char* end, uint64_t* value)
+{
+  *value = 0;
+  for (int32_t shift = 0; shift < 64; shift += 7) {
+    if (*ptr >= end) {
+      break;
+    }
+
+    uint8_t byte = *(uint8_t*)(*ptr)++;
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+
+  DB_Log(DB_LOG_ERROR, "Invalid varint in snapshot");
+  return false;
 }
 
 char*
 read_string_mmap(char** ptr, char* end_of_mapped_region)
 {
   // make sure that we have enough space to read the length
-  if (*ptr + sizeof(uint32_t) > end_of_mapped_region) {
+  uint64_t len;
+  if (!read_varint(ptr, end_of_mapped_region, &len)) {
     DB_Log(DB_LOG_ERROR, "Invalid memory access: string length exceeds mmap");
     return NULL;
   }
 
-  uint32_t len = *(uint32_t*)(*ptr); // read the length
-  *ptr += sizeof(uint32_t); // move the pointer forward by the size of uint32_t
-
   // check if the length is reasonable size
   if (len > MAX_STRING_LENGTH) {
-    DB_Log(DB_LOG_ERROR, "Invalid string length: %u", len);
+    DB_Log(DB_LOG_ERROR, "Invalid string length: %lu", (unsigned long)len);
     return NULL;
   }
 
-  if (len == 0) {
+  // make sure that we have enough space to read the string data
+  if ((uint64_t)(end_of_mapped_region - *ptr) < len + 1) {
+    DB_Log(DB_LOG_ERROR, "Invalid memory access: string content exceeds mmap");
     return NULL;
   }
 
-  // make sure that we have enough space to read the string data
-  if (*ptr + len > end_of_mapped_region) {
-    DB_Log(DB_LOG_ERROR, "Invalid memory access: string content exceeds mmap");
+  if (len == 0) {
+    *ptr += 1;
     return NULL;
   }
 
   char* str = malloc(len + 1);
   memcpy(str, *ptr, len); // copy the content
   str[len] = '\0';
-  *ptr += len; // move the pointer forward by the length of the string
+  *ptr += len + 1; // skip the string and its terminator
+  return str;
+}
+
+// same as read_string_mmap but returns the string inside the mapping
+static char*
+read_string_borrowed(char** ptr, char* end)
+{
+  uint64_t len;
+  if (!read_varint(ptr, end, &len)) {
+    return NULL;
+  }
+
+  if (len > MAX_STRING_LENGTH || (uint64_t)(end - *ptr) < len + 1 ||
+      (*ptr)[len] != '\0') {
+    DB_Log(DB_LOG_ERROR, "Invalid string of length %lu", (unsigned long)len);
+    return NULL;
+  }
+
+  char* str = len == 0 ? NULL : *ptr;
+  *ptr += len + 1;
   return str;
 }
 
+// walks the live entries of the map, including the ones an incremental resize
+// has not migrated to the new table yet. caller holds the shard lock.
+static DatabaseEntry*
+next_entry(HashMap* map, size_t* index)
+{
+  size_t progress = map->old_entries ? atomic_load(&map->resize_progress) : 0;
+  size_t old_capacity = map->old_entries ? map->old_capacity : 0;
+
+  while (*index < map->capacity + old_capacity) {
+    if (*index >= map->capacity && *index - map->capacity < progress) {
+      *index = map->capacity + progress;
+      continue;
+    }
+
+    HashEntry* hash_entry = *index < map->capacity
+                              ? &map->entries[*index]
+                              : &map->old_entries[*index - map->capacity];
+    (*index)++;
+    if (hash_entry->is_occupied && !hash_entry->is_deleted) {
+      return (DatabaseEntry*)hash_entry->value;
+    }
+  }
+  return NULL;
+}
+
+typedef struct ExportShard
+{
+  SnapshotWriter* out;
+  SnapshotBlock* block;
+  DatabaseShard* shard;
+  SnapshotShardInfo* info;
+} ExportShard;
+
+// runs on the owner of the shard
+static void
+export_shard(void* arg)
+{
+  ExportShard* job = (ExportShard*)arg;
+
+  Shard_Read_Lock(job->shard);
+  size_t index = 0;
+  DatabaseEntry* entry;
+  while ((entry = next_entry(job->shard->entries, &index)) != NULL) {
+    job->info->num_entries++;
+    block_put_entry(job->block, entry);
+    if (job->block->len >= SNAPSHOT_BLOCK_SIZE) {
+      writer_put_block(job->out, job->block);
+    }
+  }
+  Shard_Unlock(job->shard);
+
+  // blocks never span shards so each shard can be loaded on its own
+  writer_put_block(job->out, job->block);
+}
+
 int32_t
 Export_Snapshot(RuntimeContext* ctx, const char* filename)
 {
@@ -67,340 +437,1213 @@ Export_Snapshot(RuntimeContext* ctx, const char* filename)
     return -1;
   }
 
-  FILE* file = fopen(filename, "wb");
-  if (!file) {
-    DB_Log(DB_LOG_ERROR, "Unable to open file %s for writing %s", filename);
+  // concurrent exports of the same file must not share a temp file
+  static atomic_uint_fast32_t export_counter = 0;
+  size_t temp_len = strlen(filename) + 64;
+  char* temp_name = malloc(temp_len);
+  if (!temp_name) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for snapshot file name");
+    return -1;
+  }
+  snprintf(temp_name,
+           temp_len,
+           "%s.%d.%u.tmp",
+           filename,
+           (int32_t)getpid(),
+           (uint32_t)atomic_fetch_add(&export_counter, 1));
+
+  SnapshotWriter writer = { 0 };
+  writer.zero_copy = ctx->snapshot_zero_copy;
+  writer.fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer.fd < 0) {
+    DB_Log(DB_LOG_ERROR, "Unable to open file %s for writing", temp_name);
+    free(temp_name);
+    return -1;
+  }
+
+  if (posix_memalign((void**)&writer.buffer,
+                     SNAPSHOT_BUFFER_ALIGNMENT,
+                     SNAPSHOT_BUFFER_SIZE) != 0) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate snapshot buffer");
+    close(writer.fd);
+    unlink(temp_name);
+    free(temp_name);
     return -1;
   }
+  SnapshotWriter* out = &writer;
 
   // header
-  write_string(file, TINYDB_SIGNATURE);
-  write_string(file, TINYDB_VERSION);
+  write_string(out, TINYDB_SIGNATURE);
+  writer_put_varint(out, SNAPSHOT_FORMAT_VERSION);
+  writer_put_varint(out, SNAPSHOT_MIN_READER_VERSION);
+
+  // DatabaseManager, up to the last database that was used. the ones before
+  // it that were not are written empty
+  SnapshotBlock block = { 0 };
+  int32_t num_databases = ctx->db_manager.num_databases;
+  while (num_databases > 1 &&
+         !atomic_load(&ctx->db_manager.databases[num_databases - 1].ready)) {
+    num_databases--;
+  }
+  block_put_varint(&block, num_databases);
+  for (int i = 0; i < num_databases; i++) {
+    Database* db = &ctx->db_manager.databases[i];
+    block_put_varint(&block, db->ID);
+    block_put_string(&block, db->name);
+  }
+  writer_put_record(out, SNAPSHOT_RECORD_DATABASES, &block);
 
-  // DatabaseManager
-  fwrite(&ctx->db_manager.num_databases, sizeof(int32_t), 1, file);
-  for (int i = 0; i < ctx->db_manager.num_databases; i++) {
+  // UserManager
+  block_put_varint(&block, ctx->user_manager.num_users);
+  for (int i = 0; i < ctx->user_manager.num_users; i++) {
+    DB_User* user = &ctx->user_manager.users[i];
+    block_put_varint(&block, user->ID);
+    block_put_string(&block, user->name);
+    block_put(&block, user->password, sizeof(char) * 32);
+
+    // Access information
+    block_put_tag(&block, user->access != NULL);
+    if (user->access) {
+      block_put_varint(&block, user->access->database);
+      block_put_varint(&block, user->access->acl);
+    }
+  }
+  writer_put_record(out, SNAPSHOT_RECORD_USERS, &block);
+
+  // shards, located through the table written after them
+  SnapshotShardInfo* table =
+    calloc(NUM_SHARDS * num_databases + 1, sizeof(SnapshotShardInfo));
+  if (!table) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for the shard table");
+    out->failed = 1;
+  }
+
+  for (int i = 0; i < num_databases && table; i++) {
     Database* db = &ctx->db_manager.databases[i];
-    fwrite(&db->ID, sizeof(EntryID), 1, file);
-    write_string(file, db->name);
+    bool ready = atomic_load(&db->ready);
 
     for (int j = 0; j < NUM_SHARDS; j++) {
       DatabaseShard* shard = &db->shards[j];
-      fwrite(&shard->num_entries, sizeof(uint64_t), 1, file);
-      for (size_t k = 0; k < shard->entries->capacity; k++) {
-        HashEntry* hash_entry = &shard->entries->entries[k];
-        if (hash_entry->is_occupied && !hash_entry->is_deleted) {
-          DatabaseEntry* entry = (DatabaseEntry*)hash_entry->value;
-          write_string(file, entry->key);
-          fwrite(&entry->type, sizeof(DB_ENTRY_TYPE), 1, file);
-
-          switch (entry->type) {
-            case DB_ENTRY_NUMBER:
-              fwrite(&entry->value.number.value, sizeof(int64_t), 1, file);
-              break;
-            case DB_ENTRY_STRING:
-              write_string(file, entry->value.string.value);
-              break;
-            case DB_ENTRY_LIST: {
-              HPLinkedList* list = entry->value.list;
-              fwrite(&list->count, sizeof(size_t), 1, file); // list size
-
-              ListNode* current = list->head;
-              while (current) {
-                // node type
-                fwrite(&current->type, sizeof(ValueType), 1, file);
-
-                // node value based on its type
-                switch (current->type) {
-                  case TYPE_STRING:
-                    write_string(file, current->value.string_value);
-                    break;
-                  case TYPE_INT:
-                    fwrite(&current->value.int_value, sizeof(int64_t), 1, file);
-                    break;
-                  case TYPE_FLOAT:
-                    fwrite(
-                      &current->value.float_value, sizeof(double), 1, file);
-                    break;
-                }
-
-                current = current->next;
-              }
-            } break;
-            case DB_ENTRY_OBJECT:
-              DB_Log(DB_LOG_WARNING,
-                     "DB_ENTRY_OBJECT not implemented for key %s",
-                     entry->key);
-              break;
-          }
+      SnapshotShardInfo* info = &table[i * NUM_SHARDS + j];
+      info->offset = out->offset;
+      info->num_entries = 0;
+      if (!ready) {
+        continue;
+      }
+
+      ExportShard job = {
+        .out = out, .block = &block, .shard = shard, .info = info
+      };
+      Shard_Executors_Run(j, export_shard, &job);
+    }
+  }
+
+  if (table) {
+    block_put_varint(&block, NUM_SHARDS);
+    for (int i = 0; i < NUM_SHARDS * num_databases; i++) {
+      block_put_varint(&block, table[i].offset);
+      block_put_varint(&block, table[i].num_entries);
+    }
+    writer_put_record(out, SNAPSHOT_RECORD_SHARD_TABLE, &block);
+    free(table);
+  }
+  free(block.data);
+  free(block.packed);
+
+  // footer, checksum of everything above
+  writer_flush(out);
+  uint32_t crc = writer.crc;
+  writer_put(out, SNAPSHOT_FOOTER_MAGIC, SNAPSHOT_FOOTER_MAGIC_LEN);
+  writer_put(out, &crc, sizeof(uint32_t));
+  writer_flush(out);
+
+  int32_t failed = writer.failed;
+  if (!failed && fsync(writer.fd) != 0) {
+    DB_Log(DB_LOG_ERROR, "Snapshot fsync failed: %s", strerror(errno));
+    failed = 1;
+  }
+  close(writer.fd);
+  free(writer.buffer);
+
+  // the old snapshot stays in place until the new one is complete on disk
+  if (!failed && rename(temp_name, filename) != 0) {
+    DB_Log(DB_LOG_ERROR, "Unable to rename %s to %s", temp_name, filename);
+    failed = 1;
+  }
+
+  if (failed) {
+    unlink(temp_name);
+    free(temp_name);
+    return -1;
+  }
+
+  sync_parent_directory(filename);
+  free(temp_name);
+  return 0;
+}
+
+static bool
+read_raw(char** ptr, char* end, void* dst, size_t len)
+{
+  if ((size_t)(end - *ptr) < len) {
+    DB_Log(DB_LOG_ERROR, "Invalid memory access: value exceeds mmap");
+    return false;
+  }
+
+  memcpy(dst, *ptr, len);
+  *ptr += len;
+  return true;
+}
+
+static bool
+read_list(char** ptr, char* end, HPLinkedList* list)
+{
+  uint64_t list_size;
+  if (!read_varint(ptr, end, &list_size)) {
+    return false;
+  }
+
+  for (uint64_t n = 0; n < list_size; n++) {
+    uint8_t node_type;
+    if (!read_raw(ptr, end, &node_type, sizeof(uint8_t))) {
+      return false;
+    }
+
+    switch (node_type) {
+      case TYPE_STRING: {
+        char* str_value = read_string_mmap(ptr, end);
+        HPList_RPush_String(list, str_value);
+        free(str_value);
+      } break;
+      case TYPE_INT: {
+        uint64_t int_value;
+        if (!read_varint(ptr, end, &int_value)) {
+          return false;
+        }
+        HPList_RPush_Int(list, Zigzag_Decode(int_value));
+      } break;
+      case TYPE_FLOAT: {
+        double float_value;
+        if (!read_raw(ptr, end, &float_value, sizeof(double))) {
+          return false;
         }
+        HPList_RPush_Float(list, float_value);
+      } break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+static DatabaseEntry*
+read_entry(char** ptr, char* end, bool zero_copy, int32_t depth);
+
+static bool
+read_object(char** ptr, char* end, DB_Object* obj, int32_t depth)
+{
+  uint64_t num_fields;
+  if (!read_varint(ptr, end, &num_fields)) {
+    return false;
+  }
+
+  for (uint64_t n = 0; n < num_fields; n++) {
+    // the object makes its own entry for the field and owns the value
+    DatabaseEntry* field = read_entry(ptr, end, false, depth);
+    if (!field) {
+      return false;
+    }
+    DBObject_AddField(obj, field->key, field->value, field->type);
+    free(field->key);
+    free(field);
+  }
+  return true;
+}
+
+// @returns the next entry of a block or NULL when the data is corrupted
+static DatabaseEntry*
+read_entry(char** ptr, char* end, bool zero_copy, int32_t depth)
+{
+  DatabaseEntry* entry = calloc(1, sizeof(DatabaseEntry));
+  if (!entry) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for database entry");
+    return NULL;
+  }
+
+  uint8_t type = DB_ENTRY_STRING;
+  entry->key = read_string_mmap(ptr, end);
+  bool ok = entry->key != NULL && read_raw(ptr, end, &type, sizeof(uint8_t));
+  entry->type = (DB_ENTRY_TYPE)type;
+
+  switch (ok ? (int32_t)entry->type : -1) {
+    case DB_ENTRY_NUMBER: {
+      uint64_t value;
+      ok = read_varint(ptr, end, &value);
+      entry->value.number.value = Zigzag_Decode(value);
+    } break;
+    case DB_ENTRY_STRING:
+      entry->borrowed = zero_copy;
+      entry->value.string.value = zero_copy ? read_string_borrowed(ptr, end)
+                                            : read_string_mmap(ptr, end);
+      break;
+    case DB_ENTRY_LIST:
+      entry->value.list = HPList_Create();
+      ok = entry->value.list && read_list(ptr, end, entry->value.list);
+      break;
+    case DB_ENTRY_OBJECT:
+      // bounded so a corrupted file can not exhaust the stack
+      if (depth < SNAPSHOT_MAX_DEPTH) {
+        entry->value.object = CreateDBObject();
+      }
+      ok = entry->value.object &&
+           read_object(ptr, end, entry->value.object, depth + 1);
+      break;
+    default:
+      ok = false;
+      break;
+  }
+
+  if (!ok) {
+    Database_Entry_Destructor(entry);
+    return NULL;
+  }
+  return entry;
+}
+
+typedef struct SnapshotRecord
+{
+  char* data;
+  char* end;
+} SnapshotRecord;
+
+typedef struct ShardLoader
+{
+  Database* databases;
+  SnapshotShardInfo* table;
+  int32_t num_shards;
+  int32_t shards_per_database;
+  bool reshard; // written with a different NUM_SHARDS
+  char* data;
+  char* end; // start of the shard table
+  bool zero_copy;
+  atomic_int next;
+  atomic_int failed;
+
+  // shards loaded so far, the import waits for all of them
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int32_t loaded;
+
+  // the import and the queued tasks, a worker busy with a client may only get
+  // to its task once the import returned
+  atomic_int refs;
+} ShardLoader;
+
+// decompresses the blocks of shard i one at a time into scratch, values of
+// uncompressed blocks are used in place when zero copy is enabled
+static bool
+load_shard(ShardLoader* loader,
+           int32_t i,
+           uint8_t** scratch,
+           size_t* scratch_capacity)
+{
+  Database* db = &loader->databases[i / loader->shards_per_database];
+  char* ptr = loader->data + loader->table[i].offset;
+  char* end = i + 1 < loader->num_shards
+                ? loader->data + loader->table[i + 1].offset
+                : loader->end;
+
+  uint64_t loaded = 0;
+  while (ptr < end) {
+    uint8_t tag;
+    uint64_t len;
+    if (!read_raw(&ptr, end, &tag, sizeof(uint8_t)) ||
+        !read_varint(&ptr, end, &len) || len > (uint64_t)(end - ptr)) {
+      return false;
+    }
+
+    char* block = ptr;
+    char* block_end = ptr + len;
+    ptr = block_end;
+
+    bool zero_copy = loader->zero_copy;
+    if (tag == SNAPSHOT_RECORD_BLOCK_LZ) {
+      uint64_t raw_len;
+      if (!read_varint(&block, block_end, &raw_len) ||
+          !reserve_block(scratch, scratch_capacity, raw_len) ||
+          LZ_Decompress(
+            (uint8_t*)block, block_end - block, *scratch, raw_len) != 0) {
+        DB_Log(DB_LOG_ERROR, "Invalid snapshot block in shard %d", i);
+        return false;
+      }
+      block = (char*)*scratch;
+      block_end = block + raw_len;
+      zero_copy = false;
+    } else if (tag != SNAPSHOT_RECORD_BLOCK) {
+      continue; // added by a newer version
+    }
+
+    while (block < block_end) {
+      DatabaseEntry* entry = read_entry(&block, block_end, zero_copy, 0);
+      if (!entry) {
+        return false;
+      }
+      loaded++;
+
+      if (!loader->reshard) {
+        HM_Put(db->shards[i % NUM_SHARDS].entries, entry->key, entry);
+        continue;
+      }
+
+      DatabaseShard* shard = &db->shards[Pick_Shard(entry->key)];
+      if (HM_Put(shard->entries, entry->key, entry) == HM_ACTION_ADDED) {
+        atomic_fetch_add(&shard->num_entries, 1);
       }
     }
   }
 
-  // UserManager
-  fwrite(&ctx->user_manager.num_users, sizeof(int32_t), 1, file);
-  for (int i = 0; i < ctx->user_manager.num_users; i++) {
-    DB_User* user = &ctx->user_manager.users[i];
-    fwrite(&user->ID, sizeof(EntryID), 1, file);
-    write_string(file, user->name);
-    fwrite(user->password, sizeof(char), 32, file);
+  return loaded == loader->table[i].num_entries;
+}
 
-    // Access information
-    if (user->access) {
-      uint8_t has_access = 1;
-      fwrite(&has_access, sizeof(uint8_t), 1, file);
-      fwrite(&user->access->database, sizeof(EntryID), 1, file);
-      fwrite(&user->access->acl, sizeof(DB_ACCESS_LEVEL), 1, file);
-    } else {
-      uint8_t has_access = 0;
-      fwrite(&has_access, sizeof(uint8_t), 1, file);
+// takes the next shard that is not loaded yet until none is left, shards are
+// independent maps so no locking is needed while they are filled
+static void
+load_shards(ShardLoader* loader)
+{
+  uint8_t* scratch = NULL;
+  size_t scratch_capacity = 0;
+
+  int32_t i;
+  while ((i = atomic_fetch_add(&loader->next, 1)) < loader->num_shards) {
+    if (!load_shard(loader, i, &scratch, &scratch_capacity)) {
+      atomic_store(&loader->failed, 1);
     }
+
+    pthread_mutex_lock(&loader->lock);
+    if (++loader->loaded == loader->num_shards) {
+      pthread_cond_signal(&loader->done);
+    }
+    pthread_mutex_unlock(&loader->lock);
   }
 
-  fclose(file);
-  return 0;
+  free(scratch);
 }
 
-int32_t
-Import_Snapshot(RuntimeContext* ctx, const char* filename)
+static void
+release_loader(ShardLoader* loader)
 {
-  DB_Log(DB_LOG_INFO, "Trying to open file %s for reading", filename);
+  if (atomic_fetch_sub(&loader->refs, 1) == 1) {
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->done);
+    free(loader);
+  }
+}
 
-  if (ctx == NULL || filename == NULL) {
-    fprintf(stderr, "Error: \n");
-    DB_Log(DB_LOG_ERROR, "NULL context or filename in Import_Snapshot");
+static void
+Shard_Loader_Task(void* arg)
+{
+  ShardLoader* loader = (ShardLoader*)arg;
+  load_shards(loader);
+  release_loader(loader);
+}
+
+static void
+destroy_databases(RuntimeContext* ctx)
+{
+  for (int i = 0; i < ctx->db_manager.num_databases; i++) {
+    free(ctx->db_manager.databases[i].name);
+    for (int j = 0; j < NUM_SHARDS; j++) {
+      if (ctx->db_manager.databases[i].shards[j].entries) {
+        HM_Destroy(ctx->db_manager.databases[i].shards[j].entries);
+        pthread_rwlock_destroy(&ctx->db_manager.databases[i].shards[j].rwlock);
+      }
+    }
+  }
+  free(ctx->db_manager.databases);
+  ctx->db_manager.databases = NULL;
+  ctx->db_manager.num_databases = 0;
+}
+
+static int32_t
+import_databases(RuntimeContext* ctx, SnapshotRecord* record)
+{
+  char* ptr = record->data;
+  uint64_t num_databases;
+  if (!read_varint(&ptr, record->end, &num_databases) ||
+      num_databases > (uint64_t)(record->end - ptr)) {
+    DB_Log(DB_LOG_ERROR, "Invalid number of databases");
     return -1;
   }
 
-  int32_t fd = open(filename, O_RDONLY);
-  if (fd < 0) {
-    DB_Log(DB_LOG_ERROR, "Unable to open file %s for reading", filename);
+  // clean up old databases, nothing points into the previous snapshot after
+  destroy_databases(ctx);
+  if (ctx->snapshot_mapping) {
+    munmap(ctx->snapshot_mapping, ctx->snapshot_mapping_size);
+    ctx->snapshot_mapping = NULL;
+    ctx->snapshot_mapping_size = 0;
+  }
+
+  // the shard maps are created once their sizes are known, the slots past the
+  // ones of the snapshot are for databases created on first use
+  uint64_t num_slots =
+    num_databases > NUM_DATABASES ? num_databases : NUM_DATABASES;
+  ctx->db_manager.databases = calloc(num_slots + 1, sizeof(Database));
+  if (!ctx->db_manager.databases) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for databases");
     return -1;
   }
+  ctx->db_manager.num_databases = (int32_t)num_databases;
 
-  struct stat st;
-  if (fstat(fd, &st) < 0) {
-    DB_Log(DB_LOG_ERROR, "Failed to get file size for %s", filename);
-    close(fd);
+  for (int32_t i = 0; i < ctx->db_manager.num_databases; i++) {
+    Database* db = &ctx->db_manager.databases[i];
+    if (!read_varint(&ptr, record->end, &db->ID)) {
+      return -1;
+    }
+    db->name = read_string_mmap(&ptr, record->end);
+  }
+  return 0;
+}
+
+static int32_t
+import_users(RuntimeContext* ctx, SnapshotRecord* record)
+{
+  for (int32_t i = 0; i < ctx->user_manager.num_users; i++) {
+    free(ctx->user_manager.users[i].name);
+    free(ctx->user_manager.users[i].access);
+  }
+  free(ctx->user_manager.users);
+  ctx->user_manager.users = NULL;
+  ctx->user_manager.num_users = 0;
+
+  char* ptr = record->data;
+  uint64_t num_users = 0;
+  if (record->data && (!read_varint(&ptr, record->end, &num_users) ||
+                       num_users > (uint64_t)(record->end - ptr))) {
+    DB_Log(DB_LOG_ERROR, "Invalid number of users");
     return -1;
   }
 
-  // map the file
-  char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (data == MAP_FAILED) {
-    DB_Log(DB_LOG_ERROR, "Failed to mmap file %s", filename);
-    close(fd);
+  ctx->user_manager.users = calloc(num_users + 1, sizeof(DB_User));
+  if (!ctx->user_manager.users) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for users");
     return -1;
   }
 
-  char* ptr = data;
-  char* end_of_mapped_region =
-    data + st.st_size; // calculate the end of the region
+  for (uint64_t i = 0; i < num_users; i++) {
+    DB_User* user = &ctx->user_manager.users[i];
+    ctx->user_manager.num_users++;
+
+    uint8_t has_access;
+    if (!read_varint(&ptr, record->end, &user->ID) ||
+        !(user->name = read_string_mmap(&ptr, record->end)) ||
+        !read_raw(&ptr, record->end, user->password, 32) ||
+        !read_raw(&ptr, record->end, &has_access, sizeof(uint8_t))) {
+      return -1;
+    }
 
-  // read and verify header
-  char* signature = read_string_mmap(&ptr, end_of_mapped_region);
-  char* version = read_string_mmap(&ptr, end_of_mapped_region);
+    if (has_access) {
+      user->access = malloc(sizeof(DB_Access));
+      if (!user->access) {
+        DB_Log(DB_LOG_ERROR, "Failed to allocate memory for user access");
+        return -1;
+      }
 
-  if (strcmp(signature, TINYDB_SIGNATURE) != 0 ||
-      strcmp(version, TINYDB_VERSION) != 0) {
-    DB_Log(DB_LOG_ERROR, "Invalid file signature or version");
-    free(signature);
-    free(version);
-    munmap(data, st.st_size);
-    close(fd);
+      uint64_t acl;
+      if (!read_varint(&ptr, record->end, &user->access->database) ||
+          !read_varint(&ptr, record->end, &acl)) {
+        return -1;
+      }
+      user->access->acl = (DB_ACCESS_LEVEL)acl;
+    }
+  }
+  return 0;
+}
+
+static int32_t
+import_shards(RuntimeContext* ctx,
+              char* data,
+              SnapshotRecord* record,
+              char* shards_begin,
+              char* shards_end)
+{
+  char* ptr = record->data;
+  uint64_t shards_per_database;
+  if (!read_varint(&ptr, record->end, &shards_per_database) ||
+      shards_per_database == 0 || shards_per_database > SNAPSHOT_MAX_SHARDS ||
+      ctx->db_manager.num_databases * shards_per_database > INT32_MAX) {
+    DB_Log(DB_LOG_ERROR, "Invalid number of shards");
     return -1;
   }
 
-  DB_Log(
-    DB_LOG_INFO, "Importing TinyDB snapshot for version %s", TINYDB_VERSION);
+  int32_t num_databases = ctx->db_manager.num_databases;
+  ShardLoader* loader = calloc(1, sizeof(ShardLoader));
+  if (!loader) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for the shard loader");
+    return -1;
+  }
+  loader->databases = ctx->db_manager.databases;
+  loader->num_shards = num_databases * shards_per_database;
+  loader->shards_per_database = shards_per_database;
+  loader->reshard = shards_per_database != NUM_SHARDS;
+  loader->data = data;
+  loader->end = shards_end;
+  loader->zero_copy = ctx->snapshot_zero_copy;
+  pthread_mutex_init(&loader->lock, NULL);
+  pthread_cond_init(&loader->done, NULL);
+  atomic_init(&loader->next, 0);
+  atomic_init(&loader->failed, 0);
+  atomic_init(&loader->refs, 1);
+
+  loader->table =
+    malloc(sizeof(SnapshotShardInfo) * (loader->num_shards + 1));
+  if (!loader->table) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for the shard table");
+    release_loader(loader);
+    return -1;
+  }
 
-  free(signature);
-  free(version);
+  for (int32_t i = 0; i < loader->num_shards; i++) {
+    SnapshotShardInfo* info = &loader->table[i];
+    uint64_t min_offset =
+      i > 0 ? info[-1].offset : (uint64_t)(shards_begin - data);
+    if (!read_varint(&ptr, record->end, &info->offset) ||
+        !read_varint(&ptr, record->end, &info->num_entries) ||
+        info->offset < min_offset ||
+        info->offset > (uint64_t)(shards_end - data)) {
+      DB_Log(DB_LOG_ERROR, "Invalid shard table");
+      free(loader->table);
+      release_loader(loader);
+      return -1;
+    }
+  }
 
-  // number of databases
-  int32_t num_databases = *(int32_t*)ptr;
-  ptr += sizeof(int32_t);
+  // presized so that filling them never resizes, a snapshot written with a
+  // different NUM_SHARDS spreads the keys evenly over ours
+  for (int32_t i = 0; i < num_databases; i++) {
+    uint64_t total = 0;
+    for (int32_t j = 0; j < (int32_t)shards_per_database; j++) {
+      total += loader->table[i * shards_per_database + j].num_entries;
+    }
 
-  if (ptr > end_of_mapped_region) {
-    DB_Log(DB_LOG_ERROR, "Reached beyond the end of the mapped file.");
-    munmap(data, st.st_size);
-    close(fd);
+    for (int32_t j = 0; j < NUM_SHARDS; j++) {
+      DatabaseShard* shard = &ctx->db_manager.databases[i].shards[j];
+      uint64_t expected = loader->reshard
+                            ? total / NUM_SHARDS + total / (4 * NUM_SHARDS)
+                            : loader->table[i * NUM_SHARDS + j].num_entries;
+
+      shard->num_entries = loader->reshard ? 0 : expected;
+      shard->entries = Create_Shard_Map(j, expected);
+      if (!shard->entries || pthread_rwlock_init(&shard->rwlock, NULL) != 0) {
+        DB_Log(DB_LOG_ERROR, "Failed to create shard %d", j);
+        free(loader->table);
+        release_loader(loader);
+        return -1;
+      }
+    }
+  }
+
+  // the workers of the pool help, the calling thread loads shards as well.
+  // resharding moves keys across shards, that is only safe on one thread
+  int32_t num_tasks = Thread_Pool_Size() < loader->num_shards
+                        ? Thread_Pool_Size()
+                        : loader->num_shards - 1;
+  if (loader->reshard) {
+    DB_Log(DB_LOG_INFO,
+           "Snapshot has %d shards per database, resharding to %d on one "
+           "thread",
+           loader->shards_per_database,
+           NUM_SHARDS);
+    num_tasks = 0;
+  }
+  for (int32_t i = 0; i < num_tasks; i++) {
+    atomic_fetch_add(&loader->refs, 1);
+    if (Thread_Pool_Add_Task(Shard_Loader_Task, loader) != 0) {
+      atomic_fetch_sub(&loader->refs, 1);
+      break;
+    }
+  }
+  load_shards(loader);
+
+  pthread_mutex_lock(&loader->lock);
+  while (loader->loaded < loader->num_shards) {
+    pthread_cond_wait(&loader->done, &loader->lock);
+  }
+  pthread_mutex_unlock(&loader->lock);
+
+  // tasks that did not start yet find no shard left, they never read the table
+  free(loader->table);
+  bool failed = atomic_load(&loader->failed);
+  release_loader(loader);
+
+  if (failed) {
+    DB_Log(DB_LOG_ERROR, "Snapshot has corrupted shard data");
     return -1;
   }
+  return 0;
+}
+
+// strings of the legacy format: u32 length and the bytes, 0 is NULL
+static bool
+read_legacy_string(char** ptr, char* end, char** str)
+{
+  uint32_t len;
+  *str = NULL;
+  if (!read_raw(ptr, end, &len, sizeof(uint32_t)) ||
+      len > (size_t)(end - *ptr)) {
+    return false;
+  }
+  if (len == 0) {
+    return true;
+  }
 
-  // clean up old databases
-  if (ctx->db_manager.databases) {
-    for (int i = 0; i < ctx->db_manager.num_databases; i++) {
-      free(ctx->db_manager.databases[i].name);
-      for (int j = 0; j < NUM_SHARDS; j++) {
-        HM_Destroy(ctx->db_manager.databases[i].shards[j].entries);
-        pthread_rwlock_destroy(&ctx->db_manager.databases[i].shards[j].rwlock);
-      }
+  *str = malloc(len + 1);
+  if (!*str) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for string");
+    return false;
+  }
+  memcpy(*str, *ptr, len);
+  (*str)[len] = '\0';
+  *ptr += len;
+  return true;
+}
+
+static bool
+read_legacy_list(char** ptr, char* end, HPLinkedList* list)
+{
+  uint64_t list_size; // a size_t when it was written
+  if (!read_raw(ptr, end, &list_size, sizeof(uint64_t))) {
+    return false;
+  }
+
+  for (uint64_t n = 0; n < list_size; n++) {
+    int32_t node_type;
+    if (!read_raw(ptr, end, &node_type, sizeof(int32_t))) {
+      return false;
+    }
+
+    switch (node_type) {
+      case TYPE_STRING: {
+        char* str_value;
+        if (!read_legacy_string(ptr, end, &str_value)) {
+          return false;
+        }
+        HPList_RPush_String(list, str_value ? str_value : "");
+        free(str_value);
+      } break;
+      case TYPE_INT: {
+        int64_t int_value;
+        if (!read_raw(ptr, end, &int_value, sizeof(int64_t))) {
+          return false;
+        }
+        HPList_RPush_Int(list, int_value);
+      } break;
+      case TYPE_FLOAT: {
+        double float_value;
+        if (!read_raw(ptr, end, &float_value, sizeof(double))) {
+          return false;
+        }
+        HPList_RPush_Float(list, float_value);
+      } break;
+      default:
+        return false;
     }
-    free(ctx->db_manager.databases);
   }
+  return true;
+}
 
-  ctx->db_manager.num_databases = num_databases;
-  ctx->db_manager.databases = malloc(sizeof(Database) * num_databases);
+static DatabaseEntry*
+read_legacy_entry(char** ptr, char* end)
+{
+  DatabaseEntry* entry = calloc(1, sizeof(DatabaseEntry));
+  if (!entry) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for database entry");
+    return NULL;
+  }
+
+  int32_t type = DB_ENTRY_STRING;
+  bool ok = read_legacy_string(ptr, end, &entry->key) && entry->key != NULL &&
+            read_raw(ptr, end, &type, sizeof(int32_t));
+  entry->type = (DB_ENTRY_TYPE)type;
+
+  switch (ok ? type : -1) {
+    case DB_ENTRY_NUMBER: {
+      int64_t value;
+      ok = read_raw(ptr, end, &value, sizeof(int64_t));
+      entry->value.number.value = value;
+    } break;
+    case DB_ENTRY_STRING:
+      ok = read_legacy_string(ptr, end, &entry->value.string.value);
+      break;
+    case DB_ENTRY_LIST:
+      entry->value.list = HPList_Create();
+      ok = entry->value.list && read_legacy_list(ptr, end, entry->value.list);
+      break;
+    case DB_ENTRY_OBJECT:
+      // their fields were never written
+      entry->value.object = CreateDBObject();
+      ok = entry->value.object != NULL;
+      break;
+    default:
+      ok = false;
+      break;
+  }
+
+  if (!ok) {
+    Database_Entry_Destructor(entry);
+    return NULL;
+  }
+  return entry;
+}
+
+static bool
+is_legacy_snapshot(char* data, size_t size)
+{
+  uint32_t signature_len = strlen(TINYDB_SIGNATURE);
+  uint32_t version_len = strlen(SNAPSHOT_LEGACY_VERSION);
+  size_t header_len = 2 * sizeof(uint32_t) + signature_len + version_len;
+  if (size < header_len) {
+    return false;
+  }
+
+  uint32_t len;
+  memcpy(&len, data, sizeof(uint32_t));
+  if (len != signature_len ||
+      memcmp(data + sizeof(uint32_t), TINYDB_SIGNATURE, signature_len) != 0) {
+    return false;
+  }
+
+  char* ptr = data + sizeof(uint32_t) + signature_len;
+  memcpy(&len, ptr, sizeof(uint32_t));
+  return len == version_len &&
+         memcmp(ptr + sizeof(uint32_t), SNAPSHOT_LEGACY_VERSION, version_len) ==
+           0;
+}
+
+// the whole file as written by TINYDB_VERSION "0.0.1": fixed size native
+// fields and no records, the keys are put into the shards they hash to now
+static int32_t
+import_legacy(RuntimeContext* ctx, char* data, char* end)
+{
+  char* ptr = data + 2 * sizeof(uint32_t) + strlen(TINYDB_SIGNATURE) +
+              strlen(SNAPSHOT_LEGACY_VERSION);
+
+  int32_t num_databases;
+  if (!read_raw(&ptr, end, &num_databases, sizeof(int32_t)) ||
+      num_databases < 0 || num_databases > end - ptr) {
+    DB_Log(DB_LOG_ERROR, "Invalid number of databases");
+    return -1;
+  }
+
+  destroy_databases(ctx);
+  if (ctx->snapshot_mapping) {
+    munmap(ctx->snapshot_mapping, ctx->snapshot_mapping_size);
+    ctx->snapshot_mapping = NULL;
+    ctx->snapshot_mapping_size = 0;
+  }
+
+  int32_t num_slots =
+    num_databases > NUM_DATABASES ? num_databases : NUM_DATABASES;
+  ctx->db_manager.databases = calloc(num_slots + 1, sizeof(Database));
   if (!ctx->db_manager.databases) {
     DB_Log(DB_LOG_ERROR, "Failed to allocate memory for databases");
-    munmap(data, st.st_size);
-    close(fd);
     return -1;
   }
+  ctx->db_manager.num_databases = num_databases;
 
   for (int32_t i = 0; i < num_databases; i++) {
     Database* db = &ctx->db_manager.databases[i];
-
-    db->ID = *(EntryID*)ptr;
-    ptr += sizeof(EntryID);
-
-    db->name = read_string_mmap(&ptr, end_of_mapped_region);
+    if (!read_raw(&ptr, end, &db->ID, sizeof(EntryID)) ||
+        !read_legacy_string(&ptr, end, &db->name)) {
+      return -1;
+    }
 
     for (int32_t j = 0; j < NUM_SHARDS; j++) {
       DatabaseShard* shard = &db->shards[j];
+      shard->entries = Create_Shard_Map(j, 0);
+      if (!shard->entries || pthread_rwlock_init(&shard->rwlock, NULL) != 0) {
+        DB_Log(DB_LOG_ERROR, "Failed to create shard %d", j);
+        return -1;
+      }
+    }
 
-      shard->num_entries = *(uint64_t*)ptr;
-      ptr += sizeof(uint64_t);
-
-      shard->entries = HM_Create(Database_Entry_Destructor);
-      if (!shard->entries) {
-        DB_Log(DB_LOG_ERROR, "Failed to create hash map for shard %d", j);
-        munmap(data, st.st_size);
-        close(fd);
+    for (int32_t j = 0; j < SNAPSHOT_LEGACY_SHARDS; j++) {
+      uint64_t num_entries;
+      if (!read_raw(&ptr, end, &num_entries, sizeof(uint64_t))) {
         return -1;
       }
 
-      for (uint64_t k = 0; k < shard->num_entries; k++) {
-        DatabaseEntry* entry = malloc(sizeof(DatabaseEntry));
+      for (uint64_t k = 0; k < num_entries; k++) {
+        DatabaseEntry* entry = read_legacy_entry(&ptr, end);
         if (!entry) {
-          DB_Log(DB_LOG_ERROR, "Failed to allocate memory for database entry");
-          munmap(data, st.st_size);
-          close(fd);
+          DB_Log(DB_LOG_ERROR, "Snapshot has corrupted shard data");
           return -1;
         }
 
-        entry->key = read_string_mmap(&ptr, end_of_mapped_region);
+        DatabaseShard* shard = &db->shards[Pick_Shard(entry->key)];
+        if (HM_Put(shard->entries, entry->key, entry) == HM_ACTION_ADDED) {
+          atomic_fetch_add(&shard->num_entries, 1);
+        }
+      }
+    }
+  }
 
-        entry->type = *(DB_ENTRY_TYPE*)ptr;
-        ptr += sizeof(DB_ENTRY_TYPE);
+  for (int32_t i = 0; i < ctx->user_manager.num_users; i++) {
+    free(ctx->user_manager.users[i].name);
+    free(ctx->user_manager.users[i].access);
+  }
+  free(ctx->user_manager.users);
+  ctx->user_manager.users = NULL;
+  ctx->user_manager.num_users = 0;
+
+  int32_t num_users;
+  if (!read_raw(&ptr, end, &num_users, sizeof(int32_t)) || num_users < 0 ||
+      num_users > end - ptr) {
+    DB_Log(DB_LOG_ERROR, "Invalid number of users");
+    return -1;
+  }
 
-        switch (entry->type) {
-          case DB_ENTRY_NUMBER:
-            entry->value.number.value = *(int64_t*)ptr;
-            ptr += sizeof(int64_t);
-            break;
-          case DB_ENTRY_STRING:
-            entry->value.string.value =
-              read_string_mmap(&ptr, end_of_mapped_region);
-            break;
+  ctx->user_manager.users = calloc(num_users + 1, sizeof(DB_User));
+  if (!ctx->user_manager.users) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for users");
+    return -1;
+  }
 
-          case DB_ENTRY_LIST: {
-            size_t list_size = *(size_t*)ptr;
-            ptr += sizeof(size_t);
-
-            HPLinkedList* list = HPList_Create();
-            for (size_t n = 0; n < list_size; n++) {
-              ValueType node_type = *(ValueType*)ptr;
-              ptr += sizeof(ValueType);
-
-              switch (node_type) {
-                case TYPE_STRING: {
-                  char* str_value =
-                    read_string_mmap(&ptr, end_of_mapped_region);
-                  HPList_RPush_String(list, str_value);
-                  free(str_value);
-                } break;
-                case TYPE_INT: {
-                  int64_t int_value = *(int64_t*)ptr;
-                  ptr += sizeof(int64_t);
-                  HPList_RPush_Int(list, int_value);
-                } break;
-                case TYPE_FLOAT: {
-                  double float_value = *(double*)ptr;
-                  ptr += sizeof(double);
-                  HPList_RPush_Float(list, float_value);
-                } break;
-              }
-            }
-            entry->value.list = list;
-          } break;
-          case DB_ENTRY_OBJECT:
-            DB_Log(DB_LOG_WARNING,
-                   "DB_ENTRY_OBJECT not implemented for key %s",
-                   entry->key);
-            break;
-        }
+  for (int32_t i = 0; i < num_users; i++) {
+    DB_User* user = &ctx->user_manager.users[i];
+    ctx->user_manager.num_users++;
+
+    uint8_t has_access;
+    if (!read_raw(&ptr, end, &user->ID, sizeof(EntryID)) ||
+        !read_legacy_string(&ptr, end, &user->name) ||
+        !read_raw(&ptr, end, user->password, 32) ||
+        !read_raw(&ptr, end, &has_access, sizeof(uint8_t))) {
+      return -1;
+    }
 
-        HM_Put(shard->entries, entry->key, entry);
+    if (has_access) {
+      user->access = malloc(sizeof(DB_Access));
+      if (!user->access) {
+        DB_Log(DB_LOG_ERROR, "Failed to allocate memory for user access");
+        return -1;
       }
 
-      if (pthread_rwlock_init(&shard->rwlock, NULL) != 0) {
-        DB_Log(DB_LOG_ERROR, "Failed to initialize rwlock for shard %d", j);
-        munmap(data, st.st_size);
-        close(fd);
+      int32_t acl;
+      if (!read_raw(&ptr, end, &user->access->database, sizeof(EntryID)) ||
+          !read_raw(&ptr, end, &acl, sizeof(int32_t))) {
         return -1;
       }
+      user->access->acl = (DB_ACCESS_LEVEL)acl;
     }
   }
+  return 0;
+}
 
-  // users
-  int32_t num_users = *(int32_t*)ptr;
-  ptr += sizeof(int32_t);
+// a failed import leaves empty databases behind rather than broken ones, the
+// databases of the snapshot exist, the others are created on first use.
+// loaded values may point into the mapping when keep_mapping is set, it lives
+// as long as they do
+static int32_t
+finish_import(RuntimeContext* ctx,
+              char* data,
+              size_t size,
+              int32_t res,
+              bool keep_mapping)
+{
+  for (int32_t i = 0; i < ctx->db_manager.num_databases && res != 0; i++) {
+    Database* db = &ctx->db_manager.databases[i];
+    for (int32_t j = 0; j < NUM_SHARDS; j++) {
+      if (db->shards[j].entries) {
+        HM_Destroy(db->shards[j].entries);
+        pthread_rwlock_destroy(&db->shards[j].rwlock);
+      }
+    }
+    Initialize_Database(db);
+  }
 
-  if (ctx->user_manager.users) {
-    for (int32_t i = 0; i < ctx->user_manager.num_users; i++) {
-      free(ctx->user_manager.users[i].name);
-      free(ctx->user_manager.users[i].access);
+  if (ctx->db_manager.databases) {
+    for (int32_t i = 0; i < ctx->db_manager.num_databases && res == 0; i++) {
+      atomic_store(&ctx->db_manager.databases[i].ready, true);
+    }
+    for (int32_t i = ctx->db_manager.num_databases; i < NUM_DATABASES; i++) {
+      ctx->db_manager.databases[i].ID = i;
+      ctx->db_manager.num_databases = i + 1;
     }
-    free(ctx->user_manager.users);
   }
 
-  ctx->user_manager.num_users = num_users;
-  ctx->user_manager.users = malloc(sizeof(DB_User) * num_users);
-  if (!ctx->user_manager.users) {
-    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for users");
-    munmap(data, st.st_size);
+  if (res == 0 && keep_mapping) {
+    madvise(data, size, MADV_RANDOM);
+    ctx->snapshot_mapping = data;
+    ctx->snapshot_mapping_size = size;
+  } else {
+    munmap(data, size);
+  }
+  return res;
+}
+
+int32_t
+Import_Snapshot(RuntimeContext* ctx, const char* filename)
+{
+  DB_Log(DB_LOG_INFO, "Trying to open file %s for reading", filename);
+
+  if (ctx == NULL || filename == NULL) {
+    fprintf(stderr, "Error: \n");
+    DB_Log(DB_LOG_ERROR, "NULL context or filename in Import_Snapshot");
+    return -1;
+  }
+
+  int32_t fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    DB_Log(DB_LOG_ERROR, "Unable to open file %s for reading", filename);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    DB_Log(DB_LOG_ERROR, "Failed to get file size for %s", filename);
     close(fd);
     return -1;
   }
 
-  for (int32_t i = 0; i < num_users; i++) {
-    DB_User* user = &ctx->user_manager.users[i];
+  // map the file
+  char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    DB_Log(DB_LOG_ERROR, "Failed to mmap file %s", filename);
+    return -1;
+  }
+
+  if (is_legacy_snapshot(data, st.st_size)) {
+    DB_Log(DB_LOG_WARNING,
+           "Snapshot %s has the format of version %s, the next save writes "
+           "the current one",
+           filename,
+           SNAPSHOT_LEGACY_VERSION);
+    int32_t res = import_legacy(ctx, data, data + st.st_size);
+    return finish_import(ctx, data, st.st_size, res, false);
+  }
 
-    user->ID = *(EntryID*)ptr;
-    ptr += sizeof(EntryID);
+  // verify the footer before trusting any length inside the file
+  size_t footer_at = st.st_size - SNAPSHOT_FOOTER_SIZE;
+  if ((size_t)st.st_size < SNAPSHOT_FOOTER_SIZE ||
+      memcmp(data + footer_at,
+             SNAPSHOT_FOOTER_MAGIC,
+             SNAPSHOT_FOOTER_MAGIC_LEN) != 0) {
+    DB_Log(DB_LOG_ERROR, "Snapshot %s has no checksum footer", filename);
+    munmap(data, st.st_size);
+    return -1;
+  }
 
-    user->name = read_string_mmap(&ptr, end_of_mapped_region);
+  uint32_t expected_crc;
+  memcpy(&expected_crc,
+         data + footer_at + SNAPSHOT_FOOTER_MAGIC_LEN,
+         sizeof(uint32_t));
+  if (CRC32C(0, data, footer_at) != expected_crc) {
+    DB_Log(DB_LOG_ERROR, "Snapshot %s checksum mismatch", filename);
+    munmap(data, st.st_size);
+    return -1;
+  }
 
-    memcpy(user->password, ptr, 32);
-    ptr += 32;
+  char* ptr = data;
+  char* end_of_mapped_region =
+    data + footer_at; // calculate the end of the region
 
-    uint8_t has_access = *(uint8_t*)ptr;
-    ptr += sizeof(uint8_t);
+  // read and verify header, files of older versions are read as well, newer
+  // ones as long as they do not need a newer reader
+  uint64_t version = 0;
+  uint64_t min_version = 0;
+  char* signature = read_string_mmap(&ptr, end_of_mapped_region);
+  bool valid = signature && strcmp(signature, TINYDB_SIGNATURE) == 0 &&
+               read_varint(&ptr, end_of_mapped_region, &version) &&
+               read_varint(&ptr, end_of_mapped_region, &min_version);
+  free(signature);
 
-    if (has_access) {
-      user->access = malloc(sizeof(DB_Access));
-      if (!user->access) {
-        DB_Log(DB_LOG_ERROR, "Failed to allocate memory for user access");
-        munmap(data, st.st_size);
-        close(fd);
-        return -1;
+  if (!valid || min_version > SNAPSHOT_FORMAT_VERSION) {
+    DB_Log(DB_LOG_ERROR,
+           "Invalid file signature or unsupported format version %lu",
+           (unsigned long)version);
+    munmap(data, st.st_size);
+    return -1;
+  }
+
+  DB_Log(DB_LOG_INFO,
+         "Importing TinyDB snapshot format version %lu",
+         (unsigned long)version);
+
+  // records: <tag> <varint length> <payload>, unknown tags are skipped
+  SnapshotRecord databases = { 0 };
+  SnapshotRecord users = { 0 };
+  SnapshotRecord table = { 0 };
+  char* shards_begin = ptr;
+  char* shards_end = NULL;
+  while (ptr < end_of_mapped_region) {
+    char* record_start = ptr;
+    uint8_t tag;
+    uint64_t len;
+    if (!read_raw(&ptr, end_of_mapped_region, &tag, sizeof(uint8_t)) ||
+        !read_varint(&ptr, end_of_mapped_region, &len) ||
+        len > (uint64_t)(end_of_mapped_region - ptr)) {
+      valid = false;
+      break;
+    }
+
+    SnapshotRecord* record = NULL;
+    switch (tag) {
+      case SNAPSHOT_RECORD_DATABASES:
+        record = &databases;
+        break;
+      case SNAPSHOT_RECORD_USERS:
+        record = &users;
+        break;
+      case SNAPSHOT_RECORD_SHARD_TABLE:
+        record = &table;
+        shards_end = record_start;
+        break;
+    }
+
+    if (record) {
+      record->data = ptr;
+      record->end = ptr + len;
+    }
+    ptr += len;
+  }
+
+  if (!valid || !databases.data || !table.data) {
+    DB_Log(DB_LOG_ERROR, "Snapshot %s is missing records", filename);
+    munmap(data, st.st_size);
+    return -1;
+  }
+
+  int32_t res = -1;
+  if (import_databases(ctx, &databases) == 0 &&
+      import_users(ctx, &users) == 0 &&
+      import_shards(ctx, data, &table, shards_begin, shards_end) == 0) {
+    res = 0;
+  }
+
+  return finish_import(ctx, data, st.st_size, res, ctx->snapshot_zero_copy);
+}
+
+typedef struct ReplaceShard
+{
+  DatabaseShard* live;
+  DatabaseShard* staged; // NULL: the shard ends up empty
+} ReplaceShard;
+
+// empties the live shard and moves the staged entries (if any) into it. the
+// map itself stays in place, so lookups running concurrently stay valid. runs
+// on the owner of the shard
+static void
+replace_shard_entries(void* arg)
+{
+  DatabaseShard* live = ((ReplaceShard*)arg)->live;
+  DatabaseShard* staged = ((ReplaceShard*)arg)->staged;
+  Shard_Write_Lock(live);
+
+  // keys are collected first, removing while walking the table could skip
+  // entries an incremental resize moves
+  size_t num_keys = 0;
+  size_t capacity = 0;
+  char** keys = NULL;
+  size_t index = 0;
+  DatabaseEntry* entry;
+  while ((entry = next_entry(live->entries, &index)) != NULL) {
+    if (num_keys == capacity) {
+      size_t new_capacity = capacity ? capacity * 2 : 1024;
+      char** temp = realloc(keys, new_capacity * sizeof(char*));
+      if (!temp) {
+        DB_Log(DB_LOG_ERROR, "Failed to allocate memory to flush a shard");
+        break;
       }
+      keys = temp;
+      capacity = new_capacity;
+    }
+    keys[num_keys++] = entry->key;
+  }
 
-      user->access->database = *(EntryID*)ptr;
-      ptr += sizeof(EntryID);
-      user->access->acl = *(DB_ACCESS_LEVEL*)ptr;
-      ptr += sizeof(DB_ACCESS_LEVEL);
-    } else {
-      user->access = NULL;
+  // removing a key releases its entry, the remaining key pointers stay valid
+  for (size_t i = 0; i < num_keys; i++) {
+    if (HM_Remove(live->entries, keys[i])) {
+      atomic_fetch_sub(&live->num_entries, 1);
+    }
+  }
+  free(keys);
+
+  index = 0;
+  while (staged && (entry = next_entry(staged->entries, &index)) != NULL) {
+    int8_t state = HM_Put(live->entries, entry->key, entry);
+    if (state == HM_ACTION_ADDED) {
+      atomic_fetch_add(&live->num_entries, 1);
+    } else if (state == HM_ACTION_FAILED) {
+      Database_Entry_Destructor(entry);
     }
   }
 
-  munmap(data, st.st_size);
-  close(fd);
-  return 0;
+  // the live map owns the entries now
+  if (staged) {
+    staged->entries->value_destructor = NULL;
+  }
+  Shard_Unlock(live);
+}
+
+int32_t
+Import_Snapshot_Live(RuntimeContext* ctx, const char* filename)
+{
+  RuntimeContext* staging = calloc(1, sizeof(RuntimeContext));
+  if (!staging) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for the snapshot staging");
+    return -1;
+  }
+  staging->snapshot_zero_copy = ctx->snapshot_zero_copy;
+
+  int32_t res = Import_Snapshot(staging, filename);
+  if (res == 0) {
+    int32_t num_staged = staging->db_manager.num_databases;
+    if (num_staged > ctx->db_manager.num_databases) {
+      DB_Log(DB_LOG_WARNING,
+             "Snapshot %s has %d databases, only %d are loaded",
+             filename,
+             num_staged,
+             ctx->db_manager.num_databases);
+    }
+
+    for (int32_t i = 0; i < ctx->db_manager.num_databases; i++) {
+      Database* staged = i < num_staged ? &staging->db_manager.databases[i]
+                                        : NULL;
+      if (staged && !atomic_load(&staged->ready)) {
+        staged = NULL;
+      }
+
+      // a database that was never used only has to exist when it gets keys
+      Database* db = &ctx->db_manager.databases[i];
+      if (!atomic_load(&db->ready) &&
+          (!staged || !(db = Select_Database(&ctx->db_manager, i)))) {
+        continue;
+      }
+      for (int32_t j = 0; j < NUM_SHARDS; j++) {
+        ReplaceShard job = { .live = &db->shards[j],
+                             .staged = staged ? &staged->shards[j] : NULL };
+        Shard_Executors_Run(j, replace_shard_entries, &job);
+      }
+    }
+
+    // no value points into the previous mapping anymore
+    if (ctx->snapshot_mapping) {
+      munmap(ctx->snapshot_mapping, ctx->snapshot_mapping_size);
+    }
+    ctx->snapshot_mapping = staging->snapshot_mapping;
+    ctx->snapshot_mapping_size = staging->snapshot_mapping_size;
+    staging->snapshot_mapping = NULL;
+  }
+
+  // users are not taken over, the live ones stay
+  destroy_databases(staging);
+  for (int32_t i = 0; i < staging->user_manager.num_users; i++) {
+    free(staging->user_manager.users[i].name);
+    free(staging->user_manager.users[i].access);
+  }
+  free(staging->user_manager.users);
+  free(staging);
+  return res;
 }
 
 void
@@ -418,7 +1661,7 @@ Print_Runtime_Context(RuntimeContext* ctx)
     printf("  Database %d:\n", i);
     printf("    ID: %lu\n", (unsigned long)db->ID);
     printf("    Name: %s\n", db->name ? db->name : "NULL");
-    for (int j = 0; j < NUM_SHARDS; j++) {
+    for (int j = 0; j < NUM_SHARDS && atomic_load(&db->ready); j++) {
       DatabaseShard* shard = &db->shards[j];
       printf(
         "    Shard %d: %lu entries\n", j, (unsigned long)shard->num_entries);
@@ -6,12 +6,73 @@
 #define TINYDB_SIGNATURE "TINYDB"
 #define TINYDB_VERSION "0.0.1"
 
+// size of the staging buffer, the file is written in chunks of this size
+#define SNAPSHOT_BUFFER_SIZE (1 << 20)
+#define SNAPSHOT_BUFFER_ALIGNMENT 4096
+
+// the file ends with the magic followed by the CRC32C of everything before it
+#define SNAPSHOT_FOOTER_MAGIC "TDBCRC32"
+#define SNAPSHOT_FOOTER_MAGIC_LEN 8
+#define SNAPSHOT_FOOTER_SIZE (SNAPSHOT_FOOTER_MAGIC_LEN + sizeof(uint32_t))
+
+// the file starts with the signature and two varints: the format version it
+// was written in and the oldest version able to read it. a reader accepts
+// every file whose minimum version it meets, records it does not know are
+// skipped, so new records can be added without breaking older readers.
+#define SNAPSHOT_FORMAT_VERSION 1
+#define SNAPSHOT_MIN_READER_VERSION 1
+
+// snapshots of TINYDB_VERSION "0.0.1" start with the signature and that
+// version as raw u32 length prefixed strings and have no footer. they are
+// still read, the next save writes the current format
+#define SNAPSHOT_LEGACY_VERSION "0.0.1"
+#define SNAPSHOT_LEGACY_SHARDS 16
+
+// the rest of the file are records: <tag> <varint length> <payload>
+#define SNAPSHOT_RECORD_DATABASES 1
+#define SNAPSHOT_RECORD_USERS 2
+#define SNAPSHOT_RECORD_BLOCK 3    // entries of one shard
+#define SNAPSHOT_RECORD_BLOCK_LZ 4 // <varint raw length> <compressed entries>
+#define SNAPSHOT_RECORD_SHARD_TABLE 5
+
+// entries are grouped into blocks of about this size, each block is
+// compressed on its own when SNAPSHOT_COMPRESSION is set
+#define SNAPSHOT_BLOCK_SIZE (64 * 1024)
+
+// deepest nesting of objects accepted on import
+#define SNAPSHOT_MAX_DEPTH 64
+
+// a file can be loaded into a build with a different NUM_SHARDS, up to this
+#define SNAPSHOT_MAX_SHARDS 65536
+
+// the blocks of every shard are stored back to back after the users, the
+// shard table record at the end tells where each shard starts and how many
+// entries it holds. that lets the import load the shards in parallel into
+// presized maps.
+typedef struct SnapshotShardInfo
+{
+  uint64_t offset;
+  uint64_t num_entries;
+} SnapshotShardInfo;
+
+/**
+ * writes the snapshot to a temp file next to filename, syncs it and renames
+ * it over filename so a crash never leaves a partial snapshot behind.
+ */
 int32_t
 Export_Snapshot(RuntimeContext* ctx, const char* filename);
 
 int32_t
 Import_Snapshot(RuntimeContext* ctx, const char* filename);
 
+/**
+ * replaces the keys of the running databases with the ones of the snapshot,
+ * shard by shard. unlike Import_Snapshot the databases and their maps stay in
+ * place, so it is safe while connections are served. users are not loaded.
+ */
+int32_t
+Import_Snapshot_Live(RuntimeContext* ctx, const char* filename);
+
 void
 Print_Runtime_Context(RuntimeContext* ctx);
 
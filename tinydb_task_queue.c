@@ -1,41 +1,223 @@
 #include "tinydb_task_queue.h"
+#include "tinydb_log.h"
+
+static Task_Deque_Array*
+Task_Deque_Array_Create(int64_t size)
+{
+  Task_Deque_Array* array =
+    malloc(sizeof(Task_Deque_Array) + sizeof(Task_Slot) * size);
+  if (!array) {
+    return NULL;
+  }
+  array->size = size;
+  array->retired = NULL;
+  return array;
+}
+
+int32_t
+Task_Deque_Init(Task_Deque* deque)
+{
+  Task_Deque_Array* array = Task_Deque_Array_Create(TASK_QUEUE_INITIAL_SIZE);
+  if (!array) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for Task_Deque");
+    return -1;
+  }
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+  atomic_init(&deque->array, array);
+  return 0;
+}
+
+static void
+slot_store(Task_Deque_Array* array, int64_t i, Task task)
+{
+  Task_Slot* slot = &array->slots[i & (array->size - 1)];
+  atomic_store_explicit(&slot->function, task.function, memory_order_relaxed);
+  atomic_store_explicit(&slot->argument, task.argument, memory_order_relaxed);
+}
+
+static Task
+slot_load(Task_Deque_Array* array, int64_t i)
+{
+  Task_Slot* slot = &array->slots[i & (array->size - 1)];
+  Task task;
+  task.function =
+    atomic_load_explicit(&slot->function, memory_order_relaxed);
+  task.argument =
+    atomic_load_explicit(&slot->argument, memory_order_relaxed);
+  return task;
+}
+
+// owner only, thieves keep reading the old array until they see the new one
+static Task_Deque_Array*
+Task_Deque_Grow(Task_Deque* deque,
+                Task_Deque_Array* array,
+                int64_t top,
+                int64_t bottom)
+{
+  Task_Deque_Array* grown = Task_Deque_Array_Create(array->size * 2);
+  if (!grown) {
+    return NULL;
+  }
+  for (int64_t i = top; i < bottom; i++) {
+    slot_store(grown, i, slot_load(array, i));
+  }
+  grown->retired = array;
+  atomic_store_explicit(&deque->array, grown, memory_order_release);
+  return grown;
+}
+
+int32_t
+Task_Deque_Push(Task_Deque* deque, Task task)
+{
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  Task_Deque_Array* array =
+    atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+  if (bottom - top > array->size - 1) {
+    array = Task_Deque_Grow(deque, array, top, bottom);
+    if (!array) {
+      DB_Log(DB_LOG_ERROR, "Failed to grow Task_Deque");
+      return -1;
+    }
+  }
+
+  slot_store(array, bottom, task);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  return 0;
+}
+
+bool
+Task_Deque_Take(Task_Deque* deque, Task* task)
+{
+  int64_t bottom =
+    atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  Task_Deque_Array* array =
+    atomic_load_explicit(&deque->array, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  if (top > bottom) {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return false;
+  }
+
+  *task = slot_load(array, bottom);
+  if (top == bottom) {
+    // the last task, thieves may be after it too
+    bool won = atomic_compare_exchange_strong_explicit(&deque->top,
+                                                       &top,
+                                                       top + 1,
+                                                       memory_order_seq_cst,
+                                                       memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return won;
+  }
+  return true;
+}
+
+TASK_STEAL
+Task_Deque_Steal(Task_Deque* deque, Task* task)
+{
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+  if (top >= bottom) {
+    return TASK_STEAL_EMPTY;
+  }
+
+  Task_Deque_Array* array =
+    atomic_load_explicit(&deque->array, memory_order_acquire);
+  *task = slot_load(array, top);
+  if (!atomic_compare_exchange_strong_explicit(&deque->top,
+                                               &top,
+                                               top + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed)) {
+    return TASK_STEAL_RETRY;
+  }
+  return TASK_STEAL_OK;
+}
+
+bool
+Task_Deque_Empty(Task_Deque* deque)
+{
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  return top >= bottom;
+}
+
+void
+Task_Deque_Destroy(Task_Deque* deque)
+{
+  Task_Deque_Array* array =
+    atomic_load_explicit(&deque->array, memory_order_relaxed);
+  while (array) {
+    Task_Deque_Array* retired = array->retired;
+    free(array);
+    array = retired;
+  }
+  atomic_store_explicit(&deque->array, NULL, memory_order_relaxed);
+}
 
 void
 Task_Queue_Init(Task_Queue* queue)
 {
-  queue->tasks = (Task*)malloc(sizeof(Task) * MAX_QUEUE_SIZE);
-  queue->front = queue->rear = queue->count = 0;
-  queue->size = MAX_QUEUE_SIZE;
+  queue->tasks = NULL;
+  queue->front = queue->count = queue->size = 0;
   pthread_mutex_init(&(queue->mutex), NULL);
-  pthread_cond_init(&(queue->not_empty), NULL);
-  pthread_cond_init(&(queue->not_full), NULL);
 }
 
-void
+int32_t
 Task_Queue_Push(Task_Queue* queue, Task task)
 {
   pthread_mutex_lock(&(queue->mutex));
-  while (queue->count == queue->size) {
-    pthread_cond_wait(&(queue->not_full), &(queue->mutex));
+  if (queue->count == queue->size) {
+    int size = queue->size ? queue->size * 2 : TASK_QUEUE_INITIAL_SIZE;
+    Task* tasks = (Task*)malloc(sizeof(Task) * size);
+    if (!tasks) {
+      pthread_mutex_unlock(&(queue->mutex));
+      DB_Log(DB_LOG_ERROR, "Failed to grow Task_Queue");
+      return -1;
+    }
+    for (int i = 0; i < queue->count; i++) {
+      tasks[i] = queue->tasks[(queue->front + i) % queue->size];
+    }
+    free(queue->tasks);
+    queue->tasks = tasks;
+    queue->front = 0;
+    queue->size = size;
   }
-  queue->tasks[queue->rear] = task;
-  queue->rear = (queue->rear + 1) % queue->size;
+  queue->tasks[(queue->front + queue->count) % queue->size] = task;
   queue->count++;
-  pthread_cond_signal(&(queue->not_empty));
   pthread_mutex_unlock(&(queue->mutex));
+  return 0;
 }
 
-Task
-Task_Queue_Pop(Task_Queue* queue)
+bool
+Task_Queue_Pop(Task_Queue* queue, Task* task)
 {
   pthread_mutex_lock(&(queue->mutex));
-  while (queue->count == 0) {
-    pthread_cond_wait(&(queue->not_empty), &(queue->mutex));
+  if (queue->count == 0) {
+    pthread_mutex_unlock(&(queue->mutex));
+    return false;
   }
-  Task task = queue->tasks[queue->front];
+  *task = queue->tasks[queue->front];
   queue->front = (queue->front + 1) % queue->size;
   queue->count--;
-  pthread_cond_signal(&(queue->not_full));
   pthread_mutex_unlock(&(queue->mutex));
-  return task;
-}
\ No newline at end of file
+  return true;
+}
+
+void
+Task_Queue_Destroy(Task_Queue* queue)
+{
+  free(queue->tasks);
+  queue->tasks = NULL;
+  queue->front = queue->count = queue->size = 0;
+  pthread_mutex_destroy(&(queue->mutex));
+}
@@ -1,39 +1,119 @@
+/**
+ * note (David)
+ * /TASK QUEUES/
+ * every worker of the thread pool owns a Task_Deque (Chase-Lev). the owner
+ * pushes and takes at the bottom without locks, idle workers steal from the
+ * top with a single CAS. tasks submitted from outside the pool (the accept
+ * loop) go to the Task_Queue injector, a plain mutex protected ring that
+ * grows instead of blocking the producer.
+ *
+ * the deque array grows as well, old arrays stay alive until the deque is
+ * destroyed since a thief may still be reading one.
+ */
 #ifndef __TINY_DB_TASK_QUEUE
 #define __TINY_DB_TASK_QUEUE
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
-#define MAX_QUEUE_SIZE 100
+// initial capacity of the injector and of every deque, both grow on demand
+#define TASK_QUEUE_INITIAL_SIZE 64
+
+typedef void (*Task_Function)(void*);
 
 typedef struct
 {
-  void (*function)(void*);
+  Task_Function function;
   void* argument;
 } Task;
 
+typedef struct Task_Slot
+{
+  _Atomic(Task_Function) function;
+  _Atomic(void*) argument;
+} Task_Slot;
+
+typedef struct Task_Deque_Array
+{
+  int64_t size; // power of 2
+  struct Task_Deque_Array* retired; // previous (smaller) array
+  Task_Slot slots[];
+} Task_Deque_Array;
+
+typedef struct
+{
+  atomic_int_fast64_t top;
+  atomic_int_fast64_t bottom;
+  _Atomic(Task_Deque_Array*) array;
+} Task_Deque;
+
+typedef enum TASK_STEAL
+{
+  TASK_STEAL_OK,
+  TASK_STEAL_EMPTY,
+  TASK_STEAL_RETRY // lost the race for the top task to another thread
+} TASK_STEAL;
+
 typedef struct
 {
   Task* tasks;
   int front;
-  int rear;
   int count;
   int size;
   pthread_mutex_t mutex;
-  pthread_cond_t not_empty;
-  pthread_cond_t not_full;
 } Task_Queue;
 
+int32_t
+Task_Deque_Init(Task_Deque* deque);
+
+/**
+ * owner only.
+ * @returns 0 on success, -1 when the deque could not grow
+ */
+int32_t
+Task_Deque_Push(Task_Deque* deque, Task task);
+
+/**
+ * owner only, takes the task pushed last.
+ * @returns false when the deque is empty
+ */
+bool
+Task_Deque_Take(Task_Deque* deque, Task* task);
+
+/**
+ * any thread, takes the oldest task.
+ */
+TASK_STEAL
+Task_Deque_Steal(Task_Deque* deque, Task* task);
+
+bool
+Task_Deque_Empty(Task_Deque* deque);
+
 void
-Task_Queue_Init(Task_Queue* queue);
+Task_Deque_Destroy(Task_Deque* deque);
 
 void
+Task_Queue_Init(Task_Queue* queue);
+
+/**
+ * never blocks, the queue grows instead.
+ * @returns 0 on success, -1 when out of memory
+ */
+int32_t
 Task_Queue_Push(Task_Queue* queue, Task task);
 
-Task
-Task_Queue_Pop(Task_Queue* queue);
+/**
+ * @returns false when the queue is empty
+ */
+bool
+Task_Queue_Pop(Task_Queue* queue, Task* task);
+
+void
+Task_Queue_Destroy(Task_Queue* queue);
 
-#endif // __TINY_DB_TASK_QUEUE
\ No newline at end of file
+#endif // __TINY_DB_TASK_QUEUE
@@ -1,45 +1,187 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "tinydb_command_executor.h"
+#include "tinydb_connection.h"
 #include "tinydb_context.h"
 #include "tinydb_database.h"
 #include "tinydb_log.h"
+#include "tinydb_output.h"
 #include "tinydb_query_parser.h"
 #include "tinydb_tcp_client_handler.h"
 
-#define INITIAL_BUFFER_SIZE COMMAND_BUFFER_SIZE
-#define BUFFER_INCREMENT COMMAND_BUFFER_SIZE
+// how often a client blocked in BLPOP/BRPOP checks it is still connected
+#define BLOCKED_POLL_MS 100
 
 extern RuntimeContext* context;
 
+// open connections, linked through their prev/next
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static Connection* clients = NULL;
+static bool clients_closing = false;
+
+static bool
+Register_Client(Connection* conn)
+{
+  pthread_mutex_lock(&clients_lock);
+  if (clients_closing) {
+    pthread_mutex_unlock(&clients_lock);
+    return false;
+  }
+  conn->prev = NULL;
+  conn->next = clients;
+  if (clients) {
+    clients->prev = conn;
+  }
+  clients = conn;
+  pthread_mutex_unlock(&clients_lock);
+  return true;
+}
+
+static void
+Unregister_Client(Connection* conn)
+{
+  pthread_mutex_lock(&clients_lock);
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    clients = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  pthread_mutex_unlock(&clients_lock);
+}
+
 void
-TCP_Client_Handler(void* socket_desc)
+TCP_Client_Shutdown_All()
 {
-  if (socket_desc == NULL) {
-    DB_Log(DB_LOG_ERROR, "TCP_SERVER socket_desc is NULL");
-    return;
+  pthread_mutex_lock(&clients_lock);
+  clients_closing = true;
+  for (Connection* conn = clients; conn; conn = conn->next) {
+    // recv returns 0, replies still go out
+    shutdown(conn->sock, SHUT_RD);
   }
+  pthread_mutex_unlock(&clients_lock);
+}
 
-  int32_t sock = *(int32_t*)socket_desc;
-  free(socket_desc);
+bool
+TCP_Client_Admit(int32_t sock, const struct sockaddr* addr)
+{
+  return Admission_Admit(context->admission_system, sock, addr);
+}
+
+void
+TCP_Client_Release(int32_t sock)
+{
+  Admission_Release(context->admission_system, sock);
+}
 
-  size_t buffer_size = INITIAL_BUFFER_SIZE;
-  char* buffer = (char*)malloc(buffer_size);
-  if (buffer == NULL) {
-    DB_Log(DB_LOG_ERROR,
-           "TCP_SERVER Failed to allocate initial memory for buffer");
+Connection*
+TCP_Client_Open(int32_t sock)
+{
+  Connection* conn =
+    Create_Connection(sock, context->Active.db, context->Active.user);
+  if (conn == NULL) {
+    TCP_Client_Release(sock);
+    return NULL;
+  }
+  if (Output_Register(context->output_system, conn) != 0) {
+    Destroy_Connection(conn);
+    TCP_Client_Release(sock);
+    return NULL;
+  }
+  if (!Register_Client(conn)) {
+    Output_Unregister(context->output_system, conn);
+    Destroy_Connection(conn);
+    TCP_Client_Release(sock);
+    return NULL;
+  }
+  return conn;
+}
+
+size_t
+TCP_Client_Execute(Connection* conn, char* data, size_t len)
+{
+  // every complete command that arrived is executed and their replies go
+  // out together. large commands (variadic pushes) can span several reads,
+  // the unterminated rest waits for the next one.
+  char* line = data;
+  char* end = data + len;
+  char* eol;
+  while ((eol = memchr(line, '\n', end - line)) != NULL) {
+    *eol = '\0';
+    line[strcspn(line, "\r")] = '\0';
+
+    size_t line_read = eol - line;
+    ParsedCommand* cmd = Parse_Command(line, eol - line + 1, &line_read);
+    line = eol + 1;
+    if (cmd != NULL) {
+      conn->num_commands++;
+      Execute_Command(conn, cmd);
+      Free_Parsed_Command(cmd);
+    } else {
+      const char* error_msg = "Invalid command\n";
+      Output_Write(conn, error_msg, strlen(error_msg));
+    }
+
+    // a blocking pop that waits, the rest is executed once it was answered
+    if (Connection_Is_Blocked(conn)) {
+      break;
+    }
+  }
+  Output_Flush(conn);
+  return line - data;
+}
+
+void
+TCP_Client_Close(Connection* conn)
+{
+  int32_t sock = conn->sock;
+  Blocking_Remove_Client(context->blocking_system, conn);
+  if (conn->subscribed) {
+    // the descriptor is reused by the next connection
+    Unsubscribe_All(context->pubsub_system, conn);
+  }
+  Unregister_Client(conn);
+  Output_Unregister(context->output_system, conn);
+
+  Destroy_Connection(conn);
+  TCP_Client_Release(sock);
+  close(sock);
+}
+
+// the peer closed or reset the connection, what it sent is still unread
+static bool
+Peer_Gone(int32_t sock)
+{
+  struct pollfd pfd = { .fd = sock, .events = POLLRDHUP };
+  return poll(&pfd, 1, 0) > 0 &&
+         (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+}
+
+void
+TCP_Client_Handler(void* socket_desc)
+{
+  int32_t sock = (int32_t)(intptr_t)socket_desc;
+
+  Connection* conn = TCP_Client_Open(sock);
+  if (conn == NULL) {
     close(sock);
     return;
   }
 
   ssize_t read_size;
-  size_t total_read = 0;
 
 #if 0
   struct timeval timeout;
@@ -51,41 +193,49 @@ TCP_Client_Handler(void* socket_desc)
 #endif
 
   while (1) {
-    read_size =
-      recv(sock, buffer + total_read, buffer_size - total_read - 1, 0);
+    read_size = recv(sock,
+                     conn->buffer + conn->total_read,
+                     conn->buffer_size - conn->total_read - 1,
+                     0);
 
     if (read_size <= 0) {
       break;
     }
 
-    total_read += read_size;
-    buffer[total_read] = '\0';
-    buffer[strcspn(buffer, "\r\n")] = '\0';
-
-    ParsedCommand* cmd = Parse_Command(buffer, buffer_size, &total_read);
-    if (cmd != NULL) {
-      Execute_Command(sock, cmd, context->Active.db);
-      Free_Parsed_Command(cmd);
-    } else {
-      const char* error_msg = "Invalid command\n";
-      if (write(sock, error_msg, strlen(error_msg)) == -1) {
-        DB_Log(DB_LOG_ERROR,
-               "TCP_SERVER Failed to send error message, closing"
-               "connection.");
+    conn->bytes_read += read_size;
+    conn->total_read += read_size;
+    conn->buffer[conn->total_read] = '\0';
+
+    bool gone = false;
+    while (1) {
+      size_t consumed =
+        TCP_Client_Execute(conn, conn->buffer, conn->total_read);
+      conn->total_read -= consumed;
+      memmove(conn->buffer, conn->buffer + consumed, conn->total_read);
+      conn->buffer[conn->total_read] = '\0';
+      if (!Connection_Is_Blocked(conn)) {
         break;
       }
-    }
-
-    // if buffer is almost full, increase the size size
-    if (total_read >= buffer_size - 1) {
-      buffer_size += BUFFER_INCREMENT;
-      char* temp = realloc(buffer, buffer_size);
-      if (temp == NULL) {
-        DB_Log(DB_LOG_ERROR,
-               "TCP_SERVER Failed to reallocate memory for buffer");
+      // parked in a blocking pop, the pipelined rest waits for its reply
+      while (!Connection_Wait_Unblocked(conn, BLOCKED_POLL_MS)) {
+        if (Peer_Gone(sock)) {
+          gone = true;
+          break;
+        }
+      }
+      if (gone) {
         break;
       }
-      buffer = temp;
+    }
+    if (gone) {
+      read_size = 0;
+      break;
+    }
+
+    // if buffer is almost full, double its size
+    if (conn->total_read >= conn->buffer_size - 1 &&
+        !Connection_Reserve(conn, conn->buffer_size)) {
+      break;
     }
   }
 
@@ -95,6 +245,5 @@ TCP_Client_Handler(void* socket_desc)
     DB_Log(DB_LOG_ERROR, "TCP_SERVER recv failed: %s", strerror(errno));
   }
 
-  free(buffer);
-  close(sock);
-}
\ No newline at end of file
+  TCP_Client_Close(conn);
+}
@@ -1,7 +1,67 @@
 #ifndef __TINY_DB_TCP_CLIENT_HANDLER
 #define __TINY_DB_TCP_CLIENT_HANDLER
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "tinydb_connection.h"
+
+/**
+ * handles the client on the socket (cast to a pointer) until it disconnects,
+ * runs on a worker of the thread pool. the client was admitted already.
+ */
 void
 TCP_Client_Handler(void* socket_desc);
 
+/**
+ * counts a client that was just accepted against the limits, see /ADMISSION/.
+ * addr is its address from accept, NULL looks it up.
+ * @returns false when it was refused, the socket has to be closed
+ */
+bool
+TCP_Client_Admit(int32_t sock, const struct sockaddr* addr);
+
+/**
+ * releases an admitted client that is closed without TCP_Client_Open.
+ */
+void
+TCP_Client_Release(int32_t sock);
+
+/**
+ * the pieces of a handler, for servers that read the sockets themselves
+ * (see /IO_URING/).
+ *
+ * @returns connection of the admitted client on sock, registered for output
+ * and with TCP_Client_Shutdown_All. NULL when it has to be closed right away
+ * (it is released already)
+ */
+Connection*
+TCP_Client_Open(int32_t sock);
+
+/**
+ * executes the complete commands in the len bytes of data (each one ends with
+ * a newline) and sends their replies.
+ * @returns bytes up to and including the last newline, the rest of data is
+ * not executed
+ */
+size_t
+TCP_Client_Execute(Connection* conn, char* data, size_t len);
+
+/**
+ * drops the subscriptions and blocked pops of the connection, frees it and
+ * closes its socket.
+ */
+void
+TCP_Client_Close(Connection* conn);
+
+/**
+ * ends every connection after the command it is executing, handlers that start
+ * afterwards close their connection right away. used on shutdown so the
+ * thread pool can drain.
+ */
+void
+TCP_Client_Shutdown_All();
+
 #endif // __TINY_DB_TCP_CLIENT_HANDLER
@@ -1,28 +1,224 @@
+#define _GNU_SOURCE
 #include "tinydb_tcp_server.h"
 #include "tinydb_log.h"
+#include "tinydb_tcp_client_handler.h"
 #include "tinydb_thread_pool.h"
 
 #include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
-void
-TCP_Server_Create(TCP_Server* sv)
+// connections accepted from one listener per poll, the others get their turn
+// in between
+#define MAX_ACCEPTS_PER_POLL 64
+
+static int
+Add_Listener(TCP_Server* sv, int fd)
+{
+  if (sv->num_listeners == MAX_LISTENERS) {
+    DB_Log(DB_LOG_ERROR, "TCP_SERVER Too many listening sockets");
+    close(fd);
+    return -1;
+  }
+  sv->listeners[sv->num_listeners++] = fd;
+  return 0;
+}
+
+static void
+Create_Stop_Fd(TCP_Server* sv)
 {
-  sv->fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sv->fd == -1) {
-    DB_Log(DB_LOG_ERROR, "TCP_SERVER Unable to create socket");
+  if (sv->stop_fd > 0) {
     return;
   }
+  sv->stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (sv->stop_fd < 0) {
+    DB_Log(DB_LOG_ERROR, "TCP_SERVER Unable to create eventfd");
+  }
+}
 
-  sv->server.sin_family = AF_INET;
-  sv->server.sin_addr.s_addr = INADDR_ANY;
-  sv->server.sin_port = htons(PORT);
+static int
+Backlog(TCP_Server* sv)
+{
+  return sv->options.backlog > 0 ? sv->options.backlog : CONN_QUEUE_SIZE;
+}
 
-  if (bind(sv->fd, (struct sockaddr*)&sv->server, sizeof(sv->server)) < 0) {
-    DB_Log(DB_LOG_ERROR, "TCP_SERVER Unable to bind");
-    return;
+static void
+Set_Option(int fd, int level, int name, int value, const char* what)
+{
+  if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+    DB_Log(DB_LOG_WARNING,
+           "TCP_SERVER Unable to set %s: %s",
+           what,
+           strerror(errno));
+  }
+}
+
+static void
+Set_Socket_Options(TCP_Server* sv, int fd, int family)
+{
+  const TCP_Server_Options* options = &sv->options;
+
+  // a restarted server binds while connections of the previous one linger
+  Set_Option(fd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+  if (family == AF_INET6) {
+    // "::" and "0.0.0.0" can both be bound
+    Set_Option(fd, IPPROTO_IPV6, IPV6_V6ONLY, 1, "IPV6_V6ONLY");
+  }
+  if (options->reuseport) {
+    Set_Option(fd, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+  }
+  if (options->nodelay) {
+    Set_Option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  }
+  if (options->keepalive > 0) {
+    int interval = options->keepalive / 3 > 0 ? options->keepalive / 3 : 1;
+    Set_Option(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+    Set_Option(
+      fd, IPPROTO_TCP, TCP_KEEPIDLE, options->keepalive, "TCP_KEEPIDLE");
+    Set_Option(fd, IPPROTO_TCP, TCP_KEEPINTVL, interval, "TCP_KEEPINTVL");
+    Set_Option(fd, IPPROTO_TCP, TCP_KEEPCNT, 3, "TCP_KEEPCNT");
+  }
+  // before listen, the window scale of the connections depends on them
+  if (options->rcvbuf > 0) {
+    Set_Option(fd, SOL_SOCKET, SO_RCVBUF, options->rcvbuf, "SO_RCVBUF");
+  }
+  if (options->sndbuf > 0) {
+    Set_Option(fd, SOL_SOCKET, SO_SNDBUF, options->sndbuf, "SO_SNDBUF");
+  }
+}
+
+int
+TCP_Server_Listen(TCP_Server* sv, const char* host, int port)
+{
+  Create_Stop_Fd(sv);
+
+  struct addrinfo hints = { 0 };
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+
+  struct addrinfo* addrs;
+  int err = getaddrinfo(host, service, &hints, &addrs);
+  if (err != 0) {
+    DB_Log(DB_LOG_ERROR,
+           "TCP_SERVER Unable to resolve %s: %s",
+           host,
+           gai_strerror(err));
+    return -1;
   }
 
-  listen(sv->fd, CONN_QUEUE_SIZE);
+  int bound = 0;
+  for (struct addrinfo* ai = addrs; ai; ai = ai->ai_next) {
+    char name[INET6_ADDRSTRLEN] = "?";
+    getnameinfo(
+      ai->ai_addr, ai->ai_addrlen, name, sizeof(name), NULL, 0, NI_NUMERICHOST);
+
+    // non blocking, a connection that is reset between the poll and the
+    // accept must not block the loop
+    int fd = socket(ai->ai_family,
+                    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+    if (fd == -1) {
+      DB_Log(DB_LOG_ERROR, "TCP_SERVER Unable to create socket for %s", name);
+      continue;
+    }
+    Set_Socket_Options(sv, fd, ai->ai_family);
+
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 ||
+        listen(fd, Backlog(sv)) < 0) {
+      DB_Log(DB_LOG_ERROR,
+             "TCP_SERVER Unable to bind %s port %d: %s",
+             name,
+             port,
+             strerror(errno));
+      close(fd);
+      continue;
+    }
+    if (Add_Listener(sv, fd) != 0) {
+      break;
+    }
+    DB_Log(DB_LOG_INFO, " - Listening on %s port %d", name, port);
+    bound++;
+  }
+  freeaddrinfo(addrs);
+  return bound > 0 ? 0 : -1;
+}
+
+// nothing accepts on it anymore
+static bool
+Unix_Socket_Is_Stale(const struct sockaddr_un* addr)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return false;
+  }
+  bool stale = connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) < 0 &&
+               (errno == ECONNREFUSED || errno == ENOENT);
+  close(fd);
+  return stale;
+}
+
+int
+TCP_Server_Listen_Unix(TCP_Server* sv, const char* path, mode_t perm)
+{
+  Create_Stop_Fd(sv);
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    DB_Log(DB_LOG_ERROR, "TCP_SERVER Unix socket path %s is too long", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    DB_Log(DB_LOG_ERROR, "TCP_SERVER Unable to create unix socket");
+    return -1;
+  }
+
+  // a socket left behind by a previous run is removed, one a server still
+  // accepts on is not
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    if (!Unix_Socket_Is_Stale(&addr)) {
+      DB_Log(DB_LOG_ERROR,
+             "TCP_SERVER Unix socket %s is in use by another server",
+             path);
+      close(fd);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  // nobody but us may connect before the chmod, the umask is only changed
+  // while the server starts up
+  mode_t umask_before = umask(0177);
+  int bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+  umask(umask_before);
+
+  if (bound < 0 || chmod(path, perm) < 0 || listen(fd, Backlog(sv)) < 0) {
+    DB_Log(DB_LOG_ERROR,
+           "TCP_SERVER Unable to listen on %s: %s",
+           path,
+           strerror(errno));
+    if (bound == 0) {
+      unlink(path);
+    }
+    close(fd);
+    return -1;
+  }
+
+  if (Add_Listener(sv, fd) != 0) {
+    unlink(path);
+    return -1;
+  }
+  strcpy(sv->unix_path, path);
+  return 0;
 }
 
 void
@@ -32,24 +228,83 @@ TCP_Server_Process_Connections(TCP_Server* sv,
 {
   DB_Log(DB_LOG_INFO, "TCP_SERVER Waiting for incoming connections");
 
-  while ((c->sock = accept(sv->fd, (struct sockaddr*)&c->client, &c->len))) {
-    if (c->sock < 0) {
-      DB_Log(DB_LOG_ERROR, "TCP_SERVER Accept failed: %s", strerror(errno));
-      continue;
+  // the listening sockets and the stop_fd last
+  struct pollfd fds[MAX_LISTENERS + 1];
+  int num_fds = sv->num_listeners + 1;
+  for (int i = 0; i < num_fds; i++) {
+    fds[i].fd = i < sv->num_listeners ? sv->listeners[i] : sv->stop_fd;
+    fds[i].events = POLLIN;
+  }
+
+  while (1) {
+    if (poll(fds, num_fds, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DB_Log(DB_LOG_ERROR, "TCP_SERVER poll failed: %s", strerror(errno));
+      return;
+    }
+    if (atomic_load(&sv->stopping)) {
+      return;
     }
 
-    DB_Log(DB_LOG_INFO, "TCP_SERVER Connection accepted: socket %d", c->sock);
+    for (int i = 0; i < num_fds - 1; i++) {
+      if (!fds[i].revents) {
+        continue;
+      }
 
-    pthread_t sniffer_thread;
-    c->new_sock = (int*)malloc(sizeof(int));
-    if (c->new_sock == NULL) {
-      DB_Log(DB_LOG_ERROR, "TCP_SERVER Failed to allocate memory for new_sock");
-      close(c->sock);
-      continue;
+      // everything that queued up since the last poll, a storm of new
+      // connections is taken in batches instead of one poll each
+      for (int n = 0; n < MAX_ACCEPTS_PER_POLL; n++) {
+        c->len = sizeof(c->client);
+        c->sock = accept4(
+          fds[i].fd, (struct sockaddr*)&c->client, &c->len, SOCK_CLOEXEC);
+        if (c->sock < 0) {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            DB_Log(
+              DB_LOG_ERROR, "TCP_SERVER Accept failed: %s", strerror(errno));
+          }
+          break;
+        }
+
+        // over the limits it is refused right here, see /ADMISSION/
+        if (!TCP_Client_Admit(c->sock, (struct sockaddr*)&c->client)) {
+          close(c->sock);
+          continue;
+        }
+        DB_Log(
+          DB_LOG_INFO, "TCP_SERVER Connection accepted: socket %d", c->sock);
+
+        if (Thread_Pool_Add_Task(function, (void*)(intptr_t)c->sock) != 0) {
+          DB_Log(DB_LOG_ERROR, "TCP_SERVER Failed to queue the client handler");
+          TCP_Client_Release(c->sock);
+          close(c->sock);
+        }
+      }
     }
-    *c->new_sock = c->sock;
+  }
+}
 
-    Thread_Pool_Add_Task(function, (void*)c->new_sock);
-    DB_Log(DB_LOG_INFO, "TCP_SERVER Client handler was added to task queue");
+void
+TCP_Server_Stop(TCP_Server* sv)
+{
+  atomic_store(&sv->stopping, true);
+  // wakes up the poll
+  uint64_t one = 1;
+  if (write(sv->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+    DB_Log(DB_LOG_ERROR, "TCP_SERVER Unable to stop accepting connections");
   }
-}
\ No newline at end of file
+}
+
+void
+TCP_Server_Close(TCP_Server* sv)
+{
+  for (int i = 0; i < sv->num_listeners; i++) {
+    close(sv->listeners[i]);
+  }
+  sv->num_listeners = 0;
+  if (sv->unix_path[0]) {
+    unlink(sv->unix_path);
+    sv->unix_path[0] = '\0';
+  }
+}
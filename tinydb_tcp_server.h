@@ -3,7 +3,10 @@
 
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -12,19 +15,47 @@
 
 typedef struct TCP_Client
 {
-  int       sock, *new_sock;
-  struct    sockaddr_in client;
+  int       sock;
+  struct    sockaddr_storage client;
   socklen_t len;
 } TCP_Client;
 
+// listening sockets a server can have
+#define MAX_LISTENERS 8
+
+// set on the listening sockets, the accepted connections inherit them
+typedef struct TCP_Server_Options
+{
+  int       backlog;        // connections the kernel queues until accepted
+  int       nodelay;        // TCP_NODELAY, replies are not held back
+  int       reuseport;      // SO_REUSEPORT, servers can share the port
+  int       keepalive;      // idle seconds before keepalive probes, 0 off
+  int       rcvbuf, sndbuf; // SO_RCVBUF/SO_SNDBUF in bytes, 0 kernel default
+} TCP_Server_Options;
+
 typedef struct TCP_Server
 {
-  int       fd, *sock;
-  struct    sockaddr_in server;
+  int       listeners[MAX_LISTENERS], num_listeners;
+  int       stop_fd; // eventfd, written by TCP_Server_Stop
+  TCP_Server_Options options;
+  char      unix_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+  atomic_bool stopping;
 } TCP_Server;
 
-void TCP_Server_Create(TCP_Server *sv);
+// listens on every address host (a name, IPv4 or IPv6 address) resolves to,
+// returns -1 when none of them could be bound
+int TCP_Server_Listen(TCP_Server *sv, const char *host, int port);
+
+// adds a unix socket at path (created with the permissions perm) that is served
+// like the TCP port, returns -1 when it cannot listen there
+int TCP_Server_Listen_Unix(TCP_Server *sv, const char *path, mode_t perm);
 
 void TCP_Server_Process_Connections(TCP_Server *sv, TCP_Client *c, void (*function)(void*));
 
+// makes TCP_Server_Process_Connections return, safe to call from any thread
+void TCP_Server_Stop(TCP_Server *sv);
+
+// closes the listening sockets and removes the unix socket
+void TCP_Server_Close(TCP_Server *sv);
+
 #endif // __TINY_DB_TCP_SERVER
@@ -1,40 +1,310 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/syscall.h>
+
+#include "tinydb_log.h"
 #include "tinydb_thread_pool.h"
 
+// MPOL_PREFERRED of <numaif.h>, the syscall is used directly to not depend on
+// libnuma
+#define THREAD_POOL_MPOL_PREFERRED 1
+
 Thread_Pool thread_pool;
 
+// index of the worker running on this thread, -1 outside the pool
+static _Thread_local int32_t current_worker = -1;
+
+static bool
+find_task(int32_t self, uint32_t* seed, Task* task)
+{
+  if (Task_Deque_Take(&thread_pool.deques[self], task) ||
+      Task_Queue_Pop(&thread_pool.injector, task)) {
+    return true;
+  }
+
+  // xorshift, only spreads the thieves over the victims
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+
+  int32_t num_threads = thread_pool.num_threads;
+  bool retry;
+  do {
+    retry = false;
+    for (int32_t i = 0; i < num_threads; i++) {
+      int32_t victim = (int32_t)((*seed + i) % num_threads);
+      if (victim == self) {
+        continue;
+      }
+      TASK_STEAL res = Task_Deque_Steal(&thread_pool.deques[victim], task);
+      if (res == TASK_STEAL_OK) {
+        return true;
+      }
+      retry |= res == TASK_STEAL_RETRY;
+    }
+  } while (retry);
+  return false;
+}
+
 void*
 Thread_Function(void* arg)
 {
-  while (!thread_pool.stop) {
-    Task task = Task_Queue_Pop(&thread_pool.task_queue);
-    (task.function)(task.argument);
+  int32_t self = (int32_t)(intptr_t)arg;
+  uint32_t seed = (uint32_t)self * 2654435761u + 1;
+  current_worker = self;
+
+  // stop only ends the loop once there is nothing left to run
+  for (;;) {
+    Task task;
+    if (find_task(self, &seed, &task)) {
+      atomic_fetch_sub(&thread_pool.pending, 1);
+      (task.function)(task.argument);
+      continue;
+    }
+    if (atomic_load(&thread_pool.stop)) {
+      break;
+    }
+
+    // a submitter either sees us in sleepers or we see its task in pending
+    pthread_mutex_lock(&thread_pool.park_lock);
+    atomic_fetch_add(&thread_pool.sleepers, 1);
+    if (atomic_load(&thread_pool.pending) <= 0 &&
+        !atomic_load(&thread_pool.stop)) {
+      pthread_cond_wait(&thread_pool.wakeup, &thread_pool.park_lock);
+    }
+    atomic_fetch_sub(&thread_pool.sleepers, 1);
+    pthread_mutex_unlock(&thread_pool.park_lock);
   }
   return NULL;
 }
 
-void
-Thread_Pool_Init()
+int32_t
+Thread_Pool_Parse_Cpus(const char* list, int32_t** cpus)
+{
+  int32_t count = 0;
+  int32_t capacity = 0;
+  *cpus = NULL;
+
+  const char* ptr = list;
+  while (*ptr && *ptr != '\n') {
+    char* end;
+    long first = strtol(ptr, &end, 10);
+    long last = first;
+    if (end == ptr || first < 0) {
+      goto malformed;
+    }
+    if (*end == '-') {
+      ptr = end + 1;
+      last = strtol(ptr, &end, 10);
+      if (end == ptr || last < first) {
+        goto malformed;
+      }
+    }
+
+    for (long cpu = first; cpu <= last; cpu++) {
+      if (count == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        int32_t* temp = realloc(*cpus, sizeof(int32_t) * capacity);
+        if (!temp) {
+          goto malformed;
+        }
+        *cpus = temp;
+      }
+      (*cpus)[count++] = (int32_t)cpu;
+    }
+
+    ptr = end;
+    if (*ptr == ',') {
+      ptr++;
+    } else if (*ptr && *ptr != '\n') {
+      goto malformed;
+    }
+  }
+  return count;
+
+malformed:
+  free(*cpus);
+  *cpus = NULL;
+  return -1;
+}
+
+// cpus of a NUMA node as the kernel lists them
+static int32_t
+node_cpus(int32_t node, int32_t** cpus)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    DB_Log(DB_LOG_ERROR, "NUMA node %d does not exist", node);
+    return -1;
+  }
+
+  char list[1024];
+  int32_t res = -1;
+  if (fgets(list, sizeof(list), file)) {
+    res = Thread_Pool_Parse_Cpus(list, cpus);
+  }
+  fclose(file);
+  return res;
+}
+
+// memory of this thread and the threads it creates prefers the node
+static void
+prefer_node(int32_t node)
 {
-  thread_pool.stop = false;
-  Task_Queue_Init(&thread_pool.task_queue);
-  for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-    pthread_create(&thread_pool.threads[i], NULL, Thread_Function, NULL);
+#ifdef SYS_set_mempolicy
+  unsigned long mask[16] = { 0 };
+  int32_t bits = (int32_t)(sizeof(unsigned long) * 8);
+  if (node >= (int32_t)(sizeof(mask) * 8)) {
+    return;
+  }
+  mask[node / bits] = 1UL << (node % bits);
+  if (syscall(SYS_set_mempolicy,
+              THREAD_POOL_MPOL_PREFERRED,
+              mask,
+              sizeof(mask) * 8) != 0) {
+    DB_Log(DB_LOG_WARNING,
+           "Unable to place memory on NUMA node %d: %s",
+           node,
+           strerror(errno));
   }
+#endif
 }
 
-void
+int32_t
+Thread_Pool_Init(const Thread_Pool_Config* config)
+{
+  Thread_Pool_Config defaults = { DEFAULT_THREAD_POOL_SIZE, NULL, 0, -1 };
+  if (!config) {
+    config = &defaults;
+  }
+
+  thread_pool.num_threads = config->num_threads;
+  thread_pool.num_cpus = config->num_cpus;
+  thread_pool.cpus = NULL;
+  if (config->num_cpus > 0) {
+    thread_pool.cpus = malloc(sizeof(int32_t) * config->num_cpus);
+    if (thread_pool.cpus) {
+      memcpy(
+        thread_pool.cpus, config->cpus, sizeof(int32_t) * config->num_cpus);
+    }
+  } else if (config->numa_node >= 0) {
+    thread_pool.num_cpus = node_cpus(config->numa_node, &thread_pool.cpus);
+    if (thread_pool.num_cpus < 0) {
+      return -1;
+    }
+  }
+  if (config->numa_node >= 0) {
+    prefer_node(config->numa_node);
+  }
+
+  thread_pool.threads = calloc(thread_pool.num_threads, sizeof(pthread_t));
+  thread_pool.deques = calloc(thread_pool.num_threads, sizeof(Task_Deque));
+  if (thread_pool.num_threads <= 0 || !thread_pool.threads ||
+      !thread_pool.deques || (thread_pool.num_cpus > 0 && !thread_pool.cpus)) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for Thread_Pool");
+    return -1;
+  }
+
+  atomic_init(&thread_pool.stop, false);
+  atomic_init(&thread_pool.pending, 0);
+  atomic_init(&thread_pool.sleepers, 0);
+  pthread_mutex_init(&thread_pool.park_lock, NULL);
+  pthread_cond_init(&thread_pool.wakeup, NULL);
+  Task_Queue_Init(&thread_pool.injector);
+  for (int i = 0; i < thread_pool.num_threads; i++) {
+    if (Task_Deque_Init(&thread_pool.deques[i]) != 0) {
+      return -1;
+    }
+  }
+
+  for (int i = 0; i < thread_pool.num_threads; i++) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (thread_pool.num_cpus > 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(thread_pool.cpus[i % thread_pool.num_cpus], &set);
+      pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+
+    int rc = pthread_create(
+      &thread_pool.threads[i], &attr, Thread_Function, (void*)(intptr_t)i);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+      // the cpu may not exist or not be ours to use
+      DB_Log(DB_LOG_ERROR, "Failed to start worker %d: %s", i, strerror(rc));
+      thread_pool.num_threads = i;
+      Thread_Pool_Destroy();
+      return -1;
+    }
+  }
+
+  if (thread_pool.num_cpus > 0) {
+    DB_Log(DB_LOG_INFO,
+           "Thread Pool pinned %d workers to %d cpus",
+           thread_pool.num_threads,
+           thread_pool.num_cpus);
+  }
+  return 0;
+}
+
+int32_t
+Thread_Pool_Current_Worker()
+{
+  return current_worker;
+}
+
+int32_t
+Thread_Pool_Size()
+{
+  return thread_pool.num_threads;
+}
+
+int32_t
 Thread_Pool_Add_Task(void (*function)(void*), void* argument)
 {
   Task task = { function, argument };
-  Task_Queue_Push(&thread_pool.task_queue, task);
+  int32_t res = current_worker >= 0
+                  ? Task_Deque_Push(&thread_pool.deques[current_worker], task)
+                  : Task_Queue_Push(&thread_pool.injector, task);
+  if (res != 0) {
+    return -1;
+  }
+
+  atomic_fetch_add(&thread_pool.pending, 1);
+  if (atomic_load(&thread_pool.sleepers) > 0) {
+    pthread_mutex_lock(&thread_pool.park_lock);
+    pthread_cond_signal(&thread_pool.wakeup);
+    pthread_mutex_unlock(&thread_pool.park_lock);
+  }
+  return 0;
 }
 
 void
 Thread_Pool_Destroy()
 {
-  thread_pool.stop = true;
-  for (int i = 0; i < THREAD_POOL_SIZE; i++) {
+  pthread_mutex_lock(&thread_pool.park_lock);
+  atomic_store(&thread_pool.stop, true);
+  pthread_cond_broadcast(&thread_pool.wakeup);
+  pthread_mutex_unlock(&thread_pool.park_lock);
+
+  for (int i = 0; i < thread_pool.num_threads; i++) {
     pthread_join(thread_pool.threads[i], NULL);
   }
-  free(thread_pool.task_queue.tasks);
-}
\ No newline at end of file
+  for (int i = 0; i < thread_pool.num_threads; i++) {
+    Task_Deque_Destroy(&thread_pool.deques[i]);
+  }
+  Task_Queue_Destroy(&thread_pool.injector);
+  pthread_cond_destroy(&thread_pool.wakeup);
+  pthread_mutex_destroy(&thread_pool.park_lock);
+  free(thread_pool.threads);
+  free(thread_pool.deques);
+  free(thread_pool.cpus);
+  thread_pool.threads = NULL;
+  thread_pool.deques = NULL;
+  thread_pool.cpus = NULL;
+}
@@ -1,33 +1,96 @@
+/**
+ * note (David)
+ * /THREAD POOL/
+ * a task submitted by a worker (pubsub deliveries, webhooks) lands on that
+ * worker's own deque, everything else on the injector. a worker looks for
+ * work in its deque, then the injector, then steals from the other workers
+ * starting at a random one. submitting never blocks.
+ *
+ * a worker that finds nothing parks on a condition variable, pending counts
+ * the queued tasks so it never parks while one is still waiting.
+ *
+ * /PLACEMENT/
+ * workers can be pinned to a list of cpus (round robin) and the pool can be
+ * kept on one NUMA node: the workers run on the cpus of the node and memory
+ * allocated from then on (the databases and everything the workers allocate)
+ * prefers the node. Thread_Pool_Init runs before the context is created for
+ * that reason.
+ */
 #ifndef __TINY_DB_THREAD_POOL
 #define __TINY_DB_THREAD_POOL
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "config.h"
 #include "tinydb_task_queue.h"
 
-#define THREAD_POOL_SIZE 10
+typedef struct Thread_Pool_Config
+{
+  int32_t num_threads;
+  int32_t* cpus; // workers are pinned to these round robin, NULL: not pinned
+  int32_t num_cpus;
+  int32_t numa_node; // -1: any node
+} Thread_Pool_Config;
 
 typedef struct
 {
-  pthread_t threads[THREAD_POOL_SIZE];
-  Task_Queue task_queue;
-  bool stop;
+  int32_t num_threads;
+  pthread_t* threads;
+  Task_Deque* deques;
+  int32_t* cpus;
+  int32_t num_cpus;
+  Task_Queue injector;
+
+  atomic_int pending;  // tasks in the injector and the deques
+  atomic_int sleepers; // workers parked (or about to) on wakeup
+  pthread_mutex_t park_lock;
+  pthread_cond_t wakeup;
+  atomic_bool stop;
 } Thread_Pool;
 
 void*
 Thread_Function(void* arg);
 
-void
-Thread_Pool_Init();
+/**
+ * config NULL starts DEFAULT_THREAD_POOL_SIZE workers anywhere.
+ * @returns 0 on success, -1 when the pool could not be started
+ */
+int32_t
+Thread_Pool_Init(const Thread_Pool_Config* config);
 
-void
+/**
+ * parses a cpu list like "0-3,8,10-11".
+ * @returns number of cpus written to cpus (malloc'd), -1 on a malformed list
+ */
+int32_t
+Thread_Pool_Parse_Cpus(const char* list, int32_t** cpus);
+
+/**
+ * @returns index of the worker running the caller, -1 outside the pool
+ */
+int32_t
+Thread_Pool_Current_Worker();
+
+int32_t
+Thread_Pool_Size();
+
+/**
+ * @returns 0 on success, -1 when the task could not be queued (out of memory)
+ */
+int32_t
 Thread_Pool_Add_Task(void (*function)(void*), void* argument);
 
+/**
+ * lets the workers finish the running and the queued tasks (including the ones
+ * those submit) and joins them. tasks that never return, client handlers,
+ * have to be ended by the caller first.
+ */
 void
 Thread_Pool_Destroy();
 
-#endif // __TINY_DB_THREAD_POOL
\ No newline at end of file
+#endif // __TINY_DB_THREAD_POOL
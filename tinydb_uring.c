@@ -0,0 +1,707 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "tinydb_blocking.h"
+#include "tinydb_context.h"
+#include "tinydb_log.h"
+#include "tinydb_tcp_client_handler.h"
+#include "tinydb_thread_pool.h"
+#include "tinydb_uring.h"
+
+// what a completion is for, kept in the low bits of its user_data next to
+// the client (allocations are aligned to at least 8 bytes) or the index of
+// the listening socket
+#define URING_ACCEPT 1
+#define URING_RECV 2
+#define URING_WAKEUP 3
+#define URING_CANCEL 4
+#define URING_STOP 5
+#define URING_OP_MASK 7
+#define URING_OP_BITS 3
+
+// group id of the receive buffers
+#define URING_BUFFER_GROUP 0
+
+extern RuntimeContext* context;
+
+static int32_t
+uring_setup(uint32_t entries, struct io_uring_params* params)
+{
+  return (int32_t)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int32_t
+uring_enter(int32_t fd, uint32_t to_submit, uint32_t min_complete)
+{
+  return (int32_t)syscall(__NR_io_uring_enter,
+                          fd,
+                          to_submit,
+                          min_complete,
+                          min_complete > 0 ? IORING_ENTER_GETEVENTS : 0,
+                          NULL,
+                          0);
+}
+
+static int32_t
+uring_register(int32_t fd, uint32_t opcode, void* arg, uint32_t nr_args)
+{
+  return (int32_t)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// submits the queued entries, waits for a completion when wait is set
+static int32_t
+submit(URingServer* server, bool wait)
+{
+  uint32_t to_submit = server->sq_local_tail - *server->sq_tail;
+  __atomic_store_n(server->sq_tail, server->sq_local_tail, __ATOMIC_RELEASE);
+
+  int32_t ret = uring_enter(server->ring_fd, to_submit, wait ? 1 : 0);
+  // EBUSY: the completions have to be taken first
+  if (ret < 0 && errno != EINTR && errno != EBUSY) {
+    DB_Log(DB_LOG_ERROR, "IO_URING io_uring_enter failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static struct io_uring_sqe*
+get_sqe(URingServer* server)
+{
+  uint32_t head = __atomic_load_n(server->sq_head, __ATOMIC_ACQUIRE);
+  if (server->sq_local_tail - head >= server->sq_entries) {
+    if (submit(server, false) != 0) {
+      return NULL;
+    }
+    head = __atomic_load_n(server->sq_head, __ATOMIC_ACQUIRE);
+    if (server->sq_local_tail - head >= server->sq_entries) {
+      DB_Log(DB_LOG_ERROR, "IO_URING submission queue is full");
+      return NULL;
+    }
+  }
+
+  uint32_t index = server->sq_local_tail & server->sq_mask;
+  struct io_uring_sqe* sqe = &server->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  server->sq_array[index] = index;
+  server->sq_local_tail++;
+  return sqe;
+}
+
+static bool
+prep_accept(URingServer* server, int32_t listener)
+{
+  struct io_uring_sqe* sqe = get_sqe(server);
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = server->listen_fds[listener];
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = ((uint64_t)listener << URING_OP_BITS) | URING_ACCEPT;
+  return true;
+}
+
+static bool
+prep_recv(URingServer* server, URingClient* client)
+{
+  struct io_uring_sqe* sqe = get_sqe(server);
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = client->conn->sock;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = (uint64_t)(uintptr_t)client | URING_RECV;
+  return true;
+}
+
+static bool
+prep_wakeup(URingServer* server)
+{
+  struct io_uring_sqe* sqe = get_sqe(server);
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = server->wakeup_fd;
+  sqe->addr = (uint64_t)(uintptr_t)&server->wakeup_value;
+  sqe->len = sizeof(server->wakeup_value);
+  sqe->user_data = URING_WAKEUP;
+  return true;
+}
+
+static bool
+prep_stop(URingServer* server)
+{
+  struct io_uring_sqe* sqe = get_sqe(server);
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = server->stop_fd;
+  sqe->addr = (uint64_t)(uintptr_t)&server->stop_value;
+  sqe->len = sizeof(server->stop_value);
+  sqe->user_data = URING_STOP;
+  return true;
+}
+
+// cancels the request with user_data
+static bool
+prep_cancel(URingServer* server, uint64_t user_data)
+{
+  struct io_uring_sqe* sqe = get_sqe(server);
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = user_data;
+  sqe->user_data = URING_CANCEL;
+  return true;
+}
+
+// gives a receive buffer back to the kernel
+static void
+recycle_buffer(URingServer* server, uint16_t bid)
+{
+  struct io_uring_buf* buf =
+    &server->buf_ring->bufs[server->buf_tail & (URING_RECV_BUFFERS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(server->buffers +
+                                    (size_t)bid * URING_RECV_BUFFER_SIZE);
+  buf->len = URING_RECV_BUFFER_SIZE;
+  buf->bid = bid;
+  server->buf_tail++;
+  __atomic_store_n(&server->buf_ring->tail, server->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void
+close_client(URingServer* server, URingClient* client)
+{
+  TCP_Client_Close(client->conn);
+  pthread_mutex_destroy(&client->lock);
+  pthread_cond_destroy(&client->detached);
+  free(client->batch);
+  free(client);
+  server->num_clients--;
+}
+
+static void
+wake_up(URingServer* server)
+{
+  uint64_t one = 1;
+  if (write(server->wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+    DB_Log(DB_LOG_ERROR, "IO_URING Unable to wake up the ring thread");
+  }
+}
+
+// runs on a worker of the thread pool, until no complete command is left
+static void
+URing_Execute(void* arg)
+{
+  URingClient* client = (URingClient*)arg;
+  Connection* conn = client->conn;
+
+  while (1) {
+    pthread_mutex_lock(&client->lock);
+    size_t len = conn->total_read;
+    while (len > 0 && conn->buffer[len - 1] != '\n') {
+      len--;
+    }
+
+    if (len > client->batch_size) {
+      char* batch = (char*)realloc(client->batch, len);
+      if (!batch) {
+        DB_Log(DB_LOG_ERROR, "IO_URING Failed to allocate memory for commands");
+        conn->total_read = 0;
+        shutdown(conn->sock, SHUT_RDWR);
+        len = 0;
+      } else {
+        client->batch = batch;
+        client->batch_size = len;
+      }
+    }
+
+    if (len == 0) {
+      client->executing = false;
+      bool closed = client->recv_done;
+      pthread_mutex_unlock(&client->lock);
+      if (closed) {
+        // the ring thread closes it
+        URingServer* server = client->server;
+        pthread_mutex_lock(&server->lists_lock);
+        client->next_closed = server->closed;
+        server->closed = client;
+        pthread_mutex_unlock(&server->lists_lock);
+        wake_up(server);
+      }
+      return;
+    }
+
+    memcpy(client->batch, conn->buffer, len);
+    conn->total_read -= len;
+    memmove(conn->buffer, conn->buffer + len, conn->total_read);
+    conn->buffer[conn->total_read] = '\0';
+    pthread_mutex_unlock(&client->lock);
+
+    size_t consumed = TCP_Client_Execute(conn, client->batch, len);
+    if (consumed == len) {
+      continue;
+    }
+
+    // a blocking pop waits, what follows it goes back in front of what
+    // arrived meanwhile
+    size_t rest = len - consumed;
+    pthread_mutex_lock(&client->lock);
+    if (Connection_Reserve(conn, rest)) {
+      memmove(conn->buffer + rest, conn->buffer, conn->total_read);
+      memcpy(conn->buffer, client->batch + consumed, rest);
+      conn->total_read += rest;
+      conn->buffer[conn->total_read] = '\0';
+    }
+    if (client->recv_done) {
+      // nobody is left to wait for the reply
+      pthread_mutex_unlock(&client->lock);
+      Blocking_Remove_Client(context->blocking_system, conn);
+      continue;
+    }
+    // the worker is released, URing_Resume queues the task again. executing
+    // stays set so no other task starts meanwhile
+    client->parked = true;
+    if (!Connection_Is_Blocked(conn)) {
+      client->parked = false;
+      pthread_mutex_unlock(&client->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&client->lock);
+    return;
+  }
+}
+
+// conn was unblocked, the task of a parked client carries on
+static void
+URing_Resume(Connection* conn)
+{
+  URingClient* client = (URingClient*)conn->io;
+
+  pthread_mutex_lock(&client->lock);
+  bool parked = client->parked;
+  client->parked = false;
+  pthread_mutex_unlock(&client->lock);
+
+  if (parked && Thread_Pool_Add_Task(URing_Execute, client) != 0) {
+    DB_Log(DB_LOG_ERROR, "IO_URING Failed to queue the commands of a client");
+    pthread_mutex_lock(&client->lock);
+    client->executing = false;
+    pthread_mutex_unlock(&client->lock);
+  }
+}
+
+// runs on the worker executing the command, returns once the ring thread
+// stopped reading the socket
+static void
+URing_Detach(Connection* conn)
+{
+  URingClient* client = (URingClient*)conn->io;
+  URingServer* server = client->server;
+
+  pthread_mutex_lock(&client->lock);
+  if (client->recv_done) {
+    pthread_mutex_unlock(&client->lock);
+    return;
+  }
+  client->detaching = true;
+  pthread_mutex_unlock(&client->lock);
+
+  pthread_mutex_lock(&server->lists_lock);
+  client->next_detaching = server->detaching;
+  server->detaching = client;
+  pthread_mutex_unlock(&server->lists_lock);
+  wake_up(server);
+
+  pthread_mutex_lock(&client->lock);
+  while (!client->recv_done) {
+    pthread_cond_wait(&client->detached, &client->lock);
+  }
+  pthread_mutex_unlock(&client->lock);
+}
+
+static void
+open_client(URingServer* server, int32_t sock)
+{
+  DB_Log(DB_LOG_INFO, "TCP_SERVER Connection accepted: socket %d", sock);
+  if (!TCP_Client_Admit(sock, NULL)) {
+    close(sock);
+    return;
+  }
+
+  URingClient* client = (URingClient*)calloc(1, sizeof(URingClient));
+  if (!client) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for URingClient");
+    TCP_Client_Release(sock);
+    close(sock);
+    return;
+  }
+  client->conn = TCP_Client_Open(sock);
+  if (!client->conn) {
+    free(client);
+    close(sock);
+    return;
+  }
+  pthread_mutex_init(&client->lock, NULL);
+  pthread_cond_init(&client->detached, NULL);
+  client->server = server;
+  client->conn->detach = URing_Detach;
+  client->conn->resume = URing_Resume;
+  client->conn->io = client;
+  server->num_clients++;
+
+  if (!prep_recv(server, client)) {
+    close_client(server, client);
+  }
+}
+
+// the multishot recv of the client ended for good
+static void
+recv_ended(URingServer* server, URingClient* client)
+{
+  pthread_mutex_lock(&client->lock);
+  client->recv_done = true;
+  bool idle = !client->executing;
+  bool parked = client->parked;
+  if (client->detaching) {
+    pthread_cond_signal(&client->detached);
+  }
+  pthread_mutex_unlock(&client->lock);
+
+  // otherwise its task hands it back, a parked one once it is resumed
+  if (idle) {
+    close_client(server, client);
+  } else if (parked) {
+    Blocking_Remove_Client(context->blocking_system, client->conn);
+  }
+}
+
+static void
+handle_recv(URingServer* server,
+            URingClient* client,
+            int32_t res,
+            uint32_t flags)
+{
+  bool more = (flags & IORING_CQE_F_MORE) != 0;
+
+  if (res == -ENOBUFS) {
+    // every buffer was taken, they are back by now
+    if (!more && !prep_recv(server, client)) {
+      recv_ended(server, client);
+    }
+    return;
+  }
+
+  if (res <= 0) {
+    if (res == -ECANCELED) {
+      // detached, the command that took over the socket closes it
+    } else if (res == 0) {
+      DB_Log(DB_LOG_WARNING, "TCP_SERVER Client disconnected.");
+    } else {
+      DB_Log(DB_LOG_ERROR, "TCP_SERVER recv failed: %s", strerror(-res));
+    }
+    if (!more) {
+      recv_ended(server, client);
+    }
+    return;
+  }
+
+  uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+  const char* data = server->buffers + (size_t)bid * URING_RECV_BUFFER_SIZE;
+  Connection* conn = client->conn;
+
+  pthread_mutex_lock(&client->lock);
+  bool start = false;
+  if (Connection_Reserve(conn, res)) {
+    memcpy(conn->buffer + conn->total_read, data, res);
+    conn->total_read += res;
+    conn->bytes_read += res;
+    conn->buffer[conn->total_read] = '\0';
+    start = !client->executing && memchr(data, '\n', res) != NULL;
+    client->executing = client->executing || start;
+  } else {
+    // the recv ends with an error
+    shutdown(conn->sock, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&client->lock);
+  recycle_buffer(server, bid);
+
+  if (start && Thread_Pool_Add_Task(URing_Execute, client) != 0) {
+    DB_Log(DB_LOG_ERROR, "IO_URING Failed to queue the commands of a client");
+    pthread_mutex_lock(&client->lock);
+    client->executing = false;
+    pthread_mutex_unlock(&client->lock);
+  }
+
+  if (!more && !prep_recv(server, client)) {
+    recv_ended(server, client);
+  }
+}
+
+// cancels the recvs of detaching clients and closes the clients handed back
+// by their last task. a client handed back has detached before, so its
+// cancel is submitted ahead of the recv of a client reusing its memory
+static void
+handle_wakeup(URingServer* server)
+{
+  pthread_mutex_lock(&server->lists_lock);
+  URingClient* detaching = server->detaching;
+  URingClient* client = server->closed;
+  server->detaching = NULL;
+  server->closed = NULL;
+  pthread_mutex_unlock(&server->lists_lock);
+
+  for (; detaching; detaching = detaching->next_detaching) {
+    prep_cancel(server, (uint64_t)(uintptr_t)detaching | URING_RECV);
+  }
+  while (client) {
+    URingClient* next = client->next_closed;
+    close_client(server, client);
+    client = next;
+  }
+}
+
+// stops accepting, the clients close after the command they are executing
+static void
+handle_stop(URingServer* server)
+{
+  server->stopping = true;
+  for (int32_t i = 0; i < server->num_listen_fds; i++) {
+    prep_cancel(server, ((uint64_t)i << URING_OP_BITS) | URING_ACCEPT);
+  }
+  TCP_Client_Shutdown_All();
+}
+
+void
+URing_Server_Run(URingServer* server)
+{
+  DB_Log(DB_LOG_INFO, "TCP_SERVER Waiting for incoming connections (io_uring)");
+
+  if (!prep_wakeup(server) || !prep_stop(server)) {
+    return;
+  }
+  int32_t accepting = 0;
+  for (int32_t i = 0; i < server->num_listen_fds; i++) {
+    accepting += prep_accept(server, i);
+  }
+
+  while (accepting > 0 || server->num_clients > 0) {
+    if (submit(server, true) != 0) {
+      break;
+    }
+
+    uint32_t head = *server->cq_head;
+    uint32_t tail = __atomic_load_n(server->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe* cqe = &server->cqes[head & server->cq_mask];
+      uint64_t user_data = cqe->user_data;
+      int32_t res = cqe->res;
+      uint32_t flags = cqe->flags;
+
+      switch (user_data & URING_OP_MASK) {
+        case URING_ACCEPT:
+          if (res >= 0 && server->stopping) {
+            close(res);
+          } else if (res >= 0) {
+            open_client(server, res);
+          } else if (res != -ECANCELED) {
+            DB_Log(
+              DB_LOG_ERROR, "TCP_SERVER Accept failed: %s", strerror(-res));
+          }
+          if (!(flags & IORING_CQE_F_MORE) &&
+              (server->stopping ||
+               !prep_accept(server, user_data >> URING_OP_BITS))) {
+            accepting--;
+          }
+          break;
+        case URING_RECV:
+          handle_recv(server,
+                      (URingClient*)(uintptr_t)(user_data & ~URING_OP_MASK),
+                      res,
+                      flags);
+          break;
+        case URING_WAKEUP:
+          handle_wakeup(server);
+          prep_wakeup(server);
+          break;
+        case URING_CANCEL:
+          // the request ends with -ECANCELED, unless it ended already
+          break;
+        case URING_STOP:
+          handle_stop(server);
+          break;
+      }
+    }
+    __atomic_store_n(server->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+URingServer*
+Create_URing_Server(const int32_t* listen_fds,
+                    int32_t num_listen_fds,
+                    int32_t stop_fd)
+{
+  URingServer* server = (URingServer*)calloc(1, sizeof(URingServer));
+  if (!server) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for URingServer");
+    return NULL;
+  }
+  memcpy(server->listen_fds, listen_fds, num_listen_fds * sizeof(int32_t));
+  server->num_listen_fds = num_listen_fds;
+  server->stop_fd = stop_fd;
+  server->wakeup_fd = -1;
+  pthread_mutex_init(&server->lists_lock, NULL);
+
+  // room for a completion of every buffer on top of the accepts and recvs
+  struct io_uring_params params = { 0 };
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = URING_ENTRIES + URING_RECV_BUFFERS;
+  server->ring_fd = uring_setup(URING_ENTRIES, &params);
+  if (server->ring_fd < 0) {
+    DB_Log(DB_LOG_ERROR, "IO_URING io_uring_setup failed: %s", strerror(errno));
+    Destroy_URing_Server(server);
+    return NULL;
+  }
+  if (!(params.features & IORING_FEAT_NODROP)) {
+    DB_Log(DB_LOG_ERROR, "IO_URING kernel may drop completions");
+    Destroy_URing_Server(server);
+    return NULL;
+  }
+
+  server->sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  server->cq_size =
+    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (server->cq_size > server->sq_size) {
+      server->sq_size = server->cq_size;
+    }
+    server->cq_size = 0;
+  }
+  server->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  server->sq_ptr = mmap(NULL,
+                        server->sq_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        server->ring_fd,
+                        IORING_OFF_SQ_RING);
+  server->cq_ptr = server->cq_size == 0
+                     ? server->sq_ptr
+                     : mmap(NULL,
+                            server->cq_size,
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE,
+                            server->ring_fd,
+                            IORING_OFF_CQ_RING);
+  server->sqes = (struct io_uring_sqe*)mmap(NULL,
+                                            server->sqes_size,
+                                            PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE,
+                                            server->ring_fd,
+                                            IORING_OFF_SQES);
+  if (server->sq_ptr == MAP_FAILED || server->cq_ptr == MAP_FAILED ||
+      server->sqes == MAP_FAILED) {
+    DB_Log(
+      DB_LOG_ERROR, "IO_URING Unable to map the rings: %s", strerror(errno));
+    Destroy_URing_Server(server);
+    return NULL;
+  }
+
+  char* sq = (char*)server->sq_ptr;
+  server->sq_head = (uint32_t*)(sq + params.sq_off.head);
+  server->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+  server->sq_array = (uint32_t*)(sq + params.sq_off.array);
+  server->sq_mask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+  server->sq_entries = params.sq_entries;
+  server->sq_local_tail = *server->sq_tail;
+
+  char* cq = (char*)server->cq_ptr;
+  server->cq_head = (uint32_t*)(cq + params.cq_off.head);
+  server->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+  server->cq_mask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+  server->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  // the receive buffers and the ring the kernel takes them from
+  server->buf_ring_size = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+  server->buf_ring =
+    (struct io_uring_buf_ring*)mmap(NULL,
+                                    server->buf_ring_size,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS,
+                                    -1,
+                                    0);
+  server->buffers =
+    (char*)malloc((size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+  if (server->buf_ring == MAP_FAILED || !server->buffers) {
+    DB_Log(DB_LOG_ERROR, "Failed to allocate memory for the receive buffers");
+    Destroy_URing_Server(server);
+    return NULL;
+  }
+
+  struct io_uring_buf_reg reg = { 0 };
+  reg.ring_addr = (uint64_t)(uintptr_t)server->buf_ring;
+  reg.ring_entries = URING_RECV_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (uring_register(server->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) !=
+      0) {
+    DB_Log(DB_LOG_ERROR,
+           "IO_URING Unable to register the receive buffers: %s",
+           strerror(errno));
+    Destroy_URing_Server(server);
+    return NULL;
+  }
+  for (uint16_t bid = 0; bid < URING_RECV_BUFFERS; bid++) {
+    recycle_buffer(server, bid);
+  }
+
+  server->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+  if (server->wakeup_fd < 0) {
+    DB_Log(
+      DB_LOG_ERROR, "IO_URING Unable to create eventfd: %s", strerror(errno));
+    Destroy_URing_Server(server);
+    return NULL;
+  }
+  return server;
+}
+
+void
+Destroy_URing_Server(URingServer* server)
+{
+  if (server->ring_fd >= 0) {
+    // unregisters the receive buffers too
+    close(server->ring_fd);
+  }
+  if (server->sqes && server->sqes != MAP_FAILED) {
+    munmap(server->sqes, server->sqes_size);
+  }
+  if (server->cq_size > 0 && server->cq_ptr && server->cq_ptr != MAP_FAILED) {
+    munmap(server->cq_ptr, server->cq_size);
+  }
+  if (server->sq_ptr && server->sq_ptr != MAP_FAILED) {
+    munmap(server->sq_ptr, server->sq_size);
+  }
+  if (server->buf_ring && server->buf_ring != MAP_FAILED) {
+    munmap(server->buf_ring, server->buf_ring_size);
+  }
+  if (server->wakeup_fd >= 0) {
+    close(server->wakeup_fd);
+  }
+  pthread_mutex_destroy(&server->lists_lock);
+  free(server->buffers);
+  free(server);
+}
@@ -0,0 +1,119 @@
+/**
+ * note (David)
+ * /IO_URING/
+ * with --io-uring the connections do not get a worker each. a single ring
+ * thread accepts (multishot accept) and receives (multishot recv into
+ * buffers the kernel picks from a ring we share with it) for all of them, a
+ * syscall only happens when the ring runs out of completions.
+ *
+ * whenever a complete command arrives on a connection that is not executing
+ * already, its commands are handed to the thread pool as one task. the task
+ * keeps taking the commands that arrived meanwhile, so the commands of a
+ * connection still execute one after the other and in order. a blocking pop
+ * that has to wait ends the task, it is queued again once the pop was
+ * answered. replies go through the output queue as before (see /OUTPUT/).
+ *
+ * connections are only closed by the ring thread, once the peer is gone and
+ * no task executes their commands anymore.
+ */
+#ifndef __TINY_DB_URING
+#define __TINY_DB_URING
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tinydb_connection.h"
+#include "tinydb_tcp_server.h"
+
+typedef struct URingClient
+{
+  Connection* conn;
+  struct URingServer* server;
+
+  // guards conn->buffer (the ring thread appends, the task takes complete
+  // commands) and the flags
+  pthread_mutex_t lock;
+  bool executing; // a task of the thread pool executes its commands
+  bool recv_done; // the peer is gone, closed once nothing executes
+  bool detaching; // a command takes over the socket once recv_done is set
+  bool parked;    // its task waits for a blocking pop, see URing_Resume
+  pthread_cond_t detached;
+
+  // commands taken out of conn->buffer by the task
+  char* batch;
+  size_t batch_size;
+
+  struct URingClient* next_closed;
+  struct URingClient* next_detaching;
+} URingClient;
+
+typedef struct URingServer
+{
+  int32_t ring_fd;
+  int32_t listen_fds[MAX_LISTENERS];
+  int32_t num_listen_fds;
+  int32_t stop_fd; // eventfd, see TCP_Server_Stop
+  uint64_t stop_value;
+  bool stopping;
+  int32_t wakeup_fd; // eventfd, tasks hand back connections (see lists below)
+  uint64_t wakeup_value;
+
+  // submission and completion queues shared with the kernel
+  void* sq_ptr;
+  size_t sq_size;
+  void* cq_ptr;
+  size_t cq_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  uint32_t* sq_head;
+  uint32_t* sq_tail;
+  uint32_t* sq_array;
+  uint32_t sq_mask;
+  uint32_t sq_entries;
+  uint32_t sq_local_tail; // entries up to here are not submitted yet
+  uint32_t* cq_head;
+  uint32_t* cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe* cqes;
+
+  // URING_RECV_BUFFERS buffers the kernel receives into
+  struct io_uring_buf_ring* buf_ring;
+  size_t buf_ring_size;
+  char* buffers;
+  uint16_t buf_tail;
+
+  // clients whose last task ended after their peer was gone, and the ones
+  // whose recv has to be cancelled for a command taking over their socket
+  pthread_mutex_t lists_lock;
+  URingClient* closed;
+  URingClient* detaching;
+
+  int32_t num_clients;
+} URingServer;
+
+/**
+ * @returns ring accepting on the listening sockets, NULL when the kernel lacks
+ * io_uring or one of the features used
+ */
+URingServer*
+Create_URing_Server(const int32_t* listen_fds,
+                    int32_t num_listen_fds,
+                    int32_t stop_fd);
+
+/**
+ * serves the connections until stop_fd is written (TCP_Server_Stop), returns
+ * once every connection is closed.
+ */
+void
+URing_Server_Run(URingServer* server);
+
+/**
+ * the thread pool has to be drained already.
+ */
+void
+Destroy_URing_Server(URingServer* server);
+
+#endif // __TINY_DB_URING
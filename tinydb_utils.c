@@ -2,6 +2,7 @@
 #include "tinydb_hashmap.h"
 #include "tinydb_hashmap_iterator.h"
 #include "tinydb_log.h"
+#include "tinydb_object.h"
 
 #include <stdio.h>
 #include <inttypes.h>
@@ -94,11 +95,12 @@ Serialize_DB_Object_ToJSON(DB_Object* obj)
   char* json = (char*)malloc(4096);
   strcpy(json, "{");
 
-  HashMapIterator it = HM_Iterator(obj->fields);
+  pthread_rwlock_rdlock(&obj->rwlock);
+  DBObject_Iterator it = DBObject_Iter(obj);
   int32_t first = 1;
 
-  while (HM_IteratorHasNext(&it)) {
-    DatabaseEntry* entry = HM_IteratorNext(&it);
+  DatabaseEntry* entry;
+  while ((entry = DBObject_Iter_Next(&it)) != NULL) {
 
     if (!first) {
       strcat(json, ", ");
@@ -127,30 +129,32 @@ Serialize_DB_Object_ToJSON(DB_Object* obj)
     } else if (entry->type == DB_ENTRY_LIST) {
       strcat(json, "[");
       HPLinkedList* list = entry->value.list;
-      ListNode* current_node = list->head;
+      pthread_rwlock_rdlock(&list->rwlock);
+      ListNode current_node;
+      HPList_Iterator list_it = HPList_Iter(list);
       int first_in_list = 1;
-      while (current_node != NULL) {
+      while (HPList_Iter_Next(&list_it, &current_node)) {
         if (!first_in_list) {
           strcat(json, ", ");
         }
         first_in_list = 0;
 
-        if (current_node->type == TYPE_STRING) {
+        if (current_node.type == TYPE_STRING) {
           char escaped_list_value[1024];
-          Escape_String(escaped_list_value, current_node->value.string_value);
+          Escape_String(escaped_list_value, current_node.value.string_value);
           strcat(json, "\"");
           strcat(json, escaped_list_value);
           strcat(json, "\"");
-        } else if (current_node->type == TYPE_INT) {
+        } else if (current_node.type == TYPE_INT) {
           char list_number[64];
           snprintf(list_number,
                    sizeof(list_number),
                    "%" PRId64,
-                   current_node->value.int_value);
+                   current_node.value.int_value);
           strcat(json, list_number);
         }
-        current_node = current_node->next;
       }
+      pthread_rwlock_unlock(&list->rwlock);
       strcat(json, "]");
     } else if (entry->type == DB_ENTRY_OBJECT) {
       char* nested_json = Serialize_DB_Object_ToJSON(entry->value.object);
@@ -159,6 +163,8 @@ Serialize_DB_Object_ToJSON(DB_Object* obj)
     }
   }
 
+  pthread_rwlock_unlock(&obj->rwlock);
+
   strcat(json, "}");
   return json;
 }
@@ -174,9 +180,10 @@ Add_Indentation(char* dest, int32_t level)
 void
 Serialize_DB_Object_ToListStyle(DB_Object* obj, char* buffer, int32_t indent_level)
 {
-  HashMapIterator it = HM_Iterator(obj->fields);
-  while (HM_IteratorHasNext(&it)) {
-    DatabaseEntry* entry = HM_IteratorNext(&it);
+  pthread_rwlock_rdlock(&obj->rwlock);
+  DBObject_Iterator it = DBObject_Iter(obj);
+  DatabaseEntry* entry;
+  while ((entry = DBObject_Iter_Next(&it)) != NULL) {
 
     Add_Indentation(buffer, indent_level);
 
@@ -197,28 +204,31 @@ Serialize_DB_Object_ToListStyle(DB_Object* obj, char* buffer, int32_t indent_lev
     } else if (entry->type == DB_ENTRY_LIST) {
       strcat(buffer, "\n");
       HPLinkedList* list = entry->value.list;
-      ListNode* current = list->head;
-      while (current != NULL) {
+      pthread_rwlock_rdlock(&list->rwlock);
+      ListNode current;
+      HPList_Iterator list_it = HPList_Iter(list);
+      while (HPList_Iter_Next(&list_it, &current)) {
         Add_Indentation(buffer, indent_level + 1);
-        if (current->type == TYPE_STRING) {
-          strcat(buffer, current->value.string_value);
-        } else if (current->type == TYPE_INT) {
+        if (current.type == TYPE_STRING) {
+          strcat(buffer, current.value.string_value);
+        } else if (current.type == TYPE_INT) {
           char list_number[64];
           snprintf(list_number,
                    sizeof(list_number),
                    "%" PRId64,
-                   current->value.int_value);
+                   current.value.int_value);
           strcat(buffer, list_number);
         }
         strcat(buffer, "\n");
-        current = current->next;
       }
+      pthread_rwlock_unlock(&list->rwlock);
     } else if (entry->type == DB_ENTRY_OBJECT) {
       strcat(buffer, "\n");
       Serialize_DB_Object_ToListStyle(
         entry->value.object, buffer, indent_level + 1);
     }
   }
+  pthread_rwlock_unlock(&obj->rwlock);
 }
 
 char*
@@ -0,0 +1,68 @@
+#ifndef __TINY_DB_VARINT
+#define __TINY_DB_VARINT
+
+#include <stddef.h>
+#include <stdint.h>
+
+// longest LEB128 encoding of a uint64_t
+#define VARINT_MAX 10
+
+// LEB128, 7 bits per byte with the high bit set on all but the last byte
+static inline size_t
+Varint_Size(uint64_t value)
+{
+  size_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+static inline size_t
+Varint_Write(uint8_t* p, uint64_t value)
+{
+  size_t i = 0;
+  while (value >= 0x80) {
+    p[i++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  p[i++] = (uint8_t)value;
+  return i;
+}
+
+/**
+ * p must hold a complete varint, data read from outside the process has to be
+ * bounds checked by the caller instead.
+ */
+static inline size_t
+Varint_Read(const uint8_t* p, uint64_t* value)
+{
+  uint64_t result = 0;
+  size_t i = 0;
+  int32_t shift = 0;
+  for (;;) {
+    uint8_t byte = p[i++];
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      break;
+    shift += 7;
+  }
+  *value = result;
+  return i;
+}
+
+// small negative numbers stay small
+static inline uint64_t
+Zigzag_Encode(int64_t value)
+{
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t
+Zigzag_Decode(uint64_t value)
+{
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+#endif // __TINY_DB_VARINT
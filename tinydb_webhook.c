@@ -7,6 +7,7 @@
 
 #include "tinydb_context.h"
 #include "tinydb_log.h"
+#include "tinydb_shard_executor.h"
 #include "tinydb_thread_pool.h"
 #include "tinydb_webhook.h"
 
@@ -15,16 +16,35 @@
 
 extern RuntimeContext* context;
 
-void
-Add_Webhook(const char* channel_name, const char* url)
+typedef struct WebhookJob
 {
-  if (strncmp(channel_name, "@hook", 5) != 0) {
-    DB_Log(
-      DB_LOG_ERROR, "Cannot add webhook to non-hook channel: %s", channel_name);
-    return;
-  }
+  const char* channel_name;
+  const char* url;
+  DatabaseEntry entry;
+} WebhookJob;
+
+// the hooks of a channel are a list under its name, looked up and created on
+// the owner of its shard (see tinydb_shard_executor.h)
+static void
+lookup_hooks(void* arg)
+{
+  WebhookJob* job = (WebhookJob*)arg;
+  job->entry = DB_Atomic_Get(context->Active.db, job->channel_name);
+}
+
+static DatabaseEntry
+get_hooks(const char* channel_name)
+{
+  WebhookJob job = { .channel_name = channel_name };
+  Shard_Executors_Run(Pick_Shard(channel_name), lookup_hooks, &job);
+  return job.entry;
+}
 
-  DatabaseEntry entry = DB_Atomic_Get(context->Active.db, channel_name);
+static void
+add_hook(void* arg)
+{
+  WebhookJob* job = (WebhookJob*)arg;
+  DatabaseEntry entry = DB_Atomic_Get(context->Active.db, job->channel_name);
   HPLinkedList* webhook_list;
 
   if (entry.type == DB_ENTRY_LIST) {
@@ -32,10 +52,24 @@ Add_Webhook(const char* channel_name, const char* url)
   } else {
     webhook_list = HPList_Create();
     DB_Value value = { .list = webhook_list };
-    DB_Atomic_Store(context->Active.db, channel_name, value, DB_ENTRY_LIST);
+    DB_Atomic_Store(
+      context->Active.db, job->channel_name, value, DB_ENTRY_LIST);
+  }
+
+  HPList_RPush_String(webhook_list, job->url);
+}
+
+void
+Add_Webhook(const char* channel_name, const char* url)
+{
+  if (strncmp(channel_name, "@hook", 5) != 0) {
+    DB_Log(
+      DB_LOG_ERROR, "Cannot add webhook to non-hook channel: %s", channel_name);
+    return;
   }
 
-  HPList_RPush_String(webhook_list, url);
+  WebhookJob job = { .channel_name = channel_name, .url = url };
+  Shard_Executors_Run(Pick_Shard(channel_name), add_hook, &job);
 }
 
 void
@@ -48,7 +82,7 @@ Remove_Webhook(const char* channel_name, const char* url)
     return;
   }
 
-  DatabaseEntry entry = DB_Atomic_Get(context->Active.db, channel_name);
+  DatabaseEntry entry = get_hooks(channel_name);
   if (entry.type == DB_ENTRY_LIST) {
     HPLinkedList* webhook_list = entry.value.list;
     // todo (David) implement HPList_Remove_String for HList
@@ -64,17 +98,19 @@ List_Webhooks(const char* channel_name)
     return;
   }
 
-  DatabaseEntry entry = DB_Atomic_Get(context->Active.db, channel_name);
+  DatabaseEntry entry = get_hooks(channel_name);
   if (entry.type == DB_ENTRY_LIST) {
     HPLinkedList* webhook_list = entry.value.list;
     printf("Webhooks for channel %s:\n", channel_name);
-    ListNode* node = webhook_list->head;
-    while (node != NULL) {
-      if (node->type == TYPE_STRING) {
-        printf("- %s\n", node->value.string_value);
+    pthread_rwlock_rdlock(&webhook_list->rwlock);
+    ListNode node;
+    HPList_Iterator it = HPList_Iter(webhook_list);
+    while (HPList_Iter_Next(&it, &node)) {
+      if (node.type == TYPE_STRING) {
+        printf("- %s\n", node.value.string_value);
       }
-      node = node->next;
     }
+    pthread_rwlock_unlock(&webhook_list->rwlock);
   } else {
     printf("No webhooks found for channel %s\n", channel_name);
   }
@@ -87,19 +123,24 @@ Trigger_Webhooks(const char* channel_name, const char* message)
     return; // not a hook channel
   }
 
-  DatabaseEntry entry = DB_Atomic_Get(context->Active.db, channel_name);
+  DatabaseEntry entry = get_hooks(channel_name);
   if (entry.type == DB_ENTRY_LIST) {
     HPLinkedList* webhook_list = entry.value.list;
-    ListNode* node = webhook_list->head;
-    while (node != NULL) {
-      if (node->type == TYPE_STRING) {
+    pthread_rwlock_rdlock(&webhook_list->rwlock);
+    ListNode node;
+    HPList_Iterator it = HPList_Iter(webhook_list);
+    while (HPList_Iter_Next(&it, &node)) {
+      if (node.type == TYPE_STRING) {
         WebhookArgs* args = (WebhookArgs*)malloc(sizeof(WebhookArgs));
-        strncpy(args->url, node->value.string_value, MAX_URL_LENGTH);
+        strncpy(args->url, node.value.string_value, MAX_URL_LENGTH);
         args->message = strdup(message);
-        Thread_Pool_Add_Task(Send_Webhook, (void*)args);
+        if (Thread_Pool_Add_Task(Send_Webhook, (void*)args) != 0) {
+          free(args->message);
+          free(args);
+        }
       }
-      node = node->next;
     }
+    pthread_rwlock_unlock(&webhook_list->rwlock);
   }
 }
 